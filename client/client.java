@@ -11,6 +11,12 @@
 
 import java.io.*;
 import java.net.*;
+import java.util.LinkedHashMap;
+import java.util.Map;
+import java.util.TreeMap;
+import java.util.TreeSet;
+import java.util.concurrent.atomic.AtomicInteger;
+import java.util.concurrent.atomic.AtomicLong;
 
 // Apache Commons Codec used for easy hashing via MD5 algorithm
 // Borrowed from: http://commons.apache.org/codec/
@@ -19,6 +25,14 @@ import org.apache.commons.codec.digest.DigestUtils;
 class Global
 {
 	public static String path = "";
+
+	// Lock held for each exchange with the tracker, and whether we have disconnected from it
+	public static final Object tracker = new Object();
+	public static boolean closed = false;
+
+	// Number of uploads to other peers in progress, and bytes uploaded in all, reported to the tracker as our load
+	public static final AtomicInteger uploads = new AtomicInteger();
+	public static final AtomicLong uploaded = new AtomicLong();
 }
 
 class peer_server implements Runnable
@@ -88,6 +102,9 @@ class peer_server implements Runnable
 								// Open a new socket for file transfer
 								Socket fileSocket = fileServSock.accept();
 
+								// Count the upload towards our load until it is done
+								Global.uploads.incrementAndGet();
+
 								// Open specified file for transfer
 								File peerfile = new File(path + respArray[1]);
 								
@@ -106,11 +123,13 @@ class peer_server implements Runnable
 								// Send file over socket
 								fileOut.write(buffer, 0, buffer.length);
 								fileOut.flush();
+								Global.uploaded.addAndGet(buffer.length);
 								
 								// Close I/O streams, close file socket
 								fileIn.close();
 								fileOut.close();
 								fileSocket.close();
+								Global.uploads.decrementAndGet();
 								
 								// Send OK to peer, to confirm transfer success
 								out.println("OK");
@@ -153,6 +172,70 @@ class peer_server implements Runnable
 	}
 }
 
+class tracker_announce implements Runnable
+{
+	// Streams of the socket connected to the tracker
+	private BufferedReader in;
+	private PrintWriter out;
+
+	public tracker_announce(BufferedReader in, PrintWriter out)
+	{
+		this.in = in;
+		this.out = out;
+	}
+
+	// Report our load to the tracker, so the tracker can send other peers to lightly loaded peers first.  Each report
+	// also renews our lease, since the tracker disconnects a silent client after a few minutes, so reports continue
+	// between the user's commands, and while a download or a prompt keeps the user from sending any.
+	public void run()
+	{
+		try
+		{
+			// Bytes uploaded as of the last report, and when it was sent
+			long last_bytes = Global.uploaded.get();
+			long last_time = System.currentTimeMillis();
+
+			// Loop forever, reporting to the tracker every 15 seconds, well within the 45 seconds it keeps a report
+			while(true)
+			{
+				Thread.sleep(15000);
+
+				// Take the tracker, so an ANNOUNCE never interleaves with a command's replies
+				synchronized(Global.tracker)
+				{
+					if(Global.closed)
+						return;
+
+					// Upload rate since the last report, in kilobits per second
+					long bytes = Global.uploaded.get();
+					long time = System.currentTimeMillis();
+					long kbps = (bytes - last_bytes) * 8 / Math.max(time - last_time, 1);
+					last_bytes = bytes;
+					last_time = time;
+
+					// Send ANNOUNCE, and ensure the tracker replies with OK
+					out.print("ANNOUNCE " + Global.uploads.get() + " " + kbps + "\n");
+					out.flush();
+					String response = in.readLine();
+					if(response == null || !response.equals("OK"))
+					{
+						System.out.println("\n[error] tracker did not reply to ANNOUNCE: " + response);
+						return;
+					}
+				}
+			}
+		}
+		catch (InterruptedException e)
+		{
+			return;
+		}
+		catch (IOException e)
+		{
+			System.out.println("\n[error] IOException while reporting load to tracker");
+		}
+	}
+}
+
 public class client
 {
 	// Error handler method, which prints an error and exits the client
@@ -172,6 +255,10 @@ public class client
 			ret = "a null file size was encountered while indexing files with tracker";
 		else if(err.equals("ERROR A4"))
 			ret = "a duplicate file from your machine was encountered while indexing files with tracker";
+		else if(err.equals("ERROR B0"))
+			ret = "a database error occurred while indexing a batch of files with tracker";
+		else if(err.equals("ERROR B1"))
+			ret = "an invalid batch size was encountered while indexing files with tracker";
 		else if(err.equals("ERROR C0"))
 			ret = "tracker received an unknown command";
 		else if(err.equals("ERROR D0"))
@@ -184,12 +271,36 @@ public class client
 			ret = "a null file name was encountered when attempting file transfer";
 		else if(err.equals("ERROR G1"))
 			ret = "file transfer with peer failed";
+		else if(err.equals("ERROR H0"))
+			ret = "a session error occurred during the handshake with tracker";
+		else if(err.equals("ERROR H1"))
+			ret = "a null session token or digest was encountered during the handshake with tracker";
+		else if(err.equals("ERROR H2"))
+			ret = "an unknown or expired session was encountered during the handshake with tracker";
 		else if(err.equals("ERROR L0"))
 			ret = "a database error occurred while retrieving a list of files from the tracker";
+		else if(err.equals("ERROR L1"))
+			ret = "an invalid listing generation was sent to the tracker";
+		else if(err.equals("ERROR M0"))
+			ret = "a database error occurred while requesting peer addresses for several files from the tracker";
+		else if(err.equals("ERROR M1"))
+			ret = "an invalid number of files was encountered while requesting peer addresses from the tracker";
+		else if(err.equals("ERROR M2"))
+			ret = "an invalid number of peers was encountered while requesting peer addresses for several files from the tracker";
+		else if(err.equals("ERROR N0"))
+			ret = "a database error occurred while reporting load to the tracker";
+		else if(err.equals("ERROR N1"))
+			ret = "an invalid load was encountered while reporting load to the tracker";
 		else if(err.equals("ERROR R0"))
 			ret = "a database error occurred while requesting peer addresses from the tracker";
 		else if(err.equals("ERROR R1"))
 			ret = "a null file name was encountered while requesting peer addresses from the tracker";
+		else if(err.equals("ERROR R2"))
+			ret = "an invalid number of peers was encountered while requesting peer addresses from the tracker";
+		else if(err.equals("ERROR S0"))
+			ret = "a database error occurred while searching for files on the tracker";
+		else if(err.equals("ERROR S1"))
+			ret = "a null search pattern was encountered while searching for files on the tracker";
 		else
 			ret = "an unknown error occurred: " + err;
 
@@ -198,6 +309,121 @@ public class client
 		System.exit(-1);
 	}
 
+	// Digest of a set of files, as the tracker computes it over the files it holds for us: the sum of the 64-bit FNV-1a
+	// hash of each file's "filename hash size" line, so the order of the files does not matter
+	public static String manifest_digest(TreeMap<String, String[]> files)
+	{
+		// Sum of the hash of each file
+		long sum = 0;
+
+		// Hash each file's line, starting from the FNV offset basis, and add it to the sum
+		for(String name : files.keySet())
+		{
+			long hash = 0xcbf29ce484222325L;
+			String[] file = files.get(name);
+			try
+			{
+				for(byte b : (name + " " + file[0] + " " + file[1]).getBytes("UTF-8"))
+				{
+					hash ^= (b & 0xff);
+					hash *= 0x100000001b3L;
+				}
+			}
+			catch(UnsupportedEncodingException e)
+			{
+				// Every JVM supports UTF-8
+			}
+			sum += hash;
+		}
+
+		// Return the sum as 16 hex digits
+		return String.format("%016x", sum);
+	}
+
+	// Download method, which fetches a file of the given size from a peer, and writes it under the shared path
+	public static void download(String peer, String name, int size, String path) throws IOException
+	{
+		// Open communications socket with peer
+		Socket comSocket = new Socket(peer, 6601);
+
+		// Keep string to capture communication responses
+		String comResponse;
+
+		// Open I/O streams for communication with peer
+		BufferedReader comIn = new BufferedReader(new InputStreamReader(comSocket.getInputStream()));
+		PrintWriter comOut = new PrintWriter(comSocket.getOutputStream(), false);
+
+		// Send peer the OPEN handshake
+		comOut.println("OPEN");
+		comOut.flush();
+
+		// Read the peer's communication
+		comResponse = comIn.readLine();
+
+		// Ensure we received the HELLO confirmation
+		if(!comResponse.equals("HELLO"))
+		{
+			// If peer does not return handshake properly, print error and exit
+			System.out.println("[error] peer did not properly reply to handshake");
+			System.exit(-1);
+		}
+
+		// Open socket for file transfer with peer
+		Socket fileSocket = new Socket(peer, 6602);
+
+		// Send peer the GET command, sending the specified filename as well
+		comOut.println("GET " + name);
+		comOut.flush();
+
+		// Open input stream for file transfer with peer
+		InputStream fileIn = fileSocket.getInputStream();
+
+		// Open output stream to write file to disk
+		BufferedOutputStream fileOut = new BufferedOutputStream(new FileOutputStream(path + name));
+
+		// Initiate variables for file transfer
+		int bytesRead,current = 0;
+
+		// Create a byte array large enough to store the file
+		byte[] buffer = new byte[size];
+
+		// Initialize byte array cursors
+		bytesRead = fileIn.read(buffer, 0, buffer.length);
+		current = bytesRead;
+
+		System.out.println("[info] initiating file transfer of '" + name + "'");
+
+		// Loop through and keep adding bytes to buffer
+		do
+		{
+			System.out.print(". ");
+
+			// Read in more bytes
+			bytesRead = fileIn.read(buffer, current, (buffer.length - current));
+
+			// If byte counter was positive, shift it forward
+			if(bytesRead >= 0)
+				current += bytesRead;
+		} while(bytesRead > -1 && buffer.length != current);
+
+		// Write the byte array to a file
+		fileOut.write(buffer, 0, current);
+		fileOut.flush();
+
+		System.out.println("\n[info] file transfer complete");
+
+		// Close all I/O streams, close socket
+		fileIn.close();
+		fileOut.close();
+		fileSocket.close();
+
+		// Read the peer's confirmation, then send the CLOSE handshake, so the peer serves the next download
+		comIn.readLine();
+		comOut.println("CLOSE");
+		comOut.flush();
+		comSocket.close();
+	}
+
 	// Main method
 	public static void main(String[] args)
 	{
@@ -241,25 +467,39 @@ public class client
 			String response;
 			String[] respArray;
 
+			// Listing of files on the tracker as of the last 'list', kept up to date with only the changes since
+			TreeSet<String> catalog = new TreeSet<String>();
+			long list_gen = 0;
+
+			// Number of files requested in each page of the listing
+			int list_page = 25;
+
 			// Read in the server's information header, print it to the screen
 			System.out.println(in.readLine());
 
-			// Perform the necessary handshake with the server, get its response
-			out.print("CONNECT");
-			out.flush();
-			response = in.readLine();
+			// Session file left by the last run, recording the tracker, share folder, session token, and the files
+			// indexed with that session, one "filename hash size modified" line each
+			File session_file = new File(".p2p_session");
+			String session_key = server + ":" + port + " " + path;
+			String token = null;
+			TreeMap<String, String[]> last = new TreeMap<String, String[]>();
 
-			// Ensure that the HELLO response was received
-			if(!response.equals("HELLO"))
-			{
-				// If the server manages to send an incorrect handshake response, print an error and exit
-				System.out.println("[error] tracker did not properly reply to handshake");
-				System.exit(-1);	
-			}
-			else
+			// Read the last session, if it was with the same tracker and share folder
+			if(session_file.isFile())
 			{
-				// If the handshake succeeded, print success message
-				System.out.println("[info] successfully connected to tracker at " + server + ":" + port);
+				BufferedReader s_in = new BufferedReader(new FileReader(session_file));
+				if(session_key.equals(s_in.readLine()))
+				{
+					token = s_in.readLine();
+					String line;
+					while((line = s_in.readLine()) != null)
+					{
+						String[] fields = line.split(" ");
+						if(fields.length == 4)
+							last.put(fields[0], new String[] { fields[1], fields[2], fields[3] });
+					}
+				}
+				s_in.close();
 			}
 
 			// Open up files in a directory called "share"
@@ -271,58 +511,185 @@ public class client
 			String filename;
 			String filehash;
 			String filesize;
+			String modified;
 
-			// Print message to state that we are beginning to add files to the directory
-			System.out.println("[info] indexing files from " + path + " with tracker...");
-
-			// Keep count of number of files indexed
-			int index_total = 0;
+			// Files in the share folder, by name, as hash, size, and modification time
+			TreeMap<String, String[]> share = new TreeMap<String, String[]>();
 
-			// Iterate all files in the directory
+			// Hash each file, reusing the hash from the last session if the file's size and modification time are unchanged
 			for(int i = 0; i < files.length; i++)
 			{
 				// Ensure the listing is an actual file
 				if(files[i].isFile())
 				{
-					// Store the file's name
+					// Store the file's name, size, and modification time
 					filename = files[i].getName();
+					filesize = String.valueOf(files[i].length());
+					modified = String.valueOf(files[i].lastModified());
 
-					// Open file input stream, hash file by contents, close file input stream
-					f_stream = new FileInputStream(files[i]);
-					filehash = DigestUtils.md5Hex(f_stream);
-					f_stream.close();
+					// Reuse the last hash if possible, else open file input stream, hash file by contents, close file input stream
+					String[] known = last.get(filename);
+					if(known != null && known[1].equals(filesize) && known[2].equals(modified))
+						filehash = known[0];
+					else
+					{
+						f_stream = new FileInputStream(files[i]);
+						filehash = DigestUtils.md5Hex(f_stream);
+						f_stream.close();
+					}
+					share.put(filename, new String[] { filehash, filesize, modified });
+				}
+			}
 
-					// Store the file's size
-					filesize = String.valueOf(files[i].length());
+			// Files the tracker holds for us, so only the difference from the share folder must be sent
+			TreeMap<String, String[]> kept = new TreeMap<String, String[]>();
 
-					// Format these three obtained parameters into an ADD command, to send to the directory
-					out.print("ADD " + filename + " " + filehash + " " + filesize);
-					out.flush();
+			// If we hold a session, try to resume it, stating the digest of the files we last indexed with it
+			if(token != null)
+			{
+				out.print("RESUME " + token + " " + manifest_digest(last) + "\n");
+				out.flush();
+				response = in.readLine();
+
+				// If the tracker kept exactly those files, only the changes are sent, else they were purged
+				if(response.equals("RESUMED MATCH"))
+					kept = last;
+				else if(!response.equals("RESUMED RESET"))
+					token = null;
+
+				// If the session was resumed, print success message
+				if(token != null)
+					System.out.println("[info] resumed session with tracker at " + server + ":" + port);
+			}
+
+			// Else, perform the necessary handshake with the server, asking for a session, and get its response
+			if(token == null)
+			{
+				out.print("CONNECT SESSION\n");
+				out.flush();
+				response = in.readLine();
+
+				// Ensure that the HELLO response was received, along with the session token
+				if(!response.startsWith("HELLO "))
+				{
+					// If the server manages to send an incorrect handshake response, print an error and exit
+					System.out.println("[error] tracker did not properly reply to handshake");
+					System.exit(-1);
+				}
+				else
+				{
+					// If the handshake succeeded, keep the token, and print success message
+					token = response.substring(6);
+					System.out.println("[info] successfully connected to tracker at " + server + ":" + port);
+				}
+			}
 
-					// Read server's response
+			// Print message to state that we are beginning to add files to the directory
+			System.out.println("[info] indexing files from " + path + " with tracker...");
+
+			// Remove each file the tracker kept which is gone or has changed since
+			for(String name : kept.keySet())
+			{
+				String[] was = kept.get(name);
+				String[] now = share.get(name);
+				if(now == null || !now[0].equals(was[0]) || !now[1].equals(was[1]))
+				{
+					// Send DELETE for the file, and read server's response
+					out.print("DELETE " + name + " " + was[0] + "\n");
+					out.flush();
 					response = in.readLine();
 
 					// Ensure that the server returned OK, quit and print error if it didn't
 					if(!response.equals("OK"))
 						error_handler(response);
-					else
-					{
-						// On success, print a dot to indicate a file (provides progress)
+				}
+			}
+
+			// Keep count of number of files indexed, and of those the tracker already had
+			int index_total = 0;
+			int index_kept = 0;
+
+			// Files are sent to the tracker with ADDBATCH, up to the tracker's limit of 4096 files per batch, so a
+			// whole share folder is indexed in a handful of round trips rather than one per file
+			final int batch_max = 4096;
+			StringBuilder batch = new StringBuilder();
+			int batch_count = 0;
+			int remaining = share.size();
+
+			// Iterate all files in the share folder
+			for(String name : share.keySet())
+			{
+				String[] now = share.get(name);
+				String[] was = kept.get(name);
+				remaining--;
+
+				// If the tracker kept the file as it is, it need not be sent
+				if(was != null && now[0].equals(was[0]) && now[1].equals(was[1]))
+					index_kept++;
+				// Else, format its name, hash, and size into a record of the batch
+				else
+				{
+					batch.append(name + " " + now[0] + " " + now[1] + "\n");
+					batch_count++;
+				}
+
+				// Once the batch is full, or the last file is reached, send it to the directory
+				if(batch_count > 0 && (batch_count == batch_max || remaining == 0))
+				{
+					out.print("ADDBATCH " + batch_count + "\n" + batch.toString());
+					out.flush();
+
+					// Read server's response, which states how many files were added and how many failed
+					response = in.readLine();
+
+					// Ensure that the server returned ADDED, quit and print error if it didn't
+					if(!response.startsWith("ADDED "))
+						error_handler(response);
+
+					// Each failed file is reported by its position in the batch, and an error code as for ADD
+					int failed = Integer.parseInt(response.split(" ")[2]);
+					if(failed > 0)
+						error_handler("ERROR " + in.readLine().split(" ")[1]);
+
+					// Read the final OK
+					response = in.readLine();
+					if(!response.equals("OK"))
+						error_handler(response);
+
+					// On success, print a dot for each file (provides progress)
+					for(int j = 0; j < batch_count; j++)
 						System.out.print(". ");
 
-						// Increment number of files indexed
-						index_total++;
-					}
+					// Increment number of files indexed, and start a new batch
+					index_total += batch_count;
+					batch.setLength(0);
+					batch_count = 0;
 				}
 			}
 
 			// Print success message once all files are indexed
-			System.out.println("\n[info] successfully indexed " + index_total + " files with tracker");
+			System.out.println("\n[info] successfully indexed " + index_total + " files with tracker, " + index_kept + " kept from last session");
+
+			// Record the session, so the next run may resume it
+			PrintWriter s_out = new PrintWriter(new FileWriter(session_file));
+			s_out.print(session_key + "\n" + token + "\n");
+			for(String name : share.keySet())
+			{
+				String[] now = share.get(name);
+				s_out.print(name + " " + now[0] + " " + now[1] + " " + now[2] + "\n");
+			}
+			s_out.close();
 
 			// Start network listener thread, so that we may serve files from the share folder
 			Runnable run = new peer_server();
 			Thread thread = new Thread(run);
 			thread.start();
+
+			// Start tracker announce thread, reporting our load, so our lease with the tracker does not run out while the
+			// user is idle
+			Thread announce = new Thread(new tracker_announce(in, out));
+			announce.setDaemon(true);
+			announce.start();
 			
 			// Tell user that we are awaiting input
 			System.out.println("[info] ready for user input");
@@ -330,7 +697,7 @@ public class client
 			// Loop until the user asks to quit
 			do
 			{
-				// Get input from user
+				// Get input from user, the announce thread using the tracker meanwhile
 				System.out.print(">> ");
 				request = stdin.readLine();
 
@@ -344,155 +711,271 @@ public class client
 					// Print message to user
 					System.out.println("[info] requesting list of files from tracker...");
 
-					// Send server the LIST command
-					out.print("LIST");
-					out.flush();
+					// If we have no listing yet, page through the tracker's listing, printing each page as it arrives
+					if(list_gen == 0)
+					{
+						// Cursor of the next page, the generation of the first, and whether the last page has arrived
+						String list_cursor = ">";
+						long page_gen = 0;
+						boolean list_done = false;
 
-					// Keep a count of number of files which arrive in listing
-					int list_total = 0;
+						// Keep a count of number of files which arrive in listing
+						int list_total = 0;
 
-					// Read input from server
-					response = in.readLine();
+						// Start the listing over
+						catalog.clear();
 
-					// Split input into fields by space separator
-					respArray = response.split(" ");
+						// Loop until the last page, or until the user has seen enough
+						while(!list_done)
+						{
+							// Take the tracker for the page, but not while the user decides whether to see the next
+							synchronized(Global.tracker)
+							{
+								// Send server the LIST command, with the cursor and size of the page
+								out.print("LIST " + list_cursor + " " + list_page + "\n");
+								out.flush();
 
-					// Loop and receive input, until server replies OK or with ERROR
-					while((!respArray[0].equals("OK")) && (!respArray[0].equals("ERROR")))
-					{
-						// Increment total files listed
-						list_total++;
+								// Read the header, and remember the generation the first page was built from
+								response = in.readLine();
+								respArray = response.split(" ");
+								if(respArray[0].equals("ERROR"))
+									error_handler(response);
+								if(list_cursor.equals(">"))
+									page_gen = Long.parseLong(respArray[1]);
 
-						// Print formatted file and size
-						System.out.println(String.format("file [%2d]: %20s [size: %10s]", new Object[] { new Integer(list_total), respArray[0], respArray[1] }));
+								// Unless the tracker sends a cursor, this is the last page
+								list_done = true;
 
-						// If files were listed, read more input from the server
-						response = in.readLine();
+								// Read input from server
+								response = in.readLine();
 
-						// Split response into pieces by space separator
-						respArray = response.split(" ");
-					}
+								// Split input into fields by space separator
+								respArray = response.split(" ");
+
+								// Loop and receive input, until server replies OK or with ERROR
+								while((!respArray[0].equals("OK")) && (!respArray[0].equals("ERROR")))
+								{
+									// The tracker sends a cursor if more pages follow
+									if(respArray[0].equals("NEXT"))
+									{
+										list_cursor = respArray[1];
+										list_done = false;
+									}
+									else
+									{
+										// Increment total files listed, and add the file to our listing
+										list_total++;
+										catalog.add(response);
+
+										// Print formatted file and size
+										System.out.println(String.format("file [%2d]: %20s [size: %10s]", new Object[] { new Integer(list_total), respArray[0], respArray[1] }));
+									}
+
+									// Read more input from the server
+									response = in.readLine();
+
+									// Split response into pieces by space separator
+									respArray = response.split(" ");
+								}
 
-					// Print out total number of files listed
-					System.out.println("[info] received list of " + list_total + " files from tracker");
+								// Ensure that the server returned OK, quit and print error if it didn't
+								if(!response.equals("OK"))
+									error_handler(response);
+							}
 
-					// Ensure that the server returned OK, quit and print error if it didn't
-					if(!response.equals("OK"))
-						error_handler(response);
-				}
-				// request - send server the REQUEST command; initiate file transfer
-				else if(reqArray[0].equals("request"))
-				{
-					// If a file wasn't specified after the request, we'll get an exception.  Catch it.
-					try
+							// Ask the user whether to fetch the next page
+							if(!list_done)
+							{
+								System.out.print("[info] press enter for more files, or type 'q' to stop: ");
+								if(stdin.readLine().equals("q"))
+									break;
+							}
+						}
+
+						// Print out total number of files listed
+						System.out.println("[info] received list of " + list_total + " files from tracker");
+
+						// Once the whole listing has arrived, later 'list' commands only need the changes since
+						if(list_done)
+							list_gen = page_gen;
+					}
+					else
 					{
-						// Ensure that the second field in the array was set, so we have a filename to send
-						if(!reqArray[1].isEmpty())
+						// Whether the whole listing follows, and the number of lines which arrive from the tracker
+						boolean list_full;
+						int list_changes = 0;
+
+						// Take the tracker for the exchange
+						synchronized(Global.tracker)
 						{
-							// Send server the REQUEST command, with the given filename
-							out.print("REQUEST " + reqArray[1]);
+							// Send server the LISTSINCE command, with the generation of the listing we already have
+							out.print("LISTSINCE " + list_gen + "\n");
 							out.flush();
 
-							// Read input from the server
+							// Read the header, stating whether the whole listing or only the changes follow, and the new generation
 							response = in.readLine();
+							respArray = response.split(" ");
+							if(respArray[0].equals("ERROR"))
+								error_handler(response);
+							list_full = respArray[0].equals("FULL");
+							list_gen = Long.parseLong(respArray[1]);
 
-							// Split input into fields by space separator
-							respArray = response.split(" ");						
+							// If the whole listing follows, discard what we have
+							if(list_full)
+								catalog.clear();
 
-							// If OK was immediately returned, the file does not exist on the tracker.  Inform peer
-							if(respArray[0].equals("OK"))
-								System.out.println("[error] file '" + reqArray[1] + "' was not found on the tracker");
+							// Read input from server
+							response = in.readLine();
+
+							// Split input into fields by space separator
+							respArray = response.split(" ");
 
 							// Loop and receive input, until server replies OK or with ERROR
 							while((!respArray[0].equals("OK")) && (!respArray[0].equals("ERROR")))
 							{
-								// Open communications socket with peer
-								Socket comSocket = new Socket(respArray[0], 6601);	
-								
-								// Keep string to capture communication responses
-								String comResponse;
-								
-								// Open I/O streams for communication with peer
-								BufferedReader comIn = new BufferedReader(new InputStreamReader(comSocket.getInputStream()));
-								PrintWriter comOut = new PrintWriter(comSocket.getOutputStream(), false);
+								// Apply the file to our listing, either as part of the whole listing, or as an add (+) or remove (-)
+								if(list_full)
+									catalog.add(response);
+								else if(respArray[0].equals("+"))
+									catalog.add(response.substring(2));
+								else
+									catalog.remove(response.substring(2));
+								list_changes++;
+
+								// Read more input from the server
+								response = in.readLine();
+
+								// Split response into pieces by space separator
+								respArray = response.split(" ");
+							}
 
-								// Send peer the OPEN handshake
-								comOut.println("OPEN");
-								comOut.flush();
-								
-								// Read the peer's communication
-								comResponse = comIn.readLine();
-								
-								// Ensure we received the HELLO confirmation
-								if(!comResponse.equals("HELLO"))
-								{
-									// If peer does not return handshake properly, print error and exit
-									System.out.println("[error] peer did not properly reply to handshake");
-									System.exit(-1);
-								}
-	
-								// Open socket for file transfer with peer
-								Socket fileSocket = new Socket(respArray[0], 6602);
+							// Ensure that the server returned OK, quit and print error if it didn't
+							if(!response.equals("OK"))
+								error_handler(response);
+						}
 
-								// Send peer the GET command, sending the specified filename as well
-								comOut.println("GET " + reqArray[1]);
-								comOut.flush();
-								
-								// Open input stream for file transfer with peer
-								InputStream fileIn = fileSocket.getInputStream();
+						// Keep a count of number of files in the listing
+						int list_total = 0;
 
-								// Open output stream to write file to disk
-								BufferedOutputStream fileOut = new BufferedOutputStream(new FileOutputStream(path + reqArray[1]));
-								
-								// Initiate variables for file transfer
-								int bytesRead,current = 0;
+						// Print formatted file and size of each file in the listing
+						for(String entry : catalog)
+						{
+							list_total++;
+							respArray = entry.split(" ");
+							System.out.println(String.format("file [%2d]: %20s [size: %10s]", new Object[] { new Integer(list_total), respArray[0], respArray[1] }));
+						}
 
-								// Create a byte array large enough to store the file
-								byte[] buffer = new byte[Integer.parseInt(respArray[1])];
-								
-								// Initialize byte array cursors
-								bytesRead = fileIn.read(buffer, 0, buffer.length);
-								current = bytesRead;
+						// Print out total number of files listed
+						if(list_full)
+							System.out.println("[info] received list of " + list_total + " files from tracker");
+						else
+							System.out.println("[info] received " + list_changes + " change(s) from tracker, listing " + list_total + " files");
+					}
+				}
+				// search - send tracker the SEARCH command; print the best matching files
+				else if(reqArray[0].equals("search"))
+				{
+					// Ensure that a pattern was given after the search
+					if(reqArray.length < 2 || reqArray[1].isEmpty())
+						System.out.println("[error] please specify a pattern after the search command, '^' to match a prefix");
+					else
+					{
+						// Count matches
+						int search_total = 0;
 
-								System.out.println("[info] initiating file transfer");
+						// Take the tracker for the search
+						synchronized(Global.tracker)
+						{
+							// Send server the SEARCH command, with the given pattern
+							out.print("SEARCH " + reqArray[1] + "\n");
+							out.flush();
 
-								// Loop through and keep adding bytes to buffer
-								do
-								{
-									System.out.print(". ");
+							// Read input from the server, and split it into fields by space separator
+							response = in.readLine();
+							respArray = response.split(" ");
 
-									// Read in more bytes
-									bytesRead = fileIn.read(buffer, current, (buffer.length - current));
+							// Loop and receive input, until server replies OK or with ERROR
+							while((!respArray[0].equals("OK")) && (!respArray[0].equals("ERROR")))
+							{
+								// Print formatted file and size, best match first
+								search_total++;
+								System.out.println(String.format("match [%2d]: %20s [size: %10s]", new Object[] { new Integer(search_total), respArray[0], respArray[1] }));
 
-									// If byte counter was positive, shift it forward
-									if(bytesRead >= 0)
-										current += bytesRead;
-								} while(bytesRead > -1 && buffer.length != current);
+								// Read more input from the server
+								response = in.readLine();
+								respArray = response.split(" ");
+							}
 
-								// Write the byte array to a file
-								fileOut.write(buffer, 0, current);
-								fileOut.flush();
+							// Ensure that the server returned OK, quit and print error if it didn't
+							if(!respArray[0].equals("OK"))
+								error_handler(response);
+						}
+
+						// Print out total number of matches
+						System.out.println("[info] found " + search_total + " matching files on tracker");
+					}
+				}
+				// request - send server the REQUESTM command for one or more files; initiate a file transfer for each
+				else if(reqArray[0].equals("request"))
+				{
+					// If a file wasn't specified after the request, we'll get an exception.  Catch it.
+					try
+					{
+						// Ensure that the second field in the array was set, so we have a filename to send
+						if(!reqArray[1].isEmpty())
+						{
+							// Peer and size to download each file from, in the order requested
+							LinkedHashMap<String, String[]> sources = new LinkedHashMap<String, String[]>();
 
-								System.out.println("\n[info] file transfer complete");
+							// Take the tracker for the lookup, the downloads which follow do not need it
+							synchronized(Global.tracker)
+							{
+								// Send server the REQUESTM command, with the number of files, asking for a few peers chosen at random for
+								// each, so downloads of a popular file are spread across its peers, then each filename on its own line.
+								// The tracker looks them all up in one round trip, and sends the nearest, least loaded peer of each first.
+								out.print("REQUESTM " + (reqArray.length - 1) + " 8\n");
+								for(int i = 1; i < reqArray.length; i++)
+									out.print(reqArray[i] + "\n");
+								out.flush();
 
-								// Close all I/O streams, close socket
-								fileIn.close();
-								fileOut.close();
-								fileSocket.close();
+								// Read input from the server
+								response = in.readLine();
 
-								// Got file, exit loop
-								respArray[0] = "OK";
+								// Split input into fields by space separator
+								respArray = response.split(" ");
 
-								// Read more input
-								//response = in.readLine();
+								// Loop and receive each file's group, until server replies OK or with ERROR
+								while((!respArray[0].equals("OK")) && (!respArray[0].equals("ERROR")))
+								{
+									// Each group opens with FILE, the number of peers, and the filename, which may contain spaces
+									int peers = Integer.parseInt(respArray[1]);
+									String name = response.split(" ", 3)[2];
+
+									// If no peers were returned, the file does not exist on the tracker.  Inform peer
+									if(peers == 0)
+										System.out.println("[error] file '" + name + "' was not found on the tracker");
+
+									// Read the file's peers, keeping the first to download from
+									for(int i = 0; i < peers; i++)
+									{
+										response = in.readLine();
+										if(i == 0)
+											sources.put(name, response.split(" "));
+									}
+
+									// Read more input from the server
+									response = in.readLine();
+									respArray = response.split(" ");
+								}
 
-								// Split response into pieces
-								//respArray = response.split(" ");
+								// Ensure that the server returned OK, quit and print error if it didn't
+								if(!respArray[0].equals("OK"))
+									error_handler(response);
 							}
 
-							// Ensure that the server returned OK, quit and print error if it didn't
-							if(!respArray[0].equals("OK"))
-								error_handler(response);
+							// Download each file found from its peer
+							for(Map.Entry<String, String[]> source : sources.entrySet())
+								download(source.getValue()[0], source.getKey(), Integer.parseInt(source.getValue()[1]), path);
 						}
 					}
 					catch (Exception e)
@@ -503,21 +986,27 @@ public class client
 				}
 			} while(!request.equals("quit"));
 
-			// Once user wants to quit, send the disconnect handshake
-			out.print("QUIT");
-			out.flush();
-
-			// Ensure the termination handshake was successful
-			response = in.readLine();
-			if(!response.equals("GOODBYE"))
-			{
-				System.out.println("[error] tracker did not properly reply to exit handshake: " + response);
-				System.exit(-1);
-			}
-			else
+			// Take the tracker for the disconnect handshake, and keep the announce thread from using it afterwards
+			synchronized(Global.tracker)
 			{
-				// On success, print success message
-				System.out.println("[info] successfully closed connection to tracker");
+				Global.closed = true;
+
+				// Once user wants to quit, send the disconnect handshake
+				out.print("QUIT\n");
+				out.flush();
+
+				// Ensure the termination handshake was successful
+				response = in.readLine();
+				if(!response.equals("GOODBYE"))
+				{
+					System.out.println("[error] tracker did not properly reply to exit handshake: " + response);
+					System.exit(-1);
+				}
+				else
+				{
+					// On success, print success message
+					System.out.println("[info] successfully closed connection to tracker");
+				}
 			}
 
 			// Close I/O streams on socket
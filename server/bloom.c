@@ -0,0 +1,148 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:    10/16/26
+	Project: p2pd
+	Module:  bloom.c
+
+	Description:
+	A counting Bloom filter over the filenames tracked by the SQLite backend, so a REQUEST for a filename nobody
+	shares is answered without querying the database.  Each filename maps to DIR_BLOOM_HASHES counters, each row
+	sharing it raising them by one, and each row removed lowering them again.  A filename whose counters are not all
+	raised is certainly not shared, while one whose counters are may still be a false positive, and is queried.
+	The positions are derived from a single 64-bit FNV-1a hash, its halves combined as h1 + i * h2.
+
+	Counters are a byte each, and a counter which reaches 255 sticks there, since its true count is lost, which only
+	costs a false positive.  Counters are only raised and lowered by the SQLite writer thread, so they need no atomic
+	read-modify-write, only atomic loads and stores for the threads checking them.
+*/
+
+//------------------------ C LIBRARIES -----------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "config.h"
+#include "bloom.h"
+
+//------------------------ GLOBAL VARIABLES ------------------
+
+// Counters, NULL until the filter is allocated
+static unsigned char *counters = NULL;
+
+// Number of checks, and of checks answered negative
+static unsigned long checks = 0, negatives = 0;
+
+//------------------------ BLOOM HASH ------------------------
+
+// bloom_hash() returns the 64-bit FNV-1a hash of a filename, from which each of its positions is derived
+static unsigned long long bloom_hash(char *key)
+{
+	// Hash, starting at the FNV offset basis
+	unsigned long long hash = 14695981039346656037ULL;
+
+	// Fold in each byte
+	for(; *key != '\0'; key++)
+	{
+		hash ^= (unsigned char)*key;
+		hash *= 1099511628211ULL;
+	}
+
+	// Return hash
+	return hash;
+}
+
+//------------------------ BLOOM INIT ------------------------
+
+// bloom_init() allocates the filter, empty
+// Returns 0 on success, or -1 if it could not be allocated
+int bloom_init()
+{
+	if((counters = (unsigned char *)calloc(DIR_BLOOM_COUNTERS, 1)) == NULL)
+	{
+		fprintf(stderr, "%s: %s could not allocate filename filter\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+
+	// Return success
+	return 0;
+}
+
+//------------------------ BLOOM ADD -------------------------
+
+// bloom_add() raises the counters of a filename, as a row sharing it is added.  Only the writer thread may call it.
+void bloom_add(char *key)
+{
+	// Hash of the filename, its halves, counter being raised, and indexer
+	unsigned long long hash = bloom_hash(key);
+	unsigned int h1 = (unsigned int)hash, h2 = (unsigned int)(hash >> 32);
+	unsigned char *counter;
+	int i;
+
+	// Raise each counter, unless it is stuck
+	for(i = 0; i < DIR_BLOOM_HASHES; i++)
+	{
+		counter = &counters[(h1 + i * h2) & (DIR_BLOOM_COUNTERS - 1)];
+		if(*counter < 255)
+			__atomic_store_n(counter, *counter + 1, __ATOMIC_RELEASE);
+	}
+}
+
+//------------------------ BLOOM REMOVE ----------------------
+
+// bloom_remove() lowers the counters of a filename, as a row sharing it is removed.  Only the writer thread may call
+// it, and only for a filename it raised.
+void bloom_remove(char *key)
+{
+	// Hash of the filename, its halves, counter being lowered, and indexer
+	unsigned long long hash = bloom_hash(key);
+	unsigned int h1 = (unsigned int)hash, h2 = (unsigned int)(hash >> 32);
+	unsigned char *counter;
+	int i;
+
+	// Lower each counter, unless it is stuck
+	for(i = 0; i < DIR_BLOOM_HASHES; i++)
+	{
+		counter = &counters[(h1 + i * h2) & (DIR_BLOOM_COUNTERS - 1)];
+		if(*counter > 0 && *counter < 255)
+			__atomic_store_n(counter, *counter - 1, __ATOMIC_RELEASE);
+	}
+}
+
+//------------------------ BLOOM CHECK -----------------------
+
+// bloom_check() checks whether a filename may be shared
+// Returns 1 if it may be, or 0 if it certainly is not
+int bloom_check(char *key)
+{
+	// Hash of the filename, its halves, and indexer
+	unsigned long long hash = bloom_hash(key);
+	unsigned int h1 = (unsigned int)hash, h2 = (unsigned int)(hash >> 32);
+	int i;
+
+	// Count the check
+	__sync_add_and_fetch(&checks, 1);
+
+	// Any counter at zero rules the filename out
+	for(i = 0; i < DIR_BLOOM_HASHES; i++)
+	{
+		if(__atomic_load_n(&counters[(h1 + i * h2) & (DIR_BLOOM_COUNTERS - 1)], __ATOMIC_ACQUIRE) == 0)
+		{
+			__sync_add_and_fetch(&negatives, 1);
+			return 0;
+		}
+	}
+
+	// Return maybe
+	return 1;
+}
+
+//------------------------ BLOOM STATS -----------------------
+
+// bloom_stats() returns the number of checks, and of checks answered negative
+void bloom_stats(unsigned long *checked, unsigned long *negative)
+{
+	*checked = checks;
+	*negative = negatives;
+}
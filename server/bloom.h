@@ -0,0 +1,31 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:	 10/16/26
+	Project: p2pd
+	Module:	 bloom.h
+
+	Description:
+	A header containing prototypes used in bloom.c
+*/
+
+#ifndef _BLOOM_
+#define _BLOOM_
+
+//------------------------ PROTOTYPES ------------------------
+
+// Prototype for bloom_init(), which allocates the filename filter
+int bloom_init();
+
+// Prototype for bloom_add(), which raises the counters of a filename
+void bloom_add(char *);
+
+// Prototype for bloom_remove(), which lowers the counters of a filename
+void bloom_remove(char *);
+
+// Prototype for bloom_check(), which checks whether a filename may be shared
+int bloom_check(char *);
+
+// Prototype for bloom_stats(), which returns the number of checks, and of those answered negative
+void bloom_stats(unsigned long *, unsigned long *);
+
+#endif
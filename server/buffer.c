@@ -0,0 +1,320 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:    10/16/26
+	Project: p2pd
+	Module:  buffer.c
+
+	Description:
+	Per-connection input and output buffering.  Input is received into a ring buffer in whatever pieces TCP
+	delivers it, and commands are framed out of it by newline, so several pipelined commands arriving in one
+	segment, or one command split across segments, are handled the same as one command per read.
+
+	Replies are appended to a growable chain of blocks, and written with one gathering sendmsg() per flush,
+	rather than one send() per line, so a large LIST costs a handful of system calls instead of one per file.
+	A block may also point at a reference counted buffer shared by many clients, such as the cached LIST, which
+	is then sent straight from the same bytes to each of them.  Reply blocks come from a pool preallocated at startup,
+	so queueing a reply does not normally touch the heap.
+*/
+
+//------------------------ C LIBRARIES -----------------------
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "config.h"
+#include "buffer.h"
+#include "pool.h"
+
+//------------------------ GLOBAL VARIABLES ------------------
+
+// Pool of reply blocks, shared by every client
+static pool_t chunk_pool;
+
+//------------------------ RING USED -------------------------
+
+// ring_used() returns the number of bytes waiting in the buffer
+int ring_used(ring_t *ring)
+{
+	return ring->tail - ring->head;
+}
+
+//------------------------ RING WRITE ------------------------
+
+// ring_write() appends up to len bytes to the buffer, and returns the number of bytes which fit
+int ring_write(ring_t *ring, char *data, int len)
+{
+	// Indexer
+	int i;
+
+	// Only write as much as there is room for
+	if(len > INBUF_SIZE - ring_used(ring))
+		len = INBUF_SIZE - ring_used(ring);
+
+	// Copy bytes in, wrapping around the end of the buffer
+	for(i = 0; i < len; i++)
+		ring->data[(ring->tail + i) & (INBUF_SIZE - 1)] = data[i];
+	ring->tail += len;
+
+	// Return number of bytes written
+	return len;
+}
+
+//------------------------ RING LINE -------------------------
+
+// ring_line() copies the next newline terminated line into a null terminated string of at most size bytes,
+// stripping the line ending.  Returns the length of the line, -1 if no complete line is buffered yet, or -2
+// if the line was too long to fit, in which case the line is discarded up to and including its newline.
+int ring_line(ring_t *ring, char *line, int size)
+{
+	// Number of bytes buffered, and indexer
+	int used = ring_used(ring);
+	int i;
+
+	// Character being examined
+	char c;
+
+	// If an overlong line is being discarded, drop bytes through its newline
+	while(ring->skip && ring->head != ring->tail)
+	{
+		if(ring->data[ring->head++ & (INBUF_SIZE - 1)] == '\n')
+			ring->skip = 0;
+		used--;
+	}
+	if(ring->skip)
+		return -1;
+
+	// Look for a newline within the first size bytes
+	for(i = 0; i < used && i < size; i++)
+	{
+		// If a newline is found, copy out the line
+		if((c = ring->data[(ring->head + i) & (INBUF_SIZE - 1)]) == '\n')
+		{
+			// Copy the line, dropping a trailing carriage return
+			ring_take(ring, line, i + 1);
+			line[i] = '\0';
+			if(i > 0 && line[i - 1] == '\r')
+				line[--i] = '\0';
+
+			// Consume the newline itself
+			ring->head++;
+
+			// Return length of the line
+			return i;
+		}
+	}
+
+	// If a full line's worth of bytes has no newline, the line is too long, so discard it through its newline
+	if(used >= size)
+	{
+		ring->head += size;
+		ring->skip = 1;
+		return -2;
+	}
+
+	// Else, the line is not complete yet
+	return -1;
+}
+
+//------------------------ RING TAKE -------------------------
+
+// ring_take() removes up to size - 1 buffered bytes into a null terminated string, and returns the number taken
+int ring_take(ring_t *ring, char *data, int size)
+{
+	// Number of bytes to take, and indexer
+	int len = ring_used(ring);
+	int i;
+
+	// Leave room for the null terminator
+	if(len > size - 1)
+		len = size - 1;
+
+	// Copy bytes out, wrapping around the end of the buffer
+	for(i = 0; i < len; i++)
+		data[i] = ring->data[(ring->head + i) & (INBUF_SIZE - 1)];
+	data[len] = '\0';
+	ring->head += len;
+
+	// Return number of bytes taken
+	return len;
+}
+
+//------------------------ OUT INIT --------------------------
+
+// out_init() preallocates count reply blocks, beyond which blocks are allocated from the heap
+int out_init(int count)
+{
+	return pool_init(&chunk_pool, sizeof(chunk_t) + OUTBUF_CHUNK, count);
+}
+
+//------------------------ OUT WRITE -------------------------
+
+// out_write() appends len bytes to a reply buffer, adding blocks as needed
+// Returns the number of bytes written, or -1 if memory could not be allocated
+int out_write(outbuf_t *out, char *data, int len)
+{
+	// Block being filled, number of bytes copied into it, and total bytes written
+	chunk_t *chunk;
+	int n, total = 0;
+
+	// Copy until everything is written
+	while(total < len)
+	{
+		// If there is no block, or the last is full or shared, add a new block to the chain
+		if(out->tail == NULL || out->tail->release != NULL || out->tail->len == OUTBUF_CHUNK)
+		{
+			if((chunk = (chunk_t *)pool_alloc(&chunk_pool)) == NULL)
+				return -1;
+			chunk->next = NULL;
+			chunk->len = chunk->off = 0;
+			chunk->base = chunk->data;
+			chunk->release = NULL;
+			chunk->owner = NULL;
+
+			if(out->tail == NULL)
+				out->head = chunk;
+			else
+				out->tail->next = chunk;
+			out->tail = chunk;
+		}
+
+		// Copy as much as fits in the last block
+		chunk = out->tail;
+		n = (len - total < OUTBUF_CHUNK - chunk->len) ? len - total : OUTBUF_CHUNK - chunk->len;
+		memcpy(chunk->base + chunk->len, data + total, n);
+		chunk->len += n;
+		out->bytes += n;
+		total += n;
+	}
+
+	// Return number of bytes written
+	return total;
+}
+
+//------------------------ OUT SHARE -------------------------
+
+// out_share() appends len bytes of a shared buffer to a reply buffer, without copying them.  The buffer must stay
+// unchanged until release is called with owner, which happens once the bytes are sent, or the client is freed.
+// Returns the number of bytes queued, or -1 if memory could not be allocated, in which case release is not called.
+int out_share(outbuf_t *out, char *data, int len, void (*release)(void *), void *owner)
+{
+	// Block pointing at the shared buffer, allocated without room for contents of its own
+	chunk_t *chunk;
+	if((chunk = (chunk_t *)malloc(sizeof(chunk_t))) == NULL)
+		return -1;
+
+	// Point the block at the shared buffer
+	chunk->next = NULL;
+	chunk->len = len;
+	chunk->off = 0;
+	chunk->base = data;
+	chunk->release = release;
+	chunk->owner = owner;
+
+	// Add it to the chain
+	if(out->tail == NULL)
+		out->head = chunk;
+	else
+		out->tail->next = chunk;
+	out->tail = chunk;
+	out->bytes += len;
+
+	// Return number of bytes queued
+	return len;
+}
+
+//------------------------ OUT SEND --------------------------
+
+// out_send() writes as much of a reply buffer as the socket accepts, gathering every block into one sendmsg().
+// If more is set, more replies are coming, and MSG_MORE holds back a partial segment (like TCP_CORK, but without
+// the extra system calls to set and clear it).  Returns the number of bytes sent, or -1 with errno set.
+int out_send(outbuf_t *out, int fd, int more)
+{
+	// Gather vector of blocks, and the message header for sendmsg()
+	struct iovec iov[OUTBUF_IOV];
+	struct msghdr msg;
+
+	// Block being examined, number of blocks gathered, bytes sent, and bytes consumed from the current block
+	chunk_t *chunk;
+	int count = 0;
+	int b_sent, n;
+
+	// Gather the unsent part of each block
+	for(chunk = out->head; chunk != NULL && count < OUTBUF_IOV; chunk = chunk->next)
+	{
+		iov[count].iov_base = chunk->base + chunk->off;
+		iov[count].iov_len = chunk->len - chunk->off;
+		count++;
+	}
+
+	// Nothing to send
+	if(count == 0)
+		return 0;
+
+	// Send, MSG_NOSIGNAL keeps a peer which has already hung up from killing the server with SIGPIPE
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	if((b_sent = sendmsg(fd, &msg, MSG_NOSIGNAL | ((more || chunk != NULL) ? MSG_MORE : 0))) == -1)
+		return -1;
+
+	// Release the blocks which were sent completely, and advance into the block which was sent partially
+	out->bytes -= b_sent;
+	for(n = b_sent; n > 0 && (chunk = out->head) != NULL; )
+	{
+		// Block sent partially, so advance into it
+		if(n < chunk->len - chunk->off)
+		{
+			chunk->off += n;
+			break;
+		}
+
+		// Block sent completely, so free it
+		n -= chunk->len - chunk->off;
+		out->head = chunk->next;
+		chunk->next = NULL;
+		out_free(chunk);
+	}
+	if(out->head == NULL)
+		out->tail = NULL;
+
+	// Return number of bytes sent
+	return b_sent;
+}
+
+//------------------------ OUT DETACH ------------------------
+
+// out_detach() returns the chain of blocks in a reply buffer, leaving the buffer empty
+chunk_t *out_detach(outbuf_t *out)
+{
+	// Chain being detached
+	chunk_t *chain = out->head;
+
+	// Empty the buffer
+	out->head = out->tail = NULL;
+	out->bytes = 0;
+
+	// Return chain
+	return chain;
+}
+
+//------------------------ OUT FREE --------------------------
+
+// out_free() frees a chain of blocks, releasing any shared buffers they point at, and returning pooled blocks to the pool
+void out_free(chunk_t *chain)
+{
+	// Block being freed
+	chunk_t *chunk;
+
+	// Free each block in turn
+	while((chunk = chain) != NULL)
+	{
+		chain = chunk->next;
+		if(chunk->release != NULL)
+			chunk->release(chunk->owner);
+		pool_free(&chunk_pool, chunk);
+	}
+}
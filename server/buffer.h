@@ -0,0 +1,92 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:	 10/16/26
+	Project: p2pd
+	Module:	 buffer.h
+
+	Description:
+	A header containing prototypes and structs used in buffer.c
+*/
+
+#ifndef _BUFFER_
+
+#define _BUFFER_
+
+//------------------------ STRUCTS ---------------------------
+
+// Ring buffer of raw input received from a client, from which newline terminated commands are framed
+typedef struct
+{
+	// Buffered bytes, INBUF_SIZE must be a power of two
+	char data[INBUF_SIZE];
+
+	// Free running read and write positions, masked when indexing data
+	unsigned int head, tail;
+
+	// Set while discarding the remainder of an overlong line
+	int skip;
+} ring_t;
+
+// A block of reply bytes waiting to be sent to a client, either copied into the block, or shared with other clients
+typedef struct chunk
+{
+	// Next block in the reply
+	struct chunk *next;
+
+	// Number of bytes in the block, and number of those already sent
+	int len, off;
+
+	// Start of the block's bytes, either its own contents, or a shared buffer
+	char *base;
+
+	// For a shared buffer, called with its owner once the block is sent, else NULL
+	void (*release)(void *);
+	void *owner;
+
+	// Block contents, OUTBUF_CHUNK bytes, absent for a shared buffer
+	char data[];
+} chunk_t;
+
+// Growable buffer of replies waiting to be sent to a client, kept as a chain of blocks
+typedef struct
+{
+	// First and last block in the chain
+	chunk_t *head, *tail;
+
+	// Total number of unsent bytes
+	int bytes;
+} outbuf_t;
+
+//------------------------ PROTOTYPES ------------------------
+
+// Prototype for ring_used(), which returns the number of buffered bytes
+int ring_used(ring_t *);
+
+// Prototype for ring_write(), which appends bytes to the buffer, returning the number which fit
+int ring_write(ring_t *, char *, int);
+
+// Prototype for ring_line(), which removes the next complete line from the buffer
+int ring_line(ring_t *, char *, int);
+
+// Prototype for ring_take(), which removes everything buffered, complete line or not
+int ring_take(ring_t *, char *, int);
+
+// Prototype for out_init(), which preallocates the pool of reply blocks
+int out_init(int);
+
+// Prototype for out_write(), which appends bytes to a reply buffer, growing it as needed
+int out_write(outbuf_t *, char *, int);
+
+// Prototype for out_share(), which appends a shared buffer to a reply buffer without copying it
+int out_share(outbuf_t *, char *, int, void (*)(void *), void *);
+
+// Prototype for out_send(), which writes as much of a reply buffer as the socket will take in one system call
+int out_send(outbuf_t *, int, int);
+
+// Prototype for out_detach(), which hands the whole chain of blocks to the caller and empties the buffer
+chunk_t *out_detach(outbuf_t *);
+
+// Prototype for out_free(), which frees a chain of blocks
+void out_free(chunk_t *);
+
+#endif
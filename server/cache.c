@@ -0,0 +1,359 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:    10/16/26
+	Project: p2pd
+	Module:  cache.c
+
+	Description:
+	A cache of the peers sharing the most recently requested files, kept by the SQLite backend, so REQUESTs for a
+	popular file are answered from memory rather than by querying the database each time.  The cache holds
+	DIR_CACHE_ENTRIES files, split across CACHE_SHARDS shards by hash, each with its own lock, hash table, and list
+	ordered from most to least recently used, so threads requesting different files rarely contend, and the least
+	recently used file of a shard makes way for a new one.
+
+	A file is invalidated once a change to it is committed.  Since a REQUEST queries the database before caching what
+	it found, a change may be committed, and invalidated, in between, so each shard counts its invalidations, and a
+	REQUEST only caches its rows if none happened in its shard since it missed.
+*/
+
+//------------------------ C LIBRARIES -----------------------
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "config.h"
+#include "cache.h"
+
+//------------------------ PARAMETERS ------------------------
+
+// Number of shards, and number of files and hash buckets in each
+#define CACHE_SHARDS 16
+#define CACHE_SHARD_SIZE (DIR_CACHE_ENTRIES / CACHE_SHARDS)
+
+//------------------------ STRUCTS ---------------------------
+
+// A cached file, and the peers sharing it
+typedef struct cache_entry
+{
+	// Next entry in the same bucket
+	struct cache_entry *next;
+
+	// Neighbouring entries in the shard's list, more and less recently used
+	struct cache_entry *newer, *older;
+
+	// Rows of the REQUEST reply, and number of rows
+	dir_row_t *rows;
+	int count;
+
+	// Filename
+	char key[];
+} cache_entry_t;
+
+// A shard of the cache
+typedef struct cache_shard
+{
+	// Lock protecting the shard
+	pthread_mutex_t lock;
+
+	// Hash table of entries
+	cache_entry_t *buckets[CACHE_SHARD_SIZE];
+
+	// Most and least recently used entries, and number of entries
+	cache_entry_t *newest, *oldest;
+	int count;
+
+	// Number of invalidations
+	unsigned long epoch;
+} cache_shard_t;
+
+//------------------------ GLOBAL VARIABLES ------------------
+
+// Shards of the cache
+static cache_shard_t shards[CACHE_SHARDS];
+
+// Number of lookups answered from the cache, and of those which were not
+static unsigned long hits = 0, misses = 0;
+
+//------------------------ CACHE HASH ------------------------
+
+// cache_hash() returns the FNV-1a hash of a filename, its low bits picking the shard, the rest the bucket
+static unsigned int cache_hash(char *key)
+{
+	// Hash, starting at the FNV offset basis
+	unsigned int hash = 2166136261U;
+
+	// Fold in each byte
+	for(; *key != '\0'; key++)
+	{
+		hash ^= (unsigned char)*key;
+		hash *= 16777619U;
+	}
+
+	// Return hash
+	return hash;
+}
+
+//------------------------ CACHE COPY ------------------------
+
+// cache_copy() copies an array of rows, so the copy outlives the original
+// Returns the number of rows, or -1 if they could not be copied
+static int cache_copy(dir_row_t *rows, int count, dir_row_t **copy)
+{
+	// Number of rows copied, and indexer
+	int copied = 0;
+	int i;
+
+	// Start with no rows
+	*copy = NULL;
+
+	// Copy each row
+	for(i = 0; i < count; i++)
+	{
+		if(dir_rows_push(copy, &copied, rows[i].key, rows[i].size) == -1)
+		{
+			dir_rows_free(*copy, copied);
+			*copy = NULL;
+			return -1;
+		}
+	}
+
+	// Return number of rows
+	return copied;
+}
+
+//------------------------ CACHE FIND ------------------------
+
+// cache_find() returns the link in a shard's bucket pointing to a filename's entry, which points to NULL if it is not
+// cached.  The caller must hold the shard's lock.
+static cache_entry_t **cache_find(cache_shard_t *shard, unsigned int hash, char *key)
+{
+	// Link being examined
+	cache_entry_t **link;
+
+	// Walk the bucket for a matching filename
+	for(link = &shard->buckets[(hash / CACHE_SHARDS) & (CACHE_SHARD_SIZE - 1)]; *link != NULL; link = &(*link)->next)
+	{
+		if(strcmp((*link)->key, key) == 0)
+			break;
+	}
+
+	// Return link
+	return link;
+}
+
+//------------------------ CACHE UNLINK ----------------------
+
+// cache_unlink() removes an entry from its shard's list.  The caller must hold the shard's lock.
+static void cache_unlink(cache_shard_t *shard, cache_entry_t *entry)
+{
+	if(entry->newer != NULL)
+		entry->newer->older = entry->older;
+	else
+		shard->newest = entry->older;
+	if(entry->older != NULL)
+		entry->older->newer = entry->newer;
+	else
+		shard->oldest = entry->newer;
+}
+
+//------------------------ CACHE PUSH ------------------------
+
+// cache_push() puts an entry at the front of its shard's list, as the most recently used.  The caller must hold the
+// shard's lock.
+static void cache_push(cache_shard_t *shard, cache_entry_t *entry)
+{
+	entry->newer = NULL;
+	entry->older = shard->newest;
+	if(shard->newest != NULL)
+		shard->newest->newer = entry;
+	else
+		shard->oldest = entry;
+	shard->newest = entry;
+}
+
+//------------------------ CACHE INIT ------------------------
+
+// cache_init() prepares the lock of each shard
+void cache_init()
+{
+	// Indexer
+	int i;
+
+	for(i = 0; i < CACHE_SHARDS; i++)
+		pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+//------------------------ CACHE GET -------------------------
+
+// cache_get() returns a copy of the rows cached for a filename, along with the shard's count of invalidations in epoch,
+// to be handed to cache_put() along with the rows queried instead on a miss
+// Returns the number of rows, or -1 if the filename is not cached, or its rows could not be copied
+int cache_get(char *key, dir_row_t **rows, unsigned long *epoch)
+{
+	// Hash of the filename, its shard, its entry, and number of rows
+	unsigned int hash = cache_hash(key);
+	cache_shard_t *shard = &shards[hash & (CACHE_SHARDS - 1)];
+	cache_entry_t *entry;
+	int count = -1;
+
+	pthread_mutex_lock(&shard->lock);
+
+	// On a hit, copy the rows, and mark the entry most recently used
+	if((entry = *cache_find(shard, hash, key)) != NULL)
+	{
+		count = cache_copy(entry->rows, entry->count, rows);
+		cache_unlink(shard, entry);
+		cache_push(shard, entry);
+	}
+	*epoch = shard->epoch;
+
+	pthread_mutex_unlock(&shard->lock);
+
+	// Count the lookup
+	if(entry != NULL)
+		__sync_add_and_fetch(&hits, 1);
+	else
+		__sync_add_and_fetch(&misses, 1);
+
+	// Return number of rows
+	return count;
+}
+
+//------------------------ CACHE PUT -------------------------
+
+// cache_put() caches a copy of the rows queried for a filename after a miss, unless the file was invalidated since, as
+// counted by epoch, or it has no rows, or more than DIR_CACHE_ROWS
+void cache_put(char *key, dir_row_t *rows, int count, unsigned long epoch)
+{
+	// Hash of the filename, its shard, new entry, and entry evicted to make room
+	unsigned int hash = cache_hash(key);
+	cache_shard_t *shard = &shards[hash & (CACHE_SHARDS - 1)];
+	cache_entry_t *entry, *evicted = NULL;
+	cache_entry_t **link;
+
+	// Files nobody shares are left to the filename filter, and huge replies are not worth the memory
+	if(count <= 0 || count > DIR_CACHE_ROWS)
+		return;
+
+	// Build the entry before taking the lock
+	if((entry = (cache_entry_t *)malloc(sizeof(cache_entry_t) + strlen(key) + 1)) == NULL)
+		return;
+	if((entry->count = cache_copy(rows, count, &entry->rows)) == -1)
+	{
+		free(entry);
+		return;
+	}
+	strcpy(entry->key, key);
+
+	pthread_mutex_lock(&shard->lock);
+
+	// Drop the entry if the shard was invalidated since the miss, or another thread cached the file meanwhile
+	if(shard->epoch != epoch || *(link = cache_find(shard, hash, key)) != NULL)
+	{
+		pthread_mutex_unlock(&shard->lock);
+		dir_rows_free(entry->rows, entry->count);
+		free(entry);
+		return;
+	}
+
+	// Link the entry into its bucket, and at the front of the list
+	entry->next = NULL;
+	*link = entry;
+	cache_push(shard, entry);
+
+	// Evict the least recently used entry once the shard is over its size
+	if(++shard->count > CACHE_SHARD_SIZE)
+	{
+		evicted = shard->oldest;
+		cache_unlink(shard, evicted);
+		link = cache_find(shard, cache_hash(evicted->key), evicted->key);
+		*link = evicted->next;
+		shard->count--;
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	// Free the evicted entry, unlocked
+	if(evicted != NULL)
+	{
+		dir_rows_free(evicted->rows, evicted->count);
+		free(evicted);
+	}
+}
+
+//------------------------ CACHE INVALIDATE ------------------
+
+// cache_invalidate() drops the rows cached for a filename, once a change to it is committed
+void cache_invalidate(char *key)
+{
+	// Hash of the filename, its shard, link to its entry, and its entry
+	unsigned int hash = cache_hash(key);
+	cache_shard_t *shard = &shards[hash & (CACHE_SHARDS - 1)];
+	cache_entry_t **link;
+	cache_entry_t *entry;
+
+	pthread_mutex_lock(&shard->lock);
+
+	// Count the invalidation, so a REQUEST which missed before the change does not cache what it found
+	shard->epoch++;
+
+	// Unlink the entry, if the file is cached
+	if((entry = *(link = cache_find(shard, hash, key))) != NULL)
+	{
+		*link = entry->next;
+		cache_unlink(shard, entry);
+		shard->count--;
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	// Free the entry, unlocked
+	if(entry != NULL)
+	{
+		dir_rows_free(entry->rows, entry->count);
+		free(entry);
+	}
+}
+
+//------------------------ CACHE FLUSH -----------------------
+
+// cache_flush() drops every cached file, when the files touched by a change are not known
+void cache_flush()
+{
+	// Entries being dropped, the next one, and indexer
+	cache_entry_t *entry, *next;
+	int i;
+
+	for(i = 0; i < CACHE_SHARDS; i++)
+	{
+		// Empty the shard, counting an invalidation
+		pthread_mutex_lock(&shards[i].lock);
+		shards[i].epoch++;
+		entry = shards[i].newest;
+		memset(shards[i].buckets, 0, sizeof(shards[i].buckets));
+		shards[i].newest = shards[i].oldest = NULL;
+		shards[i].count = 0;
+		pthread_mutex_unlock(&shards[i].lock);
+
+		// Free its entries, unlocked
+		for(; entry != NULL; entry = next)
+		{
+			next = entry->older;
+			dir_rows_free(entry->rows, entry->count);
+			free(entry);
+		}
+	}
+}
+
+//------------------------ CACHE STATS -----------------------
+
+// cache_stats() returns the number of lookups answered from the cache, and of those which were not
+void cache_stats(unsigned long *hit, unsigned long *missed)
+{
+	*hit = hits;
+	*missed = misses;
+}
@@ -0,0 +1,38 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:	 10/16/26
+	Project: p2pd
+	Module:	 cache.h
+
+	Description:
+	A header containing prototypes used in cache.c
+*/
+
+#ifndef _CACHE_
+#define _CACHE_
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "dir.h"
+
+//------------------------ PROTOTYPES ------------------------
+
+// Prototype for cache_init(), which prepares the cache
+void cache_init();
+
+// Prototype for cache_get(), which returns a copy of the rows cached for a filename
+int cache_get(char *, dir_row_t **, unsigned long *);
+
+// Prototype for cache_put(), which caches the rows queried for a filename after a miss
+void cache_put(char *, dir_row_t *, int, unsigned long);
+
+// Prototype for cache_invalidate(), which drops the rows cached for a filename
+void cache_invalidate(char *);
+
+// Prototype for cache_flush(), which drops every cached file
+void cache_flush();
+
+// Prototype for cache_stats(), which returns the number of cache hits and misses
+void cache_stats(unsigned long *, unsigned long *);
+
+#endif
@@ -29,18 +29,168 @@
 // Define the name of the database file
 #define DB_FILE "p2pd.sqlite"
 
+// Define the number of kilobytes of page cache each SQLite connection may use
+#define DB_CACHE_KB 8192
+
+// Define the number of bytes of the database file each SQLite connection maps into memory
+#define DB_MMAP_SIZE 268435456
+
+// Define the number of milliseconds a SQLite connection waits for another connection's write to finish
+#define DB_BUSY_TIMEOUT 5000
+
+// Define the largest number of directory changes the SQLite writer commits together
+#define DB_BATCH_OPS 256
+
+// Define the number of microseconds the SQLite writer holds a batch open for more changes, while several threads write
+#define DB_BATCH_USEC 1000
+
 // Define the default port which the server will listen on, assuming another is not specified via argv array
 #define DEFAULT_PORT "6600"
 
+// Define the location of the table of site prefixes, by which peers are ranked in REQUEST replies
+#define SITE_FILE "p2pd.sites"
+
 // Define the lockfile location for this server
 #define LOCKFILE "/tmp/" SERVER_NAME ".lock"
 
-// Define the number of threads created in our thread pool
+// Define the maximum number of threads in our thread pool
 #define NUM_THREADS 64
 
+// Define the number of threads kept in our thread pool even when idle, more are started as load requires
+#define IDLE_THREADS 4
+
+// Define the stack size of each thread in our thread pool, in kilobytes
+#define THREAD_STACK 256
+
 // Define the connection queue length for listening on the local socket
 #define QUEUE_LENGTH 32
 
+// Define the maximum number of clients which may be connected to the server at once
+#define MAX_CLIENTS 16384
+
+//-------------------- EVENT LOOP --------------------------------
+
+// Define the maximum number of events returned by a single epoll_wait() call
+#define MAX_EVENTS 256
+
+// Define the maximum number of commands processed for one client before yielding its worker thread
+#define COMMAND_BATCH 64
+
+// Define the size of each client's input buffer (must be a power of two)
+#define INBUF_SIZE 4096
+
+// Define the size of each block in a client's reply buffer, in which replies are collected before being sent
+#define OUTBUF_CHUNK 16384
+
+// Define the number of buffered reply bytes at which the buffer is written out, even mid-reply
+#define OUTBUF_HIGHWATER 65536
+
+// Define the number of reply blocks preallocated at startup, beyond which blocks are allocated from the heap
+#define OUTBUF_POOL 4096
+
+// Define the maximum number of blocks gathered into a single write
+#define OUTBUF_IOV 64
+
+// Define the number of milliseconds to wait on a client which is not reading its replies
+#define SEND_TIMEOUT 5000
+
+// Define the available network I/O engines, epoll being the default
+#define IO_EPOLL 0
+#define IO_URING 1
+
+//-------------------- DIRECTORY ---------------------------------
+
+// Define the available directory backends, the in-memory index being the default
+#define DIR_MEMORY 0
+#define DIR_SQLITE 1
+
+// Define the number of buckets in each table of the in-memory index (must be a power of two)
+#define DIR_BUCKETS 65536
+
+// Define the number of locks striped across each table's buckets (must be a power of two, at most DIR_BUCKETS)
+#define DIR_STRIPES 256
+
+// Define the number of recent listing changes kept for LISTSINCE
+#define DIR_JOURNAL 8192
+
+// Define the maximum number of changes sent for LISTSINCE, beyond which the whole listing is sent instead
+#define DIR_DELTA_MAX 1024
+
+// Define the maximum number of files which may be requested in one page of the listing
+#define DIR_PAGE_MAX 1000
+
+// Define the maximum number of peers which may be requested with 'REQUEST <file> <max>'
+#define DIR_SAMPLE_MAX 100
+
+// Define the maximum number of files which may be looked up with a single REQUESTM
+#define DIR_REQUEST_MAX 1024
+
+// Define the number of buckets in the table of loads reported by peers with ANNOUNCE, a power of two
+#define DIR_LOAD_BUCKETS 4096
+
+// Define the number of seconds after which a peer's reported load is ignored, three of the Java client's reports
+#define DIR_LOAD_STALE 45
+
+// Define the upload rate, in kilobits per second, at or below which each upload counts fully towards a peer's load
+#define DIR_LOAD_KBPS 1024
+
+// Define the largest number of uploads, or upload rate in kilobits per second, a peer may report with ANNOUNCE
+#define DIR_LOAD_MAX 1000000
+
+// Define the number of counters in the SQLite backend's filter of shared filenames, a power of two, a byte each
+#define DIR_BLOOM_COUNTERS 4194304
+
+// Define the number of counters each filename raises in the filter
+#define DIR_BLOOM_HASHES 4
+
+// Define the number of files whose peers the SQLite backend caches for REQUEST (must be a power of two, at least 16)
+#define DIR_CACHE_ENTRIES 4096
+
+// Define the largest number of peers sharing a file for which they are cached
+#define DIR_CACHE_ROWS 1024
+
+// Define the maximum number of matches returned by SEARCH
+#define DIR_SEARCH_MAX 100
+
+// Define the maximum number of files which may be sent with a single ADDBATCH
+#define DIR_BATCH_MAX 4096
+
+// Define the number of hex digits in a digest of a peer's files, as sent with RESUME
+#define DIR_DIGEST 16
+
+// Define the number of seconds a dropped client's files are kept, waiting for it to RESUME its session
+#define SESSION_GRACE 120
+
+// Define the number of buckets in the table of sessions, a power of two
+#define SESSION_BUCKETS 4096
+
+// Define the number of seconds a client may stay silent before its lease runs out and it is disconnected
+#define LEASE_SECONDS 300
+
+// Define the number of milliseconds between ticks of the timer wheel, which expires leases
+#define WHEEL_TICK_MS 100
+
+// Define the number of buckets in the SEARCH trigram index (must be a power of two)
+#define SEARCH_BUCKETS 65536
+
+//-------------------- IO_URING ----------------------------------
+
+// Define the number of submission queue entries in the ring
+#define URING_ENTRIES 4096
+
+// Define the number of provided receive buffers (must be a power of two), and the size of each
+#define URING_BUFFERS 1024
+#define URING_BUFFER_SIZE 1024
+
+// Define the maximum number of sends linked into a single chain for one client
+#define URING_MAX_LINK 64
+
+// Define the number of received bytes queued for a client, at which its recv is canceled until a worker consumes them
+#define URING_RX_HIGHWATER 65536
+
+// Define the number of reply bytes queued for a client, at which its commands stop running until the ring sends them
+#define URING_TX_HIGHWATER 262144
+
 //-------------------- MISCELLANEOUS -----------------------------
 
 // Define the maximum valid TCP/UDP port
@@ -49,5 +199,5 @@
 // Define the maximum privileged TCP port
 #define PRIVILEGED_PORT 1024
 
-// Define the warning threshold for threadpool utilization
+// Define the warning threshold for client capacity utilization
 #define TP_UTIL 0.80
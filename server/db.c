@@ -0,0 +1,879 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:    10/16/26
+	Project: p2pd
+	Module:  db.c
+
+	Description:
+	The SQLite directory backend, selected with '-b sqlite'.  Every file is a row of the files table, keyed on
+	(file, hash, peer).  The database is kept in WAL mode, and each thread opens its own connection the first time
+	it touches the directory, with every statement prepared once and reused with bound parameters, so no command
+	parses SQL, and readers never wait behind a writer.  A thread's connection is closed when the thread exits.  The
+	in-memory index in dir.c is the default, and this backend is kept for comparison and debugging.
+
+	Mutations are not run by the thread which received them, but queued for a single writer thread, which runs them
+	in batches of up to DB_BATCH_OPS within one transaction, and commits each batch once.  Each statement still has
+	its own result, since a failed statement only rolls back itself, and the thread which queued it waits for the
+	commit before replying, so a client never sees OK for a change which was not committed.  When the last batch was
+	shared by several threads, the writer holds the next one open, up to DB_BATCH_USEC, until as many are queued.
+
+	REQUEST is spared most queries by two structures kept up to date by the writer.  A counting Bloom filter over
+	every filename in the table, in bloom.c, rules out a filename nobody shares without a query, and a cache of the
+	peers sharing recently requested files, in cache.c, answers popular ones from memory.  A filename enters the
+	filter as its row is inserted, before the commit, so the filter never misses a committed row, and only leaves it,
+	and the cache, once its removal is committed.  A rolled back insert leaves its filename in the filter, which at
+	worst costs a query.
+*/
+
+//------------------------ C LIBRARIES -----------------------
+
+#include <errno.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "config.h"
+#include "bloom.h"
+#include "cache.h"
+#include "dir.h"
+#include "db.h"
+
+//------------------------ STATEMENTS ------------------------
+
+// Statements prepared on every connection, indexing db_sql
+#define DB_ADD          0
+#define DB_DELETE       1
+#define DB_PURGE        2
+#define DB_LIST         3
+#define DB_REQUEST      4
+#define DB_REQUEST_HASH 5
+#define DB_UNIQUE       6
+#define DB_MANIFEST     7
+#define DB_BEGIN        8
+#define DB_COMMIT       9
+#define DB_ROLLBACK     10
+#define DB_STATEMENTS   11
+
+// SQL of each statement
+static const char *db_sql[DB_STATEMENTS] = {
+	"INSERT INTO files VALUES(?1, ?2, ?3, ?4)",
+	"DELETE FROM files WHERE file=?1 AND hash=?2 AND peer=?3",
+	"DELETE FROM files WHERE peer=?1",
+	"SELECT DISTINCT file,size FROM files ORDER BY file ASC, size ASC",
+	"SELECT peer,size FROM files WHERE file=?1 ORDER BY peer ASC",
+	"SELECT peer,size,file FROM files WHERE hash=?1 ORDER BY peer ASC, file ASC",
+	// SQLite takes the bare size column from the row holding MIN(file)
+	"SELECT MIN(file),size,hash,COUNT(DISTINCT peer) FROM files GROUP BY hash ORDER BY MIN(file) ASC, hash ASC",
+	"SELECT file,size,hash FROM files WHERE peer=?1",
+	// Take the write lock at the start of a batch, rather than failing to upgrade to it partway through
+	"BEGIN IMMEDIATE",
+	"COMMIT",
+	"ROLLBACK"
+};
+
+//------------------------ STRUCTS ---------------------------
+
+// A thread's own connection, and its prepared statements
+typedef struct
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt[DB_STATEMENTS];
+} db_conn_t;
+
+// A mutation queued for the writer thread by the thread which received it, which waits for its result, unless the
+// mutation is detached, in which case the writer frees it once committed
+typedef struct db_op
+{
+	// DB_ADD, DB_DELETE, or DB_PURGE, and its parameters
+	int which;
+	char *filename, *filehash, *peeraddr;
+	long f_size;
+
+	// For a bulk insert, the files to insert in place of a single one, and how many
+	dir_record_t *records;
+	int count;
+
+	// For a delete, the number of rows removed, and for a purge, the files the peer shared, and how many, each of
+	// which leaves the filename filter and the cache once committed
+	int removed;
+	dir_row_t *purged;
+	int purged_count;
+
+	// Result, whether its batch has been committed, and whether nobody waits for it
+	int status, done, detached;
+
+	// For a detached mutation, run by the writer once it is committed
+	void (*after)(void);
+
+	// Next mutation in the queue
+	struct db_op *next;
+} db_op_t;
+
+//------------------------ GLOBAL VARIABLES ------------------
+
+// SQLite database access struct, used by the main thread to set up and close the database
+static sqlite3 *db = NULL;
+
+// Full path of the database file, as opened by the main thread, for connections opened later by other threads,
+// which may be after daemonizing has changed the working directory
+static char *db_path = NULL;
+
+// Key under which each thread keeps its own connection
+static pthread_key_t db_key;
+
+// Writer thread, whether it is still accepting mutations, and whether it has been started
+static pthread_t writer;
+static int writer_running = 0;
+static int writer_started = 0;
+
+// Queue of mutations waiting for the writer, and its length
+static db_op_t *queue_head = NULL, *queue_tail = NULL;
+static int queue_length = 0;
+
+// Lock protecting the queue, signalled when a mutation is queued, and broadcast when a batch is committed
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+
+//------------------------ DB TUNE ---------------------------
+
+// db_tune() applies the settings used by every connection
+// Returns 0 on success, or -1 on failure
+static int db_tune(sqlite3 *handle)
+{
+	// Settings, WAL needs only a sync at checkpoints to stay consistent, and the directory is rebuilt from connected
+	// peers at every start anyway
+	char pragmas[256] = { '\0' };
+	sprintf(pragmas, "PRAGMA synchronous=NORMAL; PRAGMA cache_size=-%d; PRAGMA mmap_size=%d;", DB_CACHE_KB, DB_MMAP_SIZE);
+
+	// Wait out another connection's write, rather than failing at once
+	sqlite3_busy_timeout(handle, DB_BUSY_TIMEOUT);
+
+	// Apply settings
+	return (sqlite3_exec(handle, pragmas, NULL, NULL, NULL) == SQLITE_OK) ? 0 : -1;
+}
+
+//------------------------ DB CONN FREE ----------------------
+
+// db_conn_free() finalizes a thread's statements and closes its connection, called as the thread exits
+static void db_conn_free(void *arg)
+{
+	// Connection being closed, and indexer
+	db_conn_t *conn = (db_conn_t *)arg;
+	int i;
+
+	// Finalize each statement, then close the connection
+	for(i = 0; i < DB_STATEMENTS; i++)
+		sqlite3_finalize(conn->stmt[i]);
+	if(sqlite3_close(conn->db) != SQLITE_OK)
+		fprintf(stderr, "%s: %s sqlite: failed to close thread connection\n", SERVER_NAME, ERROR_MSG);
+	free(conn);
+}
+
+//------------------------ DB CONN ---------------------------
+
+// db_conn() returns the calling thread's connection, opening it and preparing its statements on first use
+// Returns NULL if the connection could not be opened
+static db_conn_t *db_conn()
+{
+	// Connection of the calling thread, and indexer
+	db_conn_t *conn = (db_conn_t *)pthread_getspecific(db_key);
+	int i;
+
+	// Reuse the thread's connection once it exists
+	if(conn != NULL)
+		return conn;
+
+	// Allocate connection state
+	if((conn = (db_conn_t *)calloc(1, sizeof(db_conn_t))) == NULL)
+	{
+		fprintf(stderr, "%s: %s sqlite: could not allocate memory for thread connection\n", SERVER_NAME, ERROR_MSG);
+		return NULL;
+	}
+
+	// Open the database, without SQLite's own locking, since no other thread uses this connection
+	if(sqlite3_open_v2(db_path, &conn->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK || db_tune(conn->db) == -1)
+	{
+		fprintf(stderr, "%s: %s sqlite: could not open thread connection to database %s\n", SERVER_NAME, ERROR_MSG, db_path);
+		sqlite3_close(conn->db);
+		free(conn);
+		return NULL;
+	}
+
+	// Prepare every statement once, they are reset and reused by each command
+	for(i = 0; i < DB_STATEMENTS; i++)
+	{
+		if(sqlite3_prepare_v3(conn->db, db_sql[i], -1, SQLITE_PREPARE_PERSISTENT, &conn->stmt[i], NULL) != SQLITE_OK)
+		{
+			fprintf(stderr, "%s: %s sqlite: could not prepare statement '%s'\n", SERVER_NAME, ERROR_MSG, db_sql[i]);
+			db_conn_free(conn);
+			return NULL;
+		}
+	}
+
+	// Keep the connection for the thread's later commands, and close it when the thread exits
+	pthread_setspecific(db_key, conn);
+	return conn;
+}
+
+//------------------------ DB STATEMENT ----------------------
+
+// db_statement() returns one of the calling thread's prepared statements, ready to bind and step
+// Returns NULL if the thread has no connection
+static sqlite3_stmt *db_statement(int which)
+{
+	// Connection of the calling thread
+	db_conn_t *conn = db_conn();
+
+	return (conn != NULL) ? conn->stmt[which] : NULL;
+}
+
+//------------------------ DB DONE ---------------------------
+
+// db_done() resets a statement after use, releasing its bindings and any read transaction it held
+static void db_done(sqlite3_stmt *stmt)
+{
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+//------------------------ DB SELECT -------------------------
+
+// db_select() steps a bound query returning a text column and a size column, and optionally a second text column and a
+// peer count, collecting each result as a row
+static int db_select(sqlite3_stmt *stmt, dir_row_t **rows)
+{
+	// Check SQLite return status, and count rows
+	int status;
+	int count = 0;
+
+	// Start with no rows
+	*rows = NULL;
+
+	// Evaluate, and loop SQLite query results
+	while((status = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		// Collect the row, on failure stop
+		if(dir_rows_push(rows, &count, (char *)sqlite3_column_text(stmt, 0), (long)sqlite3_column_int64(stmt, 1)) == -1)
+		{
+			status = SQLITE_NOMEM;
+			break;
+		}
+
+		// Collect the second text column and peer count, if selected
+		if(sqlite3_column_count(stmt) > 2 && ((*rows)[count - 1].extra = strdup((char *)sqlite3_column_text(stmt, 2))) == NULL)
+		{
+			status = SQLITE_NOMEM;
+			break;
+		}
+		if(sqlite3_column_count(stmt) > 3)
+			(*rows)[count - 1].peers = sqlite3_column_int(stmt, 3);
+	}
+	db_done(stmt);
+
+	// On error, free whatever was collected
+	if(status != SQLITE_DONE)
+	{
+		dir_rows_free(*rows, count);
+		*rows = NULL;
+		return DIR_ERROR;
+	}
+
+	// Return number of rows
+	return count;
+}
+
+//------------------------ DB RUN ----------------------------
+
+// db_run() runs one queued mutation on the writer's connection, inside the open batch
+static int db_run(db_conn_t *conn, db_op_t *op)
+{
+	// Check SQLite return status
+	int status;
+
+	// Prepared statement for the mutation
+	sqlite3_stmt *stmt = conn->stmt[op->which];
+
+	// Bind the filename, hash, size, and peer address of an insert, the filename, hash, and peer address of a delete,
+	// or the peer address of a purge, first collecting the files it is about to remove
+	if(op->which == DB_PURGE)
+	{
+		sqlite3_bind_text(conn->stmt[DB_MANIFEST], 1, op->peeraddr, -1, SQLITE_STATIC);
+		op->purged_count = db_select(conn->stmt[DB_MANIFEST], &op->purged);
+		sqlite3_bind_text(stmt, 1, op->peeraddr, -1, SQLITE_STATIC);
+	}
+	else
+	{
+		sqlite3_bind_text(stmt, 1, op->filename, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, op->filehash, -1, SQLITE_STATIC);
+		if(op->which == DB_ADD)
+		{
+			sqlite3_bind_int64(stmt, 3, op->f_size);
+			sqlite3_bind_text(stmt, 4, op->peeraddr, -1, SQLITE_STATIC);
+		}
+		else
+			sqlite3_bind_text(stmt, 3, op->peeraddr, -1, SQLITE_STATIC);
+	}
+
+	// Evaluate, and reset SQLite statement
+	status = sqlite3_step(stmt);
+	db_done(stmt);
+
+	// Check if user is attempting to insert a duplicate file
+	if(op->which == DB_ADD && status == SQLITE_CONSTRAINT)
+		return DIR_EXISTS;
+
+	// Else, an internal error must have occurred
+	if(status != SQLITE_DONE)
+	{
+		if(op->which == DB_ADD)
+			fprintf(stderr, "%s: %s sqlite: ADD file insert failed\n", SERVER_NAME, ERROR_MSG);
+		else if(op->which == DB_DELETE)
+			fprintf(stderr, "%s: %s sqlite: DELETE file delete failed\n", SERVER_NAME, ERROR_MSG);
+		return DIR_ERROR;
+	}
+
+	// An inserted filename enters the filter at once, a delete only notes whether it removed a row
+	if(op->which == DB_ADD)
+		bloom_add(op->filename);
+	else if(op->which == DB_DELETE)
+		op->removed = sqlite3_changes(conn->db);
+
+	// Return success
+	return DIR_OK;
+}
+
+//------------------------ DB SETTLE -------------------------
+
+// db_settle() brings the filename filter and the cache up to date with a mutation once its batch is committed, or only
+// frees the files collected for a purge if it was rolled back
+static void db_settle(db_op_t *op, int committed)
+{
+	// Indexer
+	int i;
+
+	if(committed)
+	{
+		// Inserted files are already in the filter, but their cached peers are out of date
+		if(op->records != NULL)
+		{
+			for(i = 0; i < op->count; i++)
+			{
+				if(op->records[i].status == DIR_OK)
+					cache_invalidate(op->records[i].filename);
+			}
+		}
+		else if(op->which == DB_ADD && op->status == DIR_OK)
+			cache_invalidate(op->filename);
+		// A removed file leaves the filter and the cache
+		else if(op->which == DB_DELETE && op->removed > 0)
+		{
+			bloom_remove(op->filename);
+			cache_invalidate(op->filename);
+		}
+		else if(op->which == DB_PURGE)
+		{
+			// If the peer's files could not be collected, their counters stay raised, and the whole cache goes
+			if(op->purged_count == DIR_ERROR)
+				cache_flush();
+			for(i = 0; i < op->purged_count; i++)
+			{
+				bloom_remove(op->purged[i].key);
+				cache_invalidate(op->purged[i].key);
+			}
+		}
+	}
+
+	// Free the files collected for a purge
+	if(op->purged_count > 0)
+		dir_rows_free(op->purged, op->purged_count);
+}
+
+//------------------------ DB WRITER -------------------------
+
+// db_writer() is the writer thread, taking batches of queued mutations, running them in one transaction, and waking
+// the threads waiting on them once the batch is committed
+static void *db_writer(void *args)
+{
+	// Writer's connection, batch being run, mutation in it, a single insert of a bulk insert, whether the batch
+	// committed, and indexer
+	db_conn_t *conn = db_conn();
+	db_op_t *batch, *op, *next, record;
+	int committed, i;
+
+	// Number of mutations in the last batch, and the time to stop holding a batch open
+	int last = 0;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&writer_lock);
+	while(1)
+	{
+		// Wait for a mutation, exit once stopped and drained
+		while(queue_length == 0 && writer_running)
+			pthread_cond_wait(&writer_cond, &writer_lock);
+		if(queue_length == 0)
+			break;
+
+		// If the last batch was shared by several threads, hold this one open until as many mutations are queued, since
+		// those threads are likely to be back with their next one, or until it times out
+		if(last > 1 && queue_length < last)
+		{
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += DB_BATCH_USEC * 1000L;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+			deadline.tv_nsec %= 1000000000L;
+			while(queue_length < last && writer_running)
+			{
+				if(pthread_cond_timedwait(&writer_cond, &writer_lock, &deadline) == ETIMEDOUT)
+					break;
+			}
+		}
+
+		// Take up to a full batch off the queue
+		batch = queue_head;
+		for(op = batch, last = 1; last < DB_BATCH_OPS && op->next != NULL; op = op->next)
+			last++;
+		queue_head = op->next;
+		if(queue_head == NULL)
+			queue_tail = NULL;
+		op->next = NULL;
+		queue_length -= last;
+		pthread_mutex_unlock(&writer_lock);
+
+		// Run the batch in one transaction, each mutation, and each file of a bulk insert, keeping its own result
+		committed = 0;
+		if(conn != NULL && sqlite3_step(conn->stmt[DB_BEGIN]) == SQLITE_DONE)
+		{
+			db_done(conn->stmt[DB_BEGIN]);
+			for(op = batch; op != NULL; op = op->next)
+			{
+				if(op->records == NULL)
+					op->status = db_run(conn, op);
+				else
+				{
+					op->status = DIR_OK;
+					for(i = 0; i < op->count; i++)
+					{
+						record = (db_op_t){ DB_ADD, op->records[i].filename, op->records[i].filehash, op->peeraddr, op->records[i].size, NULL, 0, 0, NULL, 0, DIR_ERROR, 0, 0, NULL, NULL };
+						if((op->records[i].status = db_run(conn, &record)) == DIR_ERROR)
+							op->status = DIR_ERROR;
+					}
+				}
+			}
+
+			// Commit the batch once, on failure roll it back and fail every mutation in it
+			committed = (sqlite3_step(conn->stmt[DB_COMMIT]) == SQLITE_DONE);
+			db_done(conn->stmt[DB_COMMIT]);
+			if(!committed)
+			{
+				sqlite3_step(conn->stmt[DB_ROLLBACK]);
+				db_done(conn->stmt[DB_ROLLBACK]);
+			}
+		}
+		else if(conn != NULL)
+			db_done(conn->stmt[DB_BEGIN]);
+		if(!committed)
+			fprintf(stderr, "%s: %s sqlite: could not commit a batch of %d changes\n", SERVER_NAME, ERROR_MSG, last);
+
+		// Update the filename filter and the cache, then follow up on each detached mutation which was committed, such as
+		// invalidating the cached listing after a purge
+		for(op = batch; op != NULL; op = op->next)
+		{
+			db_settle(op, committed);
+			if(committed && op->detached && op->after != NULL)
+				op->after();
+		}
+
+		// Hand each result back, and wake the waiting threads, detached mutations are freed instead
+		pthread_mutex_lock(&writer_lock);
+		for(op = batch; op != NULL; op = next)
+		{
+			next = op->next;
+			if(!committed)
+				op->status = DIR_ERROR;
+			if(op->detached)
+			{
+				free(op->peeraddr);
+				free(op);
+			}
+			else
+				op->done = 1;
+		}
+		pthread_cond_broadcast(&commit_cond);
+	}
+	pthread_mutex_unlock(&writer_lock);
+
+	// Return from the writer thread
+	return NULL;
+}
+
+//------------------------ DB QUEUE --------------------------
+
+// db_queue() appends a mutation to the writer's queue, and wakes the writer.  The caller must hold writer_lock.
+// Returns 0 on success, or -1 if the writer has stopped or could not be started
+static int db_queue(db_op_t *op)
+{
+	// Once stopped, the writer takes no more mutations
+	if(!writer_running)
+		return -1;
+
+	// Start the writer with the first mutation rather than in db_init(), since daemonizing forks the server after the
+	// directory is opened, and a thread started before the fork would not exist in the daemon
+	if(!writer_started)
+	{
+		if(pthread_create(&writer, NULL, db_writer, NULL) != 0)
+		{
+			fprintf(stderr, "%s: %s sqlite: could not start writer thread\n", SERVER_NAME, ERROR_MSG);
+			return -1;
+		}
+		writer_started = 1;
+	}
+
+	// Append the mutation, and wake the writer
+	if(queue_tail == NULL)
+		queue_head = op;
+	else
+		queue_tail->next = op;
+	queue_tail = op;
+	queue_length++;
+	pthread_cond_signal(&writer_cond);
+
+	// Return success
+	return 0;
+}
+
+//------------------------ DB SUBMIT -------------------------
+
+// db_submit() queues a mutation, or a bulk insert of count records, for the writer thread, and waits until its batch is
+// committed
+// Returns the mutation's result
+static int db_submit(int which, char *filename, char *filehash, long f_size, char *peeraddr, dir_record_t *records, int count)
+{
+	// Mutation, which lives on this thread's stack until the writer is done with it
+	db_op_t op = { which, filename, filehash, peeraddr, f_size, records, count, 0, NULL, 0, DIR_ERROR, 0, 0, NULL, NULL };
+
+	// Queue the mutation
+	pthread_mutex_lock(&writer_lock);
+	if(db_queue(&op) == -1)
+	{
+		pthread_mutex_unlock(&writer_lock);
+		return DIR_ERROR;
+	}
+
+	// Wait for its batch to be committed
+	while(!op.done)
+		pthread_cond_wait(&commit_cond, &writer_lock);
+	pthread_mutex_unlock(&writer_lock);
+
+	// Return result
+	return op.status;
+}
+
+//------------------------ DB INIT ---------------------------
+
+// db_init() opens the database file, switches it to WAL mode, and truncates the files table, since no peer is
+// connected yet
+int db_init()
+{
+	// Create a key for each thread's connection, closed as the thread exits
+	if(pthread_key_create(&db_key, db_conn_free) != 0)
+	{
+		fprintf(stderr, "%s: %s sqlite: could not create thread connection key\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+
+	// Open database file, as specified in config header; check for success
+	if(sqlite3_open(DB_FILE, &db) != SQLITE_OK || db_tune(db) == -1)
+	{
+		// Print an error message if database fails to open
+		fprintf(stderr, "%s: %s sqlite: could not open database %s\n", SERVER_NAME, ERROR_MSG, DB_FILE);
+		return -1;
+	}
+
+	// Keep the full path of the database file, which SQLite resolved against the current working directory
+	if((db_path = strdup(sqlite3_db_filename(db, "main"))) == NULL)
+	{
+		fprintf(stderr, "%s: %s sqlite: could not allocate memory for database path\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+
+	// Switch to WAL mode, so readers work from a snapshot while a writer appends to the log
+	if(sqlite3_exec(db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		// On query failure, print an error
+		fprintf(stderr, "%s: %s sqlite: could not switch database to WAL mode\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+
+	// Truncate the files table in the database
+	if(sqlite3_exec(db, "DELETE FROM files", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		// On query failure, print an error
+		fprintf(stderr, "%s: %s sqlite: could not truncate files table\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+
+	// Index the files table by hash, for REQUESTHASH and collapsed listings
+	if(sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS files_hash ON files(hash)", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		// On query failure, print an error
+		fprintf(stderr, "%s: %s sqlite: could not index files table by hash\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+
+	// Index the files table by peer, so purging a peer visits only its own rows rather than scanning the table
+	if(sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS files_peer ON files(peer)", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		// On query failure, print an error
+		fprintf(stderr, "%s: %s sqlite: could not index files table by peer\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+
+	// Allocate the filename filter and the cache, both empty like the table
+	if(bloom_init() == -1)
+		return -1;
+	cache_init();
+
+	// Accept mutations, the writer thread which commits them is started along with the first one
+	writer_running = 1;
+
+	// Return success
+	return 0;
+}
+
+//------------------------ DB CLOSE --------------------------
+
+// db_close() stops the writer thread once it has committed everything queued, then closes the database file, and the
+// calling thread's own connection if it has one
+void db_close()
+{
+	// Connection of the calling thread, if it ever touched the directory
+	db_conn_t *conn = (db_conn_t *)pthread_getspecific(db_key);
+
+	// Stop taking mutations, and wait for the writer to drain the queue
+	pthread_mutex_lock(&writer_lock);
+	writer_running = 0;
+	pthread_cond_signal(&writer_cond);
+	pthread_mutex_unlock(&writer_lock);
+	if(writer_started)
+		pthread_join(writer, NULL);
+	if(conn != NULL)
+	{
+		pthread_setspecific(db_key, NULL);
+		db_conn_free(conn);
+	}
+
+	// Close SQLite database
+	if(sqlite3_close(db) != SQLITE_OK)
+	{
+		// On failure, print error to console
+		fprintf(stderr, "%s: %s sqlite: failed to close database\n", SERVER_NAME, ERROR_MSG);
+	}
+}
+
+//------------------------ DB ADD ----------------------------
+
+// db_add() inserts a file into the files table, returning DIR_EXISTS if the primary key is already present
+int db_add(char *filename, char *filehash, long f_size, char *peeraddr)
+{
+	return db_submit(DB_ADD, filename, filehash, f_size, peeraddr, NULL, 0);
+}
+
+//------------------------ DB ADD BATCH ----------------------
+
+// db_add_batch() inserts count files shared by a peer in one transaction, setting each record's result
+// Returns DIR_OK, or DIR_ERROR if the transaction or any insert failed, in which case every record is marked failed
+int db_add_batch(dir_record_t *records, int count, char *peeraddr)
+{
+	// Indexer
+	int i;
+
+	// Insert every file as part of one mutation, so they are committed together
+	if(db_submit(DB_ADD, NULL, NULL, 0, peeraddr, records, count) == DIR_OK)
+		return DIR_OK;
+
+	// On failure, the peer is disconnected and purged, so treat the whole batch as failed
+	for(i = 0; i < count; i++)
+		records[i].status = DIR_ERROR;
+	return DIR_ERROR;
+}
+
+//------------------------ DB DELETE -------------------------
+
+// db_delete() removes a file with the specified filename, hash, and peer address from the files table
+int db_delete(char *filename, char *filehash, char *peeraddr)
+{
+	return db_submit(DB_DELETE, filename, filehash, 0, peeraddr, NULL, 0);
+}
+
+//------------------------ DB PURGE --------------------------
+
+// db_purge() queues the removal of all files belonging to a peer from the files table, without waiting for it to be
+// committed.  Since the writer runs mutations in order, anything the peer's address adds later is not purged.  Once
+// committed, the writer calls after, if set.
+// Returns DIR_OK once queued, or DIR_ERROR if the writer has stopped
+int db_purge(char *peeraddr, void (*after)(void))
+{
+	// Mutation, owned by the writer once queued
+	db_op_t *op = (db_op_t *)calloc(1, sizeof(db_op_t));
+
+	// Fill the mutation with its own copy of the address, as the peer's connection state is freed right away
+	if(op == NULL || (op->peeraddr = strdup(peeraddr)) == NULL)
+	{
+		free(op);
+		return DIR_ERROR;
+	}
+	op->which = DB_PURGE;
+	op->status = DIR_ERROR;
+	op->detached = 1;
+	op->after = after;
+
+	// Queue the mutation
+	pthread_mutex_lock(&writer_lock);
+	if(db_queue(op) == -1)
+	{
+		pthread_mutex_unlock(&writer_lock);
+		free(op->peeraddr);
+		free(op);
+		return DIR_ERROR;
+	}
+	pthread_mutex_unlock(&writer_lock);
+
+	// Return success
+	return DIR_OK;
+}
+
+//------------------------ DB LIST ---------------------------
+
+// db_list() selects each distinct filename and size in the files table, ordered by filename
+int db_list(dir_row_t **rows)
+{
+	// Number of rows
+	int count = DIR_ERROR;
+
+	// Query for a list of all files in the database
+	sqlite3_stmt *stmt;
+	if((stmt = db_statement(DB_LIST)) != NULL)
+		count = db_select(stmt, rows);
+
+	// On error, print message to console
+	if(count == DIR_ERROR)
+		fprintf(stderr, "%s: %s sqlite: failed to retrieve listing of files tracked by server\n", SERVER_NAME, ERROR_MSG);
+
+	// Return number of rows
+	return count;
+}
+
+//------------------------ DB REQUEST ------------------------
+
+// db_request() selects each peer sharing a file, and its size, ordered by peer.  A file nobody shares is ruled out by
+// the filename filter, and a recently requested one is answered from the cache, without a query.
+int db_request(char *filename, dir_row_t **rows)
+{
+	// Number of rows, and the cache's count of invalidations as of a miss
+	int count = DIR_ERROR;
+	unsigned long epoch;
+
+	// Prepared statement
+	sqlite3_stmt *stmt;
+
+	// Start with no rows, and return none if the filter rules the file out
+	*rows = NULL;
+	if(!bloom_check(filename))
+		return 0;
+
+	// Return the cached peers, if the file was requested recently
+	if((count = cache_get(filename, rows, &epoch)) != -1)
+		return count;
+
+	// Query for peers which possess this file in the files table, and cache them
+	if((stmt = db_statement(DB_REQUEST)) != NULL)
+	{
+		sqlite3_bind_text(stmt, 1, filename, -1, SQLITE_STATIC);
+		if((count = db_select(stmt, rows)) != DIR_ERROR)
+			cache_put(filename, *rows, count, epoch);
+	}
+
+	// On error, print message to console
+	if(count == DIR_ERROR)
+		fprintf(stderr, "%s: %s sqlite: failed to retrieve listing of peers for file '%s'\n", SERVER_NAME, ERROR_MSG, filename);
+
+	// Return number of rows
+	return count;
+}
+
+//------------------------ DB REQUEST HASH -------------------
+
+// db_request_hash() selects each peer sharing a file's content, its size, and the filename it is shared under,
+// ordered by peer
+int db_request_hash(char *filehash, dir_row_t **rows)
+{
+	// Number of rows
+	int count = DIR_ERROR;
+
+	// Query for peers which possess this content in the files table, under any filename
+	sqlite3_stmt *stmt;
+	if((stmt = db_statement(DB_REQUEST_HASH)) != NULL)
+	{
+		sqlite3_bind_text(stmt, 1, filehash, -1, SQLITE_STATIC);
+		count = db_select(stmt, rows);
+	}
+
+	// On error, print message to console
+	if(count == DIR_ERROR)
+		fprintf(stderr, "%s: %s sqlite: failed to retrieve listing of peers for hash '%s'\n", SERVER_NAME, ERROR_MSG, filehash);
+
+	// Return number of rows
+	return count;
+}
+
+//------------------------ DB UNIQUE -------------------------
+
+// db_unique() selects each distinct hash in the files table, under its first filename and that file's size, with the
+// number of peers sharing it, ordered by filename
+int db_unique(dir_row_t **rows)
+{
+	// Number of rows
+	int count = DIR_ERROR;
+
+	// Query for one row per hash
+	sqlite3_stmt *stmt;
+	if((stmt = db_statement(DB_UNIQUE)) != NULL)
+		count = db_select(stmt, rows);
+
+	// On error, print message to console
+	if(count == DIR_ERROR)
+		fprintf(stderr, "%s: %s sqlite: failed to retrieve listing of distinct files tracked by server\n", SERVER_NAME, ERROR_MSG);
+
+	// Return number of rows
+	return count;
+}
+
+//------------------------ DB MANIFEST -----------------------
+
+// db_manifest() selects each file shared by a peer, its size, and its hash, in no particular order
+int db_manifest(char *peeraddr, dir_row_t **rows)
+{
+	// Number of rows
+	int count = DIR_ERROR;
+
+	// Query for the peer's files, through the index by peer
+	sqlite3_stmt *stmt;
+	if((stmt = db_statement(DB_MANIFEST)) != NULL)
+	{
+		sqlite3_bind_text(stmt, 1, peeraddr, -1, SQLITE_STATIC);
+		count = db_select(stmt, rows);
+	}
+
+	// On error, print message to console
+	if(count == DIR_ERROR)
+		fprintf(stderr, "%s: %s sqlite: failed to retrieve files shared by peer %s\n", SERVER_NAME, ERROR_MSG, peeraddr);
+
+	// Return number of rows
+	return count;
+}
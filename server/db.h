@@ -0,0 +1,44 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:	 10/16/26
+	Project: p2pd
+	Module:	 db.h
+
+	Description:
+	A header containing prototypes used in db.c
+*/
+
+//------------------------ PROTOTYPES ------------------------
+
+// Prototype for db_init(), which opens the database and truncates the files table
+int db_init();
+
+// Prototype for db_close(), which closes the database
+void db_close();
+
+// Prototype for db_add(), which inserts a file into the files table
+int db_add(char *, char *, long, char *);
+
+// Prototype for db_add_batch(), which inserts many files into the files table in one transaction
+int db_add_batch(dir_record_t *, int, char *);
+
+// Prototype for db_delete(), which removes a file from the files table
+int db_delete(char *, char *, char *);
+
+// Prototype for db_purge(), which queues the removal of every file belonging to a peer from the files table
+int db_purge(char *, void (*)(void));
+
+// Prototype for db_list(), which selects each distinct filename and size
+int db_list(dir_row_t **);
+
+// Prototype for db_request(), which selects each peer sharing a file
+int db_request(char *, dir_row_t **);
+
+// Prototype for db_request_hash(), which selects each peer sharing a file's content
+int db_request_hash(char *, dir_row_t **);
+
+// Prototype for db_unique(), which selects each distinct file content
+int db_unique(dir_row_t **);
+
+// Prototype for db_manifest(), which selects each file shared by a peer
+int db_manifest(char *, dir_row_t **);
@@ -0,0 +1,1738 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:    10/16/26
+	Project: p2pd
+	Module:  dir.c
+
+	Description:
+	The directory of files shared by connected peers.  By default, the directory is an in-memory index built for
+	the protocol's access patterns, rather than a table which every worker queries through one SQLite handle:
+		1) each (file, hash, peer) entry is linked into three hash tables at once, indexing it by filename,
+		   by hash, and by the peer which shares it
+		2) each table is guarded by striped read-write locks, so writers on different files never contend,
+		   and LIST and REQUEST only ever take read locks
+		3) locks are always taken peer, then file, then hash, so an ADD or DELETE can never deadlock against
+		   a disconnecting peer purging its files
+	The SQLite backend in db.c may be selected instead with '-b sqlite', and each command is simply passed to it.
+
+	Either way, every change to the listing bumps its generation, and LIST is served from a serialized snapshot
+	of the whole listing, reference counted and shared by every client.  The snapshot is rebuilt lazily, by the
+	first LIST after a change, so a burst of ADDs costs one rebuild rather than one per ADD, and a reconnect wave
+	of LISTs costs one sort rather than one per client.
+
+	The in-memory index also records each change to the listing in a bounded journal, a file and size appearing
+	or disappearing, so LISTSINCE can send a client only what changed since the generation it last saw.  The
+	SQLite backend keeps no journal, so each of its changes trims the history, and LISTSINCE falls back to LIST.
+
+	Each filename also keeps the entries sharing it in an array, so 'REQUEST <file> <max>' can draw a uniformly random
+	sample of its peers in time proportional to the sample, however many peers share a popular file.
+
+	Alongside either backend, the load each peer last reported with ANNOUNCE is kept in a small table of its own, so
+	REQUEST replies can favour lightly loaded peers.  Loads are forgotten as their peer is purged, or once stale.
+*/
+
+//------------------------ C LIBRARIES -----------------------
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "config.h"
+#include "dir.h"
+#include "db.h"
+#include "search.h"
+
+//------------------------ INDEXES ---------------------------
+
+// Indexes which every entry is linked into, in the order their locks must be taken
+#define DIR_PEER 0
+#define DIR_FILE 1
+#define DIR_HASH 2
+#define DIR_INDEXES 3
+
+//------------------------ STRUCTS ---------------------------
+
+// A single (file, hash, peer) entry, the equivalent of a row in the files table
+typedef struct dir_entry
+{
+	// File size
+	long size;
+
+	// Position of the entry in its filename's array of shares
+	int share;
+
+	// Node in each index which the entry belongs to, the node names hold the peer, filename, and hash
+	struct dir_node *node[DIR_INDEXES];
+
+	// Neighboring entries within each node
+	struct
+	{
+		struct dir_entry *next, *prev;
+	} link[DIR_INDEXES];
+} dir_entry_t;
+
+// A key in one of the indexes, and the list of entries sharing it
+typedef struct dir_node
+{
+	// Next node in the same hash bucket
+	struct dir_node *next;
+
+	// Entries with this key
+	dir_entry_t *entries;
+
+	// For a filename, the same entries in an array, so peers can be sampled by position, its length, and its capacity
+	dir_entry_t **shares;
+	int count, room;
+
+	// Peer address, filename, or hash
+	char name[];
+} dir_node_t;
+
+// The load a peer last reported with ANNOUNCE
+typedef struct dir_load
+{
+	// Next load in the same bucket
+	struct dir_load *next;
+
+	// Number of uploads in progress, their combined rate in kilobits per second, and when they were reported
+	int uploads, kbps;
+	time_t announced;
+
+	// Peer address
+	char peer[];
+} dir_load_t;
+
+// A hash table of nodes, with one lock covering every DIR_STRIPES'th bucket
+typedef struct dir_table
+{
+	// Buckets of nodes
+	dir_node_t **buckets;
+
+	// Striped locks
+	pthread_rwlock_t locks[DIR_STRIPES];
+} dir_table_t;
+
+//------------------------ GLOBAL VARIABLES ------------------
+
+// Backend selected at startup
+static int backend = DIR_MEMORY;
+
+// Index of entries by peer, by filename, and by hash
+static dir_table_t tables[DIR_INDEXES];
+
+// Directory generation, bumped by every change to the listing
+static unsigned long version = 0;
+
+// Journal of recent changes to the listing, indexed by generation, the oldest generation it can answer from,
+// and lock protecting both, always taken after any index lock
+static dir_row_t journal[DIR_JOURNAL];
+static unsigned long journal_floor = 0;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Table of loads reported by peers, and lock protecting it, since loads are reported rarely but read by every REQUEST
+static dir_load_t *loads[DIR_LOAD_BUCKETS];
+static pthread_rwlock_t load_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Each thread's state for sampling peers at random, seeded on first use
+static __thread unsigned int sample_seed = 0;
+
+// Cached LIST snapshot, lock protecting the pointer, and lock held while rebuilding it, so rebuilds are not repeated
+static dir_snapshot_t *snapshot = NULL;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t rebuild_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//------------------------ DIR HASH --------------------------
+
+// dir_hash() hashes a key using 32-bit FNV-1a
+static unsigned int dir_hash(char *key)
+{
+	// Offset basis
+	unsigned int hash = 2166136261u;
+
+	// Fold in each byte
+	while(*key != '\0')
+	{
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619u;
+	}
+
+	// Return hash
+	return hash;
+}
+
+//------------------------ DIR LOCK --------------------------
+
+// dir_lock() returns the lock striped over the bucket holding a key
+static pthread_rwlock_t *dir_lock(int index, char *key)
+{
+	return &tables[index].locks[dir_hash(key) & (DIR_STRIPES - 1)];
+}
+
+//------------------------ DIR FIND --------------------------
+
+// dir_find() looks up the node for a key, creating it if requested.  The caller must hold the key's lock.
+static dir_node_t *dir_find(int index, char *key, int create)
+{
+	// Bucket holding the key, and node being examined
+	dir_node_t **bucket = &tables[index].buckets[dir_hash(key) & (DIR_BUCKETS - 1)];
+	dir_node_t *node;
+
+	// Search the bucket
+	for(node = *bucket; node != NULL; node = node->next)
+	{
+		if(strcmp(node->name, key) == 0)
+			return node;
+	}
+
+	// Not found, create it if requested
+	if(create && (node = (dir_node_t *)malloc(sizeof(dir_node_t) + strlen(key) + 1)) != NULL)
+	{
+		strcpy(node->name, key);
+		node->entries = NULL;
+		node->shares = NULL;
+		node->count = node->room = 0;
+		node->next = *bucket;
+		*bucket = node;
+
+		// A new filename is indexed for SEARCH
+		if(index == DIR_FILE)
+			search_add(node->name);
+	}
+
+	// Return node, or NULL
+	return node;
+}
+
+//------------------------ DIR PRUNE -------------------------
+
+// dir_prune() frees a node once its last entry is gone.  The caller must hold the node's lock.
+static void dir_prune(int index, dir_node_t *node)
+{
+	// Link pointing at the node being examined
+	dir_node_t **link;
+
+	// Node still has entries
+	if(node == NULL || node->entries != NULL)
+		return;
+
+	// Find the node in its bucket, unlink it, and free it
+	for(link = &tables[index].buckets[dir_hash(node->name) & (DIR_BUCKETS - 1)]; *link != NULL; link = &(*link)->next)
+	{
+		if(*link == node)
+		{
+			// A filename no longer shared by any peer is dropped from the SEARCH index
+			if(index == DIR_FILE)
+				search_remove(node->name);
+
+			*link = node->next;
+			free(node->shares);
+			free(node);
+			return;
+		}
+	}
+}
+
+//------------------------ DIR RESERVE -----------------------
+
+// dir_reserve() makes room in a filename's array of shares for one more entry, so linking the entry cannot fail.  The
+// caller must hold the filename's lock.
+// Returns 0 on success, or -1 if the array could not be grown
+static int dir_reserve(dir_node_t *node)
+{
+	// Grown array, and its capacity
+	dir_entry_t **shares;
+	int room;
+
+	// Double the array once it is full
+	if(node->count == node->room)
+	{
+		room = (node->room > 0) ? node->room * 2 : 4;
+		if((shares = (dir_entry_t **)realloc(node->shares, sizeof(dir_entry_t *) * room)) == NULL)
+			return -1;
+		node->shares = shares;
+		node->room = room;
+	}
+
+	// Return success
+	return 0;
+}
+
+//------------------------ DIR LINK --------------------------
+
+// dir_link() adds an entry to a node's list, and to the end of a filename's array of shares, which must have room for
+// it.  The caller must hold the node's lock.
+static void dir_link(dir_entry_t *entry, int index, dir_node_t *node)
+{
+	entry->node[index] = node;
+	entry->link[index].prev = NULL;
+	entry->link[index].next = node->entries;
+	if(node->entries != NULL)
+		node->entries->link[index].prev = entry;
+	node->entries = entry;
+
+	// Append the entry to the filename's shares
+	if(index == DIR_FILE)
+	{
+		entry->share = node->count;
+		node->shares[node->count++] = entry;
+	}
+}
+
+//------------------------ DIR UNLINK ------------------------
+
+// dir_unlink() removes an entry from a node's list, freeing the node if it is now empty.  The caller must hold
+// the node's lock.
+static void dir_unlink(dir_entry_t *entry, int index)
+{
+	// Node holding the entry
+	dir_node_t *node = entry->node[index];
+
+	// Unlink from neighbors
+	if(entry->link[index].prev != NULL)
+		entry->link[index].prev->link[index].next = entry->link[index].next;
+	else
+		node->entries = entry->link[index].next;
+	if(entry->link[index].next != NULL)
+		entry->link[index].next->link[index].prev = entry->link[index].prev;
+
+	// Remove the entry from the filename's shares, moving the last share into its place
+	if(index == DIR_FILE)
+	{
+		node->shares[entry->share] = node->shares[--node->count];
+		node->shares[entry->share]->share = entry->share;
+	}
+
+	// Free the node once nothing shares its key
+	dir_prune(index, node);
+}
+
+//------------------------ DIR TOUCH -------------------------
+
+// dir_touch() bumps the generation after a change made through the SQLite backend, invalidating the cached LIST
+// snapshot.  Without a journal entry to go with it, history before the change can no longer be replayed.
+static void dir_touch()
+{
+	pthread_mutex_lock(&journal_lock);
+	journal_floor = __sync_add_and_fetch(&version, 1);
+	pthread_mutex_unlock(&journal_lock);
+}
+
+//------------------------ DIR JOURNAL -----------------------
+
+// dir_journal() bumps the generation, recording a file and size appearing in or disappearing from the listing.
+// The caller must hold the file's lock, so changes to one file are journaled in the order they were made.
+static void dir_journal(int op, char *filename, long f_size)
+{
+	// Journal slot for the new generation
+	dir_row_t *change;
+
+	// Overwrite the oldest change with the new one
+	pthread_mutex_lock(&journal_lock);
+	change = &journal[(version + 1) % DIR_JOURNAL];
+	free(change->key);
+	change->key = strdup(filename);
+	change->size = f_size;
+	change->op = op;
+
+	// Bump the generation, if the change could not be recorded, history before it cannot be replayed
+	if(change->key == NULL)
+		journal_floor = version + 1;
+	__sync_add_and_fetch(&version, 1);
+	pthread_mutex_unlock(&journal_lock);
+}
+
+//------------------------ DIR SIZED -------------------------
+
+// dir_sized() reports whether a file has an entry of the given size, other than skip, in which case the file and
+// size are in the listing regardless of skip.  The caller must hold the file's lock.
+static int dir_sized(dir_node_t *node, long f_size, dir_entry_t *skip)
+{
+	// Entry being examined
+	dir_entry_t *entry;
+
+	// Search the file's entries
+	for(entry = node->entries; entry != NULL; entry = entry->link[DIR_FILE].next)
+	{
+		if(entry != skip && entry->size == f_size)
+			return 1;
+	}
+
+	// Not found
+	return 0;
+}
+
+//------------------------ DIR INIT --------------------------
+
+// dir_init() prepares the selected backend, allocating the in-memory index, or opening the SQLite database
+int dir_init(int selected)
+{
+	// Indexers
+	int i, j;
+
+	// Remember the backend
+	backend = selected;
+
+	// The SQLite backend opens its database
+	if(backend == DIR_SQLITE)
+		return db_init();
+
+	// Else, allocate each table's buckets, and initialize its locks
+	for(i = 0; i < DIR_INDEXES; i++)
+	{
+		if((tables[i].buckets = (dir_node_t **)calloc(DIR_BUCKETS, sizeof(dir_node_t *))) == NULL)
+		{
+			fprintf(stderr, "%s: %s could not allocate directory index\n", SERVER_NAME, ERROR_MSG);
+			return -1;
+		}
+		for(j = 0; j < DIR_STRIPES; j++)
+			pthread_rwlock_init(&tables[i].locks[j], NULL);
+	}
+
+	// Allocate the SEARCH index over filenames
+	return search_init();
+}
+
+//------------------------ DIR CLOSE -------------------------
+
+// dir_close() shuts down the backend.  The in-memory index is simply discarded with the process.
+void dir_close()
+{
+	if(backend == DIR_SQLITE)
+		db_close();
+}
+
+//------------------------ DIR ADD ---------------------------
+
+// dir_add() tracks a file shared by a peer, returning DIR_EXISTS if the peer already shares the same file and hash
+int dir_add(char *filename, char *filehash, long f_size, char *peeraddr)
+{
+	// Locks covering the peer, filename, and hash, in the order they must be taken
+	pthread_rwlock_t *locks[DIR_INDEXES] = { dir_lock(DIR_PEER, peeraddr), dir_lock(DIR_FILE, filename), dir_lock(DIR_HASH, filehash) };
+
+	// Keys for each index
+	char *keys[DIR_INDEXES] = { peeraddr, filename, filehash };
+
+	// Node for each key, new entry, and entry being examined
+	dir_node_t *nodes[DIR_INDEXES];
+	dir_entry_t *entry;
+
+	// Result, whether the file and size are new to the listing, and indexer
+	int status = DIR_OK;
+	int listed = 0;
+	int i;
+
+	// The SQLite backend inserts a row
+	if(backend == DIR_SQLITE)
+	{
+		if((status = db_add(filename, filehash, f_size, peeraddr)) == DIR_OK)
+			dir_touch();
+		return status;
+	}
+
+	// Take each lock, in order
+	for(i = 0; i < DIR_INDEXES; i++)
+		pthread_rwlock_wrlock(locks[i]);
+
+	// Check for an existing entry with the same primary key
+	if((nodes[DIR_FILE] = dir_find(DIR_FILE, filename, 0)) != NULL)
+	{
+		for(entry = nodes[DIR_FILE]->entries; entry != NULL; entry = entry->link[DIR_FILE].next)
+		{
+			if(strcmp(entry->node[DIR_HASH]->name, filehash) == 0 && strcmp(entry->node[DIR_PEER]->name, peeraddr) == 0)
+			{
+				status = DIR_EXISTS;
+				break;
+			}
+		}
+	}
+
+	// Create the entry, and link it into every index
+	if(status == DIR_OK)
+	{
+		listed = (nodes[DIR_FILE] == NULL || !dir_sized(nodes[DIR_FILE], f_size, NULL));
+		for(i = 0; i < DIR_INDEXES; i++)
+			nodes[i] = dir_find(i, keys[i], 1);
+
+		if(nodes[DIR_PEER] != NULL && nodes[DIR_FILE] != NULL && nodes[DIR_HASH] != NULL && dir_reserve(nodes[DIR_FILE]) == 0 && (entry = (dir_entry_t *)malloc(sizeof(dir_entry_t))) != NULL)
+		{
+			entry->size = f_size;
+			for(i = 0; i < DIR_INDEXES; i++)
+				dir_link(entry, i, nodes[i]);
+
+			// If no other peer shares the file at this size, it is new to the listing
+			if(listed)
+				dir_journal('+', filename, f_size);
+		}
+		else
+		{
+			// On failure, print an error, and free any node created for the entry
+			fprintf(stderr, "%s: %s could not allocate directory entry\n", SERVER_NAME, ERROR_MSG);
+			for(i = 0; i < DIR_INDEXES; i++)
+				dir_prune(i, nodes[i]);
+			status = DIR_ERROR;
+		}
+	}
+
+	// Release each lock, in reverse order
+	for(i = DIR_INDEXES - 1; i >= 0; i--)
+		pthread_rwlock_unlock(locks[i]);
+
+	// Return result
+	return status;
+}
+
+//------------------------ DIR ADD BATCH ---------------------
+
+// dir_add_batch() tracks count files shared by a peer, as sent with ADDBATCH, setting each record's status as dir_add()
+// would return it.  The SQLite backend inserts every file in one transaction.
+// Returns DIR_OK, or DIR_ERROR if the backend failed, in which case the peer's files must be purged
+int dir_add_batch(dir_record_t *records, int count, char *peeraddr)
+{
+	// Number of files added, result, and indexer
+	int added = 0;
+	int status = DIR_OK;
+	int i;
+
+	// The SQLite backend inserts every row at once
+	if(backend == DIR_SQLITE)
+	{
+		status = db_add_batch(records, count, peeraddr);
+		for(i = 0; i < count; i++)
+			added += (records[i].status == DIR_OK);
+		if(added > 0)
+			dir_touch();
+		return status;
+	}
+
+	// Else, add each file to the index in turn
+	for(i = 0; i < count; i++)
+	{
+		if((records[i].status = dir_add(records[i].filename, records[i].filehash, records[i].size, peeraddr)) == DIR_ERROR)
+			status = DIR_ERROR;
+	}
+
+	// Return result
+	return status;
+}
+
+//------------------------ DIR DELETE ------------------------
+
+// dir_delete() stops tracking a file shared by a peer.  As with the SQL DELETE, removing an entry which does not
+// exist is not an error.
+int dir_delete(char *filename, char *filehash, char *peeraddr)
+{
+	// Locks covering the peer, filename, and hash, in the order they must be taken
+	pthread_rwlock_t *locks[DIR_INDEXES] = { dir_lock(DIR_PEER, peeraddr), dir_lock(DIR_FILE, filename), dir_lock(DIR_HASH, filehash) };
+
+	// Node for the filename, and entry being examined
+	dir_node_t *node;
+	dir_entry_t *entry = NULL;
+
+	// Indexer
+	int i;
+
+	// The SQLite backend deletes a row
+	if(backend == DIR_SQLITE)
+	{
+		if(db_delete(filename, filehash, peeraddr) != DIR_OK)
+			return DIR_ERROR;
+		dir_touch();
+		return DIR_OK;
+	}
+
+	// Take each lock, in order
+	for(i = 0; i < DIR_INDEXES; i++)
+		pthread_rwlock_wrlock(locks[i]);
+
+	// Find the entry with this primary key
+	if((node = dir_find(DIR_FILE, filename, 0)) != NULL)
+	{
+		for(entry = node->entries; entry != NULL; entry = entry->link[DIR_FILE].next)
+		{
+			if(strcmp(entry->node[DIR_HASH]->name, filehash) == 0 && strcmp(entry->node[DIR_PEER]->name, peeraddr) == 0)
+				break;
+		}
+	}
+
+	// Unlink it from every index, and free it
+	if(entry != NULL)
+	{
+		// If no other peer shares the file at this size, it leaves the listing
+		if(!dir_sized(node, entry->size, entry))
+			dir_journal('-', filename, entry->size);
+
+		for(i = 0; i < DIR_INDEXES; i++)
+			dir_unlink(entry, i);
+		free(entry);
+	}
+
+	// Release each lock, in reverse order
+	for(i = DIR_INDEXES - 1; i >= 0; i--)
+		pthread_rwlock_unlock(locks[i]);
+
+	// Return success
+	return DIR_OK;
+}
+
+//------------------------ DIR LOAD --------------------------
+
+// dir_load() returns the link in the table of loads pointing to a peer's load, which points to NULL if it has none.
+// The caller must hold load_lock.
+static dir_load_t **dir_load(char *peeraddr)
+{
+	// Link being examined
+	dir_load_t **link;
+
+	// Walk the bucket for a matching peer
+	for(link = &loads[dir_hash(peeraddr) & (DIR_LOAD_BUCKETS - 1)]; *link != NULL; link = &(*link)->next)
+	{
+		if(strcmp((*link)->peer, peeraddr) == 0)
+			break;
+	}
+
+	// Return link
+	return link;
+}
+
+// dir_announce() records the load a peer reported, the number of uploads it has in progress, and their combined rate
+// Returns DIR_OK, or DIR_ERROR if the load could not be recorded
+int dir_announce(char *peeraddr, int uploads, int kbps)
+{
+	// Link pointing to the peer's load, and the load
+	dir_load_t **link;
+	dir_load_t *load;
+
+	pthread_rwlock_wrlock(&load_lock);
+
+	// Create the peer's load on its first report
+	if((load = *(link = dir_load(peeraddr))) == NULL)
+	{
+		if((load = (dir_load_t *)malloc(sizeof(dir_load_t) + strlen(peeraddr) + 1)) == NULL)
+		{
+			pthread_rwlock_unlock(&load_lock);
+			fprintf(stderr, "%s: %s could not allocate load of peer %s\n", SERVER_NAME, ERROR_MSG, peeraddr);
+			return DIR_ERROR;
+		}
+		strcpy(load->peer, peeraddr);
+		load->next = NULL;
+		*link = load;
+	}
+
+	// Record the load
+	load->uploads = uploads;
+	load->kbps = kbps;
+	load->announced = time(NULL);
+
+	pthread_rwlock_unlock(&load_lock);
+
+	// Return success
+	return DIR_OK;
+}
+
+// dir_forget() forgets the load of a peer, as its files are purged
+static void dir_forget(char *peeraddr)
+{
+	// Link pointing to the peer's load, and the load
+	dir_load_t **link;
+	dir_load_t *load;
+
+	pthread_rwlock_wrlock(&load_lock);
+	if((load = *(link = dir_load(peeraddr))) != NULL)
+	{
+		*link = load->next;
+		free(load);
+	}
+	pthread_rwlock_unlock(&load_lock);
+}
+
+// dir_weight() returns how strongly a peer should be favoured by its load, 1 for an idle peer, falling towards 0 as it
+// takes on uploads.  Each upload counts in full at up to DIR_LOAD_KBPS, and for less on a faster peer, which will
+// finish it sooner.  A peer which never reported its load, or has not for DIR_LOAD_STALE seconds, counts as idle.
+// The caller must hold load_lock for reading.
+static double dir_weight(char *peeraddr, time_t now)
+{
+	// Peer's load
+	dir_load_t *load = *dir_load(peeraddr);
+
+	// Unknown or stale load
+	if(load == NULL || now - load->announced > DIR_LOAD_STALE)
+		return 1.0;
+
+	// Return weight
+	return 1.0 / (1.0 + (double)load->uploads * DIR_LOAD_KBPS / ((load->kbps > DIR_LOAD_KBPS) ? load->kbps : DIR_LOAD_KBPS));
+}
+
+//------------------------ DIR PURGE -------------------------
+
+// dir_purge() stops tracking every file shared by a peer, walking the peer's own list rather than every file
+int dir_purge(char *peeraddr)
+{
+	// Lock covering the peer, and locks covering the filename and hash of each entry
+	pthread_rwlock_t *peer_lock = dir_lock(DIR_PEER, peeraddr);
+	pthread_rwlock_t *file_lock, *hash_lock;
+
+	// Node for the peer, and entry being removed
+	dir_node_t *node;
+	dir_entry_t *entry;
+
+	// The peer's load goes with its files
+	dir_forget(peeraddr);
+
+	// The SQLite backend deletes the peer's rows through its index by peer.  The delete is left to the writer thread,
+	// which bumps the generation once it is committed, so a disconnecting client never waits on it.
+	if(backend == DIR_SQLITE)
+		return db_purge(peeraddr, dir_touch);
+
+	// Hold the peer's lock throughout, so it cannot add files while they are purged
+	pthread_rwlock_wrlock(peer_lock);
+
+	// Remove entries until the peer's node is freed along with its last entry
+	while((node = dir_find(DIR_PEER, peeraddr, 0)) != NULL)
+	{
+		// Take the filename and hash locks of the first entry, in order
+		entry = node->entries;
+		file_lock = dir_lock(DIR_FILE, entry->node[DIR_FILE]->name);
+		hash_lock = dir_lock(DIR_HASH, entry->node[DIR_HASH]->name);
+		pthread_rwlock_wrlock(file_lock);
+		pthread_rwlock_wrlock(hash_lock);
+
+		// If no other peer shares the file at this size, it leaves the listing
+		if(!dir_sized(entry->node[DIR_FILE], entry->size, entry))
+			dir_journal('-', entry->node[DIR_FILE]->name, entry->size);
+
+		// Unlink it from every index, the peer last, since that may free the peer's node
+		dir_unlink(entry, DIR_HASH);
+		dir_unlink(entry, DIR_FILE);
+		dir_unlink(entry, DIR_PEER);
+		free(entry);
+
+		// Release locks, in reverse order
+		pthread_rwlock_unlock(hash_lock);
+		pthread_rwlock_unlock(file_lock);
+	}
+
+	// Release the peer's lock
+	pthread_rwlock_unlock(peer_lock);
+
+	// Return success
+	return DIR_OK;
+}
+
+//------------------------ DIR COMPARE -----------------------
+
+// dir_compare() orders rows by key, then by size, for qsort()
+static int dir_compare(const void *a, const void *b)
+{
+	// Rows being compared
+	const dir_row_t *x = (const dir_row_t *)a;
+	const dir_row_t *y = (const dir_row_t *)b;
+
+	// Result of comparing keys
+	int order = strcmp(x->key, y->key);
+
+	// Order by key, then by size
+	if(order != 0)
+		return order;
+	return (x->size > y->size) - (x->size < y->size);
+}
+
+//------------------------ DIR LIST --------------------------
+
+// dir_list() returns each distinct filename and size tracked by the directory, ordered by filename
+int dir_list(dir_row_t **rows)
+{
+	// Node and entry being examined
+	dir_node_t *node;
+	dir_entry_t *entry;
+
+	// Number of rows, first row collected for the current file, stripe, bucket, and indexer
+	int count = 0;
+	int first, stripe, bucket, i;
+
+	// The SQLite backend selects distinct rows
+	if(backend == DIR_SQLITE)
+		return db_list(rows);
+
+	// Start with no rows
+	*rows = NULL;
+
+	// Visit each stripe, holding its read lock while collecting rows from the buckets it covers
+	for(stripe = 0; stripe < DIR_STRIPES; stripe++)
+	{
+		pthread_rwlock_rdlock(&tables[DIR_FILE].locks[stripe]);
+		for(bucket = stripe; bucket < DIR_BUCKETS; bucket += DIR_STRIPES)
+		{
+			for(node = tables[DIR_FILE].buckets[bucket]; node != NULL; node = node->next)
+			{
+				// Collect each distinct size for this file, peers almost always agree, so this list is short
+				first = count;
+				for(entry = node->entries; entry != NULL; entry = entry->link[DIR_FILE].next)
+				{
+					for(i = first; i < count && (*rows)[i].size != entry->size; i++);
+					if(i == count && dir_rows_push(rows, &count, node->name, entry->size) == -1)
+					{
+						pthread_rwlock_unlock(&tables[DIR_FILE].locks[stripe]);
+						dir_rows_free(*rows, count);
+						*rows = NULL;
+						return DIR_ERROR;
+					}
+				}
+			}
+		}
+		pthread_rwlock_unlock(&tables[DIR_FILE].locks[stripe]);
+	}
+
+	// Order rows by filename, then size
+	if(count > 1)
+		qsort(*rows, count, sizeof(dir_row_t), dir_compare);
+
+	// Return number of rows
+	return count;
+}
+
+//------------------------ DIR REQUEST -----------------------
+
+// dir_entries() collects each peer sharing a file, and the size it reported.  The caller must hold the file's lock.
+// Returns the number of rows, or DIR_ERROR if they could not be collected
+static int dir_entries(dir_node_t *node, dir_row_t **rows)
+{
+	// Entry being examined, and number of rows
+	dir_entry_t *entry;
+	int count = 0;
+
+	// Start with no rows
+	*rows = NULL;
+
+	// Collect every entry for the file
+	for(entry = node->entries; entry != NULL; entry = entry->link[DIR_FILE].next)
+	{
+		if(dir_rows_push(rows, &count, entry->node[DIR_PEER]->name, entry->size) == -1)
+		{
+			dir_rows_free(*rows, count);
+			*rows = NULL;
+			return DIR_ERROR;
+		}
+	}
+
+	// Return number of rows
+	return count;
+}
+
+// dir_request() returns each peer sharing a file, and the size it reported, ordered by peer
+int dir_request(char *filename, dir_row_t **rows)
+{
+	// Lock covering the filename
+	pthread_rwlock_t *lock = dir_lock(DIR_FILE, filename);
+
+	// Node for the filename
+	dir_node_t *node;
+
+	// Number of rows
+	int count = 0;
+
+	// The SQLite backend selects matching rows
+	if(backend == DIR_SQLITE)
+		return db_request(filename, rows);
+
+	// Start with no rows
+	*rows = NULL;
+
+	// Collect every entry for the file
+	pthread_rwlock_rdlock(lock);
+	if((node = dir_find(DIR_FILE, filename, 0)) != NULL)
+		count = dir_entries(node, rows);
+	pthread_rwlock_unlock(lock);
+
+	// Order rows by peer
+	if(count > 1)
+		qsort(*rows, count, sizeof(dir_row_t), dir_compare);
+
+	// Return number of rows
+	return count;
+}
+
+//------------------------ DIR SAMPLE ------------------------
+
+// dir_random() returns a random number from 0 to bound - 1, from the calling thread's own state
+static int dir_random(int bound)
+{
+	// Seed the thread's state on first use, from the time and the address of the state, which differs by thread
+	if(sample_seed == 0)
+		sample_seed = (unsigned int)time(NULL) ^ (unsigned int)(unsigned long)&sample_seed;
+
+	// Return random number
+	return rand_r(&sample_seed) % bound;
+}
+
+// dir_pick() keeps max rows of count chosen uniformly at random and in random order, shuffling only as many positions
+// as are kept, and freeing the rest
+// Returns the number of rows kept, or DIR_ERROR if count was
+static int dir_pick(dir_row_t *rows, int count, int max)
+{
+	// Row being swapped, and indexers
+	dir_row_t row;
+	int i, j;
+
+	// Nothing to pick from
+	if(count <= 0)
+		return count;
+
+	// Swap a random row from those not yet picked into each position kept
+	if(max > count)
+		max = count;
+	for(i = 0; i < max; i++)
+	{
+		j = i + dir_random(count - i);
+		row = rows[i];
+		rows[i] = rows[j];
+		rows[j] = row;
+	}
+
+	// Free the rows not picked, the array stays as large as it was
+	for(i = max; i < count; i++)
+	{
+		free(rows[i].key);
+		free(rows[i].extra);
+	}
+
+	// Return number of rows
+	return max;
+}
+
+// dir_draw() collects up to max peers sharing a file, and the size each reported, chosen uniformly at random, but not in
+// random order, so the rows must be shuffled by dir_pick().  The caller must hold the file's lock.
+// Returns the number of rows, or DIR_ERROR if they could not be collected
+static int dir_draw(dir_node_t *node, int max, dir_row_t **rows)
+{
+	// Positions of the shares picked, number of shares, number of rows, and indexers
+	int picks[DIR_SAMPLE_MAX];
+	int shares = node->count;
+	int count = 0;
+	int i, j, k;
+
+	// Start with no rows
+	*rows = NULL;
+
+	// Pick max distinct shares using Floyd's algorithm, which draws once per pick however many shares there are: for
+	// each of the last max positions, pick a random position up to it, or the position itself if that one was already
+	// picked
+	for(i = (shares > max) ? shares - max : 0, k = 0; i < shares; i++, k++)
+	{
+		picks[k] = dir_random(i + 1);
+		for(j = 0; j < k; j++)
+		{
+			if(picks[j] == picks[k])
+			{
+				picks[k] = i;
+				break;
+			}
+		}
+	}
+
+	// Collect the picked entries
+	for(i = 0; i < k; i++)
+	{
+		if(dir_rows_push(rows, &count, node->shares[picks[i]]->node[DIR_PEER]->name, node->shares[picks[i]]->size) == -1)
+		{
+			dir_rows_free(*rows, count);
+			*rows = NULL;
+			return DIR_ERROR;
+		}
+	}
+
+	// Return number of rows
+	return count;
+}
+
+// dir_sample() returns up to max peers sharing a file, and the size each reported, chosen uniformly at random and in
+// random order, so the peers of a popular file share its downloads rather than the first few by address serving all
+int dir_sample(char *filename, int max, dir_row_t **rows)
+{
+	// Lock covering the filename
+	pthread_rwlock_t *lock = dir_lock(DIR_FILE, filename);
+
+	// Node for the filename, and number of rows
+	dir_node_t *node;
+	int count = 0;
+
+	// The SQLite backend picks from every peer sharing the file, which are usually cached
+	if(max > DIR_SAMPLE_MAX)
+		max = DIR_SAMPLE_MAX;
+	if(backend == DIR_SQLITE)
+	{
+		count = db_request(filename, rows);
+		return dir_pick(*rows, count, max);
+	}
+
+	// Start with no rows
+	*rows = NULL;
+
+	// Draw the sample
+	pthread_rwlock_rdlock(lock);
+	if((node = dir_find(DIR_FILE, filename, 0)) != NULL)
+		count = dir_draw(node, max, rows);
+	pthread_rwlock_unlock(lock);
+
+	// Floyd's algorithm picks a uniform set, but not in a uniform order, so shuffle it
+	return dir_pick(*rows, count, count);
+}
+
+//------------------------ DIR REQUEST BATCH -----------------
+
+// A file of a REQUESTM, and the stripe of the lock covering its filename
+typedef struct dir_striped
+{
+	int stripe;
+	dir_record_t *record;
+} dir_striped_t;
+
+// dir_stripe_compare() orders files by stripe, for qsort()
+static int dir_stripe_compare(const void *a, const void *b)
+{
+	return ((const dir_striped_t *)a)->stripe - ((const dir_striped_t *)b)->stripe;
+}
+
+// dir_request_batch() looks up every file of a REQUESTM at once, setting each record's rows to the peers sharing it,
+// ordered by peer, or to up to max of them chosen at random, if max is set, and its status to their number.  The
+// files are visited in order of the lock covering them, so each lock is taken once for every file it covers.
+// Returns DIR_OK, or DIR_ERROR if the directory failed, in which case no record has rows
+int dir_request_batch(dir_record_t *records, int count, int max)
+{
+	// Files ordered by stripe, node for a filename, stripe whose lock is held, and indexer
+	dir_striped_t *order;
+	dir_node_t *node;
+	int stripe = -1;
+	int i;
+
+	// Result
+	int status = DIR_OK;
+
+	// Start with no rows, nothing to look up without files
+	if(max > DIR_SAMPLE_MAX)
+		max = DIR_SAMPLE_MAX;
+	for(i = 0; i < count; i++)
+	{
+		records[i].rows = NULL;
+		records[i].status = 0;
+	}
+	if(count <= 0)
+		return DIR_OK;
+
+	// The SQLite backend looks up each file in turn, most of them answered by its filter or cache
+	if(backend == DIR_SQLITE)
+	{
+		for(i = 0; i < count && status == DIR_OK; i++)
+		{
+			records[i].status = db_request(records[i].filename, &records[i].rows);
+			if(max > 0)
+				records[i].status = dir_pick(records[i].rows, records[i].status, max);
+			if(records[i].status == DIR_ERROR)
+				status = DIR_ERROR;
+		}
+	}
+	// Else, visit the files by stripe, holding each stripe's read lock while collecting every file it covers
+	else if((order = (dir_striped_t *)malloc(sizeof(dir_striped_t) * count)) != NULL)
+	{
+		for(i = 0; i < count; i++)
+		{
+			order[i].stripe = dir_hash(records[i].filename) & (DIR_STRIPES - 1);
+			order[i].record = &records[i];
+		}
+		qsort(order, count, sizeof(dir_striped_t), dir_stripe_compare);
+
+		for(i = 0; i < count && status == DIR_OK; i++)
+		{
+			// Trade the lock held for the next stripe's, once the files of the last one are done
+			if(order[i].stripe != stripe)
+			{
+				if(stripe != -1)
+					pthread_rwlock_unlock(&tables[DIR_FILE].locks[stripe]);
+				stripe = order[i].stripe;
+				pthread_rwlock_rdlock(&tables[DIR_FILE].locks[stripe]);
+			}
+
+			// Collect the file's peers, or a sample of them
+			if((node = dir_find(DIR_FILE, order[i].record->filename, 0)) != NULL)
+				order[i].record->status = (max > 0) ? dir_draw(node, max, &order[i].record->rows) : dir_entries(node, &order[i].record->rows);
+			if(order[i].record->status == DIR_ERROR)
+				status = DIR_ERROR;
+		}
+		if(stripe != -1)
+			pthread_rwlock_unlock(&tables[DIR_FILE].locks[stripe]);
+		free(order);
+
+		// Unlocked, shuffle each sample, or order each file's peers
+		for(i = 0; i < count && status == DIR_OK; i++)
+		{
+			if(max > 0)
+				dir_pick(records[i].rows, records[i].status, records[i].status);
+			else if(records[i].status > 1)
+				qsort(records[i].rows, records[i].status, sizeof(dir_row_t), dir_compare);
+		}
+	}
+	else
+		status = DIR_ERROR;
+
+	// On failure, free every row collected
+	if(status == DIR_ERROR)
+	{
+		for(i = 0; i < count; i++)
+		{
+			if(records[i].status > 0)
+				dir_rows_free(records[i].rows, records[i].status);
+			records[i].rows = NULL;
+			records[i].status = DIR_ERROR;
+		}
+	}
+
+	// Return result
+	return status;
+}
+
+//------------------------ DIR BALANCE -----------------------
+
+// A row, and the key it is ordered by
+typedef struct dir_keyed
+{
+	double key;
+	dir_row_t row;
+} dir_keyed_t;
+
+// dir_key_compare() orders rows by key, for qsort()
+static int dir_key_compare(const void *a, const void *b)
+{
+	// Keys being compared
+	double x = ((const dir_keyed_t *)a)->key;
+	double y = ((const dir_keyed_t *)b)->key;
+
+	// Order by key
+	return (x > y) - (x < y);
+}
+
+// dir_balance() shuffles the peers of a REQUEST reply, each peer's chance of coming first weighted by how lightly
+// loaded it is.  Each peer draws an exponentially distributed key, -ln(u) / weight, and the peers are ordered by key,
+// so every downloader still sees a different order, rather than all of them rushing the least loaded peer.
+void dir_balance(dir_row_t *rows, int count)
+{
+	// Rows with their keys, time the keys are drawn, and indexer
+	dir_keyed_t *keyed;
+	time_t now = time(NULL);
+	int i;
+
+	// Nothing to order
+	if(count < 2 || (keyed = (dir_keyed_t *)malloc(sizeof(dir_keyed_t) * count)) == NULL)
+		return;
+
+	// Draw each peer's key, with u uniform over (0, 1]
+	pthread_rwlock_rdlock(&load_lock);
+	for(i = 0; i < count; i++)
+	{
+		keyed[i].row = rows[i];
+		keyed[i].key = -log((dir_random(RAND_MAX) + 1.0) / RAND_MAX) / dir_weight(rows[i].key, now);
+	}
+	pthread_rwlock_unlock(&load_lock);
+
+	// Order the rows by key
+	qsort(keyed, count, sizeof(dir_keyed_t), dir_key_compare);
+	for(i = 0; i < count; i++)
+		rows[i] = keyed[i].row;
+	free(keyed);
+}
+
+//------------------------ DIR REQUEST HASH ------------------
+
+// dir_extra_compare() orders rows by key, then by second column, for qsort()
+static int dir_extra_compare(const void *a, const void *b)
+{
+	// Rows being compared
+	const dir_row_t *x = (const dir_row_t *)a;
+	const dir_row_t *y = (const dir_row_t *)b;
+
+	// Result of comparing keys
+	int order = strcmp(x->key, y->key);
+
+	// Order by key, then by second column
+	if(order != 0)
+		return order;
+	return strcmp(x->extra, y->extra);
+}
+
+// dir_request_hash() returns each peer sharing a file's content, the size it reported, and the filename it shares
+// the content under, whatever that filename is, ordered by peer
+int dir_request_hash(char *filehash, dir_row_t **rows)
+{
+	// Lock covering the hash
+	pthread_rwlock_t *lock = dir_lock(DIR_HASH, filehash);
+
+	// Node for the hash, and entry being examined
+	dir_node_t *node;
+	dir_entry_t *entry;
+
+	// Number of rows
+	int count = 0;
+
+	// The SQLite backend selects matching rows
+	if(backend == DIR_SQLITE)
+		return db_request_hash(filehash, rows);
+
+	// Start with no rows
+	*rows = NULL;
+
+	// Collect every entry for the hash.  Entries are only unlinked with their hash's lock held, so each entry's
+	// peer and filename nodes outlive the read lock.
+	pthread_rwlock_rdlock(lock);
+	if((node = dir_find(DIR_HASH, filehash, 0)) != NULL)
+	{
+		for(entry = node->entries; entry != NULL; entry = entry->link[DIR_HASH].next)
+		{
+			if(dir_rows_push(rows, &count, entry->node[DIR_PEER]->name, entry->size) == -1 || ((*rows)[count - 1].extra = strdup(entry->node[DIR_FILE]->name)) == NULL)
+			{
+				pthread_rwlock_unlock(lock);
+				dir_rows_free(*rows, count);
+				*rows = NULL;
+				return DIR_ERROR;
+			}
+		}
+	}
+	pthread_rwlock_unlock(lock);
+
+	// Order rows by peer, then filename
+	if(count > 1)
+		qsort(*rows, count, sizeof(dir_row_t), dir_extra_compare);
+
+	// Return number of rows
+	return count;
+}
+
+//------------------------ DIR UNIQUE ------------------------
+
+// dir_unique() returns each distinct file content tracked by the directory, as its hash, the number of peers sharing
+// it, and the first of the filenames and sizes it is shared under, ordered by that filename
+int dir_unique(dir_row_t **rows)
+{
+	// Node being examined, entry being examined, entry with the first filename, and entry being compared
+	dir_node_t *node;
+	dir_entry_t *entry, *first, *other;
+
+	// Number of rows, number of distinct peers, stripe, and bucket
+	int count = 0;
+	int peers, stripe, bucket;
+
+	// The SQLite backend groups rows by hash
+	if(backend == DIR_SQLITE)
+		return db_unique(rows);
+
+	// Start with no rows
+	*rows = NULL;
+
+	// Visit each stripe of the hash index, holding its read lock while collecting rows from the buckets it covers
+	for(stripe = 0; stripe < DIR_STRIPES; stripe++)
+	{
+		pthread_rwlock_rdlock(&tables[DIR_HASH].locks[stripe]);
+		for(bucket = stripe; bucket < DIR_BUCKETS; bucket += DIR_STRIPES)
+		{
+			for(node = tables[DIR_HASH].buckets[bucket]; node != NULL; node = node->next)
+			{
+				// Find the first filename, and count each peer once, however many names it shares the content under
+				first = node->entries;
+				peers = 0;
+				for(entry = node->entries; entry != NULL; entry = entry->link[DIR_HASH].next)
+				{
+					if(strcmp(entry->node[DIR_FILE]->name, first->node[DIR_FILE]->name) < 0)
+						first = entry;
+					for(other = node->entries; other != entry && other->node[DIR_PEER] != entry->node[DIR_PEER]; other = other->link[DIR_HASH].next);
+					if(other == entry)
+						peers++;
+				}
+
+				// Collect the content under its first filename
+				if(dir_rows_push(rows, &count, first->node[DIR_FILE]->name, first->size) == -1 || ((*rows)[count - 1].extra = strdup(node->name)) == NULL)
+				{
+					pthread_rwlock_unlock(&tables[DIR_HASH].locks[stripe]);
+					dir_rows_free(*rows, count);
+					*rows = NULL;
+					return DIR_ERROR;
+				}
+				(*rows)[count - 1].peers = peers;
+			}
+		}
+		pthread_rwlock_unlock(&tables[DIR_HASH].locks[stripe]);
+	}
+
+	// Order rows by filename, then hash
+	if(count > 1)
+		qsort(*rows, count, sizeof(dir_row_t), dir_extra_compare);
+
+	// Return number of rows
+	return count;
+}
+
+//------------------------ DIR DIGEST ------------------------
+
+// dir_fold() folds a string into a 64-bit FNV-1a hash
+static unsigned long long dir_fold(unsigned long long hash, char *str)
+{
+	// Fold in each byte
+	while(*str != '\0')
+	{
+		hash ^= (unsigned char)*str++;
+		hash *= 1099511628211ULL;
+	}
+
+	// Return hash
+	return hash;
+}
+
+// dir_digest_entry() hashes one file shared by a peer, as the line "filename hash size" it was added with
+static unsigned long long dir_digest_entry(char *filename, char *filehash, long f_size)
+{
+	// Size, as sent by the peer
+	char size[32];
+	sprintf(size, "%ld", f_size);
+
+	// Hash the line, starting from the offset basis
+	return dir_fold(dir_fold(dir_fold(dir_fold(dir_fold(14695981039346656037ULL, filename), " "), filehash), " "), size);
+}
+
+// dir_digest() digests every file shared by a peer, writing DIR_DIGEST hex digits.  The digest is the sum of the hash
+// of each file, so it does not depend on the order in which they were added, and a client can compute it over the
+// files it last sent without asking for them back.
+int dir_digest(char *peeraddr, char *digest)
+{
+	// Lock covering the peer
+	pthread_rwlock_t *lock = dir_lock(DIR_PEER, peeraddr);
+
+	// Node for the peer, and entry being examined
+	dir_node_t *node;
+	dir_entry_t *entry;
+
+	// Rows returned by the SQLite backend, number of rows, and indexer
+	dir_row_t *rows;
+	int count, i;
+
+	// Sum of the hash of each file
+	unsigned long long sum = 0;
+
+	// The SQLite backend selects the peer's rows
+	if(backend == DIR_SQLITE)
+	{
+		if((count = db_manifest(peeraddr, &rows)) == DIR_ERROR)
+			return DIR_ERROR;
+		for(i = 0; i < count; i++)
+			sum += dir_digest_entry(rows[i].key, rows[i].extra, rows[i].size);
+		dir_rows_free(rows, count);
+	}
+	// Else, walk the peer's own list of entries
+	else
+	{
+		pthread_rwlock_rdlock(lock);
+		if((node = dir_find(DIR_PEER, peeraddr, 0)) != NULL)
+		{
+			for(entry = node->entries; entry != NULL; entry = entry->link[DIR_PEER].next)
+				sum += dir_digest_entry(entry->node[DIR_FILE]->name, entry->node[DIR_HASH]->name, entry->size);
+		}
+		pthread_rwlock_unlock(lock);
+	}
+
+	// Write the digest
+	sprintf(digest, "%0*llx", DIR_DIGEST, sum);
+	return DIR_OK;
+}
+
+//------------------------ DIR SEARCH ------------------------
+
+// A candidate SEARCH result, and where the pattern was found in its filename, for ranking
+typedef struct dir_match
+{
+	// 0 if the filename is the pattern, 1 if it starts with it, 2 if it merely contains it
+	int rank;
+
+	// Offset of the pattern within the filename
+	int position;
+
+	// Filename and size
+	dir_row_t row;
+} dir_match_t;
+
+// dir_match_compare() orders SEARCH results best first, by rank, position, length of filename, filename, then size
+static int dir_match_compare(const void *a, const void *b)
+{
+	// Results being compared
+	const dir_match_t *x = (const dir_match_t *)a;
+	const dir_match_t *y = (const dir_match_t *)b;
+
+	// Lengths of the filenames
+	int xlen = strlen(x->row.key);
+	int ylen = strlen(y->row.key);
+
+	// Order by rank, position, and length, then as LIST would
+	if(x->rank != y->rank)
+		return x->rank - y->rank;
+	if(x->position != y->position)
+		return x->position - y->position;
+	if(xlen != ylen)
+		return xlen - ylen;
+	return dir_compare(&x->row, &y->row);
+}
+
+// dir_search_index() collects each distinct size of every filename the trigram index finds for a folded pattern
+static int dir_search_index(char *indexed, dir_row_t **rows)
+{
+	// Candidate filenames, lock covering each, its node, and entry being examined
+	char **names;
+	pthread_rwlock_t *lock;
+	dir_node_t *node;
+	dir_entry_t *entry;
+
+	// Number of candidates, number of rows, first row collected for the current file, and indexers
+	int found, count = 0;
+	int first, i, j;
+
+	// Start with no rows
+	*rows = NULL;
+
+	// Find candidates sharing the pattern's rarest trigram
+	if((found = search_lookup(indexed, &names)) == -1)
+		return DIR_ERROR;
+
+	// Collect each distinct size of each candidate, which may have been removed since it was found
+	for(i = 0; i < found; i++)
+	{
+		lock = dir_lock(DIR_FILE, names[i]);
+		pthread_rwlock_rdlock(lock);
+		if(count != DIR_ERROR && (node = dir_find(DIR_FILE, names[i], 0)) != NULL)
+		{
+			first = count;
+			for(entry = node->entries; entry != NULL && count != DIR_ERROR; entry = entry->link[DIR_FILE].next)
+			{
+				for(j = first; j < count && (*rows)[j].size != entry->size; j++);
+				if(j == count && dir_rows_push(rows, &count, node->name, entry->size) == -1)
+				{
+					dir_rows_free(*rows, count);
+					*rows = NULL;
+					count = DIR_ERROR;
+				}
+			}
+		}
+		pthread_rwlock_unlock(lock);
+		free(names[i]);
+	}
+	free(names);
+
+	// Return number of rows
+	return count;
+}
+
+// dir_search() returns each filename and size whose filename contains a pattern, ignoring case, or starts with it if
+// the pattern begins with '^'.  Matches are ranked exact first, then prefixes, then by how early the pattern occurs,
+// and at most DIR_SEARCH_MAX are returned.
+int dir_search(char *pattern, dir_row_t **rows)
+{
+	// Whether the pattern is anchored, the folded pattern, its index form, a folded filename, and the match within it
+	int anchored = (pattern[0] == '^');
+	char *needle, *indexed, *folded, *found;
+
+	// Ranked matches, number of candidates, number of matches, and indexer
+	dir_match_t *matches = NULL;
+	int count, kept = 0;
+	int i;
+
+	// Fold the pattern for matching, and for the index, where anchoring makes even a short prefix three bytes long
+	*rows = NULL;
+	needle = search_fold(pattern + anchored, 0);
+	indexed = search_fold(pattern + anchored, anchored);
+	if(needle == NULL || indexed == NULL)
+	{
+		free(needle);
+		free(indexed);
+		return DIR_ERROR;
+	}
+
+	// The in-memory index narrows the candidates to filenames sharing the pattern's rarest trigram, else every
+	// filename in the listing is a candidate
+	if(backend == DIR_MEMORY && strlen(indexed) >= 3)
+		count = dir_search_index(indexed, rows);
+	else
+		count = dir_list(rows);
+	free(indexed);
+	if(count == DIR_ERROR || (count > 0 && (matches = (dir_match_t *)malloc(sizeof(dir_match_t) * count)) == NULL))
+	{
+		fprintf(stderr, "%s: %s could not search for files matching '%s'\n", SERVER_NAME, ERROR_MSG, pattern);
+		if(count != DIR_ERROR)
+			dir_rows_free(*rows, count);
+		*rows = NULL;
+		free(needle);
+		return DIR_ERROR;
+	}
+
+	// Rank each candidate which matches the pattern, freeing the rest
+	for(i = 0; i < count; i++)
+	{
+		folded = search_fold((*rows)[i].key, 0);
+		found = (folded == NULL) ? NULL : strstr(folded, needle);
+		if(found != NULL && (!anchored || found == folded))
+		{
+			matches[kept].position = found - folded;
+			matches[kept].rank = (found != folded) ? 2 : (strlen(folded) == strlen(needle)) ? 0 : 1;
+			matches[kept++].row = (*rows)[i];
+		}
+		else
+			free((*rows)[i].key);
+		free(folded);
+	}
+	free(needle);
+
+	// Order matches best first, and return the first DIR_SEARCH_MAX of them, in place of the candidates
+	if(kept > 1)
+		qsort(matches, kept, sizeof(dir_match_t), dir_match_compare);
+	for(i = 0; i < kept; i++)
+	{
+		if(i < DIR_SEARCH_MAX)
+			(*rows)[i] = matches[i].row;
+		else
+			free(matches[i].row.key);
+	}
+	free(matches);
+
+	// Return number of rows
+	return (kept < DIR_SEARCH_MAX) ? kept : DIR_SEARCH_MAX;
+}
+
+//------------------------ DIR SINCE -------------------------
+
+// dir_since() returns the changes to the listing after a generation, oldest first, along with the current
+// generation.  Returns DIR_TRIMMED if the journal no longer covers them, or there are too many to be worth sending.
+int dir_since(unsigned long since, dir_row_t **rows, unsigned long *current)
+{
+	// Number of rows, and generation of the change being copied
+	int count = 0;
+	unsigned long gen;
+
+	// Start with no rows
+	*rows = NULL;
+
+	// Hold the journal steady while copying from it
+	pthread_mutex_lock(&journal_lock);
+	*current = version;
+
+	// The generation is from the future, perhaps a previous run of the server, or has been trimmed, or is too old
+	if(since > version || since < journal_floor || version - since > DIR_DELTA_MAX)
+	{
+		pthread_mutex_unlock(&journal_lock);
+		return DIR_TRIMMED;
+	}
+
+	// Copy each change after the generation
+	for(gen = since + 1; gen <= version; gen++)
+	{
+		if(dir_rows_push(rows, &count, journal[gen % DIR_JOURNAL].key, journal[gen % DIR_JOURNAL].size) == -1)
+		{
+			pthread_mutex_unlock(&journal_lock);
+			dir_rows_free(*rows, count);
+			*rows = NULL;
+			return DIR_ERROR;
+		}
+		(*rows)[count - 1].op = journal[gen % DIR_JOURNAL].op;
+	}
+	pthread_mutex_unlock(&journal_lock);
+
+	// Return number of rows
+	return count;
+}
+
+//------------------------ DIR SNAPSHOT ----------------------
+
+// dir_snapshot() returns a reference to a serialized LIST reply at least as new as every change made before the
+// call, rebuilding it if the directory has changed since it was last built.  The caller must drop the reference with
+// dir_snapshot_release().  Returns NULL if the listing could not be built.
+dir_snapshot_t *dir_snapshot()
+{
+	// Snapshot being returned, rows of the listing, directory version before listing, length, and indexers
+	dir_snapshot_t *snap;
+	dir_row_t *rows;
+	unsigned long current;
+	int count, len, i, n;
+
+	// Take a reference to the cached snapshot, if it is current
+	pthread_mutex_lock(&snapshot_lock);
+	if((snap = snapshot) != NULL && snap->version == version)
+	{
+		__sync_add_and_fetch(&snap->refs, 1);
+		pthread_mutex_unlock(&snapshot_lock);
+		return snap;
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+
+	// Else, rebuild it, one thread at a time, so clients arriving during a rebuild wait for it rather than repeat it
+	pthread_mutex_lock(&rebuild_lock);
+
+	// If another thread rebuilt the snapshot while this one waited, use it
+	pthread_mutex_lock(&snapshot_lock);
+	if((snap = snapshot) != NULL && snap->version == version)
+	{
+		__sync_add_and_fetch(&snap->refs, 1);
+		pthread_mutex_unlock(&snapshot_lock);
+		pthread_mutex_unlock(&rebuild_lock);
+		return snap;
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+
+	// Note the version before listing, so a change made during the listing forces another rebuild
+	current = __sync_add_and_fetch(&version, 0);
+	if((count = dir_list(&rows)) == DIR_ERROR)
+	{
+		pthread_mutex_unlock(&rebuild_lock);
+		return NULL;
+	}
+
+	// Measure, allocate, and serialize the reply
+	for(i = 0, len = 0; i < count; i++)
+		len += snprintf(NULL, 0, "%s %ld\n", rows[i].key, rows[i].size);
+	if((snap = (dir_snapshot_t *)malloc(sizeof(dir_snapshot_t) + sizeof(int) * count + len + 1)) == NULL)
+	{
+		fprintf(stderr, "%s: %s could not allocate listing of %d files\n", SERVER_NAME, ERROR_MSG, count);
+		dir_rows_free(rows, count);
+		pthread_mutex_unlock(&rebuild_lock);
+		return NULL;
+	}
+	snap->rows = (int *)(snap + 1);
+	snap->data = (char *)(snap->rows + count);
+	for(i = 0, n = 0; i < count; i++)
+	{
+		snap->rows[i] = n;
+		n += sprintf(snap->data + n, "%s %ld\n", rows[i].key, rows[i].size);
+	}
+	dir_rows_free(rows, count);
+	snap->count = count;
+	snap->len = len;
+	snap->version = current;
+
+	// One reference for the cache, and one for the caller
+	snap->refs = 2;
+
+	// Replace the cached snapshot, dropping the cache's reference to the old one
+	pthread_mutex_lock(&snapshot_lock);
+	if(snapshot != NULL)
+		dir_snapshot_release(snapshot);
+	snapshot = snap;
+	pthread_mutex_unlock(&snapshot_lock);
+	pthread_mutex_unlock(&rebuild_lock);
+
+	// Return snapshot
+	return snap;
+}
+
+// dir_snapshot_key() compares the filename on a line of a snapshot with a filename, as strcmp() would
+static int dir_snapshot_key(dir_snapshot_t *snap, int row, char *key)
+{
+	// Filename on the line, which ends at the space before its size
+	unsigned char *name = (unsigned char *)snap->data + snap->rows[row];
+	unsigned char *other = (unsigned char *)key;
+
+	// Compare until the filenames differ, or either ends
+	while(*name != ' ' && *other != '\0' && *name == *other)
+	{
+		name++;
+		other++;
+	}
+
+	// Return order, the line's filename ending first sorts before
+	return ((*name == ' ') ? 0 : *name) - *other;
+}
+
+// dir_snapshot_page() finds the page of a snapshot which starts at the first line whose filename sorts after the
+// given filename, and holds up to limit lines.  A page never splits the sizes of one filename, so it may run past
+// limit, and the next page can always start after the filename on its last line.  Returns the first line of the
+// page, and stores the line following it, or the count if the page reaches the end.
+int dir_snapshot_page(dir_snapshot_t *snap, char *after, int limit, int *end)
+{
+	// Bounds of the binary search, and the line being examined
+	int low = 0;
+	int high = snap->count;
+	int mid;
+
+	// Last line of the page, and the length of its filename
+	char *last;
+	int length;
+
+	// Find the first line whose filename sorts after the given filename
+	while(low < high)
+	{
+		mid = low + (high - low) / 2;
+		if(dir_snapshot_key(snap, mid, after) <= 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	// Take up to limit lines
+	*end = (snap->count - low < limit) ? snap->count : low + limit;
+
+	// Then any more sizes of the last filename, which share the line's prefix up to and including the space
+	if(*end > low && *end < snap->count)
+	{
+		last = snap->data + snap->rows[*end - 1];
+		length = (char *)memchr(last, ' ', snap->len - snap->rows[*end - 1]) - last + 1;
+		while(*end < snap->count && memcmp(snap->data + snap->rows[*end], last, length) == 0)
+			(*end)++;
+	}
+
+	// Return first line of the page
+	return low;
+}
+
+// dir_snapshot_release() drops a reference to a snapshot, freeing it once no client is still sending it
+void dir_snapshot_release(void *snap)
+{
+	if(__sync_sub_and_fetch(&((dir_snapshot_t *)snap)->refs, 1) == 0)
+		free(snap);
+}
+
+//------------------------ DIR ROWS --------------------------
+
+// dir_rows_push() appends a copy of a row to an array of rows, doubling the array as it fills
+int dir_rows_push(dir_row_t **rows, int *count, char *key, long size)
+{
+	// Grown array
+	dir_row_t *grown;
+
+	// Grow the array whenever its count reaches a power of two, starting at 16 rows
+	if(*count == 0 || (*count >= 16 && (*count & (*count - 1)) == 0))
+	{
+		if((grown = (dir_row_t *)realloc(*rows, sizeof(dir_row_t) * (*count == 0 ? 16 : *count * 2))) == NULL)
+			return -1;
+		*rows = grown;
+	}
+
+	// Copy the key, since the directory may change once its locks are released
+	if(((*rows)[*count].key = strdup(key)) == NULL)
+		return -1;
+	(*rows)[*count].size = size;
+	(*rows)[*count].op = 0;
+	(*rows)[*count].extra = NULL;
+	(*rows)[*count].peers = 0;
+	(*count)++;
+
+	// Return success
+	return 0;
+}
+
+// dir_rows_free() frees the rows returned by a query
+void dir_rows_free(dir_row_t *rows, int count)
+{
+	// Indexer
+	int i;
+
+	// Free each key, and any second column, then the array
+	for(i = 0; i < count; i++)
+	{
+		free(rows[i].key);
+		free(rows[i].extra);
+	}
+	free(rows);
+}
@@ -0,0 +1,155 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:	 10/16/26
+	Project: p2pd
+	Module:	 dir.h
+
+	Description:
+	A header containing prototypes and structs used in dir.c
+*/
+
+#ifndef _DIR_
+
+#define _DIR_
+
+//------------------------ RESULT CODES ----------------------
+
+// Operation succeeded
+#define DIR_OK 0
+
+// Entry with the same filename, hash, and peer is already tracked
+#define DIR_EXISTS 1
+
+// Backend failed, the client should be disconnected
+#define DIR_ERROR -1
+
+// Changes since the requested generation are no longer available
+#define DIR_TRIMMED -2
+
+//------------------------ STRUCTS ---------------------------
+
+// A row returned by a directory query, either a filename or a peer address, and a file size
+typedef struct dir_row
+{
+	// Filename for LIST, peer address for REQUEST
+	char *key;
+
+	// File size
+	long size;
+
+	// For a change to the listing, '+' if the file was added, '-' if it was removed, else 0
+	int op;
+
+	// For a query by content, the filename a peer shares it under for REQUESTHASH, or the hash for a collapsed
+	// LIST, else NULL
+	char *extra;
+
+	// For a collapsed LIST, the number of peers sharing the content, else 0
+	int peers;
+} dir_row_t;
+
+// A serialized LIST reply, shared by every client which requests it until the directory changes
+typedef struct dir_snapshot
+{
+	// Number of holders, the cache itself and each client still sending it
+	int refs;
+
+	// Directory version which the snapshot was built from
+	unsigned long version;
+
+	// Number of lines, and the offset of each line, so pages of the listing can be found by binary search
+	int count;
+	int *rows;
+
+	// Length of the serialized reply, and the reply itself, one 'filename size' line per file, ordered by filename
+	int len;
+	char *data;
+} dir_snapshot_t;
+
+// A record of a bulk ADD, one file shared by the peer which sent the batch, or of a bulk REQUEST, one file looked up
+typedef struct dir_record
+{
+	// Line the record was parsed from, which the filename and hash point into
+	char *line;
+
+	// Filename, hash, and size of the file
+	char *filename, *filehash;
+	long size;
+
+	// Position of the record in the batch, and its result, DIR_OK, DIR_EXISTS, or DIR_ERROR, once applied, or for a
+	// bulk REQUEST, the number of peers sharing the file
+	int index, status;
+
+	// For a bulk REQUEST, the peers sharing the file
+	dir_row_t *rows;
+} dir_record_t;
+
+//------------------------ PROTOTYPES ------------------------
+
+// Prototype for dir_init(), which prepares the selected directory backend
+int dir_init(int);
+
+// Prototype for dir_close(), which shuts down the directory backend
+void dir_close();
+
+// Prototype for dir_add(), which tracks a file shared by a peer
+int dir_add(char *, char *, long, char *);
+
+// Prototype for dir_add_batch(), which tracks many files shared by a peer at once
+int dir_add_batch(dir_record_t *, int, char *);
+
+// Prototype for dir_delete(), which stops tracking a file shared by a peer
+int dir_delete(char *, char *, char *);
+
+// Prototype for dir_purge(), which stops tracking every file shared by a peer
+int dir_purge(char *);
+
+// Prototype for dir_list(), which returns each distinct filename and size, ordered by filename
+int dir_list(dir_row_t **);
+
+// Prototype for dir_request(), which returns each peer sharing a file, ordered by peer
+int dir_request(char *, dir_row_t **);
+
+// Prototype for dir_sample(), which returns up to a number of peers sharing a file, chosen at random
+int dir_sample(char *, int, dir_row_t **);
+
+// Prototype for dir_request_batch(), which looks up the peers sharing many files at once
+int dir_request_batch(dir_record_t *, int, int);
+
+// Prototype for dir_balance(), which shuffles the peers of a REQUEST reply, favouring lightly loaded peers
+void dir_balance(dir_row_t *, int);
+
+// Prototype for dir_announce(), which records the load reported by a peer
+int dir_announce(char *, int, int);
+
+// Prototype for dir_request_hash(), which returns each peer sharing a file's content under any filename, ordered by peer
+int dir_request_hash(char *, dir_row_t **);
+
+// Prototype for dir_unique(), which returns each distinct file content, under its first filename, ordered by filename
+int dir_unique(dir_row_t **);
+
+// Prototype for dir_digest(), which digests the files shared by a peer, for a resuming client to compare with its own
+int dir_digest(char *, char *);
+
+// Prototype for dir_search(), which returns the best matches for a filename pattern, ranked exact, prefix, then substring
+int dir_search(char *, dir_row_t **);
+
+// Prototype for dir_since(), which returns the changes to the listing since a generation
+int dir_since(unsigned long, dir_row_t **, unsigned long *);
+
+// Prototype for dir_snapshot(), which returns a reference to the current serialized LIST reply
+dir_snapshot_t *dir_snapshot();
+
+// Prototype for dir_snapshot_page(), which finds a page of a serialized LIST reply following a filename
+int dir_snapshot_page(dir_snapshot_t *, char *, int, int *);
+
+// Prototype for dir_snapshot_release(), which drops a reference to a serialized LIST reply
+void dir_snapshot_release(void *);
+
+// Prototype for dir_rows_push(), which appends a copy of a row to a growing array of rows
+int dir_rows_push(dir_row_t **, int *, char *, long);
+
+// Prototype for dir_rows_free(), which frees the rows returned by a query
+void dir_rows_free(dir_row_t *, int);
+
+#endif
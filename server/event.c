@@ -0,0 +1,203 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:    10/16/26
+	Project: p2pd
+	Module:  event.c
+
+	Description:
+	An edge-triggered epoll reactor which multiplexes every client onto the network thread.  Sockets
+	are non-blocking and registered one-shot, so a client is handed to exactly one worker in the thread
+	pool when it becomes readable, and is only re-armed once that worker has drained its input.  Idle
+	clients therefore cost a file descriptor and a p2p_t, rather than a thread.
+*/
+
+//------------------------ C LIBRARIES -----------------------
+
+// Required for accept4()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "config.h"
+#include "p2p.h"
+#include "event.h"
+#include "thpool.h"
+
+//------------------------ GLOBAL VARIABLES ------------------
+
+// Reference externally defined threadpool, which runs the command handlers
+extern thpool_t *threadpool;
+
+// File descriptor of the epoll instance
+static int epoll_fd = -1;
+
+// File descriptor of the listening socket, registered with a NULL pointer to tell it apart from clients
+static int listen_fd = -1;
+
+//------------------------ EVENT INIT ------------------------
+
+// event_init() prepares the listening socket and the epoll instance, returning 0 on success and -1 on failure
+int event_init(int fd)
+{
+	// Event used to register the listening socket
+	struct epoll_event ev;
+
+	// Store listening socket
+	listen_fd = fd;
+
+	// Put the listening socket in non-blocking mode, so that accept() may be called until the backlog is drained
+	if(fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK) == -1)
+	{
+		fprintf(stderr, "%s: %s failed to set listening socket non-blocking\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+
+	// Create the epoll instance
+	if((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+	{
+		fprintf(stderr, "%s: %s failed to create epoll instance\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+
+	// Register the listening socket for incoming connections
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1)
+	{
+		fprintf(stderr, "%s: %s failed to register listening socket with epoll\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+
+	// Return success
+	return 0;
+}
+
+//------------------------ EVENT MASK ------------------------
+
+// event_mask() chooses which event a client waits for.  A client with replies still buffered waits until its socket
+// is writable again, leaving further input queued in the kernel until the client reads what it has been sent.  It does
+// not wait for the client to hang up as well, since once the read side is shut that would fire at once on every
+// re-arm, while the worker could do nothing but find the socket still full.  A client gone altogether still reports
+// EPOLLHUP, which epoll always waits for.
+static uint32_t event_mask(p2p_t *conn)
+{
+	return ((conn->outbuf.bytes > 0) ? EPOLLOUT : (EPOLLIN | EPOLLRDHUP)) | EPOLLET | EPOLLONESHOT;
+}
+
+//------------------------ EVENT ACCEPT ----------------------
+
+// event_accept() accepts every pending connection on the listening socket, and registers each with epoll
+static void event_accept()
+{
+	// Incoming socket and its address
+	int inc_fd;
+	struct sockaddr_storage inc_addr;
+	socklen_t inc_len;
+
+	// Connection state for the new client
+	p2p_t *conn;
+
+	// Event used to register the client
+	struct epoll_event ev;
+
+	// Loop until the listen backlog is empty
+	while(1)
+	{
+		// Accept a connection, creating the socket in non-blocking mode
+		inc_len = sizeof(inc_addr);
+		if((inc_fd = accept4(listen_fd, (struct sockaddr *)&inc_addr, &inc_len, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+		{
+			// Backlog is drained, wait for the next event
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+
+			// Retry on interrupts, and on clients which gave up while waiting in the backlog
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			// Else, print an error (typically out of file descriptors), and wait for the next event
+			fprintf(stderr, "%s: %s failed to accept incoming connections\n", SERVER_NAME, ERROR_MSG);
+			return;
+		}
+
+		// Set up the connection state, if the client was turned away, move on
+		if((conn = p2p_open(inc_fd, &inc_addr)) == NULL)
+			continue;
+
+		// Register the client edge-triggered and one-shot, so only one worker ever owns it at a time
+		memset(&ev, 0, sizeof(ev));
+		ev.events = event_mask(conn);
+		ev.data.ptr = conn;
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inc_fd, &ev) == -1)
+		{
+			// On failure, print an error and disconnect the client
+			fprintf(stderr, "%s: %s failed to register client with epoll [fd: %d]\n", SERVER_NAME, ERROR_MSG, inc_fd);
+			p2p_close(conn);
+		}
+	}
+}
+
+//------------------------ EVENT LOOP ------------------------
+
+// event_loop() waits on epoll, accepting new clients and dispatching ready clients to the thread pool
+void *event_loop()
+{
+	// Buffer of events returned by epoll
+	struct epoll_event events[MAX_EVENTS];
+
+	// Number of ready events, and indexer
+	int ready, i;
+
+	// Loop infinitely until Ctrl+C SIGINT is caught by the signal handler
+	while(1)
+	{
+		// Wait for events
+		if((ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1)) == -1)
+		{
+			// Retry if interrupted by a signal
+			if(errno == EINTR)
+				continue;
+
+			// Else, print an error message and quit, since no more events can be handled
+			fprintf(stderr, "%s: %s failed to wait for network events\n", SERVER_NAME, ERROR_MSG);
+			return (void *)-1;
+		}
+
+		// Handle each ready event
+		for(i = 0; i < ready; i++)
+		{
+			// Listening socket has incoming connections
+			if(events[i].data.ptr == NULL)
+				event_accept();
+			// Else, a client is ready, so hand it to the thread pool to process its commands
+			else
+				thpool_add_work(threadpool, &p2p, events[i].data.ptr);
+		}
+	}
+}
+
+//------------------------ EVENT REARM -----------------------
+
+// event_rearm() re-enables notifications for a client, once its worker has read until EAGAIN, or has filled the socket
+int event_rearm(p2p_t *conn)
+{
+	// Event used to modify the registration
+	struct epoll_event ev;
+
+	// Re-register edge-triggered and one-shot
+	memset(&ev, 0, sizeof(ev));
+	ev.events = event_mask(conn);
+	ev.data.ptr = conn;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
@@ -0,0 +1,20 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:	 10/16/26
+	Project: p2pd
+	Module:	 event.h
+
+	Description:
+	A header containing prototypes used in event.c
+*/
+
+//------------------------ PROTOTYPES ------------------------
+
+// Prototype for event_init(), which creates the epoll instance and registers the listening socket
+int event_init(int);
+
+// Prototype for event_loop(), the reactor run by the network thread
+void *event_loop();
+
+// Prototype for event_rearm(), which re-enables notifications for a client once its worker is finished
+int event_rearm(p2p_t *);
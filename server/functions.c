@@ -12,9 +12,14 @@
 //------------------------ C LIBRARIES -----------------------
 
 #include <ctype.h>
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 //------------------------ CUSTOM LIBRARIES ------------------
 
@@ -66,8 +71,8 @@ void clean_string(char *str)
 int client_count(int change)
 {
 	// Modify client counter by using change integer, return its value
-	c_count += change;
-	return c_count;
+	// Connections are opened and closed from several threads, so the counter is updated atomically
+	return __sync_add_and_fetch(&c_count, change);
 }
 
 //------------------------ CONSOLE HELP ----------------------
@@ -97,28 +102,40 @@ void *get_in_addr(struct sockaddr *sa)
 
 //------------------------ RECV MSG --------------------------
 
-// recv_msg() takes a file descriptor and a message, and abstracts the recv() sockets call
-int recv_msg(int fd, char *message)
+// recv_msg() takes a file descriptor and a client's input buffer, and abstracts the recv() sockets call
+// Commands are framed out of the buffer by newline afterwards, so a read may return any part of one or more commands
+int recv_msg(int fd, ring_t *ring)
 {
-	// Keep track of number of bytes received, and total bytes received
+	// Keep track of number of bytes received
 	int b_received = 0;
-	int b_total = 0;
 
-	// Keep a buffer to gather input from recv() and copy it into the message
-	char buffer[1024];
+	// Scatter vector covering the free space in the buffer, which may wrap around its end
+	struct iovec iov[2];
+	unsigned int tail = ring->tail & (INBUF_SIZE - 1);
+	int space = INBUF_SIZE - ring_used(ring);
 
-	// Nullify the input buffer before receiving data
-	memset(buffer, '\0', sizeof(buffer));
+	// If the buffer is full, there is nothing to receive into
+	if(space == 0)
+	{
+		errno = ENOBUFS;
+		return -1;
+	}
 
-	// Perform the recv() socket call, but handle the length and null termination for us, return the number of bytes
-	b_received = recv(fd, buffer, sizeof(buffer), 0);
-	b_total += b_received;
+	// Free space runs from the write position to the end of the buffer, then wraps to the start
+	iov[0].iov_base = ring->data + tail;
+	iov[0].iov_len = (INBUF_SIZE - tail) < space ? (INBUF_SIZE - tail) : space;
+	iov[1].iov_base = ring->data;
+	iov[1].iov_len = space - iov[0].iov_len;
 
-	// Copy buffer into message
-	strcpy(message, buffer);
+	// Perform the receive, passing errors (such as EAGAIN on a non-blocking socket) back to the caller
+	if((b_received = readv(fd, iov, iov[1].iov_len ? 2 : 1)) <= 0)
+		return b_received;
+
+	// Advance the write position past the received bytes
+	ring->tail += b_received;
 
 	// Return total bytes received
-	return b_total;
+	return b_received;
 }
 
 //------------------------ SEND MSG --------------------------
@@ -126,8 +143,40 @@ int recv_msg(int fd, char *message)
 // send_msg() takes a file descriptor and a message, and abstracts the send() sockets call
 int send_msg(int fd, char *message)
 {
-	// Perform the send() socket call, but handle the length and null termination for us, return the number of bytes
-	return send(fd, message, strlen(message), 0);
+	// Keep track of number of bytes sent, total bytes sent, and the total length of the message
+	int b_sent = 0;
+	int b_total = 0;
+	int length = strlen(message);
+
+	// Poll descriptor used to wait for room in the socket buffer on non-blocking sockets
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+
+	// Perform the send() socket call until the whole message is written, handling the length for us
+	while(b_total < length)
+	{
+		// MSG_NOSIGNAL keeps a peer which has already hung up from killing the server with SIGPIPE
+		if((b_sent = send(fd, message + b_total, length - b_total, MSG_NOSIGNAL)) == -1)
+		{
+			// Retry interrupted calls
+			if(errno == EINTR)
+				continue;
+
+			// If the socket buffer is full, wait for it to drain, giving up on peers which stop reading
+			if((errno == EAGAIN || errno == EWOULDBLOCK) && poll(&pfd, 1, SEND_TIMEOUT) == 1)
+				continue;
+
+			// Else, the send failed
+			return -1;
+		}
+
+		// Add to total bytes sent
+		b_total += b_sent;
+	}
+
+	// Return total bytes sent
+	return b_total;
 }
 
 //------------------------- VALIDATE INT --------------------
@@ -13,6 +13,10 @@
 
 #include <netinet/in.h>
 
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "buffer.h"
+
 //------------------------ PROTOTYPES ------------------------
 
 // Prototype for client_count(), which keeps track of the number of clients connected
@@ -28,8 +32,8 @@ void console_help();
 // Used to get IP addresses in string format
 void *get_in_addr(struct sockaddr *);
 
-// Prototype for recv_msg(), a wrapper for the recv() system call
-int recv_msg(int, char *);
+// Prototype for recv_msg(), a wrapper for the recv() system call which fills a client's input buffer
+int recv_msg(int, ring_t *);
 
 // Prototype for send_msg(), a wrapper for the send() system call
 int send_msg(int, char *);
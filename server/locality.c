@@ -0,0 +1,338 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:    10/16/26
+	Project: p2pd
+	Module:  locality.c
+
+	Description:
+	Ranks the peers returned by REQUEST by their proximity to the requester, so a client pulls a file from a peer
+	on its own host, subnet, or site, before one across the WAN.  Peers are ranked, nearest first:
+		1) the requester's own address
+		2) the requester's /24, or /64 for IPv6
+		3) the requester's site, as listed in a table of site prefixes, loaded at startup
+		4) anywhere else
+	The site table holds one prefix per line in CIDR notation, optionally followed by the name of its site, so several
+	prefixes may make up one site; a prefix without a name is a site of its own.  Prefixes are held in a binary trie,
+	so the site of an address is found by longest-prefix match in at most 128 steps, however many prefixes are listed.
+	IPv4 addresses are held as IPv4-mapped IPv6 addresses, so both share the one trie.  The trie is only built at
+	startup, so it is read without locking.
+*/
+
+//------------------------ C LIBRARIES -----------------------
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "config.h"
+#include "functions.h"
+#include "locality.h"
+
+//------------------------ STRUCTS ---------------------------
+
+// A node of the trie, one bit of a prefix deeper than its parent
+typedef struct locality_node
+{
+	// Position of the child for a 0 bit and a 1 bit, or 0 if there is none, since the root is no node's child
+	int child[2];
+
+	// Site of the prefix ending at this node, or -1 if none ends here
+	int site;
+} locality_node_t;
+
+//------------------------ GLOBAL VARIABLES ------------------
+
+// Nodes of the trie, the root first, number of nodes, and room for them
+static locality_node_t *trie = NULL;
+static int trie_size = 0, trie_room = 0;
+
+// Names of the sites, so prefixes of the same site share its number, and the number of sites
+static char (*site_names)[64] = NULL;
+static int sites = 0;
+
+//------------------------ LOCALITY PARSE --------------------
+
+// locality_parse() converts an IPv4 or IPv6 address to 16 bytes, IPv4 as an IPv4-mapped IPv6 address
+// Returns 1 for an IPv4 address, 0 for an IPv6 address, or -1 if it is neither
+static int locality_parse(char *text, unsigned char *addr)
+{
+	// An IPv4 address is preceded by 80 zero bits, then 16 one bits
+	memset(addr, 0, 10);
+	addr[10] = addr[11] = 0xff;
+	if(inet_pton(AF_INET, text, addr + 12) == 1)
+		return 1;
+
+	// Else, try IPv6, where an IPv4-mapped address counts as IPv4
+	if(inet_pton(AF_INET6, text, addr) == 1)
+		return (memcmp(addr, "\0\0\0\0\0\0\0\0\0\0\xff\xff", 12) == 0) ? 1 : 0;
+
+	// Neither
+	return -1;
+}
+
+//------------------------ LOCALITY NODE ---------------------
+
+// locality_node() appends an empty node to the trie
+// Returns the node's position, or -1 if the trie could not be grown
+static int locality_node()
+{
+	// Grown trie
+	locality_node_t *grown;
+
+	// Double the trie once it is full
+	if(trie_size == trie_room)
+	{
+		if((grown = (locality_node_t *)realloc(trie, sizeof(locality_node_t) * (trie_room > 0 ? trie_room * 2 : 256))) == NULL)
+			return -1;
+		trie = grown;
+		trie_room = (trie_room > 0) ? trie_room * 2 : 256;
+	}
+
+	// Clear the node
+	trie[trie_size].child[0] = trie[trie_size].child[1] = 0;
+	trie[trie_size].site = -1;
+
+	// Return position
+	return trie_size++;
+}
+
+//------------------------ LOCALITY INSERT -------------------
+
+// locality_insert() adds the first bits of an address to the trie as a prefix of a site
+// Returns 0 on success, or -1 if the trie could not be grown
+static int locality_insert(unsigned char *addr, int bits, int site)
+{
+	// Node being walked, its child, the bit being followed, and indexer
+	int node = 0;
+	int child, bit, i;
+
+	// Walk down the trie, creating nodes as needed
+	for(i = 0; i < bits; i++)
+	{
+		bit = (addr[i / 8] >> (7 - i % 8)) & 1;
+		if((child = trie[node].child[bit]) == 0)
+		{
+			if((child = locality_node()) == -1)
+				return -1;
+			trie[node].child[bit] = child;
+		}
+		node = child;
+	}
+
+	// The prefix ends here
+	trie[node].site = site;
+
+	// Return success
+	return 0;
+}
+
+//------------------------ LOCALITY LOOKUP -------------------
+
+// locality_lookup() finds the site of an address, by the longest prefix in the trie which matches it
+// Returns the site, or -1 if no prefix matches
+static int locality_lookup(unsigned char *addr)
+{
+	// Node being walked, site of the longest prefix matched so far, and indexer
+	int node = 0;
+	int site = -1;
+	int i;
+
+	// No sites were loaded
+	if(trie == NULL)
+		return -1;
+
+	// Walk down the trie, remembering each prefix which ends on the way
+	for(i = 0; i < 128; i++)
+	{
+		if(trie[node].site != -1)
+			site = trie[node].site;
+		if((node = trie[node].child[(addr[i / 8] >> (7 - i % 8)) & 1]) == 0)
+			return site;
+	}
+
+	// The whole address is a prefix
+	if(trie[node].site != -1)
+		site = trie[node].site;
+
+	// Return site
+	return site;
+}
+
+//------------------------ LOCALITY SITE ---------------------
+
+// locality_site() returns the number of the site with a name, adding it if it is new
+// Returns -1 if the site could not be added
+static int locality_site(char *name)
+{
+	// Grown list of names, length of the name, and indexer
+	char (*grown)[64];
+	size_t length;
+	int i;
+
+	// Find the site by name
+	for(i = 0; i < sites; i++)
+	{
+		if(strcmp(site_names[i], name) == 0)
+			return i;
+	}
+
+	// Else, add it
+	if((grown = (char (*)[64])realloc(site_names, sizeof(*site_names) * (sites + 1))) == NULL)
+		return -1;
+	site_names = grown;
+
+	// Copy the name, which the parser already limits to fit
+	if((length = strlen(name)) > sizeof(*site_names) - 1)
+		length = sizeof(*site_names) - 1;
+	memcpy(site_names[sites], name, length);
+	site_names[sites][length] = '\0';
+
+	// Return number of the new site
+	return sites++;
+}
+
+//------------------------ LOCALITY INIT ---------------------
+
+// locality_init() loads the table of site prefixes from a file.  If the file is missing, peers are still ranked by
+// host and subnet, and an error is only printed if the file was asked for.
+// Returns the number of prefixes loaded, or -1 if the table could not be loaded
+int locality_init(char *path, int required)
+{
+	// Site table, line being read, its number, prefix, site name, address, and prefix length
+	FILE *table;
+	char line[256];
+	int number = 0;
+	char prefix[64], name[64];
+	unsigned char addr[16];
+	char *slash;
+	int bits;
+
+	// Number of prefixes loaded, whether the prefix is IPv4, and site of the prefix
+	int loaded = 0;
+	int v4, site;
+
+	// Create the root of the trie
+	if(locality_node() == -1)
+	{
+		fprintf(stderr, "%s: %s could not allocate site table\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+
+	// Open the site table
+	if((table = fopen(path, "r")) == NULL)
+	{
+		if(required)
+			fprintf(stderr, "%s: %s could not open site table %s, ranking peers by subnet only\n", SERVER_NAME, ERROR_MSG, path);
+		return -1;
+	}
+
+	// Read each line, skipping blank lines and comments
+	while(fgets(line, sizeof(line), table) != NULL)
+	{
+		number++;
+		if((slash = strchr(line, '#')) != NULL)
+			*slash = '\0';
+		name[0] = '\0';
+		if(sscanf(line, "%63s %63s", prefix, name) < 1)
+			continue;
+
+		// Split the prefix into address and length, a bare address being a prefix of its whole length
+		if((slash = strchr(prefix, '/')) != NULL)
+			*slash++ = '\0';
+		if((v4 = locality_parse(prefix, addr)) == -1 || (slash != NULL && (*slash == '\0' || validate_int(slash) != 1)))
+		{
+			fprintf(stderr, "%s: %s invalid prefix on line %d of site table %s, skipping\n", SERVER_NAME, WARN_MSG, number, path);
+			continue;
+		}
+		bits = (slash != NULL) ? atoi(slash) : (v4 ? 32 : 128);
+		if(bits < 0 || bits > (v4 ? 32 : 128))
+		{
+			fprintf(stderr, "%s: %s invalid prefix length on line %d of site table %s, skipping\n", SERVER_NAME, WARN_MSG, number, path);
+			continue;
+		}
+
+		// An IPv4 prefix is held after the 96 bits which map it into IPv6
+		if(v4)
+			bits += 96;
+
+		// A prefix named after a site joins it, else it is a site of its own, named after its line
+		if(name[0] == '\0')
+			sprintf(name, "#%d", number);
+		if((site = locality_site(name)) == -1 || locality_insert(addr, bits, site) == -1)
+		{
+			fprintf(stderr, "%s: %s could not allocate site table\n", SERVER_NAME, ERROR_MSG);
+			fclose(table);
+			return -1;
+		}
+		loaded++;
+	}
+	fclose(table);
+
+	// Print how many prefixes were loaded
+	fprintf(stdout, "%s: %s loaded %d site prefixes in %d sites from %s\n", SERVER_NAME, OK_MSG, loaded, sites, path);
+
+	// Return number of prefixes
+	return loaded;
+}
+
+//------------------------ LOCALITY RANK ---------------------
+
+// locality_rank() orders peers by their proximity to the requester, nearest first.  Peers of the same rank keep their
+// order, so a listing ordered by address stays that way within each rank, and a random sample stays random.
+void locality_rank(char *requester, dir_row_t *rows, int count)
+{
+	// Requester's address, whether it is IPv4, and its site
+	unsigned char near[16];
+	int v4, site;
+
+	// Peer's address, whether it is IPv4, and rank of each row
+	unsigned char peer[16];
+	int peer_v4;
+	unsigned char *ranks;
+
+	// Number of rows of each rank, where the next row of each rank goes, rows in their new order, and indexer
+	int counts[LOCALITY_RANKS] = { 0 };
+	int next[LOCALITY_RANKS];
+	dir_row_t *ranked;
+	int i;
+
+	// Nothing to order, or the requester's address is unknown
+	if(count < 2 || (v4 = locality_parse(requester, near)) == -1)
+		return;
+	site = locality_lookup(near);
+
+	// Rank each peer
+	if((ranks = (unsigned char *)malloc(count)) == NULL)
+		return;
+	for(i = 0; i < count; i++)
+	{
+		if((peer_v4 = locality_parse(rows[i].key, peer)) == -1)
+			ranks[i] = LOCALITY_REMOTE;
+		else if(memcmp(near, peer, 16) == 0)
+			ranks[i] = LOCALITY_HOST;
+		else if(peer_v4 == v4 && memcmp(near, peer, v4 ? 15 : 8) == 0)
+			ranks[i] = LOCALITY_SUBNET;
+		else if(site != -1 && locality_lookup(peer) == site)
+			ranks[i] = LOCALITY_SITE;
+		else
+			ranks[i] = LOCALITY_REMOTE;
+		counts[ranks[i]]++;
+	}
+
+	// Order the rows by rank with a counting sort, which keeps rows of the same rank in order
+	if((ranked = (dir_row_t *)malloc(sizeof(dir_row_t) * count)) == NULL)
+	{
+		free(ranks);
+		return;
+	}
+	for(i = 0, next[0] = 0; i < LOCALITY_RANKS - 1; i++)
+		next[i + 1] = next[i] + counts[i];
+	for(i = 0; i < count; i++)
+		ranked[next[ranks[i]]++] = rows[i];
+	memcpy(rows, ranked, sizeof(dir_row_t) * count);
+	free(ranked);
+	free(ranks);
+}
@@ -0,0 +1,43 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:	 10/16/26
+	Project: p2pd
+	Module:	 locality.h
+
+	Description:
+	A header containing prototypes and constants used in locality.c
+*/
+
+#ifndef _LOCALITY_
+#define _LOCALITY_
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "dir.h"
+
+//------------------------ CONSTANTS -------------------------
+
+// Peer is the requester itself
+#define LOCALITY_HOST 0
+
+// Peer shares the requester's /24, or /64 for IPv6
+#define LOCALITY_SUBNET 1
+
+// Peer lies in the same site as the requester, as listed in the site table
+#define LOCALITY_SITE 2
+
+// Peer is anywhere else
+#define LOCALITY_REMOTE 3
+
+// Number of ranks
+#define LOCALITY_RANKS 4
+
+//------------------------ PROTOTYPES ------------------------
+
+// Prototype for locality_init(), which loads the table of site prefixes
+int locality_init(char *, int);
+
+// Prototype for locality_rank(), which orders peers by their proximity to a requester
+void locality_rank(char *, dir_row_t *, int);
+
+#endif
@@ -23,7 +23,6 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
-#include <sqlite3.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,20 +39,22 @@
 #include "functions.h"
 #include "main.h"
 #include "p2p.h"
+#include "dir.h"
+#include "session.h"
+#include "wheel.h"
+#include "locality.h"
+#include "bloom.h"
+#include "cache.h"
+#include "event.h"
+#include "uring.h"
 #include "thpool.h"
 
 //----------------------- GLOBAL VARIABLES -------------------
 
 //----------------------- SOCKET VARIABLES -------------------
 
-// Utilize global socket file descriptors, so that we may close them via signal handlers
-int loc_fd, inc_fd;
-
-// Storage for incoming socket address
-struct sockaddr_storage inc_addr;
-
-// Define length of incoming socket using the socklen_t primitive
-socklen_t inc_len = sizeof(inc_addr);
+// Utilize global socket file descriptor, so that we may close it via signal handlers
+int loc_fd;
 
 //----------------------- THREADING --------------------------
 
@@ -71,9 +72,18 @@ int daemonized = 0;
 // Define name of lockfile used in daemonized mode
 char *lock_location = LOCKFILE;
 
-// Initialize number of threads in pool to the default number
+// Initialize maximum number of threads in pool to the default number
 int num_threads = NUM_THREADS;
 
+// Initialize number of threads kept in pool when idle to the default number
+int idle_threads = IDLE_THREADS;
+
+// Initialize thread stack size to the default number of kilobytes
+int stack_kb = THREAD_STACK;
+
+// Initialize thread pool scheduling to the default shared queue
+int tp_mode = THPOOL_FIFO;
+
 // Globally declared pidfile, so it may be closed by signal handler
 int pidfile;
 
@@ -83,13 +93,23 @@ char *port = (char *)DEFAULT_PORT;
 // Initialize connection queue length to the default number
 int queue_length = QUEUE_LENGTH;
 
-//------------------------ MISCELLANEOUS --------------------
+// Initialize maximum number of connected clients to the default number
+int max_clients = MAX_CLIENTS;
 
-// Create buffer for storing client's IP address
-char clientaddr[128] = { '\0' };
+// Initialize network I/O engine to the default epoll reactor
+int io_engine = IO_EPOLL;
 
-// SQLite database access struct
-sqlite3 *db;
+// Initialize directory backend to the default in-memory index
+int dir_backend = DIR_MEMORY;
+
+// Initialize number of seconds a silent client's lease lasts to the default number
+int lease_seconds = LEASE_SECONDS;
+
+// Initialize site table location to the default location, which need not exist unless another is specified
+char *site_location = (char *)SITE_FILE;
+int site_required = 0;
+
+//------------------------ MISCELLANEOUS --------------------
 
 // Create a start time clock
 time_t start_time;
@@ -150,13 +170,10 @@ void shutdown_handler()
 	// Print newline to clean up output
 	fprintf(stdout, "\n");
 
-	// Close SQLite database
-	if(sqlite3_close(db) != SQLITE_OK)
-	{
-		// On failure, print error to console and exit
-		fprintf(stderr, "%s: %s sqlite: failed to close database\n", SERVER_NAME, ERROR_MSG);
-		exit(-1);
-	}
+	// Stop expiring leases and sessions, then close the directory backend
+	wheel_close();
+	session_close();
+	dir_close();
 
         // Attempt to shutdown the local socket
         if(shutdown(loc_fd, 2) == -1)
@@ -198,8 +215,11 @@ void print_stats()
 	// Create a buffer to store total elapsed time
 	char runtime[32] = { '\0' };
 
-	// Create a buffer to store thread pool usage calculations
-	char tpusage[32] = { '\0' };
+	// Create a buffer to store client capacity usage calculations
+	char tpusage[64] = { '\0' };
+
+	// Create variables to count REQUEST lookups of the SQLite backend's filename filter and cache
+	unsigned long checked, negative, hits, misses;
 
 	//------------------ CALCULATE RUNTIME ---------------------
 
@@ -221,44 +241,52 @@ void print_stats()
 	// Combine all time information into a single string
 	sprintf(runtime, "%02d:%02d:%02d", hours, minutes, seconds);
 
-	//----------------- CALCULATE THREAD POOL USAGE -------------
+	//----------------- CALCULATE CLIENT CAPACITY USAGE --------
 
-	// Begin calculating thread pool usage, setting message type accordingly
-	// If thread pool is under-capacity...
-	if(client_count(0) < (num_threads * TP_UTIL))
+	// Begin calculating client capacity usage, setting message type accordingly
+	// If server is under-capacity...
+	if(client_count(0) < (max_clients * TP_UTIL))
 	{
 		// Set message type to OK
 		fprintf(stdout, "%s: %s ", SERVER_NAME, OK_MSG);
 
 		// Format users string as normal
-		sprintf(tpusage, "[users: %d/%d]", client_count(0), num_threads);
+		sprintf(tpusage, "[users: %d/%d]", client_count(0), max_clients);
 	}
-	// If thread pool is near or at-capacity...
-	else if(((double)client_count(0) >= ((double)num_threads * TP_UTIL)) && client_count(0) <= num_threads)
+	// If server is near or at-capacity...
+	else if(((double)client_count(0) >= ((double)max_clients * TP_UTIL)) && client_count(0) <= max_clients)
 	{
 		// Set message type to WARN
 		fprintf(stdout, "%s: %s ", SERVER_NAME, WARN_MSG);
 
 		// Format users string with warning color
-		sprintf(tpusage, "\033[1;33m[users: %d/%d]\033[0m", client_count(0), num_threads);
+		sprintf(tpusage, "\033[1;33m[users: %d/%d]\033[0m", client_count(0), max_clients);
 	}
-	// Finally, if thread pool is over-capacity...
+	// Finally, if server is over-capacity...
 	else
 	{
 		// Set message type to ERROR
 		fprintf(stdout, "%s: %s ", SERVER_NAME, ERROR_MSG);
 
 		// Format users string with error color
-		sprintf(tpusage, "\033[1;31m[users: %d/%d]\033[0m", client_count(0), num_threads);
+		sprintf(tpusage, "\033[1;31m[users: %d/%d]\033[0m", client_count(0), max_clients);
 	}
 	
 	//----------------- PRINT STATISTICS ------------------------
 
 	// Print out server statistics, differ slightly if daemonized
 	if(daemonized == 1)
-		fprintf(stdout, "daemon running [PID: %d] [time: %s] [lock: %s] [port: %s] [queue: %d] %s\n", getpid(), runtime, lock_location, port, queue_length, tpusage);
+		fprintf(stdout, "daemon running [PID: %d] [time: %s] [lock: %s] [port: %s] [queue: %d] [threads: %d/%d] %s\n", getpid(), runtime, lock_location, port, queue_length, thpool_threads_alive(threadpool), num_threads, tpusage);
 	else
-		fprintf(stdout, "server running [PID: %d] [time: %s] [port: %s] [queue: %d] %s\n", getpid(), runtime, port, queue_length, tpusage);
+		fprintf(stdout, "server running [PID: %d] [time: %s] [port: %s] [queue: %d] [threads: %d/%d] %s\n", getpid(), runtime, port, queue_length, thpool_threads_alive(threadpool), num_threads, tpusage);
+
+	// With the SQLite backend, print how many REQUESTs the filename filter ruled out, and the cache answered
+	if(dir_backend == DIR_SQLITE)
+	{
+		bloom_stats(&checked, &negative);
+		cache_stats(&hits, &misses);
+		fprintf(stdout, "%s: %s request filter [ruled out: %lu/%lu, %.1f%%] request cache [hits: %lu/%lu, %.1f%%]\n", SERVER_NAME, INFO_MSG, negative, checked, (checked > 0) ? 100.0 * negative / checked : 0.0, hits, hits + misses, (hits + misses > 0) ? 100.0 * hits / (hits + misses) : 0.0);
+	}
 }
 
 //----------------------- MAIN -------------------------------
@@ -280,12 +308,6 @@ int main(int argc, char *argv[])
 	// Define a generic indexer variable for loops
 	int i = 0;
 
-	// Set up SQLite statement struct
-	sqlite3_stmt *stmt;
-
-	// Create a buffer to store queries to process on the database
-	char query[256] = { '\0' };
-
 	//------------------ INITIALIZE SIGNAL HANDLERS ---------------
 
 	// Install signal handlers for graceful shutdown
@@ -305,6 +327,9 @@ int main(int argc, char *argv[])
 	// Install SIGUSR2 signal handler
 	signal(SIGUSR2, stat_handler);
 
+	// Ignore SIGPIPE, so that writing to a client which has hung up cannot terminate the server
+	signal(SIGPIPE, SIG_IGN);
+
 	//------------------ BEGIN SERVER INITIALIZATION --------------
 
 	// Read in terminal on which server was started
@@ -321,26 +346,116 @@ int main(int argc, char *argv[])
 	// Iterate through all argv command line arguments, parsing out necessary flags
 	for(i = 1; i < argc; i++)
 	{
+		// '-b' or '--backend' flag: specify the directory backend
+		if(strcmp("-b", argv[i]) == 0 || strcmp("--backend", argv[i]) == 0)
+		{
+			// Make sure another argument exists, specifying the backend
+			if(argv[i+1] != NULL)
+			{
+				// Select the backend by name, else use the default
+				if(strcmp("sqlite", argv[i+1]) == 0)
+				{
+					dir_backend = DIR_SQLITE;
+					i++;
+				}
+				else if(strcmp("memory", argv[i+1]) == 0)
+				{
+					dir_backend = DIR_MEMORY;
+					i++;
+				}
+				else
+					fprintf(stderr, "%s: %s unknown backend '%s' specified, defaulting to memory\n", SERVER_NAME, ERROR_MSG, argv[i+1]);
+			}
+			else
+			{
+				// Print error and use default backend if no backend was specified after the flag
+				fprintf(stderr, "%s: %s no backend specified after flag, defaulting to memory\n", SERVER_NAME, ERROR_MSG);
+			}
+		}
+		// '-c' or '--clients' flag: specify the maximum number of simultaneously connected clients
+		else if(strcmp("-c", argv[i]) == 0 || strcmp("--clients", argv[i]) == 0)
+		{
+			// Make sure next argument exists, specifying the number of clients
+			if(argv[i+1] != NULL)
+			{
+				// Ensure this number is a valid integer
+				if(validate_int(argv[i+1]))
+				{
+					// Set maximum number of clients to the number specified on the command line, if it's a number more than 0, else use the default
+					if(atoi(argv[i+1]) >= 1)
+					{
+						max_clients = atoi(argv[i+1]);
+						i++;
+					}
+					else
+						fprintf(stderr, "%s: %s cannot use negative or zero clients, defaulting to %d clients\n", SERVER_NAME, ERROR_MSG, MAX_CLIENTS);
+				}
+				else
+				{
+					// Print error and use default number of clients if an invalid number was specified
+					fprintf(stderr, "%s: %s invalid number of clients specified, defaulting to %d clients\n", SERVER_NAME, ERROR_MSG, MAX_CLIENTS);
+				}
+			}
+			else
+			{
+				// Print error and use default number of clients if no count was specified after the flag
+				fprintf(stderr, "%s: %s no client count specified after flag, defaulting to %d clients\n", SERVER_NAME, ERROR_MSG, MAX_CLIENTS);
+			}
+		}
 		// '-d' or '--daemon' flag: daemonize the server, and run it in the background
-		if(strcmp("-d", argv[i]) == 0 || strcmp("--daemon", argv[i]) == 0)
+		else if(strcmp("-d", argv[i]) == 0 || strcmp("--daemon", argv[i]) == 0)
 		{
 			// Set daemon flag to true, so we may daemonize later
 			daemonized = 1;
 		}
+		// '-e' or '--engine' flag: specify the network I/O engine
+		else if(strcmp("-e", argv[i]) == 0 || strcmp("--engine", argv[i]) == 0)
+		{
+			// Make sure another argument exists, specifying the engine
+			if(argv[i+1] != NULL)
+			{
+				// Select the engine by name, else use the default
+				if(strcmp("uring", argv[i+1]) == 0)
+				{
+					io_engine = IO_URING;
+					i++;
+				}
+				else if(strcmp("epoll", argv[i+1]) == 0)
+				{
+					io_engine = IO_EPOLL;
+					i++;
+				}
+				else
+					fprintf(stderr, "%s: %s unknown engine '%s' specified, defaulting to epoll\n", SERVER_NAME, ERROR_MSG, argv[i+1]);
+			}
+			else
+			{
+				// Print error and use default engine if no engine was specified after the flag
+				fprintf(stderr, "%s: %s no engine specified after flag, defaulting to epoll\n", SERVER_NAME, ERROR_MSG);
+			}
+		}
 		// '-h' or '--help' flag: print help and usage for this server, then exit
 		else if(strcmp("-h", argv[i]) == 0 || strcmp("--help", argv[i]) == 0)
 		{
 			// Print usage message
-			fprintf(stdout, "usage: %s [-d | --daemon] [-h | --help] [-l | --lock lock_file] [-p | --port port] [-q | --queue queue_length] [-t | --threads thread_count]\n\n", SERVER_NAME);
+			fprintf(stdout, "usage: %s [-b | --backend memory|sqlite] [-c | --clients max_clients] [-d | --daemon] [-e | --engine epoll|uring] [-h | --help] [-i | --idle idle_threads] [-k | --stack stack_kb] [-l | --lock lock_file] [-n | --sites site_file] [-p | --port port] [-q | --queue queue_length] [-r | --lease lease_seconds] [-s | --scheduler fifo|steal] [-t | --threads thread_count]\n\n", SERVER_NAME);
 
 			// Print out all available flags
 			fprintf(stdout, "%s flags:\n", SERVER_NAME);
+			fprintf(stdout, "\t-b | --backend:      backend - specify the directory backend, memory or sqlite (default: memory)\n");
+			fprintf(stdout, "\t-c | --clients:  max_clients - specify the maximum number of simultaneously connected clients (default: %d)\n", MAX_CLIENTS);
 			fprintf(stdout, "\t-d | --daemon:     daemonize - start server as a daemon, running it in the background\n");
+			fprintf(stdout, "\t-e | --engine:        engine - specify the network I/O engine, epoll or uring (falls back to epoll if io_uring is unavailable) (default: epoll)\n");
 			fprintf(stdout, "\t-h | --help:            help - print usage information and details about each flag the server accepts\n");
+			fprintf(stdout, "\t-i | --idle:    idle_threads - specify the number of threads kept when idle, more are started under load (default: %d)\n", IDLE_THREADS);
+			fprintf(stdout, "\t-k | --stack:       stack_kb - specify the stack size of each thread in the thread pool, in kilobytes (default: %d)\n", THREAD_STACK);
 			fprintf(stdout, "\t-l | --lock:       lock_file - specify the location of the lock file utilized when the server is daemonized (default: %s)\n", LOCKFILE);
+			fprintf(stdout, "\t-n | --sites:      site_file - specify the table of site prefixes, by which peers are ranked in REQUEST replies (default: %s)\n", SITE_FILE);
 			fprintf(stdout, "\t-p | --port:            port - specify an alternative port number to run the server (default: %s)\n", DEFAULT_PORT);
 			fprintf(stdout, "\t-q | --queue:   queue_length - specify the connection queue length for the incoming socket (default: %d)\n", QUEUE_LENGTH);
-			fprintf(stdout, "\t-t | --threads: thread_count - specify the number of threads to generate (max number of clients) (default: %d)\n", NUM_THREADS);
+			fprintf(stdout, "\t-r | --lease:  lease_seconds - specify the number of seconds a client may stay silent before it is disconnected, 0 to never (default: %d)\n", LEASE_SECONDS);
+			fprintf(stdout, "\t-s | --scheduler:  scheduler - specify the thread pool scheduler, a shared fifo queue, or per-thread work-stealing deques (default: fifo)\n");
+			fprintf(stdout, "\t-t | --threads: thread_count - specify the maximum number of threads to generate (concurrently running commands) (default: %d)\n", NUM_THREADS);
 			fprintf(stdout, "\n");
 
 			// Print out all available console commands via the common console_help() function
@@ -349,6 +464,66 @@ int main(int argc, char *argv[])
 			// Exit the server
 			exit(0);
 		}
+		// '-i' or '--idle' flag: specify the number of threads kept in the thread pool when idle
+		else if(strcmp("-i", argv[i]) == 0 || strcmp("--idle", argv[i]) == 0)
+		{
+			// Make sure next argument exists, specifying the number of threads
+			if(argv[i+1] != NULL)
+			{
+				// Ensure this number is a valid integer
+				if(validate_int(argv[i+1]))
+				{
+					// Set number of idle threads to the number specified on the command line, if it's a number more than 0, else use the default
+					if(atoi(argv[i+1]) >= 1)
+					{
+						idle_threads = atoi(argv[i+1]);
+						i++;
+					}
+					else
+						fprintf(stderr, "%s: %s cannot use negative or zero threads, defaulting to %d idle threads\n", SERVER_NAME, ERROR_MSG, IDLE_THREADS);
+				}
+				else
+				{
+					// Print error and use default number of idle threads if an invalid number was specified
+					fprintf(stderr, "%s: %s invalid number of idle threads specified, defaulting to %d idle threads\n", SERVER_NAME, ERROR_MSG, IDLE_THREADS);
+				}
+			}
+			else
+			{
+				// Print error and use default number of idle threads if no count was specified after the flag
+				fprintf(stderr, "%s: %s no idle thread count specified after flag, defaulting to %d idle threads\n", SERVER_NAME, ERROR_MSG, IDLE_THREADS);
+			}
+		}
+		// '-k' or '--stack' flag: specify the stack size of each thread in the thread pool
+		else if(strcmp("-k", argv[i]) == 0 || strcmp("--stack", argv[i]) == 0)
+		{
+			// Make sure next argument exists, specifying the stack size in kilobytes
+			if(argv[i+1] != NULL)
+			{
+				// Ensure this number is a valid integer
+				if(validate_int(argv[i+1]))
+				{
+					// Set stack size to the number of kilobytes specified on the command line, if it's a number more than 0, else use the default
+					if(atoi(argv[i+1]) >= 1)
+					{
+						stack_kb = atoi(argv[i+1]);
+						i++;
+					}
+					else
+						fprintf(stderr, "%s: %s cannot use a negative or zero stack size, defaulting to %dKB\n", SERVER_NAME, ERROR_MSG, THREAD_STACK);
+				}
+				else
+				{
+					// Print error and use default stack size if an invalid number was specified
+					fprintf(stderr, "%s: %s invalid stack size specified, defaulting to %dKB\n", SERVER_NAME, ERROR_MSG, THREAD_STACK);
+				}
+			}
+			else
+			{
+				// Print error and use default stack size if no size was specified after the flag
+				fprintf(stderr, "%s: %s no stack size specified after flag, defaulting to %dKB\n", SERVER_NAME, ERROR_MSG, THREAD_STACK);
+			}
+		}
 		// '-l' or '--lock' flag: specify an alternate lock file location
 		else if(strcmp("-l", argv[i]) == 0 || strcmp("--lock", argv[i]) == 0)
 		{
@@ -365,6 +540,23 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "%s: %s no lockfile location specified, defaulting to %s\n", SERVER_NAME, ERROR_MSG, LOCKFILE);
 			}
 		}
+		// '-n' or '--sites' flag: specify an alternate site table location
+		else if(strcmp("-n", argv[i]) == 0 || strcmp("--sites", argv[i]) == 0)
+		{
+			// Make sure that another argument exists, specifying the site table location
+			if(argv[i+1] != NULL)
+			{
+				// Set site table location as specified on the command line, which must now exist
+				site_location = argv[i+1];
+				site_required = 1;
+				i++;
+			}
+			else
+			{
+				// Print error and use default location if no site table was specified after the flag
+				fprintf(stderr, "%s: %s no site table location specified, defaulting to %s\n", SERVER_NAME, ERROR_MSG, SITE_FILE);
+			}
+		}
 		// '-p' or '--port' flag: specifies an alternative port number to run the server
 		else if(strcmp("-p", argv[i]) == 0 || strcmp("--port", argv[i]) == 0)
 		{
@@ -425,7 +617,58 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "%s: %s no queue length specified after flag, default to length %d\n", SERVER_NAME, ERROR_MSG, QUEUE_LENGTH);
 			}
 		}
-		// '-t' or '--threads' flag: specify the number of threads to generate in the thread pool
+		// '-r' or '--lease' flag: specify the number of seconds a client may stay silent before it is disconnected
+		else if(strcmp("-r", argv[i]) == 0 || strcmp("--lease", argv[i]) == 0)
+		{
+			// Make sure next argument exists, specifying the lease length
+			if(argv[i+1] != NULL)
+			{
+				// Ensure this number is a valid integer
+				if(validate_int(argv[i+1]))
+				{
+					// Set lease length to the number specified on the command line, where 0 disables leases
+					lease_seconds = atoi(argv[i+1]);
+					i++;
+				}
+				else
+				{
+					// Print error and use default lease length if an invalid number was specified
+					fprintf(stderr, "%s: %s invalid lease length specified, defaulting to %d seconds\n", SERVER_NAME, ERROR_MSG, LEASE_SECONDS);
+				}
+			}
+			else
+			{
+				// Print error and use default lease length if no length was specified after the flag
+				fprintf(stderr, "%s: %s no lease length specified after flag, defaulting to %d seconds\n", SERVER_NAME, ERROR_MSG, LEASE_SECONDS);
+			}
+		}
+		// '-s' or '--scheduler' flag: specify how the thread pool hands out jobs
+		else if(strcmp("-s", argv[i]) == 0 || strcmp("--scheduler", argv[i]) == 0)
+		{
+			// Make sure another argument exists, specifying the scheduler
+			if(argv[i+1] != NULL)
+			{
+				// Select the scheduler by name, else use the default
+				if(strcmp("steal", argv[i+1]) == 0)
+				{
+					tp_mode = THPOOL_STEAL;
+					i++;
+				}
+				else if(strcmp("fifo", argv[i+1]) == 0)
+				{
+					tp_mode = THPOOL_FIFO;
+					i++;
+				}
+				else
+					fprintf(stderr, "%s: %s unknown scheduler '%s' specified, defaulting to fifo\n", SERVER_NAME, ERROR_MSG, argv[i+1]);
+			}
+			else
+			{
+				// Print error and use default scheduler if no scheduler was specified after the flag
+				fprintf(stderr, "%s: %s no scheduler specified after flag, defaulting to fifo\n", SERVER_NAME, ERROR_MSG);
+			}
+		}
+		// '-t' or '--threads' flag: specify the maximum number of threads in the thread pool
 		else if(strcmp("-t", argv[i]) == 0 || strcmp("--threads", argv[i]) == 0)
 		{
 			// Make sure next argument exists, specifying the number of threads
@@ -463,29 +706,30 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	//------------------------ OPEN SQLITE DATABASE ----------------
+	//------------------------ INITIALIZE DIRECTORY ---------------
 
-	// Open database file, as specified in config header; check for success
-	sqlite3_open(DB_FILE, &db);
-	if(db == NULL)
+	// Prepare the directory backend, opening and truncating the database if SQLite was selected
+	if(dir_init(dir_backend) == -1)
 	{
-		// Print an error message and quit if database fails to open
-		fprintf(stderr, "%s: %s sqlite: could not open database %s\n", SERVER_NAME, ERROR_MSG, DB_FILE);
+		// Print an error message and quit if the directory cannot be prepared
+		fprintf(stderr, "%s: %s could not initialize %s directory\n", SERVER_NAME, ERROR_MSG, (dir_backend == DIR_SQLITE) ? "sqlite" : "memory");
 		exit(-1);
 	}
 
-	// Create a query to truncate the files table in the database
-	sprintf(query, "DELETE FROM files");
+	//------------------------ INITIALIZE SITE TABLE -------------
+
+	// Load the site prefixes by which peers are ranked, peers are still ranked by subnet without them
+	locality_init(site_location, site_required);
 
-	// Prepare, evaluate, and finalize SQLite query
-	sqlite3_prepare_v2(db, query, strlen(query) + 1, &stmt, NULL);
-	if(sqlite3_step(stmt) != SQLITE_DONE)
+	//------------------------ INITIALIZE CONNECTION POOLS --------
+
+	// Preallocate connection state and reply blocks, sized from the maximum number of clients
+	if(p2p_init() == -1)
 	{
-		// On query failure, print an error and exit
-		fprintf(stderr, "%s: %s sqlite: could not truncate files table\n", SERVER_NAME, ERROR_MSG);
+		// Print an error message and quit if the pools cannot be allocated
+		fprintf(stderr, "%s: %s could not initialize connection pools\n", SERVER_NAME, ERROR_MSG);
 		exit(-1);
 	}
-	sqlite3_finalize(stmt);
 
 	//------------------------ INITIALIZE TCP SERVER ---------------
 
@@ -553,14 +797,14 @@ int main(int argc, char *argv[])
 		daemonize();
 	else
 	{	
-		// Initialize a thread pool, using number of threads as defined earlier
-		threadpool = thpool_init(num_threads);
+		// Initialize a thread pool, starting the idle number of threads and growing up to the maximum as defined earlier
+		threadpool = thpool_init_elastic(idle_threads, num_threads, tp_mode, (size_t)stack_kb * 1024);
 
 		// Initialize the network thread to handle all incoming connections
 		pthread_create(&net_thread, NULL, &tcp_listen, NULL);
 	
 		// Print out server information and ready message
-		fprintf(stdout, "%s: %s server initialized [PID: %d] [port: %s] [queue: %d] [threads: %d]\n", SERVER_NAME, OK_MSG, getpid(), port, queue_length, num_threads);
+		fprintf(stdout, "%s: %s server initialized [PID: %d] [port: %s] [queue: %d] [threads: %d] [clients: %d]\n", SERVER_NAME, OK_MSG, getpid(), port, queue_length, num_threads, max_clients);
 
 		// If server is not being daemonized, use the default console interface
 		fprintf(stdout, "%s: %s type 'stop' or hit Ctrl+C (SIGINT) to stop server\n", SERVER_NAME, INFO_MSG);
@@ -601,59 +845,31 @@ int main(int argc, char *argv[])
 // Function called by network thread, used to separate the TCP listener from the console thread
 void *tcp_listen()
 {
-	// Set up p2p_t struct, to pass variables into the thread function
-	p2p_t params;
-
-	// Create output buffer, in case the base server must communicate directly to the client
-	char out[512] = { '\0' };
-
-	// Loop infinitely until Ctrl+C SIGINT is caught by the signal handler
-   	while(1)
+	// If the io_uring engine was requested, set it up, falling back to epoll if the kernel does not support it
+	if(io_engine == IO_URING)
 	{
-		// Attempt to accept incoming connections using the incoming socket
-		if((inc_fd = accept(loc_fd, (struct sockaddr *)&inc_addr, &inc_len)) == -1)
+		// Run the ring until Ctrl+C SIGINT is caught by the signal handler
+		if(uring_init(loc_fd) == 0)
 		{
-			// Print an error message and quit if server cannot accept connections
-			fprintf(stderr, "%s: %s failed to accept incoming connections\n", SERVER_NAME, ERROR_MSG);
-			return (void *)-1;
+			fprintf(stdout, "%s: %s io_uring engine initialized\n", SERVER_NAME, OK_MSG);
+			return uring_loop();
 		}
-		else
-		{
-			// If a connection is accepted, continue routines.
-			// Capture client's IP address for logging.
-			inet_ntop(inc_addr.ss_family, get_in_addr((struct sockaddr *)&inc_addr), clientaddr, sizeof(clientaddr));
-
-			// Print message when connection is received, and increment client counter
-			fprintf(stdout, "%s: %s client connected from %s [fd: %d] [users: %d/%d]\n", SERVER_NAME, OK_MSG, clientaddr, inc_fd, client_count(1), num_threads);
-
-			// If client count reaches the utilization threshold, print a warning
-			if(((double)client_count(0) >= ((double)num_threads * TP_UTIL)) && (client_count(0) <= num_threads))
-			{
-				// Print warning to server console, alter wording slightly if utilization is maxed out
-				if(client_count(0) == num_threads)
-					fprintf(stdout, "%s: %s thread pool exhausted [users: %d/%d]\n", SERVER_NAME, WARN_MSG, client_count(0), num_threads);
-				else
-					fprintf(stdout, "%s: %s thread pool nearing exhaustion [users: %d/%d]\n", SERVER_NAME, WARN_MSG, client_count(0), num_threads);
-			}
-			// If client count exceeds the number of threads in the pool, print an error
-			else if((client_count(0)) > num_threads)
-			{
-				// Print error to console
-				fprintf(stderr, "%s: %s thread pool over-exhausted [users: %d/%d]\n", SERVER_NAME, ERROR_MSG, client_count(0), num_threads);
-
-				// Generate message to send to client
-				sprintf(out, "%s: %s server has currently reached maximum user capacity, please wait\n", SERVER_NAME, USER_MSG);
-				send_msg(inc_fd, out);
-			}
 
-			// Store user's file descriptor and IP address in the params struct
-			params.fd = inc_fd;
-			strcpy(params.ipaddr, clientaddr);
+		// Else, print a warning and use the default engine
+		fprintf(stderr, "%s: %s io_uring engine unavailable, falling back to epoll\n", SERVER_NAME, WARN_MSG);
+		io_engine = IO_EPOLL;
+	}
 
-			// On client connection, add work to the threadpool, pass in params struct
-			thpool_add_work(threadpool, &p2p, (void*)&params);
-		}
+	// Set up the event loop on the local socket, print an error and quit on failure
+	if(event_init(loc_fd) == -1)
+	{
+		fprintf(stderr, "%s: %s failed to initialize event loop\n", SERVER_NAME, ERROR_MSG);
+		return (void *)-1;
 	}
+
+	// Run the event loop, accepting clients and dispatching their commands to the thread pool,
+	// until Ctrl+C SIGINT is caught by the signal handler
+	return event_loop();
 }
 
 //------------------------ DAEMONIZE -------------------------
@@ -727,7 +943,7 @@ void daemonize()
 	write(pidfile, pidstr, strlen(pidstr));
 
 	// Print success message
-	fprintf(stdout, "%s: %s daemonization complete [PID: %d] [lock: %s] [term: %s] [port: %s] [queue: %d] [threads: %d]\n", SERVER_NAME, OK_MSG, getpid(), lock_location, term, port, queue_length, num_threads);
+	fprintf(stdout, "%s: %s daemonization complete [PID: %d] [lock: %s] [term: %s] [port: %s] [queue: %d] [threads: %d] [clients: %d]\n", SERVER_NAME, OK_MSG, getpid(), lock_location, term, port, queue_length, num_threads, max_clients);
 
 	// Redirect standard streams to /dev/null
 	freopen("/dev/null", "r", stdin);
@@ -735,8 +951,8 @@ void daemonize()
 	freopen("/dev/null", "w", stderr);	
 
 	// When daemonizing, we must initialize the threadpool and listener thread here.	
-	// Initialize a thread pool, using number of threads as defined earlier
-	threadpool = thpool_init(num_threads);
+	// Initialize a thread pool, starting the idle number of threads and growing up to the maximum as defined earlier
+	threadpool = thpool_init_elastic(idle_threads, num_threads, tp_mode, (size_t)stack_kb * 1024);
 
 	// Initialize the network thread to handle all incoming connections
 	pthread_create(&net_thread, NULL, &tcp_listen, NULL);
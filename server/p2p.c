@@ -13,10 +13,17 @@
 
 //------------------------ C LIBRARIES -----------------------
 
-#include <sqlite3.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 //------------------------ CUSTOM LIBRARIES ------------------
@@ -24,368 +31,1474 @@
 #include "config.h"
 #include "functions.h"
 #include "p2p.h"
+#include "dir.h"
+#include "event.h"
+#include "uring.h"
+#include "thpool.h"
+#include "pool.h"
+#include "session.h"
+#include "wheel.h"
+#include "locality.h"
+
+//------------------------ GLOBAL VARIABLES ------------------
+
+// Reference externally defined threadpool, so a busy client may yield its worker
+extern thpool_t *threadpool;
+
+// Pool of connection state, one object for each client which may be connected at once
+static pool_t conn_pool;
+
+//------------------------ P2P INIT --------------------------
+
+// p2p_init() preallocates connection state for max_clients clients, and the pool of reply blocks, so accepting a
+// client does not allocate
+int p2p_init()
+{
+	// Preallocate connection state
+	if(pool_init(&conn_pool, sizeof(p2p_t), max_clients) == -1)
+	{
+		fprintf(stderr, "%s: %s could not preallocate connection state for %d clients\n", SERVER_NAME, ERROR_MSG, max_clients);
+		return -1;
+	}
+
+	// Preallocate reply blocks
+	if(out_init(OUTBUF_POOL) == -1)
+	{
+		fprintf(stderr, "%s: %s could not preallocate %d reply blocks\n", SERVER_NAME, ERROR_MSG, OUTBUF_POOL);
+		return -1;
+	}
+
+	// Return success
+	return 0;
+}
+
+//------------------------ P2P LEASE -------------------------
+
+// p2p_lease() is fired by the timer wheel as a client's lease may have run out.  Each command only records when it
+// arrived, so rather than moving the timer on every command, the lease is checked here, and the timer set again for
+// whatever remains of it.  Once it has run out, the socket is shut down both ways, so the network engine reports a
+// hang up, and any send still pending fails, even for a client which stopped reading its replies.  The client is then
+// disconnected by the usual routines, its session ending rather than being parked.
+// Returns the number of milliseconds until the lease must be checked again, or 0 once it has run out
+static long p2p_lease(wheel_timer_t *timer)
+{
+	// Connection state of the client, the milliseconds it has been silent for, and the reply bytes the kernel holds
+	p2p_t *conn = (p2p_t *)timer->arg;
+	long silent = (long)(wheel_clock() - __atomic_load_n(&conn->renewed, __ATOMIC_ACQUIRE)) * WHEEL_TICK_MS;
+	int unsent = 0;
+
+	// If the client was heard from within its lease, check again as the lease would run out
+	if(silent < lease_seconds * 1000L)
+		return lease_seconds * 1000L - silent;
+
+	// A reply small enough to sit wholly in the kernel's send buffer needs no more writes, so a client still reading it
+	// is only seen by the kernel's queue moving since the last check.  Renew its lease.
+	if(ioctl(conn->fd, SIOCOUTQ, &unsent) == 0 && unsent > 0 && unsent != conn->unsent)
+	{
+		conn->unsent = unsent;
+		return lease_seconds * 1000L;
+	}
+
+	// Else, disconnect the client, on failure print a warning
+	fprintf(stdout, "%s: %s lease of peer %s ran out, disconnecting [fd: %d]\n", SERVER_NAME, WARN_MSG, conn->ipaddr, conn->fd);
+	__atomic_store_n(&conn->quit, 1, __ATOMIC_RELEASE);
+	if(shutdown(conn->fd, SHUT_RDWR) == -1)
+		fprintf(stderr, "%s: %s could not shut down socket of expired peer %s [fd: %d]\n", SERVER_NAME, WARN_MSG, conn->ipaddr, conn->fd);
+
+	// Lease is done
+	return 0;
+}
+
+//------------------------ P2P OPEN --------------------------
+
+// p2p_open() creates the connection state for a newly accepted client, and greets it
+// Returns NULL if the client was turned away, in which case its socket has already been closed
+p2p_t *p2p_open(int fd, struct sockaddr_storage *addr)
+{
+	// Connection state for this client
+	p2p_t *conn;
+
+	// Socket option value
+	int on = 1;
+
+	// Create output buffer, in case the base server must communicate directly to the client
+	char out[512] = { '\0' };
+
+	// Create buffer for storing client's IP address
+	char clientaddr[128] = { '\0' };
+
+	// Capture client's IP address for logging.
+	inet_ntop(addr->ss_family, get_in_addr((struct sockaddr *)addr), clientaddr, sizeof(clientaddr));
+
+	// Print message when connection is received, and increment client counter
+	fprintf(stdout, "%s: %s client connected from %s [fd: %d] [users: %d/%d]\n", SERVER_NAME, OK_MSG, clientaddr, fd, client_count(1), max_clients);
+
+	// If client count reaches the utilization threshold, print a warning
+	if(((double)client_count(0) >= ((double)max_clients * TP_UTIL)) && (client_count(0) <= max_clients))
+	{
+		// Print warning to server console, alter wording slightly if utilization is maxed out
+		if(client_count(0) == max_clients)
+			fprintf(stdout, "%s: %s client capacity exhausted [users: %d/%d]\n", SERVER_NAME, WARN_MSG, client_count(0), max_clients);
+		else
+			fprintf(stdout, "%s: %s client capacity nearing exhaustion [users: %d/%d]\n", SERVER_NAME, WARN_MSG, client_count(0), max_clients);
+	}
+	// If client count exceeds the maximum number of clients, print an error and turn the client away
+	else if(client_count(0) > max_clients)
+	{
+		// Print error to console
+		fprintf(stderr, "%s: %s client capacity over-exhausted [users: %d/%d]\n", SERVER_NAME, ERROR_MSG, client_count(0), max_clients);
+
+		// Generate message to send to client
+		sprintf(out, "%s: %s server has currently reached maximum user capacity, please try again later\n", SERVER_NAME, USER_MSG);
+		send_msg(fd, out);
+
+		// Decrement client counter, close the socket
+		client_count(-1);
+		close(fd);
+		return NULL;
+	}
+
+	// Take connection state from the pool
+	if((conn = (p2p_t *)pool_alloc(&conn_pool)) == NULL)
+	{
+		// On failure, print an error, and drop the client
+		fprintf(stderr, "%s: %s could not allocate memory for client [fd: %d]\n", SERVER_NAME, ERROR_MSG, fd);
+		client_count(-1);
+		close(fd);
+		return NULL;
+	}
+
+	// Clear connection state, then store user's file descriptor and IP address, client must now perform the handshake
+	memset(conn, 0, sizeof(p2p_t));
+	conn->fd = fd;
+	strcpy(conn->ipaddr, clientaddr);
+	conn->state = P2P_HANDSHAKE;
+	pthread_mutex_init(&conn->lock, NULL);
+
+	// Grant the client its lease, which each command renews
+	conn->renewed = wheel_clock();
+	conn->lease.fire = p2p_lease;
+	conn->lease.arg = conn;
+	if(lease_seconds > 0)
+		wheel_add(&conn->lease, lease_seconds * 1000L);
+
+	// Replies are already coalesced into as few writes as possible, so disable Nagle's algorithm, which would only
+	// delay the final segment of each batch waiting on the client's ACK
+	if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1)
+		fprintf(stderr, "%s: %s could not disable Nagle's algorithm for client [fd: %d]\n", SERVER_NAME, WARN_MSG, fd);
+
+	// Send user a message to describe the server
+	sprintf(out, "%s: %s Justin Hill, Gordon Keesler, and Matt Layher\n", SERVER_NAME, USER_MSG);
+	p2p_send(conn, out);
+	p2p_flush(conn, 0);
+
+	// Return connection state
+	return conn;
+}
 
 //------------------------ P2P -------------------------------
 
+// p2p() is run by the thread pool whenever a client becomes readable, or writable with replies still buffered.  It
+// frames and runs every buffered command, reading more input until the socket would block, then sends the replies
+// together and hands the client back to the network engine, or disconnects it on QUIT or hang up.
 void *p2p(void *args)
 {
-	// Create and clear input and output buffers
-	char in[512],out[512] = { '\0' };
+	// Connection state, passed in from the network engine
+	p2p_t *conn = (p2p_t *)args;
+
+	// Number of bytes received, length of the current command, and number of commands run during this job
+	int b_received = 0;
+	int length = 0;
+	int commands = 0;
 
-	// Create p2p_t params struct from thread arguments
-	p2p_t params = *((p2p_t *)(args));
+	// A disconnected client only has its final replies left to send
+	if(conn->state == P2P_DRAINING)
+	{
+		p2p_drain(conn);
+		return (void *)0;
+	}
+
+	// Loop until the client disconnects, or the socket has no more data
+	while(conn->state != P2P_CLOSED)
+	{
+		// If this client has kept the worker busy for a while, send its replies and requeue it so other clients get a turn
+		if(commands == COMMAND_BATCH)
+		{
+			if(p2p_flush(conn, 0) == -1)
+				conn->state = P2P_CLOSED;
+			else
+			{
+				thpool_requeue_work(threadpool, &p2p, (void *)conn);
+				return (void *)0;
+			}
+			continue;
+		}
+
+		// If the client is not reading its replies, stop running its commands until they drain.  The io_uring engine
+		// hands every flush to the ring, which schedules the client again once enough of its replies are sent.
+		if(io_engine == IO_URING && uring_wait(conn) == 1)
+			return (void *)0;
+
+		// The epoll engine leaves replies buffered here until the socket drains
+		if(conn->outbuf.bytes >= OUTBUF_HIGHWATER)
+		{
+			// Write out what the socket will take, on failure begin disconnect
+			if(p2p_flush(conn, 0) == -1)
+			{
+				conn->state = P2P_CLOSED;
+				continue;
+			}
+
+			// If the buffer is still past the high-water mark, wait for the socket to become writable
+			if(conn->outbuf.bytes >= OUTBUF_HIGHWATER)
+			{
+				if(event_rearm(conn) == -1)
+					conn->state = P2P_CLOSED;
+				else
+					return (void *)0;
+			}
+			continue;
+		}
+
+		// Run the next complete command already in the input buffer
+		if((length = ring_line(&conn->inbuf, conn->in, sizeof(conn->in))) >= 0)
+		{
+			// Client frames its commands by newline
+			conn->framed = 1;
+			commands++;
+
+			// Clean input, and run the command
+			clean_string(conn->in);
+			p2p_command(conn, conn->in);
+			continue;
+		}
+		// If the command is too long to buffer, it is discarded, so report it as invalid (error C0)
+		else if(length == -2)
+		{
+			commands++;
+			p2p_send(conn, "ERROR C0\n");
+			continue;
+		}
+
+		// Else, receive more of the user's input from the active network engine
+		if(io_engine == IO_URING)
+			b_received = uring_recv(conn, &conn->inbuf);
+		else
+			b_received = recv_msg(conn->fd, &conn->inbuf);
+
+		// Input arrived, so go back to framing commands
+		if(b_received > 0)
+			continue;
+		// If the client hung up, begin disconnect
+		else if(b_received == 0)
+			conn->state = P2P_CLOSED;
+		// If interrupted, retry the read
+		else if(errno == EINTR)
+			continue;
+		// If the socket is drained, wait for the network engine to report more input
+		else if(errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			// Older clients end a command by waiting for its reply rather than with a newline.  Until a client
+			// sends a newline, treat everything it sent before pausing as a single command.
+			if(!conn->framed && ring_used(&conn->inbuf) > 0)
+			{
+				commands++;
+				ring_take(&conn->inbuf, conn->in, sizeof(conn->in));
+				clean_string(conn->in);
+				p2p_command(conn, conn->in);
+				continue;
+			}
+
+			// Send all replies to the commands just run in one write, on failure begin disconnect
+			if(p2p_flush(conn, 0) == -1)
+				conn->state = P2P_CLOSED;
+			// Re-arm the client, on failure begin disconnect
+			else if((io_engine == IO_URING ? uring_rearm(conn) : event_rearm(conn)) == -1)
+				conn->state = P2P_CLOSED;
+			else
+				return (void *)0;
+		}
+		// Else, a socket error occurred, begin disconnect
+		else
+			conn->state = P2P_CLOSED;
+	}
+
+	// Once the client is closed, begin disconnect routines
+	p2p_close(conn);
+
+	// Exit with success
+	return (void *)0;
+}
+
+//------------------------ P2P SEND --------------------------
+
+// p2p_send() queues a reply in the client's reply buffer.  Once a large reply such as a LIST has built up past the
+// high-water mark, the buffer is written out early, with more to follow.
+int p2p_send(p2p_t *conn, char *message)
+{
+	return p2p_sendn(conn, message, strlen(message));
+}
+
+// p2p_sendn() queues the first length bytes of a reply, such as a filename in the middle of the LIST snapshot, in the
+// client's reply buffer, as p2p_send() does
+int p2p_sendn(p2p_t *conn, char *message, int length)
+{
+	// Append the reply to the buffer
+	if(out_write(&conn->outbuf, message, length) == -1)
+	{
+		// On failure, print an error, and mark the connection for disconnect
+		fprintf(stderr, "%s: %s could not allocate memory for reply to client [fd: %d]\n", SERVER_NAME, ERROR_MSG, conn->fd);
+		conn->state = P2P_CLOSED;
+		return -1;
+	}
+
+	// Past the high-water mark, write out what the socket will take now, and keep the rest buffered
+	if(conn->outbuf.bytes >= OUTBUF_HIGHWATER && p2p_flush(conn, 1) == -1)
+	{
+		conn->state = P2P_CLOSED;
+		return -1;
+	}
+
+	// Return number of bytes queued
+	return length;
+}
+
+//------------------------ P2P FLUSH -------------------------
+
+// p2p_flush() writes out the client's reply buffer, through whichever network engine the server was started with.
+// If more is set, the caller is still generating the reply, so the kernel may hold back a partial segment.
+// With the epoll engine, whatever the socket will not take stays buffered until the client is writable again.  A client
+// still reading its replies is not silent, so every write it takes renews its lease, as a command would.
+int p2p_flush(p2p_t *conn, int more)
+{
+	// The io_uring engine takes the whole chain of blocks, and sends it as linked writes
+	if(io_engine == IO_URING)
+	{
+		uring_send(conn, out_detach(&conn->outbuf));
+		return 0;
+	}
+
+	// Else, gather as many blocks as possible into each write, until the buffer is empty or the socket is full
+	while(conn->outbuf.bytes > 0)
+	{
+		if(out_send(&conn->outbuf, conn->fd, more) == -1)
+		{
+			// If interrupted, retry the write
+			if(errno == EINTR)
+				continue;
+
+			// If the socket is full, leave the remainder buffered
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			// Else, the client is gone
+			return -1;
+		}
+		__atomic_store_n(&conn->renewed, wheel_clock(), __ATOMIC_RELEASE);
+	}
+
+	// Return success
+	return 0;
+}
+
+//------------------------ P2P BATCH -------------------------
+
+// p2p_batch_free() discards the client's ADDBATCH or REQUESTM state, along with every record received so far
+static void p2p_batch_free(p2p_t *conn)
+{
+	// Indexer
+	int i;
+
+	// Free the line each valid record was parsed from, then the records and codes themselves
+	if(conn->batch != NULL)
+	{
+		for(i = 0; i < conn->batch_valid; i++)
+			free(conn->batch[i].line);
+		free(conn->batch);
+	}
+	free(conn->batch_codes);
+
+	// No batch is in progress any longer
+	conn->batch = NULL;
+	conn->batch_codes = NULL;
+	conn->batch_count = conn->batch_got = conn->batch_valid = 0;
+	conn->batch_request = conn->batch_sample = 0;
+}
+
+// p2p_batch_apply() adds every valid record of a complete ADDBATCH to the directory, then replies with the number of
+// files added and failed, and the index and error code of each record which failed
+static void p2p_batch_apply(p2p_t *conn)
+{
+	// Create output buffer
+	char out[512] = { '\0' };
+
+	// Number of records which failed, and indexer
+	int failed = 0;
+	int i;
+
+	// Add every valid record at once
+	if(dir_add_batch(conn->batch, conn->batch_valid, conn->ipaddr) == DIR_ERROR)
+	{
+		// Send error B0 (database error) to client, and mark connection for disconnect
+		sprintf(out, "ERROR B0\n");
+		p2p_send(conn, out);
+		conn->state = P2P_CLOSED;
+		p2p_batch_free(conn);
+		return;
+	}
+
+	// A valid record fails only if the peer already shares the same file (error A4)
+	for(i = 0; i < conn->batch_valid; i++)
+	{
+		if(conn->batch[i].status == DIR_EXISTS)
+			conn->batch_codes[conn->batch[i].index] = '4';
+	}
+
+	// Count the failures, and send the header
+	for(i = 0; i < conn->batch_count; i++)
+		failed += (conn->batch_codes[i] != '\0');
+	sprintf(out, "ADDED %d %d\n", conn->batch_count - failed, failed);
+	p2p_send(conn, out);
+
+	// Send the index and error code of each failed record
+	for(i = 0; i < conn->batch_count; i++)
+	{
+		if(conn->batch_codes[i] != '\0')
+		{
+			sprintf(out, "%d A%c\n", i, conn->batch_codes[i]);
+			p2p_send(conn, out);
+		}
+	}
+
+	// Print one line for the whole batch to console, rather than one for each file
+	fprintf(stdout, "%s: %s peer %s added %d files in batch [failed: %d]\n", SERVER_NAME, OK_MSG, conn->ipaddr, conn->batch_count - failed, failed);
+
+	// Return 'OK' to client, and end the batch
+	sprintf(out, "OK\n");
+	p2p_send(conn, out);
+	p2p_batch_free(conn);
+}
+
+// p2p_batch_record() parses one record of an ADDBATCH, with the same syntax and errors as the arguments of an ADD,
+// and applies the batch once every record has arrived
+static void p2p_batch_record(p2p_t *conn, char *in)
+{
+	// Record to fill, if this line is valid
+	dir_record_t *record = &conn->batch[conn->batch_valid];
+
+	// Size of the file
+	char *filesize;
+
+	// Keep a copy of the line, which the filename and hash point into
+	if((record->line = strdup(in)) == NULL)
+	{
+		// On failure, print an error, send error B0 (database error) to client, and mark connection for disconnect
+		fprintf(stderr, "%s: %s could not allocate memory for batch record [fd: %d]\n", SERVER_NAME, ERROR_MSG, conn->fd);
+		p2p_send(conn, "ERROR B0\n");
+		conn->state = P2P_CLOSED;
+		p2p_batch_free(conn);
+		return;
+	}
+
+	// Use strtok to grab the filename, filehash, and filesize
+	record->filename = strtok(record->line, " ");
+	record->filehash = (record->filename != NULL) ? strtok(NULL, " ") : NULL;
+	filesize = (record->filehash != NULL) ? strtok(NULL, " ") : NULL;
+
+	// Note error A1 (null filename), A2 (null filehash), or A3 (null/invalid filesize), else keep the record
+	if(record->filename == NULL)
+		conn->batch_codes[conn->batch_got] = '1';
+	else if(record->filehash == NULL)
+		conn->batch_codes[conn->batch_got] = '2';
+	else if(filesize == NULL || validate_int(filesize) != 1)
+		conn->batch_codes[conn->batch_got] = '3';
+	else
+	{
+		record->size = atol(filesize);
+		record->index = conn->batch_got;
+		record->status = DIR_ERROR;
+		conn->batch_valid++;
+	}
+
+	// A record which is not kept does not need its line
+	if(conn->batch_codes[conn->batch_got] != '\0')
+		free(record->line);
+
+	// Once every record has arrived, apply the batch
+	if(++conn->batch_got == conn->batch_count)
+		p2p_batch_apply(conn);
+}
+
+// p2p_multi_apply() looks up every file of a complete REQUESTM at once, then replies with a group for each file, in the
+// order they were sent: a header with the number of peers and the filename, then each peer, as REQUEST would send them
+static void p2p_multi_apply(p2p_t *conn)
+{
+	// Create output buffer
+	char out[512] = { '\0' };
+
+	// Record being replied to, and indexers
+	dir_record_t *record;
+	int i, j;
+
+	// Look up every file, on failure send error M0 (database error) to client, and mark connection for disconnect
+	if(dir_request_batch(conn->batch, conn->batch_valid, conn->batch_sample) == DIR_ERROR)
+	{
+		sprintf(out, "ERROR M0\n");
+		p2p_send(conn, out);
+		conn->state = P2P_CLOSED;
+		p2p_batch_free(conn);
+		return;
+	}
+
+	for(i = 0; i < conn->batch_valid; i++)
+	{
+		// Send the header, the filename last, since it may be as long as the line it came from
+		record = &conn->batch[i];
+		sprintf(out, "FILE %d ", record->status);
+		p2p_send(conn, out);
+		p2p_send(conn, record->filename);
+		p2p_send(conn, "\n");
+
+		// Send the peers nearest the user first, and the lightly loaded first among those, then free them
+		dir_balance(record->rows, record->status);
+		locality_rank(conn->ipaddr, record->rows, record->status);
+		for(j = 0; j < record->status; j++)
+		{
+			sprintf(out, "%s %ld\n", record->rows[j].key, record->rows[j].size);
+			p2p_send(conn, out);
+		}
+		dir_rows_free(record->rows, record->status);
+	}
+
+	// Return 'OK' to client, and end the batch
+	sprintf(out, "OK\n");
+	p2p_send(conn, out);
+	p2p_batch_free(conn);
+}
+
+// p2p_multi_record() takes one filename of a REQUESTM, and looks them all up once every filename has arrived.  A line
+// without a filename is looked up as an empty filename, which no peer shares, so every line still gets its group.
+static void p2p_multi_record(p2p_t *conn, char *in)
+{
+	// Record to fill
+	dir_record_t *record = &conn->batch[conn->batch_valid];
+
+	// Keep a copy of the line, which the filename points into
+	if((record->line = strdup(in)) == NULL)
+	{
+		// On failure, print an error, send error M0 (database error) to client, and mark connection for disconnect
+		fprintf(stderr, "%s: %s could not allocate memory for batch request [fd: %d]\n", SERVER_NAME, ERROR_MSG, conn->fd);
+		p2p_send(conn, "ERROR M0\n");
+		conn->state = P2P_CLOSED;
+		p2p_batch_free(conn);
+		return;
+	}
+
+	// Use strtok to grab the filename, as REQUEST would
+	if((record->filename = strtok(record->line, " ")) == NULL)
+		record->filename = record->line;
+	record->index = conn->batch_got++;
+	conn->batch_valid++;
+
+	// Once every filename has arrived, look them all up
+	if(conn->batch_got == conn->batch_count)
+		p2p_multi_apply(conn);
+}
+
+//------------------------ P2P COMMAND -----------------------
+
+// p2p_parse_int() parses a count from a command, storing it in value, and returns 1 if it is a valid integer from min to
+// max, 0 otherwise, so a count too large for an int can never wrap around to a negative one
+static int p2p_parse_int(char *string, long min, long max, int *value)
+{
+	// Parsed value, and the first character which was not part of it
+	long parsed;
+	char *end;
+
+	// Only plain digits are accepted, the whole string must parse, and the value must fit in range
+	if(validate_int(string) != 1 || string[0] == '\0')
+		return 0;
+	errno = 0;
+	parsed = strtol(string, &end, 10);
+	if(errno != 0 || *end != '\0' || parsed < min || parsed > max)
+		return 0;
+
+	*value = (int)parsed;
+	return 1;
+}
+
+// p2p_command() runs a single command, as specified in the p2pd protocol, for a client
+void p2p_command(p2p_t *conn, char *in)
+{
+	// Create and clear output buffer
+	char out[512] = { '\0' };
 
 	// Create buffers to store filename, file hash, and file size, and a long integer to store file size
 	char *filename, *filehash, *filesize;
 	long int f_size = 0;
 
-	// Create buffer to store peer's IP address, pull it from args struct
-	char peeraddr[128] = { '\0' };
-	strcpy(peeraddr, params.ipaddr);
+	// Peer's IP address and file descriptor, so we can send messages and track files
+	char *peeraddr = conn->ipaddr;
+	int user_fd = conn->fd;
 
-	// Keep track of user's file descriptor, so we can send and receive messages
-	int user_fd = params.fd;
+	// Result of a directory operation, rows returned by a directory query, and indexer
+	int status;
+	dir_row_t *rows;
+	int i;
 
-	// Create buffer to store SQLite queries
-	char query[256];
+	// Generation sent with LISTSINCE, and the directory's current generation
+	char *generation;
+	unsigned long current;
 
-	// Check SQLite return status
-	int status;
+	// Cursor and page size sent with a paged LIST
+	char *cursor, *limit;
+	int p_limit;
 
-	// Create SQLite statement struct
-	sqlite3_stmt *stmt;
+	// Number of peers sampled by REQUEST
+	char *sample;
+	int s_max;
 
-	// Send user a message to describe the server
-	sprintf(out, "%s: %s Justin Hill, Gordon Keesler, and Matt Layher\n", SERVER_NAME, USER_MSG);
-	send_msg(user_fd, out);
+	// Number of uploads in progress, and their combined rate, sent with ANNOUNCE
+	char *uploads, *kbps;
+	int l_uploads, l_kbps;
+
+	// Number of records announced by ADDBATCH, or files by REQUESTM
+	char *count;
+	int b_count;
+
+	// Token and digest sent with RESUME, and the digest of the files the directory kept for the user
+	char *token, *digest;
+	char kept[DIR_DIGEST + 1];
 
-	// Loop until the user sends in the CONNECT handshake, or QUIT (which would cause them to fall
-	// right through the following loop, to disconnect routines
-	while((strcmp(in, "CONNECT")) != 0 && (strcmp(in, "QUIT") != 0))
+	// Any command from the client renews its lease
+	__atomic_store_n(&conn->renewed, wheel_clock(), __ATOMIC_RELEASE);
+
+	// While an ADDBATCH or REQUESTM is in progress, each line is one of its records
+	if(conn->batch != NULL)
 	{
-		// Receive user's message, clean input
-		recv_msg(user_fd, (char *)&in);
-		clean_string((char *)&in);
+		if(conn->batch_request)
+			p2p_multi_record(conn, in);
+		else
+			p2p_batch_record(conn, in);
+		return;
+	}
 
-		// If CONNECT is sent, confirm handshake with client via HELLO message
-		if(strcmp(in, "CONNECT") == 0)
+	// PING - Renew the client's lease without doing anything else, accepted before or after the handshake
+	// syntax: PING
+	// reply: PONG
+	if(strcmp(in, "PING") == 0)
+	{
+		sprintf(out, "PONG\n");
+		p2p_send(conn, out);
+		return;
+	}
+
+	// Until the user sends in the CONNECT or RESUME handshake, only those, PING, and QUIT are accepted
+	if(conn->state == P2P_HANDSHAKE)
+	{
+		// If CONNECT is sent, confirm handshake with client via HELLO message, along with a session token if requested
+		// syntax: CONNECT [SESSION]
+		if(strcmp(in, "CONNECT") == 0 || strcmp(in, "CONNECT SESSION") == 0)
 		{
 			fprintf(stdout, "%s: %s received handshake from peer %s [fd: %d]\n", SERVER_NAME, OK_MSG, peeraddr, user_fd);
 
-			sprintf(out, "HELLO\n");
-			send_msg(user_fd, out);
+			// A client connecting afresh starts with no files, so purge any kept for a dropped session from its address
+			session_discard(peeraddr);
+
+			// Issue a session if requested
+			if(strcmp(in, "CONNECT SESSION") == 0)
+			{
+				if(session_open(peeraddr, conn->session, &conn->epoch) == -1)
+				{
+					// On failure, return message with error H0 (session error) to client
+					sprintf(out, "ERROR H0\n");
+					p2p_send(conn, out);
+					return;
+				}
+				sprintf(out, "HELLO %s\n", conn->session);
+			}
+			else
+				sprintf(out, "HELLO\n");
+			p2p_send(conn, out);
+
+			// Client may now issue directory commands
+			conn->state = P2P_ACTIVE;
 		}
+		// If RESUME is sent, hand the client its session, and state whether the files kept for it are the ones it last
+		// sent, in which case it need only send the changes since, else they are purged, and it must send them all
+		// syntax: RESUME [token] [digest]
+		// reply: RESUMED MATCH, or RESUMED RESET
+		else if(strncmp(in, "RESUME", 6) == 0)
+		{
+			// Use strtok to grab the token and digest, skipping first RESUME command
+			strtok(in, " ");
+			token = strtok(NULL, " ");
+			digest = strtok(NULL, " ");
+
+			// Ensure that a token and digest were set
+			if(token == NULL || digest == NULL)
+			{
+				// On failure, return message with error H1 (null token/digest) to client
+				sprintf(out, "ERROR H1\n");
+				p2p_send(conn, out);
+			}
+			// Ensure that the session exists, and was issued to this address
+			else if(strlen(token) != SESSION_TOKEN || session_resume(token, peeraddr, &conn->epoch) == -1)
+			{
+				// On failure, return message with error H2 (unknown or expired session) to client
+				sprintf(out, "ERROR H2\n");
+				p2p_send(conn, out);
+			}
+			else
+			{
+				// Client now owns the session, and may issue directory commands
+				strcpy(conn->session, token);
+				conn->state = P2P_ACTIVE;
+
+				// If the client's digest matches the files kept for it, it sends only what changed
+				if(dir_digest(peeraddr, kept) == DIR_OK && strcmp(kept, digest) == 0)
+				{
+					fprintf(stdout, "%s: %s peer %s resumed its session [fd: %d]\n", SERVER_NAME, OK_MSG, peeraddr, user_fd);
+					sprintf(out, "RESUMED MATCH\n");
+					p2p_send(conn, out);
+				}
+				// Else, start the client over from no files
+				else if(dir_purge(peeraddr) == DIR_OK)
+				{
+					fprintf(stdout, "%s: %s peer %s resumed its session, but its files differ [fd: %d]\n", SERVER_NAME, OK_MSG, peeraddr, user_fd);
+					sprintf(out, "RESUMED RESET\n");
+					p2p_send(conn, out);
+				}
+				else
+				{
+					// On failure, return message with error H0 (session error) to client, and mark connection for disconnect
+					sprintf(out, "ERROR H0\n");
+					p2p_send(conn, out);
+					conn->state = P2P_CLOSED;
+				}
+			}
+		}
+		// If QUIT is sent, fall right through to disconnect routines
+		else if(strcmp(in, "QUIT") == 0)
+			conn->state = P2P_CLOSED;
+
+		return;
 	}
 
-	// Loop until the user sends in the QUIT command
-	while(strcmp(in, "QUIT") != 0)
+	// Process commands as specified in p2pd protocol
+
+	// ADDBATCH - Add many files to the directory listing in one round trip, the next count lines being records
+	// syntax: ADDBATCH [count], then count lines of: [filename] [filehash] [filesize]
+	// reply: ADDED [added] [failed], then one line of: [index] [error] for each failed record, then OK
+	if(strncmp(in, "ADDBATCH", 8) == 0)
 	{
-		// Clean buffers
-		memset(in, 0, sizeof(in));
-		memset(out, 0, sizeof(out));
-		memset(query, 0, sizeof(query));
+		// Use strtok to grab the count, skipping first ADDBATCH command
+		strtok(in, " ");
+		count = strtok(NULL, " ");
 
-		// Receive user's message, clean input
-		recv_msg(user_fd, (char *)&in);
-		clean_string((char *)&in);
+		// Ensure that a count was set, that it's a valid integer, and within the limit
+		if((count == NULL) || (p2p_parse_int(count, 0, DIR_BATCH_MAX, &b_count) != 1))
+		{
+			// On failure, return message with error B1 (null/invalid count) to client
+			sprintf(out, "ERROR B1\n");
+			p2p_send(conn, out);
+			return;
+		}
 
-		// Process commands as specified in p2pd protocol
+		// Allocate a record and an error code for each line to follow
+		conn->batch = (dir_record_t *)calloc(b_count + 1, sizeof(dir_record_t));
+		conn->batch_codes = (char *)calloc(b_count + 1, sizeof(char));
+		if(conn->batch == NULL || conn->batch_codes == NULL)
+		{
+			// On failure, print an error, send error B0 (database error) to client, and mark connection for disconnect
+			fprintf(stderr, "%s: %s could not allocate memory for batch of %d files [fd: %d]\n", SERVER_NAME, ERROR_MSG, b_count, user_fd);
+			sprintf(out, "ERROR B0\n");
+			p2p_send(conn, out);
+			conn->state = P2P_CLOSED;
+			p2p_batch_free(conn);
+			return;
+		}
+		conn->batch_count = b_count;
 
-		// ADD - Add a file to the directory listing
-		// syntax: ADD [filename] [filehash] [filesize]
-		if(strncmp(in, "ADD", 3) == 0)
+		// An empty batch is complete already
+		if(b_count == 0)
+			p2p_batch_apply(conn);
+	}
+	// ADD - Add a file to the directory listing
+	// syntax: ADD [filename] [filehash] [filesize]
+	else if(strncmp(in, "ADD", 3) == 0)
+	{
+		// Use strtok to grab the filename, skipping first ADD command
+		strtok(in, " ");
+		filename = strtok(NULL, " ");
+
+		// Ensure that a filename was set
+		if(filename != NULL)
 		{
-			// Use strtok to grab the filename, skipping first ADD command
-			strtok(in, " ");
-			filename = strtok(NULL, " ");
+			// Use strtok to grab the filehash
+			filehash = strtok(NULL, " ");
 
-			// Ensure that a filename was set
-			if(filename != NULL)
+			// Ensure that a filehash was set
+			if(filehash != NULL)
 			{
-				// Use strtok to grab the filehash
-				filehash = strtok(NULL, " ");
+				// Use strtok to grab the filesize
+				filesize = strtok(NULL, " ");
 
-				// Ensure that a filehash was set
-				if(filehash != NULL)
+				// Ensure that a filesize was set, and that it's a valid integer
+				if((filesize != NULL) && (validate_int(filesize) == 1))
 				{
-					// Use strtok to grab the filesize
-					filesize = strtok(NULL, " ");
+					// Copy filesize into an integer
+					f_size = atoi(filesize);
 
-					// Ensure that a filesize was set, and that it's a valid integer
-					if((filesize != NULL) && (validate_int(filesize) == 1))
+					// Add filename, hash, size, and peer address to the directory
+					if((status = dir_add(filename, filehash, f_size, peeraddr)) != DIR_OK)
 					{
-						// Copy filesize into an integer
-						f_size = atoi(filesize);
-
-						// Insert filename, hash, size, and peer address into files table
-						sprintf(query, "INSERT INTO files VALUES('%s', '%s', '%ld', '%s')", filename, filehash, f_size, peeraddr);
-
-						// Prepare, evaluate, finalize SQLite query
-						sqlite3_prepare_v2(db, query, strlen(query) + 1, &stmt, NULL);
-						if((status = sqlite3_step(stmt)) != SQLITE_DONE)
+						// Check if user is attempting to insert a duplicate file
+						if(status == DIR_EXISTS)
 						{
-							// Check if user is attempting to insert a duplicate file
-							if(status == SQLITE_CONSTRAINT)
-							{	
-								// Send error A4 (duplicate entry) to client
-								sprintf(out, "ERROR A4\n");
-								send_msg(user_fd, out);
-							}
-							else
-							{
-								// Else, an internal error must have occurred
-								// Print an error to console
-								fprintf(stderr, "%s: %s sqlite: ADD file insert failed\n", SERVER_NAME, ERROR_MSG);
-
-								// Send error A0 (database error) to client
-								sprintf(out, "ERROR A0\n");
-								send_msg(user_fd, out);
-
-								// Break loop, begin disconnect
-								break;
-							}
+							// Send error A4 (duplicate entry) to client
+							sprintf(out, "ERROR A4\n");
+							p2p_send(conn, out);
 						}
-						sqlite3_finalize(stmt);
-
-						// If status is OK, print success
-						if(status == SQLITE_DONE)
+						else
 						{
-							// Print confirmation of file add to console
-							fprintf(stdout, "%s: %s peer %s added %20s [hash: %20s] [size: %10ld]\n", SERVER_NAME, OK_MSG, peeraddr, filename, filehash, f_size);
+							// Else, an internal error must have occurred
+							// Send error A0 (database error) to client
+							sprintf(out, "ERROR A0\n");
+							p2p_send(conn, out);
 
-							// Return 'OK' to client
-							sprintf(out, "OK\n");
-							send_msg(user_fd, out);
+							// Mark connection for disconnect
+							conn->state = P2P_CLOSED;
+							return;
 						}
 					}
-					else
+
+					// If status is OK, print success
+					if(status == DIR_OK)
 					{
-						// On failure, return message with error A3 (null/invalid filesize) to client
-						sprintf(out, "ERROR A3\n");
-						send_msg(user_fd, out);
+						// Print confirmation of file add to console
+						fprintf(stdout, "%s: %s peer %s added %20s [hash: %20s] [size: %10ld]\n", SERVER_NAME, OK_MSG, peeraddr, filename, filehash, f_size);
+
+						// Return 'OK' to client
+						sprintf(out, "OK\n");
+						p2p_send(conn, out);
 					}
 				}
 				else
 				{
-					// On failure, return message with error A2 (null filehash) to client
-					sprintf(out, "ERROR A2\n");
-					send_msg(user_fd, out);
+					// On failure, return message with error A3 (null/invalid filesize) to client
+					sprintf(out, "ERROR A3\n");
+					p2p_send(conn, out);
 				}
 			}
 			else
 			{
-				// On failure, return message with error A1 (null filename) to client
-				sprintf(out, "ERROR A1\n");
-				send_msg(user_fd, out);
+				// On failure, return message with error A2 (null filehash) to client
+				sprintf(out, "ERROR A2\n");
+				p2p_send(conn, out);
 			}
 		}
-		// DELETE - Delete a file from the directory server listing
-		// syntax: DELETE [filename] [filehash]
-		else if(strncmp(in, "DELETE", 6) == 0)
+		else
 		{
-			// Use strtok to grab the filename, skipping first DELETE command
-			strtok(in, " ");
-			filename = strtok(NULL, " ");
+			// On failure, return message with error A1 (null filename) to client
+			sprintf(out, "ERROR A1\n");
+			p2p_send(conn, out);
+		}
+	}
+	// DELETE - Delete a file from the directory server listing
+	// syntax: DELETE [filename] [filehash]
+	else if(strncmp(in, "DELETE", 6) == 0)
+	{
+		// Use strtok to grab the filename, skipping first DELETE command
+		strtok(in, " ");
+		filename = strtok(NULL, " ");
+
+		// Ensure that a filename was set
+		if(filename != NULL)
+		{
+			// Use strtok to grab the filehash
+			filehash = strtok(NULL, " ");
 
-			// Ensure that a filename was set
-			if(filename != NULL)
+			// Ensure that a filehash was set
+			if(filehash != NULL)
 			{
-				// Use strtok to grab the filehash
-				filehash = strtok(NULL, " ");
+				// If all the previous commands succeeded, remove file from the database
 
-				// Ensure that a filehash was set
-				if(filehash != NULL)
+				// Delete file with the specified filename, hash, and peer address from the directory
+				if(dir_delete(filename, filehash, peeraddr) != DIR_OK)
 				{
-					// If all the previous commands succeeded, remove file from the database
+					// Send error D0 (database error) to client
+					sprintf(out, "ERROR D0\n");
+					p2p_send(conn, out);
 
-					// Delete file with the specified filename, hash, and peer address from the database
-					sprintf(query, "DELETE FROM files WHERE file='%s' AND hash='%s' AND peer='%s'", filename, filehash, peeraddr);
+					// Mark connection for disconnect
+					conn->state = P2P_CLOSED;
+					return;
+				}
 
-					// Prepare, evaluate, and finalize SQLite query
-					sqlite3_prepare_v2(db, query, strlen(query) + 1, &stmt, NULL);
-					if(sqlite3_step(stmt) != SQLITE_DONE)
-					{
-						// Print an error to console
-						fprintf(stderr, "%s: %s sqlite: DELETE file delete failed\n", SERVER_NAME, ERROR_MSG);
+				// Print confirmation of file delete to console
+				fprintf(stdout, "%s: %s peer %s removed file '%s' with hash '%s'\n", SERVER_NAME, OK_MSG, peeraddr, filename, filehash);
+
+				// Send user 'OK' to confirm success
+				sprintf(out, "OK\n");
+				p2p_send(conn, out);
+			}
+			else
+			{
+				// On failure, print message with error D2 (null filehash) to client
+				sprintf(out, "ERROR D2\n");
+				p2p_send(conn, out);
+			}
+		}
+		else
+		{
+			// On failure, print message with error D1 (null filename) to client
+			sprintf(out, "ERROR D1\n");
+			p2p_send(conn, out);
+		}
+	}
+	// LIST - Request listing of all files tracked by the directory server
+	// syntax: LIST
+	else if(strcmp(in, "LIST") == 0)
+	{
+		// Send the whole listing
+		p2p_list(conn, NULL, NULL, 0);
+	}
+	// LIST UNIQUE - Request listing of each distinct file content, collapsing copies shared under other filenames
+	// syntax: LIST UNIQUE
+	else if(strcmp(in, "LIST UNIQUE") == 0)
+	{
+		// Query the directory for each distinct hash
+		if((status = dir_unique(&rows)) == DIR_ERROR)
+		{
+			// Print message with error L0 (database error) to client
+			sprintf(out, "ERROR L0\n");
+			p2p_send(conn, out);
 
-						// Send error D0 (database error) to client
-						sprintf(out, "ERROR D0\n");
-						send_msg(user_fd, out);
+			// Mark connection for disconnect
+			conn->state = P2P_CLOSED;
+		}
+		else
+		{
+			// On success, print the first filename, its size, the hash, and the number of peers sharing it, the filename
+			// and hash on their own, since they may be as long as the line they came from
+			for(i = 0; i < status; i++)
+			{
+				p2p_send(conn, rows[i].key);
+				sprintf(out, " %ld ", rows[i].size);
+				p2p_send(conn, out);
+				p2p_send(conn, rows[i].extra);
+				sprintf(out, " %d\n", rows[i].peers);
+				p2p_send(conn, out);
+			}
+			dir_rows_free(rows, status);
 
-						// Break loop, begin disconnect
-						break;
-					}
-					sqlite3_finalize(stmt);
+			// Else, send user OK to confirm success
+			sprintf(out, "OK\n");
+			p2p_send(conn, out);
+		}
+	}
+	// LIST - Request one page of the listing, of up to limit files following a cursor
+	// syntax: LIST [cursor] [limit]
+	else if(strncmp(in, "LIST ", 5) == 0)
+	{
+		// Use strtok to grab the cursor and limit, skipping first LIST command
+		strtok(in, " ");
+		cursor = strtok(NULL, " ");
+		limit = strtok(NULL, " ");
 
-					// Print confirmation of file delete to console
-					fprintf(stdout, "%s: %s peer %s removed file '%s' with hash '%s'\n", SERVER_NAME, OK_MSG, peeraddr, filename, filehash);
+		// Ensure that a cursor was set, which is '>' followed by the last filename of the previous page, if any,
+		// and that the limit is a valid integer, no larger than the server allows
+		if((cursor != NULL) && (cursor[0] == '>') && (limit != NULL) && (p2p_parse_int(limit, 1, DIR_PAGE_MAX, &p_limit) == 1))
+			p2p_list(conn, "PAGE", cursor + 1, p_limit);
+		else
+		{
+			// On failure, return message with error L2 (null/invalid cursor or limit) to client
+			sprintf(out, "ERROR L2\n");
+			p2p_send(conn, out);
+		}
+	}
+	// LISTSINCE - Request the changes to the listing since a generation, or the whole listing if they are unavailable
+	// syntax: LISTSINCE [generation]
+	else if(strncmp(in, "LISTSINCE", 9) == 0)
+	{
+		// Use strtok to grab the generation, skipping first LISTSINCE command
+		strtok(in, " ");
+		generation = strtok(NULL, " ");
 
-					// Send user 'OK' to confirm success
-					sprintf(out, "OK\n");
-					send_msg(user_fd, out);
-				}
-				else
+		// Ensure that a generation was set, and that it's a valid integer
+		if((generation != NULL) && (validate_int(generation) == 1))
+		{
+			// Query the directory for changes since the generation
+			if((status = dir_since(strtoul(generation, NULL, 10), &rows, &current)) >= 0)
+			{
+				// On success, send the new generation, then each file added (+) or removed (-), and its size
+				sprintf(out, "DELTA %lu\n", current);
+				p2p_send(conn, out);
+				for(i = 0; i < status; i++)
 				{
-					// On failure, print message with error D2 (null filehash) to client
-					sprintf(out, "ERROR D2\n");
-					send_msg(user_fd, out);
+					sprintf(out, "%c ", rows[i].op);
+					p2p_send(conn, out);
+					p2p_send(conn, rows[i].key);
+					sprintf(out, " %ld\n", rows[i].size);
+					p2p_send(conn, out);
 				}
+				dir_rows_free(rows, status);
+
+				// Send user OK to confirm success
+				sprintf(out, "OK\n");
+				p2p_send(conn, out);
 			}
+			// If the changes are no longer available, send the whole listing and its generation instead
+			else if(status == DIR_TRIMMED)
+				p2p_list(conn, "FULL", NULL, 0);
 			else
 			{
-				// On failure, print message with error D1 (null filename) to client
-				sprintf(out, "ERROR D1\n");
-				send_msg(user_fd, out);
+				// Print message with error L0 (database error) to client
+				sprintf(out, "ERROR L0\n");
+				p2p_send(conn, out);
+
+				// Mark connection for disconnect
+				conn->state = P2P_CLOSED;
 			}
 		}
-		// LIST - Request listing of all files tracked by the directory server
-		// syntax: LIST
-		else if(strcmp(in, "LIST") == 0)
+		else
 		{
-			// Query for a list of all files in the database
-			sprintf(query, "SELECT DISTINCT file,size FROM files ORDER BY file ASC");
+			// On failure, return message with error L1 (null/invalid generation) to client
+			sprintf(out, "ERROR L1\n");
+			p2p_send(conn, out);
+		}
+	}
+	// QUIT - End communication with directory server
+	// syntax: QUIT
+	else if(strcmp(in, "QUIT") == 0)
+	{
+		// Mark connection for disconnect, ending the user's session rather than parking it
+		__atomic_store_n(&conn->quit, 1, __ATOMIC_RELEASE);
+		conn->state = P2P_CLOSED;
+	}
+	// ANNOUNCE - Report the user's load as a peer, so REQUEST replies can favour lightly loaded peers
+	// syntax: ANNOUNCE [active_uploads] [upload_kbps]
+	else if(strncmp(in, "ANNOUNCE", 8) == 0)
+	{
+		// Use strtok to grab the number of uploads and their rate, skipping first ANNOUNCE command
+		strtok(in, " ");
+		uploads = strtok(NULL, " ");
+		kbps = strtok(NULL, " ");
 
-			// Prepare, evaluate, and loop SQLite query results
-			sqlite3_prepare_v2(db, query, strlen(query) + 1, &stmt, NULL);
-			while((status = sqlite3_step(stmt)) != SQLITE_DONE)
-			{
-				// Check for errors
-				if(status == SQLITE_ERROR)
-				{
-					// On error, print message to console
-					fprintf(stderr, "%s: %s sqlite: failed to retrieve listing of files tracked by server\n", SERVER_NAME, ERROR_MSG);
+		// Ensure that both were set, are valid integers, and within the limit
+		if((uploads == NULL) || (kbps == NULL) || (p2p_parse_int(uploads, 0, DIR_LOAD_MAX, &l_uploads) != 1) || (p2p_parse_int(kbps, 0, DIR_LOAD_MAX, &l_kbps) != 1))
+		{
+			// On failure, return message with error N1 (null/invalid load) to client
+			sprintf(out, "ERROR N1\n");
+			p2p_send(conn, out);
+		}
+		// Record the load, on failure return message with error N0 (load error) to client
+		else if(dir_announce(peeraddr, l_uploads, l_kbps) != DIR_OK)
+		{
+			sprintf(out, "ERROR N0\n");
+			p2p_send(conn, out);
+		}
+		else
+		{
+			// Send user OK to confirm success
+			sprintf(out, "OK\n");
+			p2p_send(conn, out);
+		}
+	}
+	// REQUESTHASH - Request information from server about which peers possess a file's content, under any filename
+	// syntax: REQUESTHASH [hash]
+	else if(strncmp(in, "REQUESTHASH", 11) == 0)
+	{
+		// Use strtok to grab the hash, skipping first REQUESTHASH command
+		strtok(in, " ");
+		filehash = strtok(NULL, " ");
 
-					// Print message with error L0 (database error) to client
-					sprintf(out, "ERROR L0\n");
-					send_msg(user_fd, out);
+		// Ensure that a hash was set
+		if(filehash != NULL)
+		{
+			// Query the directory for peers which possess this content
+			if((status = dir_request_hash(filehash, &rows)) == DIR_ERROR)
+			{
+				// Print message with error H0 (database error) to client
+				sprintf(out, "ERROR H0\n");
+				p2p_send(conn, out);
 
-					// Break loop
-					break;
-				}
-				else
-				{
-					// On success, print file and its size
-					sprintf(out, "%s %d\n", sqlite3_column_text(stmt, 0), sqlite3_column_int(stmt, 1));
-					send_msg(user_fd, out);
-				}
+				// Mark connection for disconnect
+				conn->state = P2P_CLOSED;
 			}
-			sqlite3_finalize(stmt);
-
-			// If an SQLite error occurred, break the loop and disconnect
-			if(status == SQLITE_ERROR)
-				break;
 			else
 			{
+				// On success, print peer addresses, a file size, and the filename each peer shares the content under,
+				// the peers nearest the user first, and the lightly loaded first among those.  The filename is sent on its
+				// own, since it may be as long as the line it came from.
+				dir_balance(rows, status);
+				locality_rank(peeraddr, rows, status);
+				for(i = 0; i < status; i++)
+				{
+					sprintf(out, "%s %ld ", rows[i].key, rows[i].size);
+					p2p_send(conn, out);
+					p2p_send(conn, rows[i].extra);
+					p2p_send(conn, "\n");
+				}
+				dir_rows_free(rows, status);
+
 				// Else, send user OK to confirm success
 				sprintf(out, "OK\n");
-				send_msg(user_fd, out);
+				p2p_send(conn, out);
 			}
 		}
-		// QUIT - End communication with directory server
-		// syntax: QUIT
-		else if(strcmp(in, "QUIT") == 0)
+		else
 		{
-			// Break loop, end communication
-			continue;
+			// On failure, print message with error H1 (null hash) to client
+			sprintf(out, "ERROR H1\n");
+			p2p_send(conn, out);
 		}
-		// REQUEST - Request information from server about which peers possess a file
-		// syntax: REQUEST [filename]
-		else if(strncmp(in, "REQUEST", 7) == 0)
+	}
+	// REQUESTM - Request information from server about which peers possess each of many files in one round trip, the
+	// next count lines being filenames, and either every peer of each file, or up to max peers chosen at random
+	// syntax: REQUESTM [count] [max], then count lines of: [filename]
+	// reply: for each file, in order: FILE [peers] [filename], then one line of: [peer] [size] for each peer, then OK
+	else if(strncmp(in, "REQUESTM", 8) == 0)
+	{
+		// Use strtok to grab the count and the number of peers, skipping first REQUESTM command
+		strtok(in, " ");
+		count = strtok(NULL, " ");
+		sample = strtok(NULL, " ");
+
+		// Ensure that a count was set, that it's a valid integer, and within the limit
+		if((count == NULL) || (p2p_parse_int(count, 0, DIR_REQUEST_MAX, &b_count) != 1))
 		{
-			// Use strtok to grab the filename, skipping first REQUEST command
-			strtok(in, " ");
-			filename = strtok(NULL, " ");
+			// On failure, return message with error M1 (null/invalid count) to client
+			sprintf(out, "ERROR M1\n");
+			p2p_send(conn, out);
+			return;
+		}
 
-			// Ensure that a filename was set
-			if(filename != NULL)
-			{
-				// Query for peers which possess this file in the files table
-				sprintf(query, "SELECT peer,size FROM files WHERE file='%s' ORDER BY peer ASC", filename);
+		// Ensure that the number of peers, if set, is a valid integer, no larger than the server allows
+		if((sample != NULL) && (p2p_parse_int(sample, 1, DIR_SAMPLE_MAX, &s_max) != 1))
+		{
+			// On failure, return message with error M2 (invalid number of peers) to client
+			sprintf(out, "ERROR M2\n");
+			p2p_send(conn, out);
+			return;
+		}
 
-				// Prepare, evaluate, and loop SQLite query results
-				sqlite3_prepare_v2(db, query, strlen(query) + 1, &stmt, NULL);
-				while((status = sqlite3_step(stmt)) != SQLITE_DONE)
-				{
-					// Check for errors
-					if(status == SQLITE_ERROR)
-					{
-						// On error, print message to console
-						fprintf(stderr, "%s: %s sqlite: failed to retrieve listing of peers for file '%s'\n", SERVER_NAME, ERROR_MSG, filename);
+		// An empty batch needs no lookup
+		if(b_count == 0)
+		{
+			sprintf(out, "OK\n");
+			p2p_send(conn, out);
+			return;
+		}
 
-						// Print message with error R0 (database error) to client
-						sprintf(out, "ERROR R0\n");
-						send_msg(user_fd, out);
+		// Allocate a record for each filename to follow
+		if((conn->batch = (dir_record_t *)calloc(b_count, sizeof(dir_record_t))) == NULL)
+		{
+			// On failure, print an error, send error M0 (database error) to client, and mark connection for disconnect
+			fprintf(stderr, "%s: %s could not allocate memory for batch request of %d files [fd: %d]\n", SERVER_NAME, ERROR_MSG, b_count, user_fd);
+			sprintf(out, "ERROR M0\n");
+			p2p_send(conn, out);
+			conn->state = P2P_CLOSED;
+			return;
+		}
+		conn->batch_count = b_count;
+		conn->batch_request = 1;
+		conn->batch_sample = (sample != NULL) ? s_max : 0;
+	}
+	// REQUEST - Request information from server about which peers possess a file, either every peer, or up to max
+	// peers chosen at random, so downloads of a popular file spread across its peers
+	// syntax: REQUEST [filename] [max]
+	else if(strncmp(in, "REQUEST", 7) == 0)
+	{
+		// Use strtok to grab the filename and the number of peers, skipping first REQUEST command
+		strtok(in, " ");
+		filename = strtok(NULL, " ");
+		sample = strtok(NULL, " ");
 
-						// Break loop	
-						break;
-					}	
-					else
-					{
-						// On success, print peer addresses, and a file size
-						sprintf(out, "%s %ld\n", sqlite3_column_text(stmt, 0), (long int)sqlite3_column_int(stmt, 1));
-						send_msg(user_fd, out);
-					}
-				}
-				sqlite3_finalize(stmt);
+		// Ensure that the number of peers, if set, is a valid integer, no larger than the server allows
+		if((sample != NULL) && (p2p_parse_int(sample, 1, DIR_SAMPLE_MAX, &s_max) != 1))
+		{
+			// On failure, print message with error R2 (invalid number of peers) to client
+			sprintf(out, "ERROR R2\n");
+			p2p_send(conn, out);
+		}
+		// Ensure that a filename was set
+		else if(filename != NULL)
+		{
+			// Query the directory for peers which possess this file, or a sample of them
+			if(sample != NULL)
+				status = dir_sample(filename, s_max, &rows);
+			else
+				status = dir_request(filename, &rows);
+			if(status == DIR_ERROR)
+			{
+				// Print message with error R0 (database error) to client
+				sprintf(out, "ERROR R0\n");
+				p2p_send(conn, out);
 
-				// If an SQLite error occurred, break the loop and disconnect
-				if(status == SQLITE_ERROR)
-					break;
-				else
+				// Mark connection for disconnect
+				conn->state = P2P_CLOSED;
+			}
+			else
+			{
+				// On success, print peer addresses, and a file size, the peers nearest the user first, and the lightly
+				// loaded first among those
+				dir_balance(rows, status);
+				locality_rank(peeraddr, rows, status);
+				for(i = 0; i < status; i++)
 				{
-					// Else, send user OK to confirm success
-					sprintf(out, "OK\n");
-					send_msg(user_fd, out);
+					sprintf(out, "%s %ld\n", rows[i].key, rows[i].size);
+					p2p_send(conn, out);
 				}
+				dir_rows_free(rows, status);
+
+				// Else, send user OK to confirm success
+				sprintf(out, "OK\n");
+				p2p_send(conn, out);
+			}
+		}
+		else
+		{
+			// On failure, print message with error R1 (null filename) to client
+			sprintf(out, "ERROR R1\n");
+			p2p_send(conn, out);
+		}
+	}
+	// SEARCH - Find files whose names contain a pattern, ignoring case, or start with it if it begins with '^'
+	// syntax: SEARCH [pattern]
+	else if(strncmp(in, "SEARCH", 6) == 0)
+	{
+		// Use strtok to grab the pattern, skipping first SEARCH command
+		strtok(in, " ");
+		filename = strtok(NULL, " ");
+
+		// Ensure that a pattern was set, and is more than an anchor
+		if(filename != NULL && strcmp(filename, "^") != 0)
+		{
+			// Query the directory for the best matching files
+			if((status = dir_search(filename, &rows)) == DIR_ERROR)
+			{
+				// Print message with error S0 (database error) to client
+				sprintf(out, "ERROR S0\n");
+				p2p_send(conn, out);
+
+				// Mark connection for disconnect
+				conn->state = P2P_CLOSED;
 			}
 			else
 			{
-				// On failure, print message with error R1 (null filename) to client
-				sprintf(out, "ERROR R1\n");
-				send_msg(user_fd, out);
+				// On success, print filenames and sizes, best match first, the filename on its own, since it may be as
+				// long as the line it came from
+				for(i = 0; i < status; i++)
+				{
+					p2p_send(conn, rows[i].key);
+					sprintf(out, " %ld\n", rows[i].size);
+					p2p_send(conn, out);
+				}
+				dir_rows_free(rows, status);
+
+				// Else, send user OK to confirm success
+				sprintf(out, "OK\n");
+				p2p_send(conn, out);
 			}
 		}
 		else
 		{
-			// Else, command is invalid. (error C0)
-			sprintf(out, "ERROR C0\n");
-			send_msg(user_fd, out);
+			// On failure, print message with error S1 (null pattern) to client
+			sprintf(out, "ERROR S1\n");
+			p2p_send(conn, out);
+		}
+	}
+	else
+	{
+		// Else, command is invalid. (error C0)
+		sprintf(out, "ERROR C0\n");
+		p2p_send(conn, out);
+	}
+}
+
+//------------------------ P2P LIST --------------------------
+
+// p2p_list() queues the listing for a client, either whole, or one page of up to limit files following the filename
+// after.  If header is set, the listing is preceded by a header line naming the generation it was built from.  The
+// listing is the directory's shared snapshot, sent straight from the same bytes to every client.
+void p2p_list(p2p_t *conn, char *header, char *after, int limit)
+{
+	// Create output buffer
+	char out[512] = { '\0' };
+
+	// Shared LIST reply
+	dir_snapshot_t *snap;
+
+	// First line of the listing to send, the line following the last, and the byte offsets of both
+	int first = 0;
+	int end = 0;
+	int start, stop;
+
+	// Last line sent, and the length of its filename, for the cursor of the next page
+	char *last;
+	int length;
+
+	// Take a reference to the directory's shared listing, rebuilt only if a file was added or removed since
+	if((snap = dir_snapshot()) == NULL)
+	{
+		// Print message with error L0 (database error) to client
+		sprintf(out, "ERROR L0\n");
+		p2p_send(conn, out);
+
+		// Mark connection for disconnect
+		conn->state = P2P_CLOSED;
+		return;
+	}
+
+	// Tell the client which generation the listing was built from
+	if(header != NULL)
+	{
+		sprintf(out, "%s %lu\n", header, snap->version);
+		p2p_send(conn, out);
+	}
+
+	// Choose the lines to send, a page found by binary search, or everything
+	if(after != NULL)
+		first = dir_snapshot_page(snap, after, limit, &end);
+	else
+		end = snap->count;
+	start = (first < snap->count) ? snap->rows[first] : snap->len;
+	stop = (end < snap->count) ? snap->rows[end] : snap->len;
+
+	// Queue the listing of each file and its size, holding a reference to the snapshot until it is sent
+	if(stop > start)
+	{
+		__sync_add_and_fetch(&snap->refs, 1);
+		if(out_share(&conn->outbuf, snap->data + start, stop - start, &dir_snapshot_release, snap) == -1)
+		{
+			// On failure, print an error, and mark connection for disconnect
+			fprintf(stderr, "%s: %s could not allocate memory for reply to client [fd: %d]\n", SERVER_NAME, ERROR_MSG, conn->fd);
+			dir_snapshot_release(snap);
+			dir_snapshot_release(snap);
+			conn->state = P2P_CLOSED;
+			return;
 		}
 	}
 
-	// Once loop ends, begin disconnect routines
+	// If the page stops short of the end, send the cursor for the next page, the last filename sent
+	if(after != NULL && end < snap->count)
+	{
+		last = snap->data + snap->rows[end - 1];
+		length = (char *)memchr(last, ' ', stop - snap->rows[end - 1]) - last;
+		p2p_send(conn, "NEXT >");
+		p2p_sendn(conn, last, length);
+		p2p_send(conn, "\n");
+	}
+	dir_snapshot_release(snap);
+
+	// Send user OK to confirm success
+	sprintf(out, "OK\n");
+	p2p_send(conn, out);
+}
+
+//------------------------ P2P DRAIN -------------------------
 
-	// Clean output buffer
-	memset(out, 0, sizeof(out));
+// p2p_linger() is fired by the timer wheel once a disconnected client has had SEND_TIMEOUT to read its final replies.
+// The socket is shut down, so the pending writes fail, and the event loop hands the client back for its socket to be
+// closed.
+static long p2p_linger(wheel_timer_t *timer)
+{
+	// Connection state of the client
+	p2p_t *conn = (p2p_t *)timer->arg;
 
-	// Send goodbye message to user
+	// Drop whatever the client did not read, on failure print a warning
+	if(shutdown(conn->fd, SHUT_RDWR) == -1)
+		fprintf(stderr, "%s: %s could not shut down socket of lingering client [fd: %d]\n", SERVER_NAME, WARN_MSG, conn->fd);
+
+	// Timer is done
+	return 0;
+}
+
+// p2p_drain() writes out the final replies of a disconnected client each time its socket becomes writable, then
+// closes the socket and frees the connection state once they are sent, or the client is gone
+void p2p_drain(p2p_t *conn)
+{
+	// Write out what the socket will take, and wait for it to become writable again if anything is left
+	if(p2p_flush(conn, 0) == 0 && conn->outbuf.bytes > 0 && event_rearm(conn) == 0)
+		return;
+
+	// The client is done with, so it must not linger any longer
+	wheel_cancel(&conn->lease);
+	out_free(out_detach(&conn->outbuf));
+
+	// Attempt to close user socket, closing it also removes it from the event loop
+	if(close(conn->fd) == -1)
+	{
+		// On failure, print error to console
+		fprintf(stderr, "%s: %s failed to close user socket [fd: %d]\n", SERVER_NAME, ERROR_MSG, conn->fd);
+	}
+
+	// Free connection state
+	p2p_free(conn);
+}
+
+//------------------------ P2P CLOSE -------------------------
+
+// p2p_close() performs disconnect routines for a client, purging its files.  Its socket is closed and its connection
+// state freed once its final replies are sent, by this worker if the socket takes them at once, else by the network
+// engine, so a slow client never holds a worker while it reads them.
+void p2p_close(p2p_t *conn)
+{
+	// Create output buffer
+	char out[512] = { '\0' };
+
+	// What became of the user's session
+	int status;
+
+	// The client is leaving, so its lease need not run out
+	wheel_cancel(&conn->lease);
+
+	// Queue goodbye message to user, after any replies still buffered
 	sprintf(out, "GOODBYE\n");
-	send_msg(user_fd, out);
+	p2p_send(conn, out);
 
 	// Decrement client counter, print message to console
-	fprintf(stdout, "%s: %s client disconnected from %s [fd: %d] [users: %d/%d]\n", SERVER_NAME, OK_MSG, peeraddr, user_fd, client_count(-1), NUM_THREADS);
+	fprintf(stdout, "%s: %s client disconnected from %s [fd: %d] [users: %d/%d]\n", SERVER_NAME, OK_MSG, conn->ipaddr, conn->fd, client_count(-1), max_clients);
 
-	// Run query to purge all files belonging to this user from the database
-	sprintf(query, "DELETE FROM files WHERE peer='%s'", peeraddr);
-
-	// Prepare, evaluate, and finalize SQLite query
-	sqlite3_prepare_v2(db, query, strlen(query) + 1, &stmt, NULL);
-	if(sqlite3_step(stmt) != SQLITE_DONE)
+	// If the user dropped without QUIT, park its session, keeping its files until it resumes or the grace period ends.
+	// If the session was resumed by a newer connection already, the files are that connection's.
+	if(conn->session[0] != '\0' && (status = session_leave(conn->session, conn->epoch, !__atomic_load_n(&conn->quit, __ATOMIC_ACQUIRE))) != SESSION_ENDED)
+	{
+		fprintf(stdout, "%s: %s %s session of peer %s [fd: %d]\n", SERVER_NAME, OK_MSG, (status == SESSION_PARKED) ? "parked" : "handed over", conn->ipaddr, conn->fd);
+	}
+	// Else, purge all files belonging to this user from the directory, the SQLite backend only queues the purge
+	else if(dir_purge(conn->ipaddr) != DIR_OK)
 	{
-		// On failure, print a console error, exit thread
-		fprintf(stderr, "%s: %s failed to purge files belonging to peer %s [fd: %d]\n", SERVER_NAME, ERROR_MSG, peeraddr, user_fd);
-		return (void *)-1;
+		// On failure, print a console error
+		fprintf(stderr, "%s: %s failed to purge files belonging to peer %s [fd: %d]\n", SERVER_NAME, ERROR_MSG, conn->ipaddr, conn->fd);
 	}
-	sqlite3_finalize(stmt);
 
-	// Attempt to close user socket
-	if(close(user_fd) == -1)
+	// The io_uring engine closes and frees the client itself, once its final messages are sent
+	if(io_engine == IO_URING)
 	{
-		// On failure, print error to console, exit
-		fprintf(stderr, "%s: %s failed to close user socket [fd: %d]\n", SERVER_NAME, ERROR_MSG, user_fd);
-		return (void *)-1;
+		p2p_flush(conn, 0);
+		uring_close(conn);
+		return;
 	}
 
-	// Exit with success
-	return (void *)0;
+	// Else, write out what the socket will take now, and leave the rest to the event loop, giving the client up to
+	// SEND_TIMEOUT to read it
+	conn->state = P2P_DRAINING;
+	conn->lease.fire = p2p_linger;
+	if(conn->outbuf.bytes > 0)
+		wheel_add(&conn->lease, SEND_TIMEOUT);
+	p2p_drain(conn);
+}
+
+//------------------------ P2P FREE --------------------------
+
+// p2p_free() returns a client's connection state to the pool, once nothing references it
+void p2p_free(p2p_t *conn)
+{
+	wheel_cancel(&conn->lease);
+	p2p_batch_free(conn);
+	pthread_mutex_destroy(&conn->lock);
+	pool_free(&conn_pool, conn);
 }
@@ -9,20 +9,156 @@
 	A header containing prototypes and structs used in p2pd
 */
 
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "buffer.h"
+#include "session.h"
+#include "wheel.h"
+
 //------------------------ GLOBAL VARIABLES ------------------
 
-// Reference externally defined SQLite database
-extern sqlite3 *db;
+// Reference externally defined maximum number of connected clients
+extern int max_clients;
 
-//------------------------ PROTOTYPES ------------------------
+// Reference externally defined network I/O engine
+extern int io_engine;
+
+// Reference externally defined number of seconds a silent client's lease lasts
+extern int lease_seconds;
+
+//------------------------ CONNECTION STATES -----------------
+
+// Client has connected, but has not yet sent the CONNECT handshake
+#define P2P_HANDSHAKE 0
+
+// Client has completed the handshake, and may issue directory commands
+#define P2P_ACTIVE 1
+
+// Client has sent QUIT, hung up, or hit a fatal error, and must be disconnected
+#define P2P_CLOSED 2
+
+// Client has been disconnected, and the event loop is sending the replies it has yet to read before closing its socket
+#define P2P_DRAINING 3
 
 //------------------------ STRUCTS ---------------------------
 
-typedef struct
+// Blocks of received bytes, as queued by the io_uring engine
+struct uring_msg;
+
+// Files sent with ADDBATCH, as defined in dir.h
+struct dir_record;
+
+typedef struct p2p
 {
 	// User's file descriptor
 	int fd;
 
 	// User's IP address
 	char ipaddr[128];
+
+	// Current position of the user in the protocol state machine
+	int state;
+
+	// Token of the user's resumable session, empty if it has none, and the epoch it owns the session under
+	char session[SESSION_TOKEN + 1];
+	int epoch;
+
+	// Set once the user sends QUIT, or its lease runs out, ending its session rather than parking it
+	int quit;
+
+	// Lease timer, which disconnects the user once it stays silent for lease_seconds, the wheel tick of the user's
+	// last command or read of its replies, which renews the lease, and the reply bytes the kernel still held for the
+	// user when the lease was last checked
+	wheel_timer_t lease;
+	unsigned long renewed;
+	int unsent;
+
+	// Input buffer of raw bytes received from the user
+	ring_t inbuf;
+
+	// Current command, as framed out of the input buffer
+	char in[1024];
+
+	// Set once the user terminates a command with a newline, older clients rely on timing alone
+	int framed;
+
+	// Replies to the commands processed so far, sent together once the user's input is drained
+	outbuf_t outbuf;
+
+	//---------------- ADDBATCH AND REQUESTM STATE -----------
+
+	// Files of an ADDBATCH or REQUESTM being received, NULL when none is in progress, and for an ADDBATCH, the error
+	// code of each record, or '\0' if it parsed and has yet to be applied
+	struct dir_record *batch;
+	char *batch_codes;
+
+	// Number of records announced, received so far, and valid among those
+	int batch_count, batch_got, batch_valid;
+
+	// Whether the batch is a REQUESTM rather than an ADDBATCH, and the number of peers it asks for of each file, or 0
+	// for every peer
+	int batch_request, batch_sample;
+
+	//---------------- IO_URING ENGINE STATE -----------------
+
+	// Lock protecting the queues and flags below, shared between the ring thread and workers
+	pthread_mutex_t lock;
+
+	// Queue of received blocks, waiting for a worker
+	struct uring_msg *rx_head, *rx_tail;
+
+	// Queue of outgoing reply blocks, and the linked chain of sends currently in flight
+	chunk_t *tx_head, *tx_tail, *tx_chain;
+
+	// Number of send completions outstanding for the chain in flight
+	int tx_inflight;
+
+	// Number of bytes in the received blocks, in the outgoing blocks and chain in flight, and in the chain alone
+	int rx_bytes, tx_bytes, tx_sending;
+
+	// Flags: a worker owns the client, client hung up, multishot recv is armed, close was requested,
+	// and the client is waiting in the ring's request queue
+	int scheduled, rx_eof, rx_armed, closing, queued;
+
+	// Flags: recv is held back until a worker consumes the received blocks, and the worker is waiting for the ring
+	// to send the outgoing blocks
+	int rx_paused, tx_waiting;
+
+	// Next client in the ring's request queue
+	struct p2p *next;
 } p2p_t;
+
+//------------------------ PROTOTYPES ------------------------
+
+// Prototype for p2p_init(), which preallocates connection state and reply blocks
+int p2p_init();
+
+// Prototype for p2p_open(), which creates the connection state for a newly accepted client
+p2p_t *p2p_open(int, struct sockaddr_storage *);
+
+// Prototype for p2p(), the thread pool job which processes all pending input from a client
+void *p2p(void *);
+
+// Prototype for p2p_send(), which queues a reply in a client's reply buffer
+int p2p_send(p2p_t *, char *);
+
+// Prototype for p2p_sendn(), which queues a reply of a given length, not necessarily ending the string it is part of
+int p2p_sendn(p2p_t *, char *, int);
+
+// Prototype for p2p_flush(), which writes a client's reply buffer through the active network engine
+int p2p_flush(p2p_t *, int);
+
+// Prototype for p2p_command(), which runs a single protocol command for a client
+void p2p_command(p2p_t *, char *);
+
+// Prototype for p2p_list(), which queues the whole listing, or one page of it, for a client
+void p2p_list(p2p_t *, char *, char *, int);
+
+// Prototype for p2p_drain(), which sends a disconnected client's final replies, then closes it and frees its state
+void p2p_drain(p2p_t *);
+
+// Prototype for p2p_close(), which performs disconnect routines and frees the connection state
+void p2p_close(p2p_t *);
+
+// Prototype for p2p_free(), which returns a client's connection state to the pool
+void p2p_free(p2p_t *);
@@ -0,0 +1,104 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:    10/16/26
+	Project: p2pd
+	Module:  pool.c
+
+	Description:
+	Fixed size object pools, used for connection state and reply blocks, so accepting a client or queueing a reply
+	does not call malloc().  Each pool is one slab sized at startup, from which objects are carved in order the first
+	time they are needed, and recycled through a free list once released.  Since the slab is never written until an
+	object is carved, pages for capacity which is never used are not committed by the kernel.  A pool which runs dry
+	falls back to the heap, and objects from the heap go back to it when released.
+*/
+
+//------------------------ C LIBRARIES -----------------------
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "pool.h"
+
+//------------------------ PARAMETERS ------------------------
+
+// Objects are aligned to a cache line, so neighbouring objects used by different threads do not share one
+#define POOL_ALIGN 64
+
+//------------------------ POOL INIT -------------------------
+
+// pool_init() allocates the slab for count objects of size bytes
+// Returns 0 on success, or -1 if the slab could not be allocated
+int pool_init(pool_t *pool, size_t size, int count)
+{
+	// Round the object size up to a whole number of cache lines
+	pool->size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	pool->count = count;
+	pool->carved = 0;
+	pool->free = NULL;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	// Allocate the slab, but leave it untouched
+	if(posix_memalign((void **)&pool->slab, POOL_ALIGN, pool->size * count) != 0)
+	{
+		pool->slab = NULL;
+		pool->count = 0;
+		return -1;
+	}
+
+	// Return success
+	return 0;
+}
+
+//------------------------ POOL ALLOC ------------------------
+
+// pool_alloc() takes a released object, else carves a new one from the slab, else allocates one from the heap
+// Returns the object, uninitialized, or NULL if the heap is exhausted as well
+void *pool_alloc(pool_t *pool)
+{
+	// Object being taken
+	void *obj = NULL;
+
+	// Prefer the most recently released object, which is most likely still cached
+	pthread_mutex_lock(&pool->lock);
+	if(pool->free != NULL)
+	{
+		obj = pool->free;
+		pool->free = *(void **)obj;
+	}
+	else if(pool->carved < pool->count)
+		obj = pool->slab + pool->size * pool->carved++;
+	pthread_mutex_unlock(&pool->lock);
+
+	// Once the pool is exhausted, fall back to the heap
+	if(obj == NULL)
+		obj = malloc(pool->size);
+
+	// Return object
+	return obj;
+}
+
+//------------------------ POOL FREE -------------------------
+
+// pool_free() returns an object to the free list if it belongs to the slab, else frees it
+void pool_free(pool_t *pool, void *obj)
+{
+	// Ignore a NULL object, as free() would
+	if(obj == NULL)
+		return;
+
+	// Objects from the heap go back to the heap
+	if((uintptr_t)obj < (uintptr_t)pool->slab || (uintptr_t)obj >= (uintptr_t)(pool->slab + pool->size * pool->count))
+	{
+		free(obj);
+		return;
+	}
+
+	// Objects from the slab are pushed onto the free list
+	pthread_mutex_lock(&pool->lock);
+	*(void **)obj = pool->free;
+	pool->free = obj;
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,50 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:	 10/16/26
+	Project: p2pd
+	Module:	 pool.h
+
+	Description:
+	A header containing prototypes and structs used in pool.c
+*/
+
+#ifndef _POOL_
+#define _POOL_
+
+//------------------------ C LIBRARIES -----------------------
+
+#include <pthread.h>
+#include <stddef.h>
+
+//------------------------ STRUCTS ---------------------------
+
+// A pool of fixed size objects, carved from one slab allocated at startup, and recycled through a free list
+typedef struct
+{
+	// Slab of objects, size of each object rounded up to a cache line, and number of objects in the slab
+	char *slab;
+	size_t size;
+	int count;
+
+	// Number of objects carved from the slab so far, the rest have never been touched
+	int carved;
+
+	// Free list of released objects, linked through their first word
+	void *free;
+
+	// Lock protecting the free list and carve position
+	pthread_mutex_t lock;
+} pool_t;
+
+//------------------------ PROTOTYPES ------------------------
+
+// Prototype for pool_init(), which allocates the slab for a pool
+int pool_init(pool_t *, size_t, int);
+
+// Prototype for pool_alloc(), which takes an object from a pool, or from the heap once the pool is exhausted
+void *pool_alloc(pool_t *);
+
+// Prototype for pool_free(), which returns an object to its pool, or to the heap if it came from there
+void pool_free(pool_t *, void *);
+
+#endif
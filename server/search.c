@@ -0,0 +1,375 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:    10/16/26
+	Project: p2pd
+	Module:  search.c
+
+	Description:
+	A trigram index over the filenames tracked by the in-memory directory, used by SEARCH.  Each filename is folded
+	to lowercase and prefixed with two anchor bytes, and is listed under every three byte sequence it contains, so:
+		1) a substring of three or more bytes is found by scanning only the filenames listed under the rarest of
+		   its trigrams, rather than every filename in the directory
+		2) a prefix of any length is found the same way, since the anchors make it at least three bytes long
+	The directory adds a filename when its first entry is added, and removes it when its last entry is removed, so
+	the index is kept up to date by ADD, DELETE, and the purge on disconnect.  Trigrams are spread over striped
+	locks, which are always taken after the directory's own, and never more than one at a time.
+*/
+
+//------------------------ C LIBRARIES -----------------------
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "config.h"
+#include "search.h"
+
+//------------------------ ANCHORS ---------------------------
+
+// Byte used to anchor the start of a folded filename, which cannot appear in a command
+#define SEARCH_ANCHOR '\001'
+
+//------------------------ STRUCTS ---------------------------
+
+// An indexed filename, referenced from the posting list of each of its trigrams
+typedef struct search_name
+{
+	// Folded filename, anchored and lowercased, which patterns are matched against
+	char *folded;
+
+	// Filename, as tracked by the directory
+	char name[];
+} search_name_t;
+
+// A trigram, and the posting list of filenames containing it
+typedef struct search_gram
+{
+	// Next trigram in the same hash bucket
+	struct search_gram *next;
+
+	// Trigram, packed into the low three bytes
+	unsigned int key;
+
+	// Number of filenames in the posting list, and its capacity
+	int count, size;
+
+	// Posting list
+	search_name_t **names;
+} search_gram_t;
+
+//------------------------ GLOBAL VARIABLES ------------------
+
+// Buckets of trigrams, and locks striped across them
+static search_gram_t **buckets = NULL;
+static pthread_rwlock_t locks[DIR_STRIPES];
+
+//------------------------ SEARCH HASH -----------------------
+
+// search_hash() mixes a packed trigram into a bucket number
+static unsigned int search_hash(unsigned int key)
+{
+	return (key * 2654435761u) >> 16;
+}
+
+//------------------------ SEARCH GRAMS ----------------------
+
+// search_key_compare() orders packed trigrams, for qsort()
+static int search_key_compare(const void *a, const void *b)
+{
+	// Trigrams being compared
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+
+	// Return order
+	return (x > y) - (x < y);
+}
+
+// search_grams() packs each distinct trigram of a folded string into a newly allocated array, returning the count,
+// or -1 if memory could not be allocated
+static int search_grams(char *folded, unsigned int **keys)
+{
+	// Length of the string, number of trigrams, and indexers
+	int length = strlen(folded);
+	int count = 0;
+	int i;
+
+	// No trigrams in a string shorter than three bytes
+	*keys = NULL;
+	if(length < 3)
+		return 0;
+
+	// Pack each trigram
+	if((*keys = (unsigned int *)malloc(sizeof(unsigned int) * (length - 2))) == NULL)
+		return -1;
+	for(i = 0; i + 2 < length; i++)
+		(*keys)[i] = ((unsigned char)folded[i] << 16) | ((unsigned char)folded[i + 1] << 8) | (unsigned char)folded[i + 2];
+
+	// Sort, and drop repeats
+	qsort(*keys, length - 2, sizeof(unsigned int), search_key_compare);
+	for(i = 0; i < length - 2; i++)
+	{
+		if(count == 0 || (*keys)[count - 1] != (*keys)[i])
+			(*keys)[count++] = (*keys)[i];
+	}
+
+	// Return number of distinct trigrams
+	return count;
+}
+
+//------------------------ SEARCH FIND -----------------------
+
+// search_find() looks up a trigram, creating it if requested.  The caller must hold the trigram's lock.
+static search_gram_t *search_find(unsigned int key, int create)
+{
+	// Bucket holding the trigram, and trigram being examined
+	search_gram_t **bucket = &buckets[search_hash(key) & (SEARCH_BUCKETS - 1)];
+	search_gram_t *gram;
+
+	// Search the bucket
+	for(gram = *bucket; gram != NULL; gram = gram->next)
+	{
+		if(gram->key == key)
+			return gram;
+	}
+
+	// Not found, create it if requested
+	if(create && (gram = (search_gram_t *)calloc(1, sizeof(search_gram_t))) != NULL)
+	{
+		gram->key = key;
+		gram->next = *bucket;
+		*bucket = gram;
+	}
+
+	// Return trigram, or NULL
+	return gram;
+}
+
+// search_lock() returns the lock striped over the bucket holding a trigram
+static pthread_rwlock_t *search_lock(unsigned int key)
+{
+	return &locks[search_hash(key) & (DIR_STRIPES - 1)];
+}
+
+//------------------------ SEARCH INIT -----------------------
+
+// search_init() allocates the trigram index
+int search_init()
+{
+	// Indexer
+	int i;
+
+	// Allocate buckets, and initialize locks
+	if((buckets = (search_gram_t **)calloc(SEARCH_BUCKETS, sizeof(search_gram_t *))) == NULL)
+	{
+		fprintf(stderr, "%s: %s could not allocate search index\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+	for(i = 0; i < DIR_STRIPES; i++)
+		pthread_rwlock_init(&locks[i], NULL);
+
+	// Return success
+	return 0;
+}
+
+//------------------------ SEARCH FOLD -----------------------
+
+// search_fold() returns a newly allocated, lowercased copy of a string, prefixed with the anchor bytes if requested,
+// so that a prefix pattern only matches at the start of a folded filename.  Returns NULL if memory is exhausted.
+char *search_fold(char *string, int anchored)
+{
+	// Folded copy, and indexers
+	char *folded;
+	int i, j = 0;
+
+	// Allocate the copy
+	if((folded = (char *)malloc(strlen(string) + 3)) == NULL)
+		return NULL;
+
+	// Anchor, and lowercase each byte
+	if(anchored)
+	{
+		folded[j++] = SEARCH_ANCHOR;
+		folded[j++] = SEARCH_ANCHOR;
+	}
+	for(i = 0; string[i] != '\0'; i++)
+		folded[j++] = tolower((unsigned char)string[i]);
+	folded[j] = '\0';
+
+	// Return folded copy
+	return folded;
+}
+
+//------------------------ SEARCH ADD ------------------------
+
+// search_add() indexes a filename under each of its trigrams.  The directory calls it with the filename's lock held,
+// so a filename is never added and removed at once.
+void search_add(char *filename)
+{
+	// Indexed filename, its trigrams, trigram being updated, and grown posting list
+	search_name_t *entry;
+	unsigned int *keys;
+	search_gram_t *gram;
+	search_name_t **grown;
+
+	// Number of trigrams, and indexer
+	int count, i;
+
+	// Allocate the indexed filename, and fold it
+	if((entry = (search_name_t *)malloc(sizeof(search_name_t) + strlen(filename) + 1)) == NULL)
+		return;
+	strcpy(entry->name, filename);
+	if((entry->folded = search_fold(filename, 1)) == NULL || (count = search_grams(entry->folded, &keys)) == -1)
+	{
+		fprintf(stderr, "%s: %s could not index filename '%s' for search\n", SERVER_NAME, ERROR_MSG, filename);
+		free(entry->folded);
+		free(entry);
+		return;
+	}
+
+	// Add the filename to the posting list of each trigram, taking one lock at a time
+	for(i = 0; i < count; i++)
+	{
+		pthread_rwlock_wrlock(search_lock(keys[i]));
+		if((gram = search_find(keys[i], 1)) != NULL)
+		{
+			// Double the posting list as it fills
+			if(gram->count == gram->size)
+			{
+				if((grown = (search_name_t **)realloc(gram->names, sizeof(search_name_t *) * (gram->size == 0 ? 4 : gram->size * 2))) != NULL)
+				{
+					gram->names = grown;
+					gram->size = (gram->size == 0) ? 4 : gram->size * 2;
+				}
+			}
+			if(gram->count < gram->size)
+				gram->names[gram->count++] = entry;
+		}
+		pthread_rwlock_unlock(search_lock(keys[i]));
+	}
+	free(keys);
+}
+
+//------------------------ SEARCH REMOVE ---------------------
+
+// search_remove() removes a filename from the posting list of each of its trigrams, and frees it.  The directory
+// calls it with the filename's lock held.
+void search_remove(char *filename)
+{
+	// Indexed filename, its folded form, its trigrams, and trigram being updated
+	search_name_t *entry = NULL;
+	char *folded;
+	unsigned int *keys;
+	search_gram_t *gram, **link;
+
+	// Number of trigrams, and indexers
+	int count, i, j;
+
+	// Fold the filename to find its trigrams
+	if((folded = search_fold(filename, 1)) == NULL || (count = search_grams(folded, &keys)) == -1)
+	{
+		fprintf(stderr, "%s: %s could not remove filename '%s' from search index\n", SERVER_NAME, ERROR_MSG, filename);
+		free(folded);
+		return;
+	}
+	free(folded);
+
+	// Remove the filename from the posting list of each trigram, taking one lock at a time
+	for(i = 0; i < count; i++)
+	{
+		pthread_rwlock_wrlock(search_lock(keys[i]));
+		if((gram = search_find(keys[i], 0)) != NULL)
+		{
+			// Swap the filename out of the posting list
+			for(j = 0; j < gram->count; j++)
+			{
+				if(strcmp(gram->names[j]->name, filename) == 0)
+				{
+					entry = gram->names[j];
+					gram->names[j] = gram->names[--gram->count];
+					break;
+				}
+			}
+
+			// Free the trigram once no filename contains it
+			if(gram->count == 0)
+			{
+				for(link = &buckets[search_hash(gram->key) & (SEARCH_BUCKETS - 1)]; *link != gram; link = &(*link)->next);
+				*link = gram->next;
+				free(gram->names);
+				free(gram);
+			}
+		}
+		pthread_rwlock_unlock(search_lock(keys[i]));
+	}
+	free(keys);
+
+	// No posting list refers to the filename any more, so free it
+	if(entry != NULL)
+	{
+		free(entry->folded);
+		free(entry);
+	}
+}
+
+//------------------------ SEARCH LOOKUP ---------------------
+
+// search_lookup() returns a newly allocated array of copies of every indexed filename whose folded form contains a
+// folded pattern of at least three bytes.  Only the posting list of the pattern's rarest trigram is scanned.
+// Returns the number of filenames, or -1 if memory could not be allocated.
+int search_lookup(char *pattern, char ***names)
+{
+	// Trigrams of the pattern, the rarest of them, and trigram being examined
+	unsigned int *keys;
+	unsigned int rarest = 0;
+	search_gram_t *gram;
+
+	// Number of trigrams, fewest filenames under any of them, number of matches, and indexers
+	int count, fewest = -1;
+	int matches = 0;
+	int i;
+
+	// Start with no matches
+	*names = NULL;
+	if((count = search_grams(pattern, &keys)) <= 0)
+		return count;
+
+	// Find the trigram with the shortest posting list, if any trigram is missing, nothing matches
+	for(i = 0; i < count && fewest != 0; i++)
+	{
+		pthread_rwlock_rdlock(search_lock(keys[i]));
+		gram = search_find(keys[i], 0);
+		if(fewest == -1 || gram == NULL || gram->count < fewest)
+		{
+			fewest = (gram == NULL) ? 0 : gram->count;
+			rarest = keys[i];
+		}
+		pthread_rwlock_unlock(search_lock(keys[i]));
+	}
+	free(keys);
+	if(fewest == 0)
+		return 0;
+
+	// Copy each filename in its posting list which contains the whole pattern
+	pthread_rwlock_rdlock(search_lock(rarest));
+	if((gram = search_find(rarest, 0)) != NULL && gram->count > 0)
+	{
+		if((*names = (char **)malloc(sizeof(char *) * gram->count)) == NULL)
+		{
+			pthread_rwlock_unlock(search_lock(rarest));
+			return -1;
+		}
+		for(i = 0; i < gram->count; i++)
+		{
+			if(strstr(gram->names[i]->folded, pattern) != NULL && ((*names)[matches] = strdup(gram->names[i]->name)) != NULL)
+				matches++;
+		}
+	}
+	pthread_rwlock_unlock(search_lock(rarest));
+
+	// Return number of matches
+	return matches;
+}
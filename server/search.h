@@ -0,0 +1,26 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:	 10/16/26
+	Project: p2pd
+	Module:	 search.h
+
+	Description:
+	A header containing prototypes used in search.c
+*/
+
+//------------------------ PROTOTYPES ------------------------
+
+// Prototype for search_init(), which allocates the trigram index
+int search_init();
+
+// Prototype for search_fold(), which lowercases a filename or pattern for matching, optionally anchoring it
+char *search_fold(char *, int);
+
+// Prototype for search_add(), which indexes a filename newly tracked by the directory
+void search_add(char *);
+
+// Prototype for search_remove(), which removes a filename no longer tracked by the directory from the index
+void search_remove(char *);
+
+// Prototype for search_lookup(), which returns every indexed filename containing a folded pattern
+int search_lookup(char *, char ***);
@@ -0,0 +1,383 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:    10/16/26
+	Project: p2pd
+	Module:  session.c
+
+	Description:
+	Resumable sessions, so a client which drops and reconnects does not have to index its whole share folder again.
+	A client which sends 'CONNECT SESSION' is issued a random token along with its HELLO.  If it later disconnects
+	without sending QUIT, its session is parked, and its files are kept for SESSION_GRACE seconds rather than purged.
+	Within that time, the client may reconnect with 'RESUME <token> <digest>', and only send what changed since.
+	Once the grace period runs out, a reaper thread purges the files of the parked session.
+
+	Each session records an epoch, bumped whenever a new connection resumes it, so a stale connection from before a
+	network blip, which the server has yet to notice is dead, neither parks nor purges a session it no longer owns.
+*/
+
+//------------------------ C LIBRARIES -----------------------
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "config.h"
+#include "dir.h"
+#include "session.h"
+
+//------------------------ STRUCTS ---------------------------
+
+// A session, owned by a connected client, or parked until its client resumes it
+typedef struct session
+{
+	// Token issued to the client, and the peer address its files are shared under
+	char token[SESSION_TOKEN + 1];
+	char peeraddr[128];
+
+	// Bumped each time a connection resumes the session
+	int epoch;
+
+	// Whether the session is parked, and when its files are purged if so
+	int parked;
+	time_t expires;
+
+	// Next session in the same bucket
+	struct session *next;
+
+	// Neighbouring sessions in the list of parked sessions, which is ordered by expiry
+	struct session *park_prev, *park_next;
+} session_t;
+
+//------------------------ GLOBAL VARIABLES ------------------
+
+// Table of sessions, by token
+static session_t *buckets[SESSION_BUCKETS];
+
+// Parked sessions, the first to expire at the head
+static session_t *parked_head = NULL, *parked_tail = NULL;
+
+// Lock protecting the table and the parked list, and signalled when the first session is parked
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaper_cond = PTHREAD_COND_INITIALIZER;
+
+// Reaper thread, whether it has been started, and whether it should keep running
+static pthread_t reaper;
+static int reaper_started = 0;
+static int reaper_running = 1;
+
+// Source of session tokens
+static int random_fd = -1;
+
+//------------------------ SESSION FIND ----------------------
+
+// session_find() returns the link in the table pointing to a session, which points to NULL if there is none
+static session_t **session_find(char *token)
+{
+	// Hash of the token, using 32-bit FNV-1a, and link being examined
+	unsigned int hash = 2166136261u;
+	session_t **link;
+	char *c;
+
+	// Fold in each byte
+	for(c = token; *c != '\0'; c++)
+	{
+		hash ^= (unsigned char)*c;
+		hash *= 16777619u;
+	}
+
+	// Walk the bucket for a matching token
+	for(link = &buckets[hash & (SESSION_BUCKETS - 1)]; *link != NULL; link = &(*link)->next)
+	{
+		if(strcmp((*link)->token, token) == 0)
+			break;
+	}
+
+	// Return link
+	return link;
+}
+
+//------------------------ SESSION UNPARK --------------------
+
+// session_unpark() removes a session from the list of parked sessions
+static void session_unpark(session_t *session)
+{
+	// Unlink the session from its neighbours
+	if(session->park_prev != NULL)
+		session->park_prev->park_next = session->park_next;
+	else
+		parked_head = session->park_next;
+	if(session->park_next != NULL)
+		session->park_next->park_prev = session->park_prev;
+	else
+		parked_tail = session->park_prev;
+
+	// Session is live again
+	session->park_prev = session->park_next = NULL;
+	session->parked = 0;
+}
+
+//------------------------ SESSION EXPIRE --------------------
+
+// session_expire() purges the files of a parked session, and forgets it.  The purge happens under the lock, so a client
+// reconnecting from the same address cannot add files which the purge would then remove.
+static void session_expire(session_t *session)
+{
+	// Link pointing to the session in the table
+	session_t **link = session_find(session->token);
+
+	// Purge the peer's files, on failure print an error
+	if(dir_purge(session->peeraddr) != DIR_OK)
+		fprintf(stderr, "%s: %s failed to purge files belonging to peer %s\n", SERVER_NAME, ERROR_MSG, session->peeraddr);
+
+	// Forget the session
+	session_unpark(session);
+	*link = session->next;
+	free(session);
+}
+
+//------------------------ SESSION REAPER --------------------
+
+// session_reaper() is the reaper thread, which sleeps until the oldest parked session expires, then purges its files
+static void *session_reaper(void *args)
+{
+	// Time the oldest parked session expires
+	struct timespec deadline;
+
+	pthread_mutex_lock(&session_lock);
+	while(reaper_running)
+	{
+		// Expire every session whose grace period has run out
+		while(parked_head != NULL && parked_head->expires <= time(NULL))
+		{
+			fprintf(stdout, "%s: %s session of peer %s expired, purging its files\n", SERVER_NAME, OK_MSG, parked_head->peeraddr);
+			session_expire(parked_head);
+		}
+
+		// Sleep until the next session expires, or one is parked
+		if(parked_head == NULL)
+			pthread_cond_wait(&reaper_cond, &session_lock);
+		else
+		{
+			deadline.tv_sec = parked_head->expires;
+			deadline.tv_nsec = 0;
+			pthread_cond_timedwait(&reaper_cond, &session_lock, &deadline);
+		}
+	}
+	pthread_mutex_unlock(&session_lock);
+
+	// Return from the reaper thread
+	return NULL;
+}
+
+//------------------------ SESSION OPEN ----------------------
+
+// session_open() issues a new session to a peer, writing its token, and the epoch the caller owns it under
+// Returns 0 on success, or -1 if no token could be generated
+int session_open(char *peeraddr, char *token, int *epoch)
+{
+	// Random bytes of the token, new session, link in the table for it, and indexer
+	unsigned char bytes[SESSION_TOKEN / 2];
+	session_t *session;
+	session_t **link;
+	int i;
+
+	pthread_mutex_lock(&session_lock);
+
+	// Open the source of tokens the first time one is needed
+	if(random_fd == -1 && (random_fd = open("/dev/urandom", O_RDONLY)) == -1)
+	{
+		pthread_mutex_unlock(&session_lock);
+		fprintf(stderr, "%s: %s could not open /dev/urandom for session tokens\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+
+	// Draw tokens until one is not already in use
+	do
+	{
+		if(read(random_fd, bytes, sizeof(bytes)) != sizeof(bytes))
+		{
+			pthread_mutex_unlock(&session_lock);
+			fprintf(stderr, "%s: %s could not read a session token\n", SERVER_NAME, ERROR_MSG);
+			return -1;
+		}
+		for(i = 0; i < sizeof(bytes); i++)
+			sprintf(token + i * 2, "%02x", bytes[i]);
+		link = session_find(token);
+	}
+	while(*link != NULL);
+
+	// Create the session, owned by the caller
+	if((session = (session_t *)calloc(1, sizeof(session_t))) == NULL)
+	{
+		pthread_mutex_unlock(&session_lock);
+		fprintf(stderr, "%s: %s could not allocate memory for session\n", SERVER_NAME, ERROR_MSG);
+		return -1;
+	}
+	strcpy(session->token, token);
+	strncpy(session->peeraddr, peeraddr, sizeof(session->peeraddr) - 1);
+	*link = session;
+	*epoch = 0;
+
+	pthread_mutex_unlock(&session_lock);
+
+	// Return success
+	return 0;
+}
+
+//------------------------ SESSION RESUME --------------------
+
+// session_resume() hands a session to a client reconnecting from the same address.  The session may be parked, or
+// still owned by a connection the server has not yet noticed is dead, which loses it.
+// Returns 0 on success, writing the epoch the caller owns the session under, or -1 if there is no such session
+int session_resume(char *token, char *peeraddr, int *epoch)
+{
+	// Session being resumed
+	session_t *session;
+
+	pthread_mutex_lock(&session_lock);
+
+	// The session must exist, and belong to the same address, since files are tracked by address
+	if((session = *session_find(token)) == NULL || strcmp(session->peeraddr, peeraddr) != 0)
+	{
+		pthread_mutex_unlock(&session_lock);
+		return -1;
+	}
+
+	// Take the session over
+	if(session->parked)
+		session_unpark(session);
+	*epoch = ++session->epoch;
+
+	pthread_mutex_unlock(&session_lock);
+
+	// Return success
+	return 0;
+}
+
+//------------------------ SESSION LEAVE ---------------------
+
+// session_leave() is called as a client with a session disconnects.  If park is set, the client dropped rather than
+// sending QUIT, so the session is parked, otherwise it ends.
+// Returns SESSION_PARKED or SESSION_MOVED if the client's files must be kept, or SESSION_ENDED if they must be purged
+int session_leave(char *token, int epoch, int park)
+{
+	// Link pointing to the session, and the session
+	session_t **link;
+	session_t *session;
+
+	pthread_mutex_lock(&session_lock);
+
+	// If the session is gone, its files are the client's to purge
+	link = session_find(token);
+	if((session = *link) == NULL)
+	{
+		pthread_mutex_unlock(&session_lock);
+		return SESSION_ENDED;
+	}
+
+	// If a newer connection has resumed the session, it owns the files
+	if(session->epoch != epoch)
+	{
+		pthread_mutex_unlock(&session_lock);
+		return SESSION_MOVED;
+	}
+
+	// On QUIT, forget the session
+	if(!park)
+	{
+		*link = session->next;
+		free(session);
+		pthread_mutex_unlock(&session_lock);
+		return SESSION_ENDED;
+	}
+
+	// Else, park the session at the tail of the parked list, since it expires last
+	session->parked = 1;
+	session->expires = time(NULL) + SESSION_GRACE;
+	session->park_prev = parked_tail;
+	session->park_next = NULL;
+	if(parked_tail != NULL)
+		parked_tail->park_next = session;
+	else
+		parked_head = session;
+	parked_tail = session;
+
+	// Start the reaper with the first parked session rather than at startup, since daemonizing forks the server, and a
+	// thread started before the fork would not exist in the daemon.  Else, wake it if it has nothing to wait for.
+	if(!reaper_started)
+	{
+		if(pthread_create(&reaper, NULL, session_reaper, NULL) == 0)
+			reaper_started = 1;
+		else
+			fprintf(stderr, "%s: %s could not start session reaper thread\n", SERVER_NAME, ERROR_MSG);
+	}
+	else if(parked_head == session)
+		pthread_cond_signal(&reaper_cond);
+
+	pthread_mutex_unlock(&session_lock);
+
+	// Return parked
+	return SESSION_PARKED;
+}
+
+//------------------------ SESSION DISCARD -------------------
+
+// session_discard() purges the files of every parked session of a peer, as a client connecting afresh from the same
+// address starts with none, just as if the dropped client's files had been purged as it disconnected
+void session_discard(char *peeraddr)
+{
+	// Session being examined, and the next one
+	session_t *session, *next;
+
+	pthread_mutex_lock(&session_lock);
+	for(session = parked_head; session != NULL; session = next)
+	{
+		next = session->park_next;
+		if(strcmp(session->peeraddr, peeraddr) == 0)
+			session_expire(session);
+	}
+	pthread_mutex_unlock(&session_lock);
+}
+
+//------------------------ SESSION CLOSE ---------------------
+
+// session_close() stops the reaper thread, and forgets every session.  The files of parked sessions are left to the
+// directory, which is closed next.
+void session_close()
+{
+	// Session being freed, the next one, and indexer
+	session_t *session, *next;
+	int i;
+
+	// Stop the reaper, and wait for it
+	pthread_mutex_lock(&session_lock);
+	reaper_running = 0;
+	pthread_cond_signal(&reaper_cond);
+	pthread_mutex_unlock(&session_lock);
+	if(reaper_started)
+		pthread_join(reaper, NULL);
+
+	// Free every session
+	pthread_mutex_lock(&session_lock);
+	for(i = 0; i < SESSION_BUCKETS; i++)
+	{
+		for(session = buckets[i]; session != NULL; session = next)
+		{
+			next = session->next;
+			free(session);
+		}
+		buckets[i] = NULL;
+	}
+	parked_head = parked_tail = NULL;
+	pthread_mutex_unlock(&session_lock);
+
+	// Close the source of tokens
+	if(random_fd != -1)
+		close(random_fd);
+}
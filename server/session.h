@@ -0,0 +1,45 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:	 10/16/26
+	Project: p2pd
+	Module:	 session.h
+
+	Description:
+	A header containing prototypes and constants used in session.c
+*/
+
+#ifndef _SESSION_
+#define _SESSION_
+
+//------------------------ CONSTANTS -------------------------
+
+// Number of hex digits in a session token
+#define SESSION_TOKEN 32
+
+// A client left its session for good, so its files must be purged
+#define SESSION_ENDED 0
+
+// A client dropped, and its files are kept until it resumes or the grace period runs out
+#define SESSION_PARKED 1
+
+// A client's session was already resumed by a newer connection, which now owns its files
+#define SESSION_MOVED 2
+
+//------------------------ PROTOTYPES ------------------------
+
+// Prototype for session_open(), which issues a new session token to a client
+int session_open(char *, char *, int *);
+
+// Prototype for session_resume(), which hands a parked or stale session to a reconnecting client
+int session_resume(char *, char *, int *);
+
+// Prototype for session_leave(), which parks or ends a session as its client disconnects
+int session_leave(char *, int, int);
+
+// Prototype for session_discard(), which purges the files of every parked session of a peer
+void session_discard(char *);
+
+// Prototype for session_close(), which stops the reaper thread, and forgets every session
+void session_close();
+
+#endif
@@ -20,33 +20,76 @@
  * thpool       = threadpool
  * thpool_t     = threadpool type
  * tp_p         = threadpool pointer
- * sem          = semaphore
  * xN           = x can be any string. N stands for amount
  * 
  * */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "thpool.h"      /* here you can also find the interface to each function */
 
 
-static int thpool_keepalive=1;
 
-/* Create mutex variable */
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER; /* used to serialize queue access */
 
+/* Pool the calling thread belongs to, and its worker state in work-stealing mode */
+static __thread thpool_t* thpool_current=NULL;
+static __thread thpool_worker* thpool_self=NULL;
 
+static int  thpool_find(thpool_t* tp_p, thpool_job_t* job_p);
+static void thpool_wake(thpool_jobqueue* queue_p);
+static int  thpool_spawn(thpool_t* tp_p);
+static int  thpool_retire(thpool_worker* self_p);
+static void* thpool_manage(void* arg_p);
+static long thpool_clock(void);
+static int  thpool_deque_push(thpool_deque* deque_p, void *(*function_p)(void*), void* arg_p);
+static int  thpool_deque_pop(thpool_deque* deque_p, thpool_job_t* job_p);
+static int  thpool_deque_steal(thpool_deque* deque_p, thpool_job_t* job_p);
+
+
+/* Wait on a futex word while it still holds val, or wake up to n threads waiting on it */
+static int thpool_futex(int* word_p, int op, int val){
+	return syscall(SYS_futex, word_p, op, val, NULL, NULL, 0);
+}
+
+
+/* Wait on a futex word while it still holds val, for at most ms milliseconds */
+static int thpool_futex_timed(int* word_p, int val, long ms){
+	struct timespec timeout;
+	
+	timeout.tv_sec=ms/1000;
+	timeout.tv_nsec=(ms%1000)*1000000L;
+	return syscall(SYS_futex, word_p, FUTEX_WAIT_PRIVATE, val, &timeout, NULL, 0);
+}
 
 
 /* Initialise thread pool */
 thpool_t* thpool_init(int threadsN){
+	return thpool_init_mode(threadsN, THPOOL_FIFO);
+}
+
+
+/* Initialise thread pool with a scheduling mode */
+thpool_t* thpool_init_mode(int threadsN, int mode){
+	return thpool_init_elastic(threadsN, threadsN, mode, 0);
+}
+
+
+/* Initialise thread pool which grows from minN threads up to maxN with load */
+thpool_t* thpool_init_elastic(int minN, int maxN, int mode, size_t stacksize){
 	thpool_t* tp_p;
 	
-	if (!threadsN || threadsN<1) threadsN=1;
+	if (!maxN || maxN<1) maxN=1;
+	if (minN<1) minN=1;
+	if (minN>maxN) minN=maxN;
 	
 	/* Make new thread pool */
 	tp_p=(thpool_t*)malloc(sizeof(thpool_t));                              /* MALLOC thread pool */
@@ -54,12 +97,34 @@ thpool_t* thpool_init(int threadsN){
 		fprintf(stderr, "thpool_init(): Could not allocate memory for thread pool\n");
 		return NULL;
 	}
-	tp_p->threads=(pthread_t*)malloc(threadsN*sizeof(pthread_t));          /* MALLOC thread IDs */
+	tp_p->threads=(pthread_t*)malloc(maxN*sizeof(pthread_t));             /* MALLOC thread IDs */
 	if (tp_p->threads==NULL){
 		fprintf(stderr, "thpool_init(): Could not allocate memory for thread IDs\n");
 		return NULL;
 	}
-	tp_p->threadsN=threadsN;
+	tp_p->threadsN=maxN;
+	tp_p->threadsMin=minN;
+	tp_p->alive=0;
+	tp_p->stacksize=stacksize;
+	tp_p->keepalive=1;
+	tp_p->mode=mode;
+	tp_p->managed=(maxN>minN);                                           /* before any worker reads it */
+	tp_p->now=0;
+	
+	/* Give each possible thread a slot, with its own deque for work-stealing mode. Slots are
+	 * only touched once a thread uses them, so unused ones cost no memory */
+	tp_p->workers=(thpool_worker*)calloc(maxN, sizeof(thpool_worker));     /* MALLOC workers */
+	if (tp_p->workers==NULL){
+		fprintf(stderr, "thpool_init(): Could not allocate memory for worker slots\n");
+		return NULL;
+	}
+	int w;
+	for (w=0; w<maxN; w++){
+		tp_p->workers[w].tp_p=tp_p;
+		tp_p->workers[w].id=w;
+		tp_p->workers[w].state=THPOOL_SLOT_FREE;
+		tp_p->workers[w].seed=w*2654435761u+1;
+	}
 	
 	/* Initialise the job queue */
 	if (thpool_jobqueue_init(tp_p)==-1){
@@ -67,108 +132,282 @@ thpool_t* thpool_init(int threadsN){
 		return NULL;
 	}
 	
-	/* Initialise semaphore*/
-	tp_p->jobqueue->queueSem=(sem_t*)malloc(sizeof(sem_t));                 /* MALLOC job queue semaphore */
-	sem_init(tp_p->jobqueue->queueSem, 0, 0); /* no shared, initial value */
-	
 	/* Make threads in pool */
 	int t;
-	for (t=0; t<threadsN; t++){
-		pthread_create(&(tp_p->threads[t]), NULL, (void * (*)(void *))thpool_thread_do, (void *)tp_p); /* MALLOCS INSIDE PTHREAD HERE */
+	for (t=0; t<minN; t++){
+		if (thpool_spawn(tp_p)==-1){
+			fprintf(stderr, "thpool_init(): Could not create thread\n");
+			return NULL;
+		}
+	}
+	
+	/* If the pool may grow, start the manager which grows it */
+	if (maxN>minN){
+		tp_p->now=thpool_clock();
+		if (pthread_create(&tp_p->manager, NULL, thpool_manage, (void *)tp_p)!=0){
+			fprintf(stderr, "thpool_init(): Could not create manager thread\n");
+			return NULL;
+		}
 	}
 	
 	return tp_p;
 }
 
 
+/* Start a thread in a free slot, joining one which retired first if need be. Only called
+ * from init and the manager thread, so slots are never claimed twice */
+static int thpool_spawn(thpool_t* tp_p){
+	pthread_attr_t attr;
+	thpool_worker* worker_p=NULL;
+	int w, status;
+	
+	/* Find a free slot, or one whose thread has retired */
+	for (w=0; w<tp_p->threadsN && worker_p==NULL; w++){
+		if (__atomic_load_n(&tp_p->workers[w].state, __ATOMIC_ACQUIRE)!=THPOOL_SLOT_RUNNING)
+			worker_p=&tp_p->workers[w];
+	}
+	if (worker_p==NULL)
+		return -1;
+	if (worker_p->state==THPOOL_SLOT_EXITED)
+		pthread_join(tp_p->threads[worker_p->id], NULL);
+	
+	/* Start the thread, with a small stack if one was asked for */
+	pthread_attr_init(&attr);
+	if (tp_p->stacksize>0)
+		pthread_attr_setstacksize(&attr, tp_p->stacksize<PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : tp_p->stacksize);
+	worker_p->state=THPOOL_SLOT_RUNNING;
+	__atomic_add_fetch(&tp_p->alive, 1, __ATOMIC_SEQ_CST);
+	status=pthread_create(&(tp_p->threads[worker_p->id]), &attr, (void * (*)(void *))thpool_thread_do, (void *)worker_p); /* MALLOCS INSIDE PTHREAD HERE */
+	pthread_attr_destroy(&attr);
+	if (status!=0){
+		worker_p->state=THPOOL_SLOT_FREE;
+		__atomic_sub_fetch(&tp_p->alive, 1, __ATOMIC_SEQ_CST);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Milliseconds on a monotonic clock */
+static long thpool_clock(void){
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000L+ts.tv_nsec/1000000L;
+}
+
+
+/* What the manager thread of an elastic pool is doing: keeping the clock producers stamp jobs
+ * with, starting a thread whenever the oldest job has waited too long, and joining threads
+ * which retired */
+static void* thpool_manage(void* arg_p){
+	thpool_t* tp_p=(thpool_t*)arg_p;
+	thpool_jobqueue* queue_p=tp_p->jobqueue;
+	thpool_job_t* slot_p;
+	unsigned long pos;
+	long now;
+	int w;
+	
+	while (tp_p->keepalive){
+		usleep(THPOOL_TICK_MS*1000);
+		now=thpool_clock();
+		__atomic_store_n(&tp_p->now, now, __ATOMIC_RELAXED);
+		
+		/* Free the stacks of threads which retired */
+		for (w=0; w<tp_p->threadsN; w++){
+			if (__atomic_load_n(&tp_p->workers[w].state, __ATOMIC_ACQUIRE)==THPOOL_SLOT_EXITED){
+				pthread_join(tp_p->threads[w], NULL);
+				tp_p->workers[w].state=THPOOL_SLOT_FREE;
+			}
+		}
+		
+		/* If the oldest job in the ring has waited too long, every thread is busy, so add one */
+		pos=__atomic_load_n(&queue_p->tail, __ATOMIC_ACQUIRE);
+		slot_p=&queue_p->ring[pos & queue_p->mask];
+		if (__atomic_load_n(&slot_p->seq, __ATOMIC_ACQUIRE)==pos+1
+		    && now-__atomic_load_n(&slot_p->stamp, __ATOMIC_RELAXED)>=THPOOL_SPAWN_MS
+		    && __atomic_load_n(&tp_p->alive, __ATOMIC_SEQ_CST)<tp_p->threadsN)
+			thpool_spawn(tp_p);
+	}
+	return NULL;
+}
+
+
 /* What each individual thread is doing 
  * */
 /* There are two scenarios here. One is everything works as it should and second if
- * the thpool is to be killed. In that manner we try to BYPASS sem_wait and end each thread. */
-void thpool_thread_do(thpool_t* tp_p){
-
-	while(thpool_keepalive){
+ * the thpool is to be killed. In that manner we wake every parked thread and end each thread. */
+void thpool_thread_do(thpool_worker* worker_p){
+	thpool_t* tp_p=worker_p->tp_p;
+	thpool_jobqueue* queue_p=tp_p->jobqueue;
+	thpool_job_t job;
+	int word, sleepers, status;
+
+	/* In work-stealing mode, the slot's deque is this thread's own */
+	thpool_current=tp_p;
+	if (tp_p->mode==THPOOL_STEAL)
+		thpool_self=worker_p;
+
+	while(tp_p->keepalive){
 		
-		if (sem_wait(tp_p->jobqueue->queueSem)) {/* WAITING until there is work in the queue */
-			perror("thpool_thread_do(): Waiting for semaphore");
-			exit(1);
+		/* Run jobs until there are none to be found */
+		if (thpool_find(tp_p, &job)==0){
+			job.function(job.arg);                                         /* run function */
+			continue;
 		}
-
-		if (thpool_keepalive){
-			
-			/* Read job from queue and execute it */
-			void*(*func_buff)(void* arg);
-			void*  arg_buff;
-			thpool_job_t* job_p;
-	
-			pthread_mutex_lock(&mutex);                  /* LOCK */
-			
-			job_p = thpool_jobqueue_peek(tp_p);
-			func_buff=job_p->function;
-			arg_buff =job_p->arg;
-			thpool_jobqueue_removelast(tp_p);
-			
-			pthread_mutex_unlock(&mutex);                /* UNLOCK */
+		
+		/* Note the futex word, then announce this thread as a sleeper before checking once more,
+		 * so a producer either sees the sleeper and bumps the word, or this check sees its job */
+		word=__atomic_load_n(&queue_p->futex, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&queue_p->sleepers, 1, __ATOMIC_SEQ_CST);
+		
+		if (thpool_find(tp_p, &job)==0){
 			
-			func_buff(arg_buff);               			 /* run function */
-			free(job_p);                                                       /* DEALLOC job */
+			/* Withdraw as a sleeper, unless a producer already claimed one to wake */
+			sleepers=__atomic_load_n(&queue_p->sleepers, __ATOMIC_SEQ_CST);
+			while (sleepers>0 && !__atomic_compare_exchange_n(&queue_p->sleepers, &sleepers, sleepers-1, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+			job.function(job.arg);                                         /* run function */
+			continue;
 		}
+		
+		/* WAITING until there is work in the queue, returns at once if the word has moved.
+		 * The producer which wakes this thread has already withdrawn it as a sleeper.
+		 * In an elastic pool, only wait so long before trying to retire. */
+		if (!tp_p->keepalive)
+			break;
+		if (tp_p->managed)
+			status=thpool_futex_timed(&queue_p->futex, word, THPOOL_IDLE_MS);
 		else
-		{
-			return; /* EXIT thread*/
+			status=thpool_futex(&queue_p->futex, FUTEX_WAIT_PRIVATE, word);
+		if (status==-1 && errno==ETIMEDOUT){
+			if (thpool_retire(worker_p))
+				return; /* RETIRE thread */
+		}
+		else if (status==-1 && errno!=EAGAIN && errno!=EINTR){
+			perror("thpool_thread_do(): Waiting for futex");
+			exit(1);
 		}
 	}
-	return;
+	return; /* EXIT thread*/
+}
+
+
+/* Retire a thread which has idled for THPOOL_IDLE_MS, unless the pool is at its minimum or a
+ * producer claimed this thread to run a job. Returns 1 if the thread must exit */
+static int thpool_retire(thpool_worker* self_p){
+	thpool_t* tp_p=self_p->tp_p;
+	thpool_jobqueue* queue_p=tp_p->jobqueue;
+	int sleepers, alive;
+	
+	/* Withdraw as a sleeper; if none is left, a producer claimed this thread, so stay for its job */
+	sleepers=__atomic_load_n(&queue_p->sleepers, __ATOMIC_SEQ_CST);
+	do {
+		if (sleepers<=0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&queue_p->sleepers, &sleepers, sleepers-1, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	
+	/* Leave the pool unless that would shrink it below its minimum. Any job added from now on
+	 * wakes one of the remaining threads, or is found by a busy one before it parks */
+	alive=__atomic_load_n(&tp_p->alive, __ATOMIC_SEQ_CST);
+	do {
+		if (alive<=tp_p->threadsMin)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&tp_p->alive, &alive, alive-1, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	
+	/* Hand the slot back for the manager to join */
+	__atomic_store_n(&self_p->state, THPOOL_SLOT_EXITED, __ATOMIC_RELEASE);
+	return 1;
+}
+
+
+/* Find a job to run: in work-stealing mode from this thread's deque, the shared queue, or
+ * another thread's deque, in that order, else from the shared queue */
+static int thpool_find(thpool_t* tp_p, thpool_job_t* job_p){
+	thpool_worker* self_p=thpool_self;
+	int t, victim;
+	
+	if (tp_p->mode!=THPOOL_STEAL || self_p==NULL)
+		return thpool_jobqueue_take(tp_p, job_p);
+	
+	/* Now and then, serve the shared queue first, so outside jobs always get a turn */
+	if (++self_p->ticks%THPOOL_GLOBAL_TICK==0 && thpool_jobqueue_take(tp_p, job_p)==0)
+		return 0;
+	
+	/* Newest job of our own */
+	if (thpool_deque_pop(&self_p->deque, job_p)==0)
+		return 0;
+	
+	/* Oldest job from outside the pool */
+	if (thpool_jobqueue_take(tp_p, job_p)==0)
+		return 0;
+	
+	/* Oldest job of another thread, starting from a random victim so thieves spread out */
+	self_p->seed^=self_p->seed<<13;
+	self_p->seed^=self_p->seed>>17;
+	self_p->seed^=self_p->seed<<5;
+	victim=self_p->seed%tp_p->threadsN;
+	for (t=0; t<tp_p->threadsN; t++, victim=(victim+1)%tp_p->threadsN){
+		if (victim!=self_p->id && thpool_deque_steal(&tp_p->workers[victim].deque, job_p)==0)
+			return 0;
+	}
+	return -1;
 }
 
 
 /* Add work to the thread pool */
 int thpool_add_work(thpool_t* tp_p, void *(*function_p)(void*), void* arg_p){
-	thpool_job_t* newJob;
 	
-	newJob=(thpool_job_t*)malloc(sizeof(thpool_job_t));                        /* MALLOC job */
-	if (newJob==NULL){
-		fprintf(stderr, "thpool_add_work(): Could not allocate memory for new job\n");
-		exit(1);
+	/* In work-stealing mode, a thread of the pool adds to its own deque, unless it is full */
+	if (tp_p->mode==THPOOL_STEAL && thpool_self!=NULL && thpool_self->tp_p==tp_p
+	    && thpool_deque_push(&thpool_self->deque, function_p, arg_p)==0){
+		thpool_wake(tp_p->jobqueue);
+		return 0;
 	}
 	
-	/* add function and argument */
-	newJob->function=function_p;
-	newJob->arg=arg_p;
-	
 	/* add job to queue */
-	pthread_mutex_lock(&mutex);                  /* LOCK */
-	thpool_jobqueue_add(tp_p, newJob);
-	pthread_mutex_unlock(&mutex);                /* UNLOCK */
+	thpool_jobqueue_add(tp_p, function_p, arg_p);
+	
+	return 0;
+}
+
+
+/* Add work to the thread pool, behind everything already queued */
+int thpool_requeue_work(thpool_t* tp_p, void *(*function_p)(void*), void* arg_p){
+	
+	/* add job to the shared queue, whatever the mode */
+	thpool_jobqueue_add(tp_p, function_p, arg_p);
 	
 	return 0;
 }
 
 
+/* Amount of threads running */
+int thpool_threads_alive(thpool_t* tp_p){
+	return __atomic_load_n(&tp_p->alive, __ATOMIC_SEQ_CST);
+}
+
+
 /* Destroy the threadpool */
 /* Force kill functionality added by Matt Layher */
 void thpool_destroy(thpool_t* tp_p, int force){
 	int t;
 	
-	/* End each thread's infinite loop */
-	thpool_keepalive=0; 
-
-	/* Awake idle threads waiting at semaphore */
-	for (t=0; t<(tp_p->threadsN); t++){
-		if (sem_post(tp_p->jobqueue->queueSem)){
-			fprintf(stderr, "thpool_destroy(): Could not bypass sem_wait()\n");
-		}
-	}
-
-	/* Kill semaphore */
-	if (sem_destroy(tp_p->jobqueue->queueSem)!=0){
-		fprintf(stderr, "thpool_destroy(): Could not destroy semaphore\n");
-	}
+	/* End each thread's infinite loop, and stop the manager first so no thread is started or joined
+	 * behind our back */
+	tp_p->keepalive=0; 
+	if (tp_p->managed)
+		pthread_join(tp_p->manager, NULL);
+
+	/* Awake idle threads parked on the futex */
+	__atomic_add_fetch(&tp_p->jobqueue->futex, 1, __ATOMIC_SEQ_CST);
+	thpool_futex(&tp_p->jobqueue->futex, FUTEX_WAKE_PRIVATE, INT_MAX);
 	
 	/* Wait for threads to finish, or if force is true, cancel them */
 	for (t=0; t<(tp_p->threadsN); t++)
 	{
-		if(force == 1)
+		if(tp_p->workers[t].state == THPOOL_SLOT_FREE)
+			continue;
+		if(force == 1 && tp_p->workers[t].state == THPOOL_SLOT_RUNNING)
 			pthread_cancel(tp_p->threads[t]);
 		else
 			pthread_join(tp_p->threads[t], NULL);
@@ -177,8 +416,8 @@ void thpool_destroy(thpool_t* tp_p, int force){
 	thpool_jobqueue_empty(tp_p);
 	
 	/* Dealloc */
+	free(tp_p->workers);                                                   /* DEALLOC workers             */
 	free(tp_p->threads);                                                   /* DEALLOC threads             */
-	free(tp_p->jobqueue->queueSem);                                        /* DEALLOC job queue semaphore */
 	free(tp_p->jobqueue);                                                  /* DEALLOC job queue           */
 	free(tp_p);                                                            /* DEALLOC thread pool         */
 }
@@ -189,97 +428,198 @@ void thpool_destroy(thpool_t* tp_p, int force){
 
 /* Initialise queue */
 int thpool_jobqueue_init(thpool_t* tp_p){
-	tp_p->jobqueue=(thpool_jobqueue*)malloc(sizeof(thpool_jobqueue));      /* MALLOC job queue */
+	unsigned long pos;
+	
+	tp_p->jobqueue=(thpool_jobqueue*)calloc(1, sizeof(thpool_jobqueue));  /* MALLOC job queue */
 	if (tp_p->jobqueue==NULL) return -1;
-	tp_p->jobqueue->tail=NULL;
-	tp_p->jobqueue->head=NULL;
-	tp_p->jobqueue->jobsN=0;
+	tp_p->jobqueue->ring=(thpool_job_t*)malloc(THPOOL_QUEUE*sizeof(thpool_job_t)); /* MALLOC ring */
+	if (tp_p->jobqueue->ring==NULL){
+		free(tp_p->jobqueue);
+		return -1;
+	}
+	tp_p->jobqueue->mask=THPOOL_QUEUE-1;
+	
+	/* Each slot starts out free for the producer at its own position */
+	for (pos=0; pos<THPOOL_QUEUE; pos++)
+		tp_p->jobqueue->ring[pos].seq=pos;
 	return 0;
 }
 
 
 /* Add job to queue */
-void thpool_jobqueue_add(thpool_t* tp_p, thpool_job_t* newjob_p){ /* remember that job prev and next point to NULL */
-
-	newjob_p->next=NULL;
-	newjob_p->prev=NULL;
-	
-	thpool_job_t *oldFirstJob;
-	oldFirstJob = tp_p->jobqueue->head;
+void thpool_jobqueue_add(thpool_t* tp_p, void *(*function_p)(void*), void* arg_p){
+	thpool_jobqueue* queue_p=tp_p->jobqueue;
+	thpool_job_t* slot_p;
+	thpool_job_t job;
+	unsigned long pos, seq;
+	long diff;
 	
-	/* fix jobs' pointers */
-	switch(tp_p->jobqueue->jobsN){
+	/* Claim the slot at head once a consumer has freed it for this lap of the ring */
+	pos=__atomic_load_n(&queue_p->head, __ATOMIC_RELAXED);
+	for (;;){
+		slot_p=&queue_p->ring[pos & queue_p->mask];
+		seq=__atomic_load_n(&slot_p->seq, __ATOMIC_ACQUIRE);
+		diff=(long)seq-(long)pos;
 		
-		case 0:     /* if there are no jobs in queue */
-					tp_p->jobqueue->tail=newjob_p;
-					tp_p->jobqueue->head=newjob_p;
-					break;
-		
-		default: 	/* if there are already jobs in queue */
-					oldFirstJob->prev=newjob_p;
-					newjob_p->next=oldFirstJob;
-					tp_p->jobqueue->head=newjob_p;
-
+		if (diff==0){                                          /* slot is free, try to claim it */
+			if (__atomic_compare_exchange_n(&queue_p->head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff<0){                                      /* ring is full, let a thread take a job */
+			/* A thread of this pool runs one itself, since every thread may be adding */
+			if (thpool_current==tp_p && thpool_find(tp_p, &job)==0)
+				job.function(job.arg);
+			else
+				sched_yield();
+			pos=__atomic_load_n(&queue_p->head, __ATOMIC_RELAXED);
+		}
+		else                                                   /* another producer claimed it, move on */
+			pos=__atomic_load_n(&queue_p->head, __ATOMIC_RELAXED);
 	}
+	
+	/* Fill the slot, then publish it to consumers */
+	slot_p->function=function_p;
+	slot_p->arg=arg_p;
+	__atomic_store_n(&slot_p->stamp, __atomic_load_n(&tp_p->now, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_store_n(&slot_p->seq, pos+1, __ATOMIC_RELEASE);
+	
+	/* Wake a parked thread to run it */
+	thpool_wake(queue_p);
+}
 
-	(tp_p->jobqueue->jobsN)++;     /* increment amount of jobs in queue */
-	sem_post(tp_p->jobqueue->queueSem);
+
+/* Wake a thread for a newly added job */
+static void thpool_wake(thpool_jobqueue* queue_p){
+	int sleepers;
 	
-	int sval;
-	sem_getvalue(tp_p->jobqueue->queueSem, &sval);
+	/* If any thread is parked, or about to be, claim it so no other producer wakes it too, then bump
+	 * the word and wake one */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	sleepers=__atomic_load_n(&queue_p->sleepers, __ATOMIC_SEQ_CST);
+	while (sleepers>0){
+		if (__atomic_compare_exchange_n(&queue_p->sleepers, &sleepers, sleepers-1, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+			__atomic_add_fetch(&queue_p->futex, 1, __ATOMIC_SEQ_CST);
+			thpool_futex(&queue_p->futex, FUTEX_WAKE_PRIVATE, 1);
+			break;
+		}
+	}
 }
 
 
-/* Remove job from queue */
-int thpool_jobqueue_removelast(thpool_t* tp_p){
-	thpool_job_t *oldLastJob;
-	oldLastJob = tp_p->jobqueue->tail;
+/* Take oldest job from queue */
+int thpool_jobqueue_take(thpool_t* tp_p, thpool_job_t* job_p){
+	thpool_jobqueue* queue_p=tp_p->jobqueue;
+	thpool_job_t* slot_p;
+	unsigned long pos, seq;
+	long diff;
 	
-	/* fix jobs' pointers */
-	switch(tp_p->jobqueue->jobsN){
-		
-		case 0:     /* if there are no jobs in queue */
-					return -1;
-					break;
+	/* Claim the slot at tail once a producer has filled it */
+	pos=__atomic_load_n(&queue_p->tail, __ATOMIC_RELAXED);
+	for (;;){
+		slot_p=&queue_p->ring[pos & queue_p->mask];
+		seq=__atomic_load_n(&slot_p->seq, __ATOMIC_ACQUIRE);
+		diff=(long)seq-(long)(pos+1);
 		
-		case 1:     /* if there is only one job in queue */
-					tp_p->jobqueue->tail=NULL;
-					tp_p->jobqueue->head=NULL;
-					break;
-					
-		default: 	/* if there are more than one jobs in queue */
-					oldLastJob->prev->next=NULL;               /* the almost last item */
-					tp_p->jobqueue->tail=oldLastJob->prev;
-					
+		if (diff==0){                                          /* slot is ready, try to claim it */
+			if (__atomic_compare_exchange_n(&queue_p->tail, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff<0)                                       /* queue is empty */
+			return -1;
+		else                                                   /* another thread took it, move on */
+			pos=__atomic_load_n(&queue_p->tail, __ATOMIC_RELAXED);
 	}
 	
-	(tp_p->jobqueue->jobsN)--;
-	
-	int sval;
-	sem_getvalue(tp_p->jobqueue->queueSem, &sval);
+	/* Copy the job out, then free the slot for the next lap of the ring */
+	job_p->function=slot_p->function;
+	job_p->arg=slot_p->arg;
+	__atomic_store_n(&slot_p->seq, pos+queue_p->mask+1, __ATOMIC_RELEASE);
 	return 0;
 }
 
 
-/* Get first element from queue */
-thpool_job_t* thpool_jobqueue_peek(thpool_t* tp_p){
-	return tp_p->jobqueue->tail;
+/* Remove all jobs in queue */
+void thpool_jobqueue_empty(thpool_t* tp_p){
+	thpool_job_t job;
+	
+	/* Discard whatever is left, then free the ring */
+	while (thpool_jobqueue_take(tp_p, &job)==0);
+	free(tp_p->jobqueue->ring);                                            /* DEALLOC ring */
+	tp_p->jobqueue->ring=NULL;
 }
 
-/* Remove and deallocate all jobs in queue */
-void thpool_jobqueue_empty(thpool_t* tp_p){
+/* =================== WORKER DEQUE OPERATIONS ===================== */
+
+
+
+/* Push job at the bottom of a deque, only ever called by its owner */
+static int thpool_deque_push(thpool_deque* deque_p, void *(*function_p)(void*), void* arg_p){
+	thpool_job_t* slot_p;
+	long bottom, top;
+	
+	bottom=__atomic_load_n(&deque_p->bottom, __ATOMIC_RELAXED);
+	top=__atomic_load_n(&deque_p->top, __ATOMIC_ACQUIRE);
+	if (bottom-top>=THPOOL_DEQUE)                          /* deque is full */
+		return -1;
+	
+	/* Fill the slot, then publish it to thieves */
+	slot_p=&deque_p->slots[bottom & (THPOOL_DEQUE-1)];
+	__atomic_store_n(&slot_p->function, function_p, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot_p->arg, arg_p, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque_p->bottom, bottom+1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+/* Pop newest job from the bottom of a deque, only ever called by its owner */
+static int thpool_deque_pop(thpool_deque* deque_p, thpool_job_t* job_p){
+	thpool_job_t* slot_p;
+	long bottom, top;
+	int found=0;
 	
-	thpool_job_t* curjob;
-	curjob=tp_p->jobqueue->tail;
+	/* Reserve the bottom job, then see whether a thief got there first */
+	bottom=__atomic_load_n(&deque_p->bottom, __ATOMIC_RELAXED)-1;
+	__atomic_store_n(&deque_p->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	top=__atomic_load_n(&deque_p->top, __ATOMIC_RELAXED);
 	
-	while(tp_p->jobqueue->jobsN){
-		tp_p->jobqueue->tail=curjob->prev;
-		free(curjob);
-		curjob=tp_p->jobqueue->tail;
-		tp_p->jobqueue->jobsN--;
+	if (top<=bottom){
+		slot_p=&deque_p->slots[bottom & (THPOOL_DEQUE-1)];
+		job_p->function=__atomic_load_n(&slot_p->function, __ATOMIC_RELAXED);
+		job_p->arg=__atomic_load_n(&slot_p->arg, __ATOMIC_RELAXED);
+		found=1;
+		
+		/* The last job may be raced for by a thief, whoever moves top wins it */
+		if (top==bottom){
+			if (!__atomic_compare_exchange_n(&deque_p->top, &top, top+1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				found=0;
+			__atomic_store_n(&deque_p->bottom, bottom+1, __ATOMIC_RELAXED);
+		}
 	}
+	else                                                   /* deque is empty, undo the reservation */
+		__atomic_store_n(&deque_p->bottom, bottom+1, __ATOMIC_RELAXED);
 	
-	/* Fix head and tail */
-	tp_p->jobqueue->tail=NULL;
-	tp_p->jobqueue->head=NULL;
+	return found ? 0 : -1;
+}
+
+
+/* Steal oldest job from the top of a deque, called by any other thread */
+static int thpool_deque_steal(thpool_deque* deque_p, thpool_job_t* job_p){
+	thpool_job_t* slot_p;
+	long bottom, top;
+	
+	top=__atomic_load_n(&deque_p->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bottom=__atomic_load_n(&deque_p->bottom, __ATOMIC_ACQUIRE);
+	if (top>=bottom)                                       /* deque is empty */
+		return -1;
+	
+	/* Read the job, then claim it by moving top, if another thread moved it first, give up */
+	slot_p=&deque_p->slots[top & (THPOOL_DEQUE-1)];
+	job_p->function=__atomic_load_n(&slot_p->function, __ATOMIC_RELAXED);
+	job_p->arg=__atomic_load_n(&slot_p->arg, __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&deque_p->top, &top, top+1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return -1;
+	return 0;
 }
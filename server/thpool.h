@@ -24,7 +24,6 @@
  * thpool       = threadpool
  * thpool_t     = threadpool type
  * tp_p         = threadpool pointer
- * sem          = semaphore
  * xN           = x can be any string. N stands for amount
  * 
  * */
@@ -37,30 +36,54 @@
  *             \_______________________________________________________/
  * 
  *    Description:       Jobs are added to the job queue. Once a thread in the pool
- *                       is idle, it is assigned with the first job from the queue(and
- *                       erased from the queue). It's each thread's job to read from 
- *                       the queue serially(using lock) and executing each job
- *                       until the queue is empty.
+ *                       is idle, it takes the oldest job from the queue and runs it,
+ *                       until the queue is empty. Then it parks on a futex until
+ *                       more work is added.
+ * 
+ *                       The job queue is a bounded multi-producer/multi-consumer ring
+ *                       (after Dmitry Vyukov's design). Each slot carries a sequence
+ *                       number, so producers and consumers claim slots with a single
+ *                       compare-and-swap on their own counter, and never take a lock
+ *                       or allocate memory. If the ring is ever full, the producer
+ *                       yields until a slot frees up, so no job is ever dropped; a
+ *                       producer which is itself a thread of the pool runs a queued
+ *                       job instead, since every thread may be adding at once.
  * 
  * 
  *    Scheme:
  * 
- *    thpool______                jobqueue____                      ______ 
- *    |           |               |           |       .----------->|_job0_| Newly added job
- *    |           |               |  head------------'             |_job1_|
- *    | jobqueue----------------->|           |                    |_job2_|
- *    |           |               |  tail------------.             |__..__| 
- *    |___________|               |___________|       '----------->|_jobn_| Job for thread to take
- * 
- * 
- *    job0________ 
- *    |           |
- *    | function---->
- *    |           |
- *    |   arg------->
- *    |           |         job1________ 
- *    |  next-------------->|           |
- *    |___________|         |           |..
+ *    thpool______                jobqueue____                  ring (size slots)
+ *    |           |               |           |                 |_job0_| seq == pos + 1: ready to run
+ *    |           |               |  tail------------------->   |_job1_|
+ *    | jobqueue----------------->|           |                 |_job2_|
+ *    |           |               |  head------------------->   |______| seq == pos: free for a producer
+ *    |___________|               |___________|                 |__..__|
+ * 
+ * 
+ *    Idle threads:      A worker which finds the ring empty notes the futex word,
+ *                       announces itself as a sleeper, and checks the ring once more
+ *                       before waiting on the word. A producer which sees sleepers
+ *                       bumps the word and wakes one, so a wakeup is never lost
+ *                       between a worker's last check and its wait.
+ * 
+ *    Work stealing:     With THPOOL_STEAL, each worker also owns a Chase-Lev deque.
+ *                       Jobs a worker adds go to the bottom of its own deque, and it
+ *                       runs the newest first, while cache is still warm. A worker
+ *                       with nothing to run takes from the shared ring, then steals
+ *                       the oldest job from the top of another worker's deque. The
+ *                       shared ring is only used for jobs from outside the pool.
+ * 
+ *    worker0 deque  | top: steal here | .. | .. | bottom: push/pop here |
+ *    worker1 deque  | top: steal here | .. | bottom: push/pop here |
+ * 
+ *    Elastic pool:      A pool made with thpool_init_elastic() starts its minimum
+ *                       amount of threads, plus a manager thread. Producers stamp
+ *                       each job with a coarse clock the manager keeps, and every
+ *                       THPOOL_TICK_MS the manager looks at the oldest job in the
+ *                       ring. If it has waited THPOOL_SPAWN_MS or more, every thread
+ *                       must be busy, so one more is started, up to the maximum. A
+ *                       thread which stays parked for THPOOL_IDLE_MS retires, down
+ *                       to the minimum, and the manager joins it to free its stack.
  */
 
 #ifndef _THPOOL_
@@ -68,46 +91,103 @@
 #define _THPOOL_
 
 #include <pthread.h>
-#include <semaphore.h>
 
 
 
 /* ================================= STRUCTURES ================================================ */
 
 
-/* Individual job */
+/* Number of slots in the job queue, must be a power of two */
+#define THPOOL_QUEUE 65536
+
+/* Size of a cache line, used to keep producer and consumer counters apart */
+#define THPOOL_CACHELINE 64
+
+/* Number of slots in each worker's deque in work-stealing mode, must be a power of two */
+#define THPOOL_DEQUE 1024
+
+/* In work-stealing mode, a worker checks the shared queue first once every this many jobs,
+ * so jobs from outside the pool are never starved by jobs which workers keep submitting */
+#define THPOOL_GLOBAL_TICK 61
+
+/* In an elastic pool, how often the manager checks the queue, how long the oldest job may
+ * wait before another thread is started, and how long a thread may idle before it retires */
+#define THPOOL_TICK_MS  5
+#define THPOOL_SPAWN_MS 10
+#define THPOOL_IDLE_MS  30000
+
+/* Scheduling modes */
+#define THPOOL_FIFO  0                                 /**< every job goes through the shared queue */
+#define THPOOL_STEAL 1                                 /**< jobs from a worker go to its own deque, idle workers steal */
+
+
+/* Individual job, a slot in the ring */
 typedef struct thpool_job_t{
+	unsigned long             seq;                     /**< position this slot is ready for */
+	long                      stamp;                   /**< pool clock when the job was added */
 	void*  (*function)(void* arg);                     /**< function pointer         */
 	void*                     arg;                     /**< function's argument      */
-	struct thpool_job_t*     next;                     /**< pointer to next job      */
-	struct thpool_job_t*     prev;                     /**< pointer to previous job  */
 }thpool_job_t;
 
 
-/* Job queue as doubly linked list */
+/* Job queue as a bounded ring, head and tail on separate cache lines */
 typedef struct thpool_jobqueue{
-	thpool_job_t *head;                                /**< pointer to head of queue */
-	thpool_job_t *tail;                                /**< pointer to tail of queue */
-	int           jobsN;                               /**< amount of jobs in queue  */
-	sem_t        *queueSem;                            /**< semaphore(this is probably just holding the same as jobsN) */
+	thpool_job_t *ring;                                /**< slots of the ring        */
+	unsigned long mask;                                /**< amount of slots minus one */
+	char          pad0[THPOOL_CACHELINE];
+	unsigned long head;                                /**< next position to add at  */
+	char          pad1[THPOOL_CACHELINE];
+	unsigned long tail;                                /**< next position to take from */
+	char          pad2[THPOOL_CACHELINE];
+	int           futex;                               /**< word idle threads wait on, bumped to wake them */
+	int           sleepers;                            /**< amount of threads waiting, or about to */
 }thpool_jobqueue;
 
 
+/* A worker's Chase-Lev deque, its owner pushes and pops at bottom, other workers steal at top */
+typedef struct thpool_deque{
+	long          top;                                 /**< next position to steal from */
+	char          pad0[THPOOL_CACHELINE];
+	long          bottom;                              /**< next position to push at */
+	char          pad1[THPOOL_CACHELINE];
+	thpool_job_t  slots[THPOOL_DEQUE];                 /**< jobs, seq is unused      */
+}thpool_deque;
+
+
+/* States of a worker slot */
+#define THPOOL_SLOT_FREE    0                          /**< no thread, may be started */
+#define THPOOL_SLOT_RUNNING 1                          /**< thread is running        */
+#define THPOOL_SLOT_EXITED  2                          /**< thread retired, waiting to be joined */
+
+
+/* Per thread state, and its deque in work-stealing mode */
+typedef struct thpool_worker{
+	struct thpool_t* tp_p;                             /**< pool the thread belongs to */
+	int              id;                               /**< index among the pool's workers */
+	int              state;                            /**< THPOOL_SLOT_FREE, RUNNING or EXITED */
+	unsigned int     ticks;                            /**< jobs run, for THPOOL_GLOBAL_TICK */
+	unsigned int     seed;                             /**< state for picking a victim to steal from */
+	thpool_deque     deque;                            /**< the thread's own jobs    */
+}thpool_worker;
+
+
 /* The threadpool */
 typedef struct thpool_t{
 	pthread_t*       threads;                          /**< pointer to threads' ID   */
-	int              threadsN;                         /**< amount of threads        */
+	int              threadsN;                         /**< maximum amount of threads */
+	int              threadsMin;                       /**< amount of threads kept even when idle */
+	int              alive;                            /**< amount of threads running */
+	size_t           stacksize;                        /**< stack size of each thread, 0 for the default */
+	volatile int     keepalive;                        /**< cleared to end each thread's loop */
+	int              mode;                             /**< THPOOL_FIFO or THPOOL_STEAL */
+	int              managed;                          /**< set if a manager thread resizes the pool */
+	pthread_t        manager;                          /**< ID of the manager thread */
+	long             now;                              /**< coarse clock in milliseconds, kept by the manager */
+	thpool_worker*   workers;                          /**< per thread state, one slot for each possible thread */
 	thpool_jobqueue* jobqueue;                         /**< pointer to the job queue */
 }thpool_t;
 
 
-/* Container for all things that each thread is going to need */
-typedef struct thread_data{                            
-	pthread_mutex_t *mutex_p;
-	thpool_t        *tp_p;
-}thread_data;
-
-
 
 /* =========================== FUNCTIONS ================================================ */
 
@@ -117,8 +197,8 @@ typedef struct thread_data{
 /**
  * @brief  Initialize threadpool
  * 
- * Allocates memory for the threadpool, jobqueue, semaphore and fixes 
- * pointers in jobqueue.
+ * Allocates memory for the threadpool and its jobqueue ring, and starts
+ * the threads.
  * 
  * @param  number of threads to be used
  * @return threadpool struct on success,
@@ -127,16 +207,53 @@ typedef struct thread_data{
 thpool_t* thpool_init(int threadsN);
 
 
+/**
+ * @brief  Initialize threadpool with a scheduling mode
+ * 
+ * As thpool_init(), but with THPOOL_STEAL, each thread also gets its own
+ * deque. Jobs added by a thread of the pool go to its deque, where it runs
+ * the newest first, and threads with nothing to do steal the oldest jobs
+ * from the others, so workers only contend when they run out of work.
+ * Jobs added from outside the pool still go through the shared queue.
+ * 
+ * @param  number of threads to be used
+ * @param  THPOOL_FIFO or THPOOL_STEAL
+ * @return threadpool struct on success,
+ *         NULL on error
+ */
+thpool_t* thpool_init_mode(int threadsN, int mode);
+
+
+/**
+ * @brief  Initialize a threadpool which grows and shrinks with load
+ * 
+ * As thpool_init_mode(), but only the minimum amount of threads are started.
+ * Another is started whenever the oldest queued job has waited THPOOL_SPAWN_MS,
+ * up to the maximum, and a thread idle for THPOOL_IDLE_MS retires, down to the
+ * minimum. A smaller stack than the system default keeps each thread cheap.
+ * 
+ * @param  amount of threads kept even when idle
+ * @param  maximum amount of threads
+ * @param  THPOOL_FIFO or THPOOL_STEAL
+ * @param  stack size of each thread in bytes, 0 for the system default
+ * @return threadpool struct on success,
+ *         NULL on error
+ */
+thpool_t* thpool_init_elastic(int minN, int maxN, int mode, size_t stacksize);
+
+
 /**
  * @brief What each thread is doing
  * 
- * In principle this is an endless loop. The only time this loop gets interuppted is once
- * thpool_destroy() is invoked.
+ * In principle this is an endless loop, taking jobs from the queue and parking
+ * when it is empty. The only time this loop gets interuppted is once
+ * thpool_destroy() is invoked, or in an elastic pool, once the thread has
+ * been idle long enough to retire.
  * 
- * @param threadpool to use
+ * @param worker slot of the thread
  * @return nothing
  */
-void thpool_thread_do(thpool_t* tp_p);
+void thpool_thread_do(thpool_worker* worker_p);
 
 
 /**
@@ -156,6 +273,31 @@ void thpool_thread_do(thpool_t* tp_p);
 int thpool_add_work(thpool_t* tp_p, void *(*function_p)(void*), void* arg_p);
 
 
+/**
+ * @brief Add work behind everything already queued
+ * 
+ * As thpool_add_work(), but the job always goes through the shared queue,
+ * even from a thread of the pool in work-stealing mode. For a job which
+ * gives up its thread so that others get a turn, and would otherwise be
+ * popped straight back off its thread's own deque.
+ * 
+ * @param  threadpool to where the work will be added to
+ * @param  function to add as work
+ * @param  argument to the above function
+ * @return int
+ */
+int thpool_requeue_work(thpool_t* tp_p, void *(*function_p)(void*), void* arg_p);
+
+
+/**
+ * @brief Amount of threads running
+ * 
+ * @param  threadpool to inspect
+ * @return amount of threads currently running, between the minimum and maximum
+ */
+int thpool_threads_alive(thpool_t* tp_p);
+
+
 /**
  * @brief Destroy the threadpool
  * 
@@ -186,49 +328,37 @@ int thpool_jobqueue_init(thpool_t* tp_p);
 /**
  * @brief Add job to queue
  * 
- * A new job will be added to the queue. The new job MUST be allocated
- * before passed to this function or else other functions like thpool_jobqueue_empty()
- * will be broken.
+ * Claims the next free slot of the ring and fills it with the job, then wakes
+ * an idle thread if any is parked. Never blocks on a lock; if the ring is full
+ * it yields until a thread takes a job, or runs one itself if called from a
+ * thread of the pool.
  * 
  * @param pointer to threadpool
- * @param pointer to the new job(MUST BE ALLOCATED)
+ * @param function to add as work
+ * @param argument to the above function
  * @return nothing 
  */
-void thpool_jobqueue_add(thpool_t* tp_p, thpool_job_t* newjob_p);
+void thpool_jobqueue_add(thpool_t* tp_p, void *(*function_p)(void*), void* arg_p);
 
 
 /**
- * @brief Remove last job from queue. 
+ * @brief Take the oldest job from queue
  * 
- * This does not free allocated memory so be sure to have peeked() \n
- * before invoking this as else there will result lost memory pointers.
+ * Claims the oldest ready slot of the ring and copies its job out, freeing
+ * the slot for producers.
  * 
  * @param  pointer to threadpool
+ * @param  pointer to the job to fill in
  * @return 0 on success,
  *         -1 if queue is empty
  */
-int thpool_jobqueue_removelast(thpool_t* tp_p);
-
-
-/** 
- * @brief Get last job in queue (tail)
- * 
- * Gets the last job that is inside the queue. This will work even if the queue
- * is empty.
- * 
- * @param  pointer to threadpool structure
- * @return job a pointer to the last job in queue,
- *         a pointer to NULL if the queue is empty
- */
-thpool_job_t* thpool_jobqueue_peek(thpool_t* tp_p);
+int thpool_jobqueue_take(thpool_t* tp_p, thpool_job_t* job_p);
 
 
 /**
- * @brief Remove and deallocate all jobs in queue
+ * @brief Remove all jobs in queue
  * 
- * This function will deallocate all jobs in the queue and set the
- * jobqueue to its initialization values, thus tail and head pointing
- * to NULL and amount of jobs equal to 0.
+ * This function will discard every job still in the queue and free the ring.
  * 
  * @param pointer to threadpool structure
  * */
@@ -0,0 +1,340 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:    10/16/26
+	Project: p2pd
+	Module:  thpool_bench.c
+
+	Description:
+	A microbenchmark of the thread pool's job queue, built with 'make bench', and not part of the server.  For 1 to
+	64 threads, trivial jobs are pushed through three pools:
+		1) list: the original queue, a doubly linked list under one global mutex, a malloc() per job, and a
+		   semaphore to wake workers
+		2) ring: the lock-free ring in thpool.c, with futex parking for idle workers
+		3) steal: thpool.c in work-stealing mode, with a Chase-Lev deque per worker
+	In the 'flat' workload, as many producers as workers add every job from outside the pool, as the network
+	engines do.  In the 'spawn' workload, the producers add only roots, and each root adds BENCH_FANOUT children from
+	inside the pool, as finer grained command handlers would.
+	Each run reports jobs per second, from the first job added to the last job run, and the latency of each add
+	call as percentiles, since it is paid by the network thread for every readable client.
+*/
+
+//------------------------ C LIBRARIES -----------------------
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "thpool.h"
+
+//------------------------ PARAMETERS ------------------------
+
+// Number of jobs pushed through the pool in each run, split among the producers
+#define BENCH_JOBS 400000
+
+// Largest number of threads, runs double the thread count starting from one
+#define BENCH_THREADS 64
+
+// Number of children each root job adds in the spawn workload
+#define BENCH_FANOUT 15
+
+//------------------------ LIST POOL -------------------------
+
+// A job in the original queue
+typedef struct list_job
+{
+	void *(*function)(void *);
+	void *arg;
+	struct list_job *next, *prev;
+} list_job_t;
+
+// The original pool, a job list guarded by one mutex, and a semaphore counting its jobs
+typedef struct list_pool
+{
+	pthread_t *threads;
+	int threadsN;
+	volatile int keepalive;
+	list_job_t *head, *tail;
+	int jobsN;
+	pthread_mutex_t mutex;
+	sem_t sem;
+} list_pool_t;
+
+// list_thread_do() takes the oldest job under the mutex, and runs it, as thpool_thread_do() originally did
+static void *list_thread_do(void *args)
+{
+	// Pool being served, and job taken
+	list_pool_t *pool = (list_pool_t *)args;
+	list_job_t *job;
+
+	// Wait for a job, then unlink it from the tail
+	while(pool->keepalive)
+	{
+		sem_wait(&pool->sem);
+		if(!pool->keepalive)
+			break;
+
+		pthread_mutex_lock(&pool->mutex);
+		job = pool->tail;
+		pool->tail = job->prev;
+		if(pool->tail != NULL)
+			pool->tail->next = NULL;
+		else
+			pool->head = NULL;
+		pool->jobsN--;
+		pthread_mutex_unlock(&pool->mutex);
+
+		// Run and free the job
+		job->function(job->arg);
+		free(job);
+	}
+	return NULL;
+}
+
+// list_init() starts the original pool
+static void *list_init(int threadsN)
+{
+	// Pool, and indexer
+	list_pool_t *pool = (list_pool_t *)calloc(1, sizeof(list_pool_t));
+	int t;
+
+	// Initialize the queue, and start the threads
+	pool->threads = (pthread_t *)malloc(threadsN * sizeof(pthread_t));
+	pool->threadsN = threadsN;
+	pool->keepalive = 1;
+	pthread_mutex_init(&pool->mutex, NULL);
+	sem_init(&pool->sem, 0, 0);
+	for(t = 0; t < threadsN; t++)
+		pthread_create(&pool->threads[t], NULL, list_thread_do, pool);
+	return pool;
+}
+
+// list_add() allocates a job, and links it onto the head under the mutex, as thpool_add_work() originally did
+static void list_add(void *args, void *(*function)(void *), void *arg)
+{
+	// Pool being added to, and new job
+	list_pool_t *pool = (list_pool_t *)args;
+	list_job_t *job = (list_job_t *)malloc(sizeof(list_job_t));
+
+	// Fill the job, and link it
+	job->function = function;
+	job->arg = arg;
+	job->prev = NULL;
+	pthread_mutex_lock(&pool->mutex);
+	job->next = pool->head;
+	if(pool->head != NULL)
+		pool->head->prev = job;
+	else
+		pool->tail = job;
+	pool->head = job;
+	pool->jobsN++;
+	sem_post(&pool->sem);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+// list_destroy() wakes and joins every thread, then frees the pool
+static void list_destroy(void *args)
+{
+	// Pool being destroyed, and indexer
+	list_pool_t *pool = (list_pool_t *)args;
+	int t;
+
+	// End each thread's loop, and wake it
+	pool->keepalive = 0;
+	for(t = 0; t < pool->threadsN; t++)
+		sem_post(&pool->sem);
+	for(t = 0; t < pool->threadsN; t++)
+		pthread_join(pool->threads[t], NULL);
+
+	// Free the pool
+	sem_destroy(&pool->sem);
+	free(pool->threads);
+	free(pool);
+}
+
+//------------------------ RING POOL -------------------------
+
+// ring_init() starts a pool using thpool.c
+static void *ring_init(int threadsN)
+{
+	return thpool_init(threadsN);
+}
+
+// ring_add() adds a job using thpool.c
+static void ring_add(void *pool, void *(*function)(void *), void *arg)
+{
+	thpool_add_work((thpool_t *)pool, function, arg);
+}
+
+// steal_init() starts a pool using thpool.c in work-stealing mode
+static void *steal_init(int threadsN)
+{
+	return thpool_init_mode(threadsN, THPOOL_STEAL);
+}
+
+// ring_destroy() joins and frees a pool using thpool.c
+static void ring_destroy(void *pool)
+{
+	thpool_destroy((thpool_t *)pool, 0);
+}
+
+//------------------------ BENCHMARK -------------------------
+
+// A pool implementation under test
+typedef struct bench_pool
+{
+	char *name;
+	void *(*init)(int);
+	void (*add)(void *, void *(*)(void *), void *);
+	void (*destroy)(void *);
+} bench_pool_t;
+
+// A producer thread, and the enqueue latencies it recorded
+typedef struct bench_producer
+{
+	pthread_t thread;
+	bench_pool_t *impl;
+	void *pool;
+	int jobs;
+	void *arg;
+	long *latency;
+} bench_producer_t;
+
+// Number of jobs run in the current run
+static volatile long completed = 0;
+
+// Pool under test, for jobs which add children
+static bench_pool_t *spawn_impl;
+static void *spawn_pool;
+
+// bench_now() returns a monotonic timestamp in nanoseconds
+static long bench_now()
+{
+	// Current time
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// bench_job() is the job run by the pool, doing nothing but counting itself, and adding children if it is a root
+static void *bench_job(void *arg)
+{
+	// Indexer
+	int i;
+
+	// A root adds its children from inside the pool
+	if(arg != NULL)
+	{
+		for(i = 0; i < BENCH_FANOUT; i++)
+			spawn_impl->add(spawn_pool, bench_job, NULL);
+	}
+	__sync_add_and_fetch(&completed, 1);
+	return NULL;
+}
+
+// bench_produce() adds a producer's share of jobs, timing each call
+static void *bench_produce(void *args)
+{
+	// Producer, timestamp before each call, and indexer
+	bench_producer_t *producer = (bench_producer_t *)args;
+	long start;
+	int i;
+
+	// Add and time each job
+	for(i = 0; i < producer->jobs; i++)
+	{
+		start = bench_now();
+		producer->impl->add(producer->pool, bench_job, producer->arg);
+		producer->latency[i] = bench_now() - start;
+	}
+	return NULL;
+}
+
+// bench_compare() orders latencies, for qsort()
+static int bench_compare(const void *a, const void *b)
+{
+	// Latencies being compared
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+
+	return (x > y) - (x < y);
+}
+
+// bench_run() pushes BENCH_JOBS jobs through a pool of threads workers, from as many producers, and prints a line.
+// If spawn is set, the producers add roots, which add the rest of the jobs from inside the pool.
+static void bench_run(bench_pool_t *impl, int threads, int spawn)
+{
+	// Pool, producers, jobs added by the producers, every latency recorded, timestamps, and indexers
+	void *pool = impl->init(threads);
+	bench_producer_t *producers = (bench_producer_t *)calloc(threads, sizeof(bench_producer_t));
+	int added = spawn ? BENCH_JOBS / (BENCH_FANOUT + 1) : BENCH_JOBS;
+	long *latency = (long *)malloc(added * sizeof(long));
+	long start, elapsed;
+	int total = 0;
+	int i;
+
+	// Start every producer, each with its share of the jobs and of the latency array
+	completed = 0;
+	spawn_impl = impl;
+	spawn_pool = pool;
+	start = bench_now();
+	for(i = 0; i < threads; i++)
+	{
+		producers[i].impl = impl;
+		producers[i].pool = pool;
+		producers[i].jobs = added / threads + (i < added % threads);
+		producers[i].arg = spawn ? (void *)pool : NULL;
+		producers[i].latency = latency + total;
+		total += producers[i].jobs;
+		pthread_create(&producers[i].thread, NULL, bench_produce, &producers[i]);
+	}
+
+	// Wait for the producers, then for the last job to run
+	for(i = 0; i < threads; i++)
+		pthread_join(producers[i].thread, NULL);
+	while(completed < (spawn ? added * (BENCH_FANOUT + 1) : added))
+		usleep(100);
+	elapsed = bench_now() - start;
+
+	// Report throughput and enqueue latency percentiles
+	qsort(latency, added, sizeof(long), bench_compare);
+	fprintf(stdout, "%-5s %-5s %7d %12.0f %9ld %9ld %9ld %9ld\n", spawn ? "spawn" : "flat", impl->name, threads, (double)completed * 1e9 / elapsed,
+		latency[added / 2], latency[added / 100 * 99], latency[added / 1000 * 999], latency[added - 1]);
+
+	// Clean up
+	impl->destroy(pool);
+	free(producers);
+	free(latency);
+}
+
+//------------------------ MAIN ------------------------------
+
+int main(int argc, char *argv[])
+{
+	// Pools under test, workload, and thread count
+	bench_pool_t pools[3] = {
+		{ "list", list_init, list_add, list_destroy },
+		{ "ring", ring_init, ring_add, ring_destroy },
+		{ "steal", steal_init, ring_add, ring_destroy }
+	};
+	int spawn, threads, i;
+
+	// Run each pool at each thread count, for each workload
+	fprintf(stdout, "%d jobs per run, %ld CPUs, enqueue latency in ns\n", BENCH_JOBS, sysconf(_SC_NPROCESSORS_ONLN));
+	fprintf(stdout, "%-5s %-5s %7s %12s %9s %9s %9s %9s\n", "load", "queue", "threads", "jobs/sec", "p50", "p99", "p99.9", "max");
+	for(spawn = 0; spawn < 2; spawn++)
+	{
+		for(threads = 1; threads <= BENCH_THREADS; threads *= 2)
+		{
+			for(i = 0; i < 3; i++)
+				bench_run(&pools[i], threads, spawn);
+		}
+	}
+	return 0;
+}
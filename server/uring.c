@@ -0,0 +1,895 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:    10/16/26
+	Project: p2pd
+	Module:  uring.c
+
+	Description:
+	An io_uring network engine, selectable at startup as an alternative to the epoll reactor.  The network
+	thread owns a single ring, and drives every socket through it:
+		1) one multishot accept on the listening socket produces a completion per new client
+		2) one multishot recv per client pulls input into a ring of kernel-provided buffers
+		3) reply blocks queued by workers are submitted as a chain of linked sends, keeping them in order
+	Workers never make socket system calls in this mode; they consume received blocks and queue replies,
+	and wake the ring through an eventfd.  Submissions and completions are batched in a single
+	io_uring_enter() call per loop iteration.
+
+	The interface is used via raw system calls, so no library beyond the kernel headers is required.
+*/
+
+//------------------------ C LIBRARIES -----------------------
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "config.h"
+#include "p2p.h"
+#include "uring.h"
+#include "thpool.h"
+
+//------------------------ MACROS ----------------------------
+
+// Operations are tagged in the low bits of each submission's user_data, the rest holds the client pointer
+#define OP_ACCEPT 0
+#define OP_WAKE   1
+#define OP_RECV   2
+#define OP_SEND   3
+#define OP_CANCEL 4
+#define OP_MASK   7
+
+// Group ID of the provided receive buffers
+#define BUFFER_GROUP 0
+
+//------------------------ GLOBAL VARIABLES ------------------
+
+// Reference externally defined threadpool, which runs the command handlers
+extern thpool_t *threadpool;
+
+//------------------------ RING STATE ------------------------
+
+// Ring file descriptor and listening socket
+static int ring_fd = -1;
+static int listen_fd = -1;
+
+// Submission queue ring pointers
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static struct io_uring_sqe *sqes;
+
+// Local submission tail, and number of entries queued since the last io_uring_enter()
+static unsigned sq_local;
+static unsigned sq_pending;
+
+// Completion queue ring pointers
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+// Provided buffer ring, and the memory backing its buffers
+static struct io_uring_buf_ring *buf_ring;
+static char *buf_base;
+
+// Eventfd used by workers to wake the ring, and the counter it is read into
+static int wake_fd = -1;
+static uint64_t wake_count;
+
+// Queue of clients with requests (sends or closes) from workers, and the lock protecting it
+static p2p_t *req_head, *req_tail;
+static pthread_mutex_t req_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Cleared if the kernel rejects multishot recv, in which case each recv is re-armed after it completes
+static int recv_multishot = 1;
+
+//------------------------ SYSTEM CALLS ----------------------
+
+// io_uring_setup() system call wrapper
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+// io_uring_enter() system call wrapper
+static int sys_enter(unsigned submit, unsigned wait, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ring_fd, submit, wait, flags, NULL, 0);
+}
+
+// io_uring_register() system call wrapper
+static int sys_register(unsigned opcode, void *arg, unsigned args)
+{
+	return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, args);
+}
+
+//------------------------ SUBMISSION ------------------------
+
+// uring_sqe() returns a cleared submission entry, flushing the queue to the kernel if it is full
+static struct io_uring_sqe *uring_sqe()
+{
+	// Submission entry to return
+	struct io_uring_sqe *sqe;
+
+	// If the queue is full, submit what is queued so far
+	while(sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == *sq_mask + 1)
+	{
+		if(sys_enter(sq_pending, 0, 0) >= 0)
+			sq_pending = 0;
+	}
+
+	// Claim the next entry and clear it
+	sqe = &sqes[sq_local & *sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[sq_local & *sq_mask] = sq_local & *sq_mask;
+
+	// Publish the entry to the kernel
+	sq_local++;
+	sq_pending++;
+	__atomic_store_n(sq_tail, sq_local, __ATOMIC_RELEASE);
+
+	// Return entry
+	return sqe;
+}
+
+// uring_buffer() returns a provided buffer to the kernel once its contents have been consumed
+static void uring_buffer(int bid)
+{
+	// Current tail of the buffer ring
+	unsigned short tail = buf_ring->tail;
+
+	// Fill in the next slot with the buffer, and publish it
+	struct io_uring_buf *buf = &buf_ring->bufs[tail & (URING_BUFFERS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(buf_base + bid * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	__atomic_store_n(&buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// uring_arm_accept() submits the multishot accept on the listening socket
+static void uring_arm_accept()
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = OP_ACCEPT;
+}
+
+// uring_arm_wake() submits a read on the eventfd, so that workers can wake the ring
+static void uring_arm_wake()
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = wake_fd;
+	sqe->addr = (uint64_t)(uintptr_t)&wake_count;
+	sqe->len = sizeof(wake_count);
+	sqe->user_data = OP_WAKE;
+}
+
+// uring_arm_recv() submits a recv for a client, selecting its buffer from the provided buffer ring
+static void uring_arm_recv(p2p_t *conn)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUFFER_GROUP;
+	sqe->ioprio = recv_multishot ? IORING_RECV_MULTISHOT : 0;
+	sqe->user_data = (uint64_t)(uintptr_t)conn | OP_RECV;
+	conn->rx_armed = 1;
+}
+
+// uring_arm_cancel() submits a cancellation of a client's recv, which then reports its final completion
+static void uring_arm_cancel(p2p_t *conn)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64_t)(uintptr_t)conn | OP_RECV;
+	sqe->user_data = OP_CANCEL;
+}
+
+// uring_arm_send() submits everything queued for a client as one chain of linked sends
+static void uring_arm_send(p2p_t *conn)
+{
+	// Submission entry, block being sent, and the last block of the chain
+	struct io_uring_sqe *sqe = NULL;
+	chunk_t *chunk, *last = NULL;
+
+	// Number of sends in this chain
+	int count = 0;
+
+	// Link each queued block to the next, so the kernel sends them in order, holding back partial segments with MSG_MORE
+	conn->tx_sending = 0;
+	for(chunk = conn->tx_head; chunk != NULL && count < URING_MAX_LINK; chunk = chunk->next)
+	{
+		conn->tx_sending += chunk->len - chunk->off;
+		sqe = uring_sqe();
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = conn->fd;
+		sqe->addr = (uint64_t)(uintptr_t)(chunk->base + chunk->off);
+		sqe->len = chunk->len - chunk->off;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | MSG_MORE;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = (uint64_t)(uintptr_t)conn | OP_SEND;
+		last = chunk;
+		count++;
+	}
+
+	// The final send ends the chain, and pushes out the last segment
+	sqe->flags = 0;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+
+	// Move the chain from the queue to the in flight list
+	conn->tx_chain = conn->tx_head;
+	conn->tx_head = last->next;
+	if(conn->tx_head == NULL)
+		conn->tx_tail = NULL;
+	last->next = NULL;
+	conn->tx_inflight = count;
+}
+
+//------------------------ CLIENT TEARDOWN -------------------
+
+// uring_teardown() moves a closing client towards release, once its sends have drained
+static void uring_teardown(p2p_t *conn)
+{
+	// Received block being freed
+	uring_msg_t *msg;
+
+	// Flag set if the client is still on the request queue
+	int queued;
+
+	// Wait for any chain of sends still in flight
+	if(conn->tx_inflight > 0)
+		return;
+
+	// If the client is still on the request queue, the ring will continue its teardown once it services the queue
+	pthread_mutex_lock(&req_lock);
+	queued = conn->queued;
+	pthread_mutex_unlock(&req_lock);
+	if(queued)
+		return;
+
+	// If recv is still armed, cancel it, and wait for its final completion
+	if(conn->rx_armed)
+	{
+		// Only cancel once
+		if(conn->closing == 1)
+		{
+			uring_arm_cancel(conn);
+			conn->closing = 2;
+		}
+		return;
+	}
+
+	// No more operations reference the client, so close its socket
+	if(close(conn->fd) == -1)
+		fprintf(stderr, "%s: %s failed to close user socket [fd: %d]\n", SERVER_NAME, ERROR_MSG, conn->fd);
+
+	// Free anything left on the queues
+	while((msg = conn->rx_head) != NULL)
+	{
+		conn->rx_head = msg->next;
+		free(msg);
+	}
+	out_free(conn->tx_head);
+	out_free(conn->outbuf.head);
+
+	// Free connection state
+	p2p_free(conn);
+}
+
+//------------------------ REQUESTS --------------------------
+
+// uring_request() places a client on the ring's request queue, and wakes the ring
+static void uring_request(p2p_t *conn)
+{
+	// Value written to the eventfd
+	uint64_t one = 1;
+
+	// Place the client on the queue, unless it is already waiting
+	pthread_mutex_lock(&req_lock);
+	if(!conn->queued)
+	{
+		conn->queued = 1;
+		conn->next = NULL;
+		if(req_tail == NULL)
+			req_head = conn;
+		else
+			req_tail->next = conn;
+		req_tail = conn;
+	}
+	pthread_mutex_unlock(&req_lock);
+
+	// Wake the ring
+	if(write(wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		fprintf(stderr, "%s: %s failed to wake io_uring engine\n", SERVER_NAME, ERROR_MSG);
+}
+
+// uring_requests() services every client on the request queue, submitting sends and starting teardowns
+static void uring_requests()
+{
+	// Queue detached from the workers, and the client being serviced
+	p2p_t *list, *conn;
+
+	// Detach the whole queue at once
+	pthread_mutex_lock(&req_lock);
+	list = req_head;
+	req_head = req_tail = NULL;
+	pthread_mutex_unlock(&req_lock);
+
+	// Service each client
+	while((conn = list) != NULL)
+	{
+		// Advance the list first, since the client may be freed
+		list = conn->next;
+
+		// Lock the client, and clear its queued flag so workers may queue it again
+		pthread_mutex_lock(&conn->lock);
+		pthread_mutex_lock(&req_lock);
+		conn->queued = 0;
+		pthread_mutex_unlock(&req_lock);
+
+		// Submit queued messages, unless a chain is already in flight
+		if(conn->tx_inflight == 0 && conn->tx_head != NULL)
+			uring_arm_send(conn);
+
+		// Resume receiving once a worker has consumed enough of what was received
+		if(conn->rx_paused && !conn->rx_armed && !conn->closing && conn->rx_bytes < URING_RX_HIGHWATER)
+		{
+			conn->rx_paused = 0;
+			uring_arm_recv(conn);
+		}
+
+		// If the client is being closed, continue its teardown
+		if(conn->closing)
+		{
+			pthread_mutex_unlock(&conn->lock);
+			uring_teardown(conn);
+		}
+		else
+			pthread_mutex_unlock(&conn->lock);
+	}
+}
+
+//------------------------ COMPLETIONS -----------------------
+
+// uring_accepted() sets up a new client, and arms its first recv
+static void uring_accepted(int fd)
+{
+	// Storage for the client's address, which multishot accept does not report
+	struct sockaddr_storage inc_addr;
+	socklen_t inc_len = sizeof(inc_addr);
+
+	// Connection state for the new client
+	p2p_t *conn;
+
+	// Look up the client's address
+	memset(&inc_addr, 0, sizeof(inc_addr));
+	getpeername(fd, (struct sockaddr *)&inc_addr, &inc_len);
+
+	// Set up the connection state, if the client was turned away, move on
+	if((conn = p2p_open(fd, &inc_addr)) == NULL)
+		return;
+
+	// Start receiving
+	pthread_mutex_lock(&conn->lock);
+	uring_arm_recv(conn);
+	pthread_mutex_unlock(&conn->lock);
+}
+
+// uring_received() queues a block of input for a client, and schedules a worker if none owns the client
+static void uring_received(p2p_t *conn, struct io_uring_cqe *cqe)
+{
+	// Block of input, and buffer ID it arrived in
+	uring_msg_t *msg = NULL;
+	int bid;
+
+	// Flag set if this completion means a worker must be scheduled
+	int schedule = 0;
+
+	// Copy input out of the provided buffer, and hand the buffer straight back to the kernel
+	if(cqe->flags & IORING_CQE_F_BUFFER)
+	{
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if(cqe->res > 0 && (msg = (uring_msg_t *)malloc(sizeof(uring_msg_t) + cqe->res + 1)) != NULL)
+		{
+			msg->next = NULL;
+			msg->len = cqe->res;
+			memcpy(msg->data, buf_base + bid * URING_BUFFER_SIZE, cqe->res);
+			msg->data[cqe->res] = '\0';
+		}
+		uring_buffer(bid);
+	}
+
+	pthread_mutex_lock(&conn->lock);
+
+	// Queue the block of input
+	if(msg != NULL)
+	{
+		if(conn->rx_tail == NULL)
+			conn->rx_head = msg;
+		else
+			conn->rx_tail->next = msg;
+		conn->rx_tail = msg;
+		conn->rx_bytes += msg->len;
+	}
+
+	// If the recv is finished, decide whether to re-arm it
+	if(!(cqe->flags & IORING_CQE_F_MORE))
+	{
+		conn->rx_armed = 0;
+
+		// If the client is closing, continue its teardown
+		if(conn->closing)
+		{
+			pthread_mutex_unlock(&conn->lock);
+			uring_teardown(conn);
+			return;
+		}
+		// Kernel does not support multishot recv, fall back to re-arming after each completion
+		else if(cqe->res == -EINVAL && recv_multishot)
+		{
+			fprintf(stderr, "%s: %s io_uring: kernel does not support multishot recv, re-arming per completion\n", SERVER_NAME, WARN_MSG);
+			recv_multishot = 0;
+			uring_arm_recv(conn);
+		}
+		// Keep receiving, unless the client hung up or failed, or too much input is still waiting for a worker, in which
+		// case the ring re-arms the recv once the worker consumes it
+		else if(cqe->res > 0 || cqe->res == -ENOBUFS || (cqe->res == -ECANCELED && conn->rx_paused))
+		{
+			if(conn->rx_bytes >= URING_RX_HIGHWATER)
+				conn->rx_paused = 1;
+			else
+			{
+				conn->rx_paused = 0;
+				uring_arm_recv(conn);
+			}
+		}
+		else
+			conn->rx_eof = 1;
+	}
+	// If too much input is waiting for a worker, stop the multishot recv until the worker consumes it
+	else if(conn->rx_bytes >= URING_RX_HIGHWATER && !conn->rx_paused)
+	{
+		conn->rx_paused = 1;
+		uring_arm_cancel(conn);
+	}
+
+	// Schedule a worker if there is something to process and no worker owns the client
+	if(!conn->scheduled && (conn->rx_head != NULL || conn->rx_eof))
+	{
+		conn->scheduled = 1;
+		schedule = 1;
+	}
+
+	pthread_mutex_unlock(&conn->lock);
+
+	// Hand the client to the thread pool
+	if(schedule)
+		thpool_add_work(threadpool, &p2p, (void *)conn);
+}
+
+// uring_sent() handles a send completion, releasing the chain once all of its sends have completed, and rescheduling
+// the client's worker if it was waiting for its replies to be sent
+static void uring_sent(p2p_t *conn, struct io_uring_cqe *cqe)
+{
+	// Flag set if the client's worker must be scheduled again
+	int schedule = 0;
+
+	pthread_mutex_lock(&conn->lock);
+
+	// If the send failed, the client is gone, so drop whatever is still queued
+	if(cqe->res < 0 && cqe->res != -ECANCELED)
+	{
+		out_free(conn->tx_head);
+		conn->tx_head = conn->tx_tail = NULL;
+		conn->tx_bytes = conn->tx_sending;
+	}
+	// Else, the client is still reading its replies, which renews its lease
+	else if(cqe->res > 0)
+		__atomic_store_n(&conn->renewed, wheel_clock(), __ATOMIC_RELEASE);
+
+	// Once the whole chain has completed, free it, and submit anything queued since
+	if(--conn->tx_inflight == 0)
+	{
+		out_free(conn->tx_chain);
+		conn->tx_chain = NULL;
+		conn->tx_bytes -= conn->tx_sending;
+		conn->tx_sending = 0;
+		if(conn->tx_head != NULL)
+			uring_arm_send(conn);
+	}
+
+	// If the worker stopped running commands until its replies were sent, let it continue
+	if(conn->tx_waiting && conn->tx_bytes < URING_TX_HIGHWATER)
+	{
+		conn->tx_waiting = 0;
+		schedule = 1;
+	}
+
+	// If the client is being closed, continue its teardown
+	if(conn->closing)
+	{
+		pthread_mutex_unlock(&conn->lock);
+		uring_teardown(conn);
+	}
+	else
+		pthread_mutex_unlock(&conn->lock);
+
+	// Hand the client back to the thread pool
+	if(schedule)
+		thpool_add_work(threadpool, &p2p, (void *)conn);
+}
+
+//------------------------ URING INIT ------------------------
+
+// uring_init() sets up the ring, the provided buffer ring, and the wake eventfd
+// Returns 0 on success, or -1 if io_uring (or a required feature) is unavailable
+int uring_init(int fd)
+{
+	// Ring parameters, and pointers to the mapped rings
+	struct io_uring_params params;
+	char *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+
+	// Probe used to check for the required opcodes
+	struct io_uring_probe *probe;
+	int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_ASYNC_CANCEL };
+
+	// Registration of the provided buffer ring
+	struct io_uring_buf_reg reg;
+
+	// Generic indexer
+	int i;
+
+	// Store listening socket
+	listen_fd = fd;
+
+	// Create the ring, only the network thread submits, so let the kernel skip cross-thread work
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	if((ring_fd = sys_setup(URING_ENTRIES, &params)) == -1)
+	{
+		// Older kernels reject these flags, retry without them
+		memset(&params, 0, sizeof(params));
+		if((ring_fd = sys_setup(URING_ENTRIES, &params)) == -1)
+		{
+			fprintf(stderr, "%s: %s io_uring: could not create ring (%s)\n", SERVER_NAME, WARN_MSG, strerror(errno));
+			return -1;
+		}
+	}
+
+	// Completions must never be dropped, and both rings must share one mapping
+	if(!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		fprintf(stderr, "%s: %s io_uring: kernel is too old\n", SERVER_NAME, WARN_MSG);
+		close(ring_fd);
+		return -1;
+	}
+
+	// Check that every opcode we use is supported
+	if((probe = (struct io_uring_probe *)calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op))) == NULL)
+	{
+		close(ring_fd);
+		return -1;
+	}
+	if(sys_register(IORING_REGISTER_PROBE, probe, 256) == -1)
+	{
+		fprintf(stderr, "%s: %s io_uring: could not probe supported operations\n", SERVER_NAME, WARN_MSG);
+		free(probe);
+		close(ring_fd);
+		return -1;
+	}
+	for(i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++)
+	{
+		if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+		{
+			fprintf(stderr, "%s: %s io_uring: kernel does not support opcode %d\n", SERVER_NAME, WARN_MSG, ops[i]);
+			free(probe);
+			close(ring_fd);
+			return -1;
+		}
+	}
+	free(probe);
+
+	// Map the submission and completion rings, which share a single mapping
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(cq_size > sq_size)
+		sq_size = cq_size;
+	if((sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: %s io_uring: could not map rings\n", SERVER_NAME, WARN_MSG);
+		close(ring_fd);
+		return -1;
+	}
+	cq_ptr = sq_ptr;
+
+	// Map the submission entries
+	if((sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES)) == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: %s io_uring: could not map submission entries\n", SERVER_NAME, WARN_MSG);
+		close(ring_fd);
+		return -1;
+	}
+
+	// Store pointers into the rings
+	sq_head = (unsigned *)(sq_ptr + params.sq_off.head);
+	sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+	sq_mask = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+	sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+	cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+	cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+	cq_mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+	sq_local = *sq_tail;
+
+	// Allocate the provided buffer ring, and the buffers it hands out
+	if((buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED
+		|| (buf_base = (char *)malloc(URING_BUFFERS * URING_BUFFER_SIZE)) == NULL)
+	{
+		fprintf(stderr, "%s: %s io_uring: could not allocate receive buffers\n", SERVER_NAME, WARN_MSG);
+		close(ring_fd);
+		return -1;
+	}
+
+	// Register the buffer ring with the kernel
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = BUFFER_GROUP;
+	if(sys_register(IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+	{
+		fprintf(stderr, "%s: %s io_uring: kernel does not support provided buffer rings\n", SERVER_NAME, WARN_MSG);
+		close(ring_fd);
+		return -1;
+	}
+
+	// Hand every buffer to the kernel
+	for(i = 0; i < URING_BUFFERS; i++)
+		uring_buffer(i);
+
+	// Create the eventfd used by workers to wake the ring
+	if((wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+	{
+		fprintf(stderr, "%s: %s io_uring: could not create eventfd\n", SERVER_NAME, WARN_MSG);
+		close(ring_fd);
+		return -1;
+	}
+
+	// Return success
+	return 0;
+}
+
+//------------------------ URING LOOP ------------------------
+
+// uring_loop() submits pending operations and handles completions, until the network thread is canceled
+void *uring_loop()
+{
+	// Completion being handled, its tag and client
+	struct io_uring_cqe *cqe;
+	int op;
+	p2p_t *conn;
+
+	// Local copy of the completion queue head
+	unsigned head;
+
+	// Start accepting clients, and listening for wakeups from workers
+	uring_arm_accept();
+	uring_arm_wake();
+
+	// Loop infinitely until Ctrl+C SIGINT is caught by the signal handler
+	while(1)
+	{
+		// Submit everything queued, and wait for at least one completion
+		if(sys_enter(sq_pending, 1, IORING_ENTER_GETEVENTS) == -1)
+		{
+			// Retry if interrupted, or if the kernel is temporarily out of resources
+			if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+
+			// Else, print an error message and quit, since no more events can be handled
+			fprintf(stderr, "%s: %s io_uring: failed to submit and wait (%s)\n", SERVER_NAME, ERROR_MSG, strerror(errno));
+			return (void *)-1;
+		}
+		sq_pending = 0;
+
+		// Handle every available completion
+		head = *cq_head;
+		while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		{
+			cqe = &cqes[head & *cq_mask];
+			op = cqe->user_data & OP_MASK;
+			conn = (p2p_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+
+			switch(op)
+			{
+				// New client, re-arm accept if the multishot accept was terminated
+				case OP_ACCEPT:
+					if(cqe->res >= 0)
+						uring_accepted(cqe->res);
+					else
+						fprintf(stderr, "%s: %s failed to accept incoming connections\n", SERVER_NAME, ERROR_MSG);
+					if(!(cqe->flags & IORING_CQE_F_MORE))
+						uring_arm_accept();
+					break;
+
+				// Workers queued requests
+				case OP_WAKE:
+					uring_requests();
+					uring_arm_wake();
+					break;
+
+				// Input from a client
+				case OP_RECV:
+					uring_received(conn, cqe);
+					break;
+
+				// Send to a client completed
+				case OP_SEND:
+					uring_sent(conn, cqe);
+					break;
+
+				// Cancellations need no handling, the canceled recv reports its own completion
+				default:
+					break;
+			}
+
+			// Consume the completion
+			head++;
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+//------------------------ WORKER INTERFACE ------------------
+
+// uring_recv() moves as much received input as fits into a client's input buffer
+// Returns the number of bytes, 0 if the client hung up, or -1 with errno EAGAIN if nothing is waiting
+int uring_recv(p2p_t *conn, ring_t *ring)
+{
+	// Block being consumed, the number of bytes moved from it, and the total moved
+	uring_msg_t *msg;
+	int len, total = 0;
+
+	// Flag set if the ring must resume receiving, and errno saved while waking it
+	int resume = 0;
+	int error;
+
+	pthread_mutex_lock(&conn->lock);
+
+	// Move blocks until the queue is empty or the buffer is full
+	while((msg = conn->rx_head) != NULL && (len = ring_write(ring, msg->data, msg->len)) > 0)
+	{
+		total += len;
+		conn->rx_bytes -= len;
+
+		// If only part of the block fit, keep the rest queued
+		if(len < msg->len)
+		{
+			msg->len -= len;
+			memmove(msg->data, msg->data + len, msg->len);
+			break;
+		}
+
+		// Dequeue and free the block
+		conn->rx_head = msg->next;
+		if(conn->rx_head == NULL)
+			conn->rx_tail = NULL;
+		free(msg);
+	}
+
+	// If nothing was moved, report a hang up or a drained client
+	if(total == 0)
+	{
+		total = (conn->rx_head == NULL && conn->rx_eof) ? 0 : -1;
+		errno = (conn->rx_head == NULL) ? EAGAIN : ENOBUFS;
+	}
+
+	// If the recv was stopped while too much input was waiting, and enough has been consumed, ask the ring to resume it
+	if(conn->rx_paused && !conn->rx_armed && conn->rx_bytes < URING_RX_HIGHWATER)
+		resume = 1;
+
+	pthread_mutex_unlock(&conn->lock);
+
+	// Wake the ring, preserving errno for the caller
+	if(resume)
+	{
+		error = errno;
+		uring_request(conn);
+		errno = error;
+	}
+
+	// Return number of bytes
+	return total;
+}
+
+// uring_rearm() releases a worker's ownership of a client, rescheduling it if input arrived meanwhile
+int uring_rearm(p2p_t *conn)
+{
+	// Flag set if more input arrived after the worker drained the queue
+	int schedule = 0;
+
+	// Release ownership, unless there is more to do
+	pthread_mutex_lock(&conn->lock);
+	if(conn->rx_head != NULL || conn->rx_eof)
+		schedule = 1;
+	else
+		conn->scheduled = 0;
+	pthread_mutex_unlock(&conn->lock);
+
+	// Keep ownership by requeueing the client
+	if(schedule)
+		thpool_add_work(threadpool, &p2p, (void *)conn);
+
+	// Return success
+	return 0;
+}
+
+// uring_send() queues a chain of reply blocks, and asks the ring to send them
+// The ring frees the blocks once they are sent
+void uring_send(p2p_t *conn, chunk_t *chain)
+{
+	// Last block of the chain, and the number of bytes in it
+	chunk_t *last;
+	int bytes;
+
+	// Nothing to send
+	if(chain == NULL)
+		return;
+
+	// Find the end of the chain
+	for(last = chain, bytes = chain->len - chain->off; last->next != NULL; last = last->next)
+		bytes += last->next->len - last->next->off;
+
+	// Queue the chain
+	pthread_mutex_lock(&conn->lock);
+	if(conn->tx_tail == NULL)
+		conn->tx_head = chain;
+	else
+		conn->tx_tail->next = chain;
+	conn->tx_tail = last;
+	conn->tx_bytes += bytes;
+	pthread_mutex_unlock(&conn->lock);
+
+	// Ask the ring to submit it
+	uring_request(conn);
+}
+
+// uring_wait() stops a client's worker while the replies queued for it are past the high-water mark.  The worker keeps
+// ownership of the client, and the ring schedules it again once enough of them are sent.
+// Returns 1 if the worker must stop, or 0 if it may keep running commands
+int uring_wait(p2p_t *conn)
+{
+	// Flag set if the worker must stop
+	int wait;
+
+	pthread_mutex_lock(&conn->lock);
+	wait = conn->tx_waiting = (conn->tx_bytes >= URING_TX_HIGHWATER);
+	pthread_mutex_unlock(&conn->lock);
+
+	// Return whether to stop
+	return wait;
+}
+
+// uring_close() asks the ring to send anything still queued for a client, then close and free it
+// The worker must not touch the client after calling this
+void uring_close(p2p_t *conn)
+{
+	// Mark the client as closing
+	pthread_mutex_lock(&conn->lock);
+	conn->closing = 1;
+	pthread_mutex_unlock(&conn->lock);
+
+	// Ask the ring to tear it down
+	uring_request(conn);
+}
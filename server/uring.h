@@ -0,0 +1,47 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:	 10/16/26
+	Project: p2pd
+	Module:	 uring.h
+
+	Description:
+	A header containing prototypes and structs used in uring.c
+*/
+
+//------------------------ STRUCTS ---------------------------
+
+// A block of bytes received from a client, waiting for a worker
+typedef struct uring_msg
+{
+	// Next block in the queue
+	struct uring_msg *next;
+
+	// Number of bytes in the block
+	int len;
+
+	// Block contents
+	char data[];
+} uring_msg_t;
+
+//------------------------ PROTOTYPES ------------------------
+
+// Prototype for uring_init(), which sets up the ring and provided buffers, returning -1 if io_uring is unavailable
+int uring_init(int);
+
+// Prototype for uring_loop(), the completion loop run by the network thread
+void *uring_loop();
+
+// Prototype for uring_recv(), which moves input received for a client into its input buffer
+int uring_recv(p2p_t *, ring_t *);
+
+// Prototype for uring_rearm(), which parks a client once its worker has consumed all received input
+int uring_rearm(p2p_t *);
+
+// Prototype for uring_send(), which hands a chain of reply blocks to the ring to send to a client
+void uring_send(p2p_t *, chunk_t *);
+
+// Prototype for uring_wait(), which parks a client's worker while too many reply bytes are waiting to be sent
+int uring_wait(p2p_t *);
+
+// Prototype for uring_close(), which asks the ring to flush, close, and free a client
+void uring_close(p2p_t *);
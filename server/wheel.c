@@ -0,0 +1,300 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:    10/16/26
+	Project: p2pd
+	Module:  wheel.c
+
+	Description:
+	A hierarchical timer wheel, used for client leases, so arming, renewing, or cancelling any number of timers costs
+	O(1), as does each tick.  A thread advances the wheel every WHEEL_TICK_MS milliseconds:
+		1) the root wheel has a slot for each of the next WHEEL_ROOT_SIZE ticks, and each tick fires every timer in
+		   the current slot
+		2) each outer level has WHEEL_LEVEL_SIZE slots, each covering a whole turn of the level below it, so timers
+		   far in the future cost nothing until their slot comes up, when they are cascaded down a level
+	This is the classic layout of the Linux kernel's timer wheel.  Timers are fired with the wheel locked, so once
+	wheel_cancel() returns, the timer is certain not to be running, and its owner may be freed.
+*/
+
+//------------------------ C LIBRARIES -----------------------
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+//------------------------ CUSTOM LIBRARIES ------------------
+
+#include "config.h"
+#include "wheel.h"
+
+//------------------------ PARAMETERS ------------------------
+
+// Slots in the root wheel, and in each outer level
+#define WHEEL_ROOT_BITS 8
+#define WHEEL_ROOT_SIZE (1 << WHEEL_ROOT_BITS)
+#define WHEEL_ROOT_MASK (WHEEL_ROOT_SIZE - 1)
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_LEVEL_SIZE (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_LEVEL_MASK (WHEEL_LEVEL_SIZE - 1)
+
+// Number of outer levels, which with 100ms ticks spans 77 days
+#define WHEEL_LEVELS 3
+
+// Furthest a timer may be set, in ticks
+#define WHEEL_SPAN ((1UL << (WHEEL_ROOT_BITS + WHEEL_LEVELS * WHEEL_LEVEL_BITS)) - 1)
+
+//------------------------ GLOBAL VARIABLES ------------------
+
+// Root wheel, and outer levels
+static wheel_timer_t *root[WHEEL_ROOT_SIZE];
+static wheel_timer_t *levels[WHEEL_LEVELS][WHEEL_LEVEL_SIZE];
+
+// Tick the wheel has run up to, and a copy readable without the lock
+static unsigned long jiffies = 0;
+static unsigned long ticks = 0;
+
+// Number of timers armed
+static int armed = 0;
+
+// Lock protecting the wheel
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Wheel thread, whether it has been started, and whether it should keep running
+static pthread_t wheel;
+static int wheel_started = 0;
+static int wheel_running = 1;
+
+//------------------------ WHEEL LINK ------------------------
+
+// wheel_link() links a timer into the slot covering its expiry.  The caller must hold wheel_lock.
+static void wheel_link(wheel_timer_t *timer)
+{
+	// Ticks until the timer expires, and level it belongs to
+	unsigned long delta = timer->expires - jiffies;
+	int level;
+
+	// A timer already due fires on the next tick
+	if((long)delta < 0)
+		timer->slot = &root[jiffies & WHEEL_ROOT_MASK];
+	// A timer due within a turn of the root wheel goes into its own slot there
+	else if(delta < WHEEL_ROOT_SIZE)
+		timer->slot = &root[timer->expires & WHEEL_ROOT_MASK];
+	// Else, find the first level whose turn covers it
+	else
+	{
+		for(level = 0; level < WHEEL_LEVELS - 1; level++)
+		{
+			if(delta < (1UL << (WHEEL_ROOT_BITS + (level + 1) * WHEEL_LEVEL_BITS)))
+				break;
+		}
+		timer->slot = &levels[level][(timer->expires >> (WHEEL_ROOT_BITS + level * WHEEL_LEVEL_BITS)) & WHEEL_LEVEL_MASK];
+	}
+
+	// Push the timer onto the slot
+	timer->prev = NULL;
+	timer->next = *timer->slot;
+	if(timer->next != NULL)
+		timer->next->prev = timer;
+	*timer->slot = timer;
+}
+
+//------------------------ WHEEL UNLINK ----------------------
+
+// wheel_unlink() removes a timer from its slot.  The caller must hold wheel_lock.
+static void wheel_unlink(wheel_timer_t *timer)
+{
+	// Unlink the timer from its neighbours
+	if(timer->prev != NULL)
+		timer->prev->next = timer->next;
+	else
+		*timer->slot = timer->next;
+	if(timer->next != NULL)
+		timer->next->prev = timer->prev;
+
+	// Timer is no longer armed
+	timer->slot = NULL;
+	timer->next = timer->prev = NULL;
+}
+
+//------------------------ WHEEL ARM -------------------------
+
+// wheel_arm() links a timer to fire after a number of milliseconds.  The caller must hold wheel_lock.
+static void wheel_arm(wheel_timer_t *timer, long ms)
+{
+	// Round up to whole ticks, so a timer never fires early, and keep within the wheel's span
+	unsigned long delta = (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+	if(delta < 1)
+		delta = 1;
+	else if(delta > WHEEL_SPAN)
+		delta = WHEEL_SPAN;
+
+	// Link the timer
+	timer->expires = jiffies + delta;
+	wheel_link(timer);
+	armed++;
+}
+
+//------------------------ WHEEL CASCADE ---------------------
+
+// wheel_cascade() moves every timer in a slot of an outer level down into the levels below it, now that its turn has
+// come.  The caller must hold wheel_lock.
+static void wheel_cascade(int level, int index)
+{
+	// Timers in the slot, and the next one
+	wheel_timer_t *timer = levels[level][index];
+	wheel_timer_t *next;
+
+	// Empty the slot, then link each timer again
+	levels[level][index] = NULL;
+	for(; timer != NULL; timer = next)
+	{
+		next = timer->next;
+		wheel_link(timer);
+	}
+}
+
+//------------------------ WHEEL TICK ------------------------
+
+// wheel_tick() advances the wheel by one tick, cascading outer levels as each turn completes, and firing every timer
+// which is due.  The caller must hold wheel_lock.
+static void wheel_tick()
+{
+	// Slot of the root wheel, timers being fired, the next one, level being cascaded, and its slot
+	int index = jiffies & WHEEL_ROOT_MASK;
+	wheel_timer_t *timer, *next;
+	int level, slot;
+	long again;
+
+	// Once the root wheel completes a turn, cascade the next slot of each level whose turn also completed
+	if(index == 0)
+	{
+		for(level = 0; level < WHEEL_LEVELS; level++)
+		{
+			slot = (jiffies >> (WHEEL_ROOT_BITS + level * WHEEL_LEVEL_BITS)) & WHEEL_LEVEL_MASK;
+			wheel_cascade(level, slot);
+			if(slot != 0)
+				break;
+		}
+	}
+	jiffies++;
+	__atomic_store_n(&ticks, jiffies, __ATOMIC_RELEASE);
+
+	// Take every timer in the slot, then fire each, arming it again if asked to
+	timer = root[index];
+	root[index] = NULL;
+	for(; timer != NULL; timer = next)
+	{
+		next = timer->next;
+		timer->slot = NULL;
+		timer->next = timer->prev = NULL;
+		armed--;
+		if((again = timer->fire(timer)) > 0)
+			wheel_arm(timer, again);
+	}
+}
+
+//------------------------ WHEEL RUN -------------------------
+
+// wheel_run() is the wheel's thread, advancing the wheel once every WHEEL_TICK_MS milliseconds.  Sleeping until an
+// absolute time, rather than for a tick each time, keeps the wheel in step with the clock however long firing takes.
+static void *wheel_run(void *args)
+{
+	// Time of the next tick
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	pthread_mutex_lock(&wheel_lock);
+	while(wheel_running)
+	{
+		// Sleep until the next tick, unlocked
+		next.tv_nsec += WHEEL_TICK_MS * 1000000L;
+		next.tv_sec += next.tv_nsec / 1000000000L;
+		next.tv_nsec %= 1000000000L;
+		pthread_mutex_unlock(&wheel_lock);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		pthread_mutex_lock(&wheel_lock);
+
+		// Advance the wheel
+		if(wheel_running)
+			wheel_tick();
+	}
+	pthread_mutex_unlock(&wheel_lock);
+
+	// Return from the wheel's thread
+	return NULL;
+}
+
+//------------------------ WHEEL ADD -------------------------
+
+// wheel_add() arms a timer to fire after a number of milliseconds, re-arming it if it was already armed
+void wheel_add(wheel_timer_t *timer, long ms)
+{
+	pthread_mutex_lock(&wheel_lock);
+
+	// Start the wheel's thread with the first timer rather than at startup, since daemonizing forks the server, and
+	// a thread started before the fork would not exist in the daemon
+	if(!wheel_started)
+	{
+		if(pthread_create(&wheel, NULL, wheel_run, NULL) != 0)
+		{
+			pthread_mutex_unlock(&wheel_lock);
+			fprintf(stderr, "%s: %s could not start timer wheel thread\n", SERVER_NAME, ERROR_MSG);
+			return;
+		}
+		wheel_started = 1;
+	}
+
+	// Disarm the timer if needed, and arm it again
+	if(timer->slot != NULL)
+	{
+		wheel_unlink(timer);
+		armed--;
+	}
+	wheel_arm(timer, ms);
+
+	pthread_mutex_unlock(&wheel_lock);
+}
+
+//------------------------ WHEEL CANCEL ----------------------
+
+// wheel_cancel() disarms a timer, if it is armed.  Since timers are fired with the wheel locked, the timer is certain
+// not to be running once this returns.
+void wheel_cancel(wheel_timer_t *timer)
+{
+	pthread_mutex_lock(&wheel_lock);
+	if(timer->slot != NULL)
+	{
+		wheel_unlink(timer);
+		armed--;
+	}
+	pthread_mutex_unlock(&wheel_lock);
+}
+
+//------------------------ WHEEL CLOCK -----------------------
+
+// wheel_clock() returns the number of ticks since the wheel started, without locking, for cheap timestamps
+unsigned long wheel_clock()
+{
+	return __atomic_load_n(&ticks, __ATOMIC_ACQUIRE);
+}
+
+//------------------------ WHEEL ARMED -----------------------
+
+// wheel_armed() returns the number of timers armed
+int wheel_armed()
+{
+	return armed;
+}
+
+//------------------------ WHEEL CLOSE -----------------------
+
+// wheel_close() stops the wheel's thread.  Armed timers are simply never fired.
+void wheel_close()
+{
+	// Stop the thread, which notices at its next tick
+	pthread_mutex_lock(&wheel_lock);
+	wheel_running = 0;
+	pthread_mutex_unlock(&wheel_lock);
+	if(wheel_started)
+		pthread_join(wheel, NULL);
+}
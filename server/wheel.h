@@ -0,0 +1,51 @@
+/*
+	Authors: Justin Hill, Gordon Keesler, Matt Layher
+	Date:	 10/16/26
+	Project: p2pd
+	Module:	 wheel.h
+
+	Description:
+	A header containing prototypes and structs used in wheel.c
+*/
+
+#ifndef _WHEEL_
+#define _WHEEL_
+
+//------------------------ STRUCTS ---------------------------
+
+// A timer, embedded in whatever it times, so arming it never allocates
+typedef struct wheel_timer
+{
+	// Called once the timer expires, with the wheel locked.  Returns the number of milliseconds until it should fire
+	// again, or 0 if it is done.
+	long (*fire)(struct wheel_timer *);
+
+	// Argument for the callback
+	void *arg;
+
+	// Tick the timer expires on, and the slot it is linked into, NULL if it is not armed
+	unsigned long expires;
+	struct wheel_timer **slot;
+
+	// Neighbouring timers in the same slot
+	struct wheel_timer *next, *prev;
+} wheel_timer_t;
+
+//------------------------ PROTOTYPES ------------------------
+
+// Prototype for wheel_add(), which arms a timer to fire after a number of milliseconds
+void wheel_add(wheel_timer_t *, long);
+
+// Prototype for wheel_cancel(), which disarms a timer, so it is certain not to fire once this returns
+void wheel_cancel(wheel_timer_t *);
+
+// Prototype for wheel_clock(), which returns the number of ticks since the wheel started
+unsigned long wheel_clock();
+
+// Prototype for wheel_armed(), which returns the number of timers armed
+int wheel_armed();
+
+// Prototype for wheel_close(), which stops the wheel's thread
+void wheel_close();
+
+#endif